@@ -0,0 +1,65 @@
+
+
+
+
+#ifndef BSPLINESMOOTHER_H
+#define BSPLINESMOOTHER_H
+
+#include <vector>
+#include <string>
+
+class TH1;
+
+class BSplineSmoother
+{
+    /* Smoothing by a penalized fit of a tensor product of cubic B-splines (P-splines), in 2D or 3D.
+    Knots are uniformly spaced over the template range, and the basis function of coefficient i along an axis is
+    centered on min+(i-1)*h, with h the knot spacing. Bins are weighted by their inverse squared errors, and
+    second differences of the coefficients along each axis are penalized.
+    The normal equations are solved with a preconditioned conjugate gradient. The fit matrix is never built:
+    products with the basis are applied axis by axis, since it is the Kronecker product of 1D bases.
+    */
+    public:
+        BSplineSmoother(unsigned int ndim);
+        ~BSplineSmoother(){};
+
+        void setNumberOfKnots(unsigned int knots) {m_knots = knots;}
+        void setPenalty(double penalty) {m_penalty = penalty;}
+        void setVerbose(bool verbose) {m_verbose = verbose;}
+        TH1* smooth(const TH1* histo);
+        TH1* coefficientHistogram(const std::string& name) const;
+
+    private:
+        // Values of the 4 non-zero basis functions at each bin center along one axis
+        struct Basis
+        {
+            double min;
+            double spacing;
+            std::vector<int> first;
+            std::vector<double> values;
+        };
+
+        // Relative residual at which the conjugate gradient stops, and maximum number of iterations
+        static const double s_tolerance;
+        static const unsigned int s_maxIterations = 2000;
+
+        void applyBasis(const std::vector<double>& in, std::vector<double>& out, bool transpose, bool squared) const;
+        void applyPenalty(const std::vector<double>& in, std::vector<double>& out) const;
+        void penaltyDiagonal(std::vector<double>& diagonal) const;
+        void applyNormalMatrix(const std::vector<double>& in, std::vector<double>& out) const;
+        void fit(const std::vector<double>& contents, std::vector<double>& diagonal);
+
+        unsigned int m_ndim;
+        unsigned int m_knots;
+        double m_penalty;
+        std::vector<Basis> m_bases;
+        std::vector<int> m_nbins;
+        std::vector<int> m_ncoefficients;
+        std::vector<double> m_binWeights;
+        double m_scaledPenalty;
+        std::vector<double> m_coefficients;
+        bool m_verbose;
+};
+
+
+#endif
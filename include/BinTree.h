@@ -5,20 +5,27 @@
 
 #include <iostream>
 #include <vector>
+#include <string>
 #include <algorithm>
+#include <chrono>
 #include "TLine.h"
 #include "TH2F.h"
 
+class EntryOrdering;
+class TDirectory;
+class GridND;
+
 class EntryList
 {
     public:
         EntryList(int ndim);
-        ~EntryList(){};
 
         void add(const std::vector<double>& values, double weight);
 
         unsigned int size() const;
+        double totalSize() const;
         unsigned int effectiveSize() const;
+        double effectiveSize(double sumw, double sumw2, unsigned int nentries) const;
         unsigned int dimension() const;
         double sumOfWeights() const;
         double sumOfWeightsError() const;
@@ -27,16 +34,28 @@ class EntryList
         double weight(int entry) const;
 
         void sort();
+        void sort(const EntryOrdering& ordering);
+        void clear();
+        void setStoredEntries(double nentries, double sumw, double sumw2);
+        bool hasStoredEntries() const {return m_storedSize>0.;}
+        const std::vector< std::pair<double,int> >& sortedValues(unsigned int axis) const {return m_sortedValues[axis];}
 
         std::pair<EntryList, EntryList> split(unsigned int axis, double cut) const;
         std::pair<int, int> entriesIfSplit(unsigned int axis, double cut) const;
 
         std::vector<double> percentiles(const std::vector<double>& q, unsigned int axis=0) const;
+        double weightedMedian(unsigned int axis=0) const;
         double densityGradient(unsigned int axis=0, double q=10.) const;
         void print();
 
 
     private:
+        void computeSumOfWeights();
+        double storedFraction(double sumw, unsigned int nentries) const;
+
+        // Minimum number of entries for sorting the different axes in parallel
+        static const int s_minParallelAxesSize = 4096;
+
         unsigned int m_ndim;
         std::vector< std::vector< std::pair<double,int> > > m_sortedValues;
         std::vector< std::vector<int> >  m_sortedPositions;
@@ -44,6 +63,31 @@ class EntryList
         double m_maxWeight;
         double m_sumOfWeights;
         double m_sumOfWeightsError;
+        double m_totalSize;
+        // Entries restored with a stored partition, of which only the statistics are known
+        double m_storedSize;
+        double m_storedSumOfWeights;
+        double m_storedSumOfWeights2;
+};
+
+
+class EntryOrdering
+{
+    /* Sorted order of the entries of an EntryList along each axis.
+    It is computed once and shared read-only between entry lists containing the same coordinates
+    (templates built from the same inputs, variables and selection, but with different weights).
+    */
+    public:
+        EntryOrdering(const EntryList& entries);
+        EntryOrdering(const EntryOrdering& ordering, const std::vector<int>& indexMap);
+        ~EntryOrdering(){};
+
+        unsigned int size() const;
+        unsigned int dimension() const {return m_order.size();}
+        const std::vector<int>& order(unsigned int axis) const {return m_order[axis];}
+
+    private:
+        std::vector< std::vector<int> > m_order;
 };
 
 
@@ -56,7 +100,6 @@ class BinLeaf
     public:
         BinLeaf();
         BinLeaf(const std::vector< std::pair<double,double> >& minmax);
-        ~BinLeaf();
 
         bool operator <(const BinLeaf& leaf) const
         {
@@ -64,25 +107,29 @@ class BinLeaf
         }
 
         void setBinBoundaries(const std::vector< std::pair<double,double> >& minmax);
-        const std::vector< std::pair<double,double> >& getBinBoundaries();
-        double getMin(int axis=0);
-        double getMax(int axis=0);
-        double getWidth(int axis=0);
-        double getCenter(int axis=0);
-        bool isNeighbor(BinLeaf* leaf);
-        unsigned int getNEntries();
-        unsigned int effectiveNEntries();
-        double getSumOfWeights();
-        const EntryList& getEntries();
+        const std::vector< std::pair<double,double> >& getBinBoundaries() const;
+        double getMin(int axis=0) const;
+        double getMax(int axis=0) const;
+        double getWidth(int axis=0) const;
+        double getCenter(int axis=0) const;
+        bool isNeighbor(const BinLeaf* leaf) const;
+        unsigned int getNEntries() const;
+        unsigned int effectiveNEntries() const;
+        double getSumOfWeights() const;
+        const EntryList& getEntries() const;
         //const std::vector< std::vector<double> >& getEntries();
         //const std::vector< double >& getWeights();
-        std::vector<double> percentiles(const std::vector<double>& q, unsigned int axis=0);
-        double densityGradient(unsigned int axis=0, double q=10.);
-        bool inBin(const std::vector<double>& xs);
+        std::vector<double> percentiles(const std::vector<double>& q, unsigned int axis=0) const;
+        double weightedMedian(unsigned int axis=0) const;
+        double densityGradient(unsigned int axis=0, double q=10.) const;
+        bool inBin(const std::vector<double>& xs) const;
         bool addEntry(const std::vector<double>& xsi, double wi);
         void setEntries(const EntryList& entries);
         void sortEntries();
-        std::vector<TLine*> getBoundaryTLines();
+        void sortEntries(const EntryOrdering& ordering);
+        void clearEntries();
+        void setStoredEntries(double nentries, double sumw, double sumw2);
+        std::vector<TLine*> getBoundaryTLines() const;
 
         unsigned int index() const {return m_index;}
         void setIndex(unsigned int index) {m_index = index;}
@@ -97,59 +144,124 @@ class BinLeaf
 
 class BinTree
 {
+    /* Adaptive binning tree.
+    Nodes and leaves are stored in two flat arrays, and nodes refer to their sons and leaf with indices.
+    Leaf i is stored in getLeaves()[i] and has index i. Pointers to leaves are invalidated when the tree is split.
+    */
     public:
+        // Criterion used to choose the bin to split and the cut
+        enum SplitCriterion
+        {
+            GRADIENT = 0, // largest density gradient, cut at the median
+            VARIANCE = 1, // largest reduction of the weighted variance of the coordinates
+            POISSON = 2, // largest gain in Poisson likelihood of the bin contents
+            CONTRAST = 3 // largest density difference between the two new bins
+        };
+        static SplitCriterion splitCriterionFromName(const std::string& name);
+
         BinTree(const std::vector< std::pair<double,double> >& minmax, const std::vector< std::vector<double> >& entries, const std::vector< double >& weights);
         ~BinTree();
+
+        static BinTree* read(TDirectory* dir);
+        void write(TDirectory* dir) const;
+
         void addEntry(const std::vector<double>& xsi, double wi);
-        std::vector< std::pair<double,double> > getBinBoundaries();
-        double getMin(int axis=0);
-        double getMax(int axis=0);
-        unsigned int getNEntries();
-        double getSumOfWeights();
+        void addEntries(const std::vector< std::vector<double> >& entries, const std::vector< double >& weights);
+        void clearEntries();
+        void clearStoredEntries();
+        bool hasStoredEntries() const;
+        const std::vector< std::pair<double,double> >& getBinBoundaries() const {return m_boundaries;}
+        double getMin(int axis=0) const {return m_boundaries[axis].first;}
+        double getMax(int axis=0) const {return m_boundaries[axis].second;}
+        unsigned int getNEntries() const;
+        double getSumOfWeights() const;
         //std::vector< std::vector<double> > getEntries();
         //std::vector< double > getWeights();
         BinLeaf* getLeaf(const std::vector<double>& xs);
-        std::vector<BinLeaf*> getLeaves();
-        std::vector<BinTree*> getTerminalNodes();
-        std::vector<BinLeaf*> findNeighborLeaves(BinLeaf* leaf);
-        std::vector<BinTree*> getSons() {return m_treeSons;}
-        unsigned int getNLeaves();
-        double getMinBinWidth(unsigned int axis);
-        double getMinEntries();
-        double getMaxEntries();
-        unsigned int maxLeafIndex();
+        const std::vector<BinLeaf>& getLeaves() const {return m_leaves;}
+        std::vector<const BinLeaf*> findNeighborLeaves(const BinLeaf* leaf) const;
+        unsigned int getNLeaves() const {return m_leaves.size();}
+        double getMinBinWidth(unsigned int axis) const;
+        double getMinEntries() const;
+        double getMaxEntries() const;
+        unsigned int maxLeafIndex() const {return m_leaves.size()-1;}
         unsigned int minLeafEntries() const {return m_minLeafEntries;}
         double maxAxisAsymmetry() const {return m_maxAxisAsymmetry;}
-        void build();
-        std::vector<TLine*> getBoundaryTLines();
+        double maxBuildSeconds() const {return m_maxBuildSeconds;}
+        bool multiAxisSplit() const {return m_multiAxisSplit;}
+        SplitCriterion splitCriterion() const {return m_splitCriterion;}
+        void build(const EntryOrdering* ordering=NULL);
+        std::vector<bool> update();
+        std::vector<TLine*> getBoundaryTLines() const;
         TH1* fillHistogram();
         std::vector<TH1*> fillWidths(const TH1* widthTemplate=NULL);
+        std::vector<TH1*> fillWidths(const TH1* widthTemplate, const std::vector<TH1*>& previousWidths, const std::vector<bool>& updatedLeaves);
         std::vector<TH1*> fillWidthsLowStat(const TH1* widthTemplate=NULL);
-        std::vector<TH1*> fillWidthsHighStat(const TH1* widthTemplate=NULL);
+        std::vector<TH1*> fillWidthsHighStat(const TH1* widthTemplate=NULL, const std::vector<TH1*>* previousWidths=NULL, const std::vector<bool>* updatedLeaves=NULL);
+        // N-dimensional versions, filled on the grid given with setGridConstraintND()
+        GridND* fillGrid() const;
+        std::vector<GridND*> fillWidthsGrid() const;
 
-        BinLeaf* leaf(){return m_leaf;}
+        BinLeaf* leaf(){return (m_nodes[0].leaf>=0 ? &m_leaves[m_nodes[0].leaf] : NULL);}
         void setGridConstraint(TH1* gridConstraint);
-        void setVetoSplit(unsigned int axis, bool veto){m_vetoSplit[axis] = veto;}
+        void setGridConstraintND(const GridND* gridConstraint) {m_gridConstraintND = gridConstraint;}
+        void setVetoSplit(unsigned int axis, bool veto){setVetoSplit(0, axis, veto);}
         void setMinLeafEntries(unsigned int minLeafEntries){m_minLeafEntries = minLeafEntries;}
         void setMaxAxisAsymmetry(double maxAxisAsymmetry){m_maxAxisAsymmetry = maxAxisAsymmetry;}
-        bool vetoSplit(unsigned int axis){return m_vetoSplit[axis];}
+        void setMaxBuildSeconds(double maxBuildSeconds){m_maxBuildSeconds = maxBuildSeconds;}
+        void setMultiAxisSplit(bool multiAxisSplit){m_multiAxisSplit = multiAxisSplit;}
+        void setVerbose(bool verbose){m_verbose = verbose;} // informational printouts
+        void setSplitCriterion(SplitCriterion criterion){m_splitCriterion = criterion; m_splitCandidates.clear();}
+        bool vetoSplit(unsigned int axis) const {return vetoSplit(0, axis);}
 
     private:
-        std::pair<int,int> entriesIfSplit(double cut, unsigned int axis=0);
-        void splitLeaf(double cut, unsigned int maxLeafIndex, unsigned int axis=0);
-        void findBestSplit(BinTree*& bestNode, unsigned int& axis, double& gradient);
-        void constrainSplit(int axis, double& cut, bool& veto);
-        void minimizeLongBins(BinTree* tree, unsigned int axis, double& cut, bool& veto);
+        struct BinNode
+        {
+            int sons[2]; // -1 for terminal nodes
+            int leaf; // -1 for non-terminal nodes
+            unsigned int cutAxis;
+            double cut;
+            unsigned int vetoSplit; // one bit per axis
+        };
+
+        int addNode(int leaf);
+        int findLeaf(const std::vector<double>& xs) const;
+        BinLeaf& nodeLeaf(int node);
+        bool vetoSplit(int node, unsigned int axis) const {return (m_nodes[node].vetoSplit>>axis) & 1;}
+        void setVetoSplit(int node, unsigned int axis, bool veto);
+        std::pair<int,int> entriesIfSplit(int node, double cut, unsigned int axis=0);
+        void splitLeaf(int node, double cut, unsigned int axis=0);
+        bool multiSplitLeaf(int node);
+        void findBestSplit(int& bestNode, unsigned int& axis, double& gradient);
+        double splitGain(int node, unsigned int axis);
+        double splitCut(int node, unsigned int axis);
+        const std::vector< std::pair<double,double> >& splitCandidates(int leaf);
+        std::pair<double,double> bestCut(const BinLeaf& leaf, unsigned int axis) const;
+        void constrainSplit(int node, int axis, double& cut, bool& veto);
+        bool constrainedCut(int node, int axis, double& cut);
+        void minimizeLongBins(int node, unsigned int axis, double& cut, bool& veto);
+        void splitLeaves();
+        bool buildTimeSpent() const;
+        void printBuildProgress() const;
+        void splitBoundaryLeaves(std::vector<int> terminalNodes);
+        std::vector<int> leafGridBins(const BinLeaf& leaf) const;
 
         unsigned int m_ndim;
-        std::vector<BinTree*> m_treeSons;
-        unsigned int m_cutAxis;
-        double m_cut;
-        std::vector<int> m_vetoSplit;
-        BinLeaf* m_leaf;
+        std::vector< std::pair<double,double> > m_boundaries;
+        std::vector<BinNode> m_nodes;
+        std::vector<BinLeaf> m_leaves;
+        std::vector<int> m_leafNodes; // node of each leaf
+        std::vector<bool> m_updatedLeaves; // leaves created or modified by splits since the last update()
         unsigned int m_minLeafEntries;
         double m_maxAxisAsymmetry;
+        double m_maxBuildSeconds; // <=0 for no time limit
+        bool m_multiAxisSplit; // split along all possible axes at once
+        SplitCriterion m_splitCriterion;
+        std::vector< std::vector< std::pair<double,double> > > m_splitCandidates; // (gain,cut) for each leaf and axis, when the criterion is not GRADIENT
+        std::chrono::steady_clock::time_point m_buildStart;
         TH1* m_gridConstraint;
+        const GridND* m_gridConstraintND; // used instead of m_gridConstraint for more than 3 dimensions
+        bool m_verbose;
 
 };
 
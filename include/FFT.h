@@ -0,0 +1,28 @@
+
+
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <vector>
+#include <complex>
+
+class FFT
+{
+    /* Radix-2 fast Fourier transforms of complex arrays.
+    N-dimensional arrays are stored with the last axis running fastest, and all sizes must be powers of 2.
+    Lines along each axis are transformed in parallel on the global thread pool.
+    Inverse transforms are normalized (divided by the number of points).
+    */
+    public:
+        static unsigned int nextPowerOfTwo(unsigned int n);
+        static void transform(std::vector< std::complex<double> >& data, bool inverse=false);
+        static void transform(std::vector< std::complex<double> >& data, const std::vector<unsigned int>& sizes, bool inverse=false);
+
+    private:
+        static void transformLine(std::complex<double>* line, unsigned int n, const std::vector< std::complex<double> >& twiddles);
+        static void twiddleFactors(unsigned int n, bool inverse, std::vector< std::complex<double> >& twiddles);
+};
+
+
+#endif
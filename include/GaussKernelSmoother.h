@@ -22,29 +22,148 @@
 #define GAUSSKERNELSMOOTHER_H
 
 #include <TH1.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
 #include <algorithm>
+#include <functional>
+
+class GridND;
 
 class GaussKernelSmoother
 {
     public:
+        // Kernel profile along each axis. Compact kernels are not truncated, and are cheaper than the Gaussian:
+        // their support is sqrt(5) (Epanechnikov), 2.63 (tricube) or sqrt(7) (biweight) sigmas instead of 4
+        enum KernelShape
+        {
+            GAUSSIAN = 0,
+            EPANECHNIKOV = 1,
+            TRICUBE = 2,
+            BIWEIGHT = 3
+        };
+        static KernelShape kernelShapeFromName(const std::string& name);
+
         GaussKernelSmoother();
         GaussKernelSmoother(unsigned int ndim);
         ~GaussKernelSmoother();
 
         TH1* smooth(const TH1* histo);
+        // Smooth several histograms with the same binning and the same widths in one pass
+        std::vector<TH1*> smooth(const std::vector<const TH1*>& histos);
+        GridND* smooth(const GridND* grid);
         void setWidths(const std::vector<TH1*>& widths);
+        void setWidths(const std::vector<GridND*>& widths);
         void setWidthScalingFactor(double widthScalingFactor){m_widthScalingFactor = widthScalingFactor;}
+        void setWidthTolerance(double widthTolerance){m_widthTolerance = widthTolerance;}
+        // Maximum fraction of the kernel weights discarded by the truncation. 0 means truncation at 4 sigmas
+        void setTruncationTolerance(double truncationTolerance){m_truncationTolerance = truncationTolerance;}
+        void setKernelShape(KernelShape kernelShape){m_kernelShape = kernelShape;}
+        // Relative width step between FFT kernel bands. 0 means direct smoothing
+        void setFFTBandStep(double fftBandStep){m_fftBandStep = fftBandStep;}
+        // Approximate the Gaussian kernel with iterated box filters (2D and 3D)
+        void setBoxFilter(bool boxFilter){m_boxFilter = boxFilter;}
+        // Maximum number of coarser levels used for wide kernels. 0 means full resolution only
+        void setPyramidLevels(unsigned int levels){m_pyramidLevels = levels;}
+        // Template (anti)symmetric along 'axis' (-1 for none): only half of the bins are smoothed
+        void setMirror(int axis, bool antisymmetric){m_mirrorAxis = axis; m_antiMirror = antisymmetric;}
+        // Informational printouts (warnings are always printed)
+        void setVerbose(bool verbose){m_verbose = verbose;}
 
     private:
-        inline double weight(const std::vector<double>& x0, const std::vector<double>& xi);
-        inline double weight(const std::vector<double>& x0, double dx, int axis);
-        inline std::pair<double,double> smoothedValueError(const TH1* histo, const std::vector<double>& x0);
-        inline std::pair<double,double> smoothed2DValueError(const TH1* histo, const std::vector<double>& x0);
-        inline std::pair<double,double> smoothed3DValueError(const TH1* histo, const std::vector<double>& x0);
+        // Compact kernel profiles, functions of u = distance/support for |u|<=1 (not normalized).
+        // radius() is the support in kernel sigmas, such that the kernel variance is the one of the Gaussian of the same width
+        struct EpanechnikovKernel
+        {
+            static double radius() {return std::sqrt(5.);}
+            double operator()(double u) const {return 1.-u*u;}
+        };
+        struct TricubeKernel
+        {
+            static double radius() {return std::sqrt(243./35.);}
+            double operator()(double u) const {double v = 1.-std::fabs(u*u*u); return v*v*v;}
+        };
+        struct BiweightKernel
+        {
+            static double radius() {return std::sqrt(7.);}
+            double operator()(double u) const {double v = 1.-u*u; return v*v;}
+        };
+        // Normalized kernel weights for all the neighbor shifts, last axis running fastest
+        struct Stencil
+        {
+            std::vector<int> halfWidths;
+            std::vector<double> weights;
+        };
+        // Maximum number of cached stencil weights (~256 MB)
+        static const unsigned int s_maxStencilCacheSize = 32000000;
+        // Maximum number of points of the FFT arrays (~270 MB per array)
+        static const unsigned int s_maxFFTSize = 16777216;
+        // Minimum kernel sigma, in coarse bins, for smoothing a bin at a coarser pyramid level
+        static const unsigned int s_pyramidMinSigma = 4;
+        // Stencil id of the bins without any non-zero content in their kernel support
+        static const unsigned int s_inactiveBin = 0xFFFFFFFF;
+
+        void smoothBins(unsigned int nbins, const std::function<void(unsigned int)>& smoothBin) const;
+        void fillArrays(const std::vector<const TH1*>& histos);
+        double gaus(double x) const;
+        int truncationBins(double width, double binWidth) const;
+        double truncationBound(const std::vector< std::vector<double> >& widths, const std::vector< std::vector<int> >& halfWidths) const;
+        void axisWeights(double width, double binWidth, int nbinsWidth, std::vector<double>& weights) const;
+        template<typename Kernel> void compactAxisWeights(double width, double binWidth, int nbinsWidth, std::vector<double>& weights) const;
+        void printTruncation(const std::vector< std::vector<double> >& widths, const std::vector< std::vector<int> >& halfWidths) const;
+        std::vector<double> stencilWidths(unsigned int bin) const;
+        void buildStencil(const std::vector<double>& widths, const std::vector<int>& halfWidths, Stencil& stencil) const;
+        void buildStencils();
+        void smoothArrays(std::vector< std::pair<double,double> >& valueErrors);
+        bool smoothFFT(std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothBoxSAT(std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothPyramid(std::vector< std::pair<double,double> >& valueErrors);
+        void foldArrays();
+        void unfoldValueErrors(std::vector< std::pair<double,double> >& valueErrors) const;
+        static void accumulateRow(const double* weights, const double* contents, const double* errors, int n, double& sumw, double& sumwv, double& sumwe);
+        void accumulateRows(const double* weights, unsigned int offset, int n, double& sumw, std::vector<double>& sumwv, std::vector<double>& sumwe) const;
+        int rowWeights(int bin, int nbins, const std::vector<double>& weights, double weight0, double dbr2, double widthRatio, std::vector<double>& row) const;
+        void accumulateStencilRow(const double* weights, int halfWidth, int bin, int nbins, unsigned int offset, std::vector<double>& folded, double& sumw, std::vector<double>& sumwv, std::vector<double>& sumwe) const;
+        void smoothedValueErrors(unsigned int bin, std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothed2DValueErrors(unsigned int bin, const Stencil& stencil, std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothed3DValueErrors(unsigned int bin, const Stencil& stencil, std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothed2DValueErrors(unsigned int bin, const std::vector<double>& widths, const std::vector<int>& halfWidths, std::vector< std::pair<double,double> >& valueErrors) const;
+        void smoothed3DValueErrors(unsigned int bin, const std::vector<double>& widths, const std::vector<int>& halfWidths, std::vector< std::pair<double,double> >& valueErrors) const;
+        std::pair<double,double> smoothedNDValueError(const GridND* grid, unsigned int index, const std::vector< std::map<double,int> >& halfWidths);
 
         unsigned int m_ndim;
         std::vector<TH1*> m_widths;
+        std::vector<GridND*> m_widthsND;
         double m_widthScalingFactor;
+        // Flat copies of the smoothed histograms and of the widths, last axis running fastest.
+        // Contents and errors of the m_nhistos histograms are stored one histogram after the other
+        std::vector<int> m_nbins;
+        std::vector<double> m_binWidths;
+        unsigned int m_nhistos;
+        unsigned int m_total;
+        std::vector<double> m_contents;
+        std::vector<double> m_errors;
+        std::vector< std::vector<double> > m_widthArrays;
+        // Relative tolerance used to quantize widths, and stencils shared by bins with the same quantized widths
+        double m_widthTolerance;
+        std::vector< std::vector<double> > m_stencilWidths;
+        // Truncation half widths of each stencil, in bins along each axis
+        std::vector< std::vector<int> > m_stencilHalfWidths;
+        std::vector<Stencil> m_stencils;
+        std::vector<unsigned int> m_binStencils;
+        // Maximum discarded fraction of the kernel weights. 0 means truncation at 4 sigmas
+        double m_truncationTolerance;
+        KernelShape m_kernelShape;
+        double m_fftBandStep;
+        bool m_boxFilter;
+        // Pyramid level of each bin, and scale of the bins of the current level with respect to full resolution bins
+        unsigned int m_pyramidLevels;
+        std::vector<unsigned char> m_binLevels;
+        double m_dampingScale;
+        int m_mirrorAxis;
+        bool m_antiMirror;
+        bool m_verbose;
 
 };
 
@@ -0,0 +1,71 @@
+
+
+
+#ifndef GRIDND_H
+#define GRIDND_H
+
+#include <vector>
+#include <string>
+
+class THnBase;
+class TH1D;
+
+class GridND
+{
+    /* Regular N-dimensional grid of bin contents and errors, used for templates with more than 3 dimensions.
+    Only bins inside the boundaries are stored, in a flat array where the first axis runs fastest.
+    As in ROOT histograms, bin numbers along each axis go from 1 to nbins.
+    */
+    public:
+        GridND(const std::string& name, const std::vector<unsigned int>& nbins, const std::vector< std::pair<double,double> >& minmax);
+        ~GridND(){};
+
+        const std::string& getName() const {return m_name;}
+        void setName(const std::string& name) {m_name = name;}
+        unsigned int dimension() const {return m_nbins.size();}
+        unsigned int size() const {return m_contents.size();}
+        const std::vector<unsigned int>& getNbins() const {return m_nbins;}
+        int getNbins(unsigned int axis) const {return m_nbins[axis];}
+        const std::vector< std::pair<double,double> >& getMinMax() const {return m_minmax;}
+        double getBinWidth(unsigned int axis) const {return m_binWidths[axis];}
+        double getBinLowEdge(unsigned int axis, int bin) const {return m_minmax[axis].first + (bin-1)*m_binWidths[axis];}
+        double getBinUpEdge(unsigned int axis, int bin) const {return m_minmax[axis].first + bin*m_binWidths[axis];}
+        double getBinCenter(unsigned int axis, int bin) const {return m_minmax[axis].first + (bin-0.5)*m_binWidths[axis];}
+        int findBin(unsigned int axis, double x) const;
+        bool sameBinning(const GridND& grid) const;
+
+        unsigned int index(const std::vector<int>& bins) const;
+        void bins(unsigned int index, std::vector<int>& bins) const;
+        void binCenter(unsigned int index, std::vector<double>& point) const;
+        int fill(const std::vector<double>& point, double weight);
+
+        double getBinContent(unsigned int index) const {return m_contents[index];}
+        double getBinError(unsigned int index) const;
+        void setBinContent(unsigned int index, double content) {m_contents[index] = content;}
+        void setBinError(unsigned int index, double error) {m_sumw2[index] = error*error;}
+        double getSumOfWeights() const;
+        double getMinimum() const;
+        double filledFraction() const;
+
+        void reset();
+        void scale(double factor);
+        void add(const GridND& grid, double factor=1.);
+        void scaleSlice(unsigned int axis, int bin, double factor);
+        TH1D* projection(unsigned int axis, const std::string& name) const;
+        THnBase* toTHn(bool sparse) const;
+
+    private:
+        // Maximum number of bins, in order to limit the memory used by dense grids
+        static const unsigned int s_maxSize = 100000000;
+
+        std::string m_name;
+        std::vector<unsigned int> m_nbins;
+        std::vector< std::pair<double,double> > m_minmax;
+        std::vector<double> m_binWidths;
+        std::vector<unsigned int> m_strides;
+        std::vector<double> m_contents;
+        std::vector<double> m_sumw2;
+};
+
+
+#endif
@@ -0,0 +1,62 @@
+
+
+
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+
+class KDTree
+{
+    /* Static k-d tree over a set of points, built once by splitting at the median along the axis of largest extent.
+    Points are stored in tree order, such that the points of each node are contiguous. Positions in this order are
+    returned by the queries, and originalIndex() gives the corresponding index in the input points.
+    Each point can be given an extent (half-size of a box centered on the point, e.g. a kernel support), which is
+    used by findContaining() to select the points whose box contains a given position.
+    */
+    public:
+        KDTree(const std::vector< std::vector<double> >& points, unsigned int leafSize=16);
+        ~KDTree(){};
+
+        unsigned int dimension() const {return m_ndim;}
+        unsigned int size() const {return m_indices.size();}
+        unsigned int originalIndex(unsigned int position) const {return m_indices[position];}
+        const double* point(unsigned int position) const {return &m_points[position*m_ndim];}
+
+        double neighborDistance(unsigned int position, unsigned int k) const;
+        void setExtents(const std::vector<double>& extents);
+        void findContaining(const std::vector<double>& x, std::vector<unsigned int>& positions) const;
+
+    private:
+        struct Node
+        {
+            unsigned int first;
+            unsigned int last;
+            int left;
+            int right;
+        };
+
+        int build(unsigned int first, unsigned int last);
+        void computeBox(unsigned int first, unsigned int last, double* low, double* high) const;
+        double minDistance2(int node, const double* x) const;
+        void searchNeighbors(int node, const double* x, unsigned int k, std::vector<double>& heap) const;
+        void updateSupports(int node);
+        void searchContaining(int node, const double* x, std::vector<unsigned int>& positions) const;
+
+        unsigned int m_ndim;
+        unsigned int m_leafSize;
+        // Points in tree order, and their index in the input points
+        std::vector<double> m_points;
+        std::vector<unsigned int> m_indices;
+        std::vector<double> m_extents;
+        std::vector<Node> m_nodes;
+        // Bounding boxes of the points of each node, and of their extents
+        std::vector<double> m_low;
+        std::vector<double> m_high;
+        std::vector<double> m_supportLow;
+        std::vector<double> m_supportHigh;
+};
+
+
+#endif
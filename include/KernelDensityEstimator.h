@@ -0,0 +1,56 @@
+
+
+
+
+#ifndef KERNELDENSITYESTIMATOR_H
+#define KERNELDENSITYESTIMATOR_H
+
+#include <vector>
+#include <utility>
+#include <functional>
+
+class TH1;
+class GridND;
+class KDTree;
+
+class KernelDensityEstimator
+{
+    /* Adaptive Gaussian kernel density estimate computed directly from the entries of a template, and evaluated at the bin centers.
+    Coordinates are normalized to the template range along each axis. Each entry has its own isotropic kernel, with a width
+    given by the distance to its k-th nearest neighbor (the side of the cube with the volume of the k-neighbor ball, as for
+    adaptive bins of k entries). Kernels are truncated at s_truncation sigmas, and normalized inside the template range.
+    Neighbors and kernels reaching each bin center are found with a k-d tree.
+    */
+    public:
+        KernelDensityEstimator(const std::vector< std::pair<double,double> >& minmax);
+        ~KernelDensityEstimator();
+
+        void setNeighbors(unsigned int neighbors) {m_neighbors = neighbors;}
+        void setWidthScalingFactor(double widthScalingFactor) {m_widthScalingFactor = widthScalingFactor;}
+        void setVerbose(bool verbose) {m_verbose = verbose;}
+        void setEntries(const std::vector< std::vector<double> >& entries, const std::vector<double>& weights);
+        TH1* estimate(const TH1* histo);
+        GridND* estimate(const GridND* grid);
+
+    private:
+        // Kernel truncation, in number of sigmas
+        static const double s_truncation;
+
+        void prepareKernels(const std::vector<double>& binWidths);
+        std::pair<double,double> valueError(const std::vector<double>& x, double binVolume, std::vector<unsigned int>& positions) const;
+        void estimateBins(unsigned int nbins, const std::vector<double>& binWidths, const std::function<void(unsigned int, std::vector<double>&)>& binCenter, std::vector< std::pair<double,double> >& valueErrors);
+
+        std::vector< std::pair<double,double> > m_minmax;
+        unsigned int m_neighbors;
+        double m_widthScalingFactor;
+        KDTree* m_tree;
+        bool m_verbose;
+        // Per entry, in tree order: weight, k-neighbor width, kernel sigma along each axis and normalization
+        std::vector<double> m_weights;
+        std::vector<double> m_widths;
+        std::vector<double> m_sigmas;
+        std::vector<double> m_norms;
+};
+
+
+#endif
@@ -0,0 +1,55 @@
+
+
+
+
+#ifndef LEAFGRAPHSMOOTHER_H
+#define LEAFGRAPHSMOOTHER_H
+
+#include <vector>
+#include <utility>
+
+class TH1;
+class BinTree;
+
+class LeafGraphSmoother
+{
+    /* Smoothing at the resolution of the adaptive binning, on the graph of the partition leaves.
+    The density of each leaf (mean content of the template bins whose center is in the leaf) is replaced by a weighted
+    local linear regression over the leaf and its neighbor leaves (leaves sharing a face with it). Neighbors are weighted
+    by their number of bins and by a Gaussian of the distance between the leaf centers, in units of the leaf widths.
+    Template bins then take the interpolation of the smoothed leaf densities, with multilinear (tent) weights centered on
+    the leaves, spanning one leaf width on each side. The cost depends on the number of leaves rather than on the number
+    of template bins and kernel sizes.
+    */
+    public:
+        LeafGraphSmoother(BinTree* partition);
+        ~LeafGraphSmoother(){};
+
+        void setWidthScalingFactor(double widthScalingFactor) {m_widthScalingFactor = widthScalingFactor;}
+        void setVerbose(bool verbose) {m_verbose = verbose;}
+        TH1* smooth(const TH1* histo);
+
+    private:
+        void mapBins(const TH1* histo);
+        void buildGraph();
+        void fitLeaves();
+        std::pair<double,double> interpolate(unsigned int bin, const std::vector<double>& x) const;
+
+        BinTree* m_partition;
+        unsigned int m_ndim;
+        double m_widthScalingFactor;
+        bool m_verbose;
+        // Template bins, flat numbering with the last axis running fastest
+        std::vector<int> m_nbins;
+        std::vector< std::vector<double> > m_binCenters;
+        std::vector<int> m_binLeaves;
+        // Per leaf: number of template bins, density and error, neighbor leaves, smoothed density and error
+        std::vector<unsigned int> m_leafBins;
+        std::vector<double> m_densities;
+        std::vector<double> m_errors;
+        std::vector< std::vector<unsigned int> > m_neighbors;
+        std::vector< std::pair<double,double> > m_smoothed;
+};
+
+
+#endif
@@ -0,0 +1,46 @@
+
+
+#ifndef RADIXSORT_H
+#define RADIXSORT_H
+
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+class RadixSorter
+{
+    /* LSD radix sort of (value, index) pairs on the value.
+    Values are mapped to order-preserving 64-bit keys, sorted with 11-bit digits,
+    and digits that are identical for all the keys are skipped.
+    Scratch buffers are kept between calls, so one sorter per thread should be reused (see local()).
+    */
+    public:
+        RadixSorter(){};
+        ~RadixSorter(){};
+
+        static RadixSorter& local();
+
+        void sort(std::vector< std::pair<double,int> >& values, bool parallel=false);
+
+        // Below this size a comparison sort is faster
+        static const unsigned int s_minRadixSize = 1024;
+        // Minimum size for splitting the sort in chunks processed by different threads
+        static const unsigned int s_minParallelSize = 1<<17;
+
+    private:
+        void sortSerial(unsigned int nentries);
+        void sortParallel(unsigned int nentries, unsigned int nchunks);
+
+        struct Record
+        {
+            uint64_t key;
+            int index;
+        };
+
+        std::vector<Record> m_records;
+        std::vector<Record> m_buffer;
+        std::vector<unsigned int> m_counts;
+};
+
+
+#endif
@@ -34,6 +34,7 @@ class Smoother1D
         ~Smoother1D();
 
         TH1D* smooth(TH1D* rawHisto);
+        void setVerbose(bool verbose) {m_verbose = verbose;}
 
 
     private:
@@ -52,6 +53,7 @@ class Smoother1D
         TH1D* m_rebinHistoX;
         TGraph* m_smoothWidth;
         TH1D* m_smoothHisto;
+        bool m_verbose;
 
 
 };
@@ -35,6 +35,8 @@
 #include <map>
 #include <stdexcept>
 
+class BinTree;
+class GridND;
 
 
 class PostProcessing
@@ -112,8 +114,17 @@ class Template
         double getRescaling() {return m_scaleFactor;}
         BinningType getBinningType() const {return m_binningType;}
         unsigned int getEntriesPerBin() const {return m_entriesPerBin;}
+        double getMaxBuildSeconds() const {return m_maxBuildSeconds;}
+        bool multiAxisSplit() const {return m_multiAxisSplit;}
+        const std::string& getSplitCriterion() const {return m_splitCriterion;}
+        const std::string& getBinningGroup() const {return m_binningGroup;}
         TH1* getTemplate() const {return m_template;}
         TH1* getRawTemplate() const {return m_rawTemplate;}
+        // Templates with more than 3 dimensions are stored in N-dimensional grids instead of histograms
+        GridND* getTemplateND() const {return m_templateND;}
+        GridND* getRawTemplateND() const {return m_rawTemplateND;}
+        const std::vector<GridND*>& getWidthsND() const {return m_widthsND;}
+        double getSumOfWeights() const;
         TH1D* getRaw1DTemplate(unsigned int axis=0) const {return m_raw1DTemplates[axis];}
         const std::vector<TH1D*>& getRaw1DTemplates() const {return m_raw1DTemplates;}
         TH2D* getRaw2DTemplate(unsigned int axis=0) const {return m_raw2DTemplates[axis];}
@@ -127,15 +138,27 @@ class Template
         std::vector< std::pair<std::string, std::string> >::const_iterator inputFileAndTreeEnd() const {return m_inputFileAndTreeNames.end();}
         std::vector<std::pair<std::string,double> >::const_iterator inputTemplatesBegin() const {return m_inputTemplates.begin();}
         std::vector<std::pair<std::string,double> >::const_iterator inputTemplatesEnd() const {return m_inputTemplates.end();}
-        std::vector<std::vector<double> >::const_iterator entriesBegin() const {return m_entries.begin();}
-        std::vector<std::vector<double> >::const_iterator entriesEnd() const {return m_entries.end();}
+        std::vector<std::vector<double> >::const_iterator entriesBegin() const {return entries().begin();}
+        std::vector<std::vector<double> >::const_iterator entriesEnd() const {return entries().end();}
         std::vector<double>::const_iterator weightsBegin() const {return m_weights.begin();}
         std::vector<double>::const_iterator weightsEnd() const {return m_weights.end();}
-        const std::vector< std::vector<double> >& entries() const {return m_entries;}
+        const std::vector< std::vector<double> >& entries() const {return (m_sharedEntries ? *m_sharedEntries : m_entries);}
         const std::vector<double>& weights() const {return m_weights;}
+        const std::vector<unsigned int>& inputFileNEntries() const {return m_inputFileNEntries;}
         double originalSumOfWeights() const {return m_originalSumOfWeights;}
         bool conserveSumOfWeights() const {return m_conserveSumOfWeights;}
         bool fillOverflows() const {return m_fillOverflows;}
+        const std::string& getPartitionFile() const {return m_partitionFile;}
+        const std::string& getPartitionName() const {return m_partitionName;}
+        bool updatePartition() const {return m_updatePartition;}
+        BinTree* getPartition() const {return m_partition;}
+        unsigned int getBootstrap() const {return m_bootstrap;}
+        unsigned int getBootstrapSeed() const {return m_bootstrapSeed;}
+        bool isBootstrapReplica() const {return m_sharedEntries!=NULL;}
+        bool verbose() const {return m_verbose;}
+        TH1* getBootstrapMean() const {return m_bootstrapMean;}
+        TH1* getBootstrapRMS() const {return m_bootstrapRMS;}
+        TH1* getSplineCoefficients() const {return m_splineCoefficients;}
         std::vector<PostProcessing>::iterator postProcessingBegin() {return m_postProcessings.begin();}
         std::vector<PostProcessing>::iterator postProcessingEnd() {return m_postProcessings.end();}
         std::vector<TCanvas*>::iterator controlPlotsBegin() {return m_controlPlots.begin();}
@@ -153,6 +176,10 @@ class Template
         void setTreeName(const std::string& name);
         void setBinningType(BinningType type) {m_binningType = type;}
         void setEntriesPerBin(unsigned int entriesPerBin) {m_entriesPerBin = entriesPerBin;}
+        void setMaxBuildSeconds(double seconds) {m_maxBuildSeconds = seconds;}
+        void setMultiAxisSplit(bool multiAxisSplit) {m_multiAxisSplit = multiAxisSplit;}
+        void setSplitCriterion(const std::string& criterion) {m_splitCriterion = criterion;}
+        void setBinningGroup(const std::string& group) {m_binningGroup = group;}
         void addPostProcessing(PostProcessing postProcess) {m_postProcessings.push_back(postProcess);}
         void createTemplate(const std::vector<unsigned int>& nbins, const std::vector< std::pair<double,double> >& minmax);
         void setTemplate(const TH1* histo);
@@ -160,13 +187,29 @@ class Template
         void setRaw1DTemplates(const std::vector<TH1D*>& histo);
         void setRaw2DTemplates(const std::vector<TH2D*>& histo);
         void setWidths(const std::vector<TH1*>& width);
+        void setTemplateND(const GridND* grid);
+        void setRawTemplateND(const GridND* grid);
+        void setWidthsND(const std::vector<GridND*>& widths);
+        void scale(double factor);
         void setRescaling(double scaleFactor) {m_scaleFactor = scaleFactor;}
-        bool inTemplate(const std::vector<double>& vs);
+        bool inTemplate(const std::vector<double>& vs) const;
         void store(const std::vector<double>& vs, double w);
+        void addInputFileNEntries(unsigned int nentries) {m_inputFileNEntries.push_back(nentries);}
         void reweight1D(unsigned int axis, unsigned int bin, double weight);
         void setOriginalSumOfWeights(double sumOfWeights) {m_originalSumOfWeights = sumOfWeights;}
         void setConserveSumOfWeights(bool conserve) {m_conserveSumOfWeights = conserve;}
         void setFillOverflows(bool overflows) {m_fillOverflows = overflows;}
+        void setPartitionReference(const std::string& fileName, const std::string& name) {m_partitionFile = fileName; m_partitionName = name;}
+        void setUpdatePartition(bool update) {m_updatePartition = update;}
+        void setPartition(BinTree* partition);
+        void setBootstrap(unsigned int nreplicas) {m_bootstrap = nreplicas;}
+        void setBootstrapSeed(unsigned int seed) {m_bootstrapSeed = seed;}
+        void setBootstrapHistograms(TH1* mean, TH1* rms);
+        void setSplineCoefficients(TH1* coefficients);
+        Template* bootstrapReplica(unsigned int replica) const;
+        void setMakeControlPlots(bool make) {m_makeControlPlots = make;}
+        // Informational printouts of the building and postprocessing of this template (warnings are always printed)
+        void setVerbose(bool verbose) {m_verbose = verbose;}
         // control plot methods
         void makeProjectionControlPlot(const std::string& tag);
         void makeResidualsControlPlot(const std::string& tag, unsigned int rebin=1);
@@ -190,14 +233,34 @@ class Template
         std::vector<TH2D*> m_raw2DTemplates;
         std::vector< std::pair<double,double> > m_minmax;
         std::vector<TH1*> m_widths;
+        GridND* m_templateND;
+        GridND* m_rawTemplateND;
+        std::vector<GridND*> m_widthsND;
         unsigned int m_entriesPerBin;
+        double m_maxBuildSeconds;
+        bool m_multiAxisSplit;
+        std::string m_splitCriterion;
+        std::string m_binningGroup; // templates with the same group share the same adaptive binning
         std::vector<PostProcessing> m_postProcessings;
         double m_scaleFactor;
         std::vector< std::vector<double> > m_entries;
+        const std::vector< std::vector<double> >* m_sharedEntries; // entries of the nominal template, for bootstrap replicas
         std::vector< double > m_weights;
+        std::vector<unsigned int> m_inputFileNEntries;
         double m_originalSumOfWeights;
         bool m_conserveSumOfWeights;
         bool m_fillOverflows;
+        std::string m_partitionFile;
+        std::string m_partitionName;
+        bool m_updatePartition;
+        BinTree* m_partition;
+        unsigned int m_bootstrap;
+        unsigned int m_bootstrapSeed; // base seed of the bootstrap replicas
+        TH1* m_bootstrapMean;
+        TH1* m_bootstrapRMS;
+        TH1* m_splineCoefficients; // coefficients of the B-spline smoothing, if any
+        bool m_makeControlPlots;
+        bool m_verbose;
 
         std::vector<TCanvas*> m_controlPlots;
 
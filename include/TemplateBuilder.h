@@ -23,7 +23,13 @@
 #include "Template.h"
 
 #include <map>
+#include <set>
 #include <string>
+#include <mutex>
+
+class BinTree;
+class EntryOrdering;
+class GaussKernelSmoother;
 
 class TemplateBuilder
 {
@@ -42,12 +48,38 @@ class TemplateBuilder
         void fillTemplates();
         void postProcessing(Template::Origin origin=Template::Origin::FILES);
         void buildTemplatesFromTemplates();
+        void bootstrap();
 
 
     private:
-        void applyReweighting(Template* tmp, const PostProcessing& pp);
+        void fillTemplate(Template* tmp);
+        void postProcess(Template* tmp, Template::Origin origin);
+        void setSmoothingParameters(GaussKernelSmoother& smoother, const PostProcessing& pp) const;
+        void smoothBinningGroups();
+        void bootstrap(Template* tmp);
+        void applyReweighting(Template* tmp, const PostProcessing& pp, int mirrorAxis=-1);
+        BinTree* adaptiveBinning(Template* tmp, unsigned int entriesPerBin, std::vector<TH1*>& widths, TH1* gridConstraint=NULL, const TH1* widthTemplate=NULL);
+        BinTree* readPartition(const Template* tmp, std::vector<TH1*>* widths=NULL, std::vector<std::string>* inputs=NULL) const;
+        bool newInputFiles(const Template* tmp, const BinTree* bintree, const std::vector<std::string>& partitionInputs, std::vector<bool>& newFiles) const;
+        void buildBinningGroups();
+        BinTree* groupBinning(Template* tmp, std::vector<TH1*>& widths, TH1* gridConstraint) const;
+        const EntryOrdering* entryOrdering(const Template* tmp, BinTree& bintree);
+        bool entryIndexMap(const Template* ref, const Template* tmp, std::vector<int>& refToTmp) const;
+        std::string entryOrderingKey(const Template* tmp) const;
+        void releaseEntryOrdering(const Template* tmp);
 
         std::map<std::string, Template*> m_templates;
+        // Sorted entries shared between templates with the same coordinates
+        std::map<std::string, EntryOrdering*> m_entryOrderings;
+        std::map<std::string, const Template*> m_entryOrderingReferences;
+        // Templates which don't need their sorted entries anymore
+        std::set<const Template*> m_entryOrderingReleased;
+        std::mutex m_entryOrderingMutex;
+        // Adaptive binnings (without entries) and width maps shared by the templates of a binning group
+        std::map<std::string, BinTree*> m_groupPartitions;
+        std::map<std::string, std::vector<TH1*> > m_groupWidths;
+        // Templates of a binning group smoothed together, before the rest of their postprocessing
+        std::map<const Template*, TH1*> m_groupSmoothedTemplates;
 };
 
 
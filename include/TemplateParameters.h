@@ -32,13 +32,14 @@ namespace Json
 class TemplateParameters
 {
     public:
-        TemplateParameters(){};
+        TemplateParameters():m_nThreads(1){};
         ~TemplateParameters(){};
 
         void read(const std::string& parFile);
 
         const std::string& inputDirectory() const {return m_inputDirectory;}
         const std::string& outputFileName() const {return m_outputFileName;}
+        unsigned int nThreads() const {return m_nThreads;}
         std::vector<Template*>::iterator templateBegin() {return m_templates.begin();}
         std::vector<Template*>::iterator templateEnd() {return m_templates.end();}
 
@@ -52,6 +53,7 @@ class TemplateParameters
 
         std::string m_inputDirectory;
         std::string m_outputFileName;
+        unsigned int m_nThreads;
         std::vector<Template*> m_templates;
 
 
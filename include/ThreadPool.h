@@ -0,0 +1,50 @@
+
+
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+class ThreadPool
+{
+    /* Pool of worker threads executing independent tasks.
+    parallelFor() distributes tasks 0..n-1 between the workers and the calling thread, and returns when all of them are done.
+    Calls made from inside a task, or while the pool is busy, are executed serially in the calling thread.
+    */
+    public:
+        ThreadPool(unsigned int nthreads=1);
+        ~ThreadPool();
+
+        static ThreadPool& global();
+
+        void setNThreads(unsigned int nthreads);
+        unsigned int nThreads() const {return m_nthreads;}
+        void parallelFor(unsigned int ntasks, const std::function<void(unsigned int)>& task);
+
+    private:
+        void startWorkers();
+        void stopWorkers();
+        void work();
+        void runTasks();
+
+        unsigned int m_nthreads;
+        std::vector<std::thread> m_workers;
+        std::mutex m_mutex;
+        std::condition_variable m_wakeUp;
+        std::condition_variable m_done;
+        const std::function<void(unsigned int)>* m_task;
+        unsigned int m_ntasks;
+        unsigned int m_nextTask;
+        unsigned int m_runningTasks;
+        std::exception_ptr m_exception;
+        bool m_stop;
+};
+
+
+#endif
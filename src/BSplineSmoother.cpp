@@ -0,0 +1,387 @@
+
+
+
+
+#include "BSplineSmoother.h"
+#include "ThreadPool.h"
+
+#include "TH2F.h"
+#include "TH3F.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+const double BSplineSmoother::s_tolerance = 1.e-6;
+
+
+/*****************************************************************/
+BSplineSmoother::BSplineSmoother(unsigned int ndim):
+    m_ndim(ndim),
+    m_knots(0),
+    m_penalty(1.),
+    m_scaledPenalty(0.),
+    m_verbose(true)
+/*****************************************************************/
+{
+}
+
+
+/*****************************************************************/
+void BSplineSmoother::applyBasis(const vector<double>& in, vector<double>& out, bool transpose, bool squared) const
+/*****************************************************************/
+{
+    // Product with the basis (coefficients -> bin centers), or its transpose (bin centers -> coefficients),
+    // applied one axis at a time. Arrays have the last axis running fastest.
+    // With 'squared', the squared basis values are used
+    vector<int> dims = (transpose ? m_nbins : m_ncoefficients);
+    vector<double> current(in);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        const Basis& basis = m_bases[axis];
+        int nbins = m_nbins[axis];
+        int ncoefficients = m_ncoefficients[axis];
+        unsigned int outer = 1;
+        unsigned int inner = 1;
+        for(unsigned int a=0;a<axis;a++) outer *= dims[a];
+        for(unsigned int a=axis+1;a<m_ndim;a++) inner *= dims[a];
+        dims[axis] = (transpose ? ncoefficients : nbins);
+        int nin = (transpose ? nbins : ncoefficients);
+        int nout = dims[axis];
+        vector<double> next(outer*nout*inner, 0.);
+        // Tasks are made of blocks of lines along the axis, which write to different parts of the output
+        unsigned int innerTile = min(inner, 256u);
+        unsigned int ninnerTiles = (inner+innerTile-1)/innerTile;
+        unsigned int outerTile = max(1u, 256u/innerTile);
+        unsigned int nouterTiles = (outer+outerTile-1)/outerTile;
+        ThreadPool::global().parallelFor(nouterTiles*ninnerTiles, [&](unsigned int task)
+        {
+            unsigned int firstOuter = (task/ninnerTiles)*outerTile;
+            unsigned int lastOuter = min(firstOuter+outerTile, outer);
+            unsigned int firstInner = (task%ninnerTiles)*innerTile;
+            unsigned int lastInner = min(firstInner+innerTile, inner);
+            for(unsigned int o=firstOuter;o<lastOuter;o++)
+            {
+                for(int b=0;b<nbins;b++)
+                {
+                    for(int k=0;k<4;k++)
+                    {
+                        double value = basis.values[4*b+k];
+                        if(squared) value *= value;
+                        int c = basis.first[b]+k;
+                        const double* src = &current[((size_t)o*nin+(transpose ? b : c))*inner];
+                        double* dst = &next[((size_t)o*nout+(transpose ? c : b))*inner];
+                        for(unsigned int i=firstInner;i<lastInner;i++) dst[i] += value*src[i];
+                    }
+                }
+            }
+        });
+        current.swap(next);
+    }
+    out.swap(current);
+}
+
+
+/*****************************************************************/
+void BSplineSmoother::applyPenalty(const vector<double>& in, vector<double>& out) const
+/*****************************************************************/
+{
+    // Sum over the axes of D^T.D, with D the second differences of the coefficients along the axis
+    out.assign(in.size(), 0.);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        int n = m_ncoefficients[axis];
+        unsigned int outer = 1;
+        unsigned int inner = 1;
+        for(unsigned int a=0;a<axis;a++) outer *= m_ncoefficients[a];
+        for(unsigned int a=axis+1;a<m_ndim;a++) inner *= m_ncoefficients[a];
+        for(unsigned int o=0;o<outer;o++)
+        {
+            for(unsigned int i=0;i<inner;i++)
+            {
+                size_t offset = (size_t)o*n*inner+i;
+                for(int r=0;r<n-2;r++)
+                {
+                    double d = in[offset+r*inner]-2.*in[offset+(r+1)*inner]+in[offset+(r+2)*inner];
+                    out[offset+r*inner] += d;
+                    out[offset+(r+1)*inner] -= 2.*d;
+                    out[offset+(r+2)*inner] += d;
+                }
+            }
+        }
+    }
+}
+
+
+/*****************************************************************/
+void BSplineSmoother::penaltyDiagonal(vector<double>& diagonal) const
+/*****************************************************************/
+{
+    diagonal.assign(m_coefficients.size(), 0.);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        int n = m_ncoefficients[axis];
+        vector<double> axisDiagonal(n, 0.);
+        for(int r=0;r<n-2;r++)
+        {
+            axisDiagonal[r] += 1.;
+            axisDiagonal[r+1] += 4.;
+            axisDiagonal[r+2] += 1.;
+        }
+        unsigned int inner = 1;
+        for(unsigned int a=axis+1;a<m_ndim;a++) inner *= m_ncoefficients[a];
+        for(unsigned int c=0;c<diagonal.size();c++) diagonal[c] += axisDiagonal[(c/inner)%n];
+    }
+}
+
+
+/*****************************************************************/
+void BSplineSmoother::applyNormalMatrix(const vector<double>& in, vector<double>& out) const
+/*****************************************************************/
+{
+    // (B^T.W.B + penalty).in
+    vector<double> binValues;
+    applyBasis(in, binValues, false, false);
+    for(unsigned int bin=0;bin<binValues.size();bin++) binValues[bin] *= m_binWeights[bin];
+    applyBasis(binValues, out, true, false);
+    vector<double> penalty;
+    applyPenalty(in, penalty);
+    for(unsigned int c=0;c<out.size();c++) out[c] += m_scaledPenalty*penalty[c];
+}
+
+
+/*****************************************************************/
+void BSplineSmoother::fit(const vector<double>& contents, vector<double>& diagonal)
+/*****************************************************************/
+{
+    // Fit of the coefficients with the current bin weights. 'diagonal' is filled with the diagonal of the normal matrix
+    unsigned int ncoefficients = 1;
+    for(unsigned int axis=0;axis<m_ndim;axis++) ncoefficients *= m_ncoefficients[axis];
+    // The penalty is given relative to the mean diagonal element of B^T.W.B, such that
+    // it doesn't depend on the normalization of the template
+    vector<double> fitDiagonal;
+    applyBasis(m_binWeights, fitDiagonal, true, true);
+    double meanDiagonal = 0.;
+    for(unsigned int c=0;c<ncoefficients;c++) meanDiagonal += fitDiagonal[c];
+    meanDiagonal /= (double)ncoefficients;
+    m_scaledPenalty = m_penalty*meanDiagonal;
+    m_coefficients.assign(ncoefficients, 0.);
+    penaltyDiagonal(diagonal);
+    for(unsigned int c=0;c<ncoefficients;c++)
+    {
+        diagonal[c] = fitDiagonal[c]+m_scaledPenalty*diagonal[c];
+        if(diagonal[c]<=0.) diagonal[c] = meanDiagonal;
+    }
+    // Preconditioned (Jacobi) conjugate gradient on (B^T.W.B + penalty).c = B^T.W.y
+    unsigned int nbins = contents.size();
+    vector<double> weightedContents(nbins);
+    for(unsigned int bin=0;bin<nbins;bin++) weightedContents[bin] = m_binWeights[bin]*contents[bin];
+    vector<double> residual;
+    applyBasis(weightedContents, residual, true, false);
+    double norm2 = 0.;
+    for(unsigned int c=0;c<ncoefficients;c++) norm2 += residual[c]*residual[c];
+    vector<double> z(ncoefficients);
+    vector<double> direction(ncoefficients);
+    vector<double> product;
+    double rz = 0.;
+    for(unsigned int c=0;c<ncoefficients;c++)
+    {
+        z[c] = residual[c]/diagonal[c];
+        direction[c] = z[c];
+        rz += residual[c]*z[c];
+    }
+    unsigned int iteration = 0;
+    double residual2 = norm2;
+    while(iteration<s_maxIterations && residual2>s_tolerance*s_tolerance*norm2)
+    {
+        applyNormalMatrix(direction, product);
+        double pAp = 0.;
+        for(unsigned int c=0;c<ncoefficients;c++) pAp += direction[c]*product[c];
+        if(pAp<=0.) break;
+        double alpha = rz/pAp;
+        residual2 = 0.;
+        for(unsigned int c=0;c<ncoefficients;c++)
+        {
+            m_coefficients[c] += alpha*direction[c];
+            residual[c] -= alpha*product[c];
+            residual2 += residual[c]*residual[c];
+        }
+        double rzNew = 0.;
+        for(unsigned int c=0;c<ncoefficients;c++)
+        {
+            z[c] = residual[c]/diagonal[c];
+            rzNew += residual[c]*z[c];
+        }
+        for(unsigned int c=0;c<ncoefficients;c++) direction[c] = z[c]+rzNew/rz*direction[c];
+        rz = rzNew;
+        iteration++;
+    }
+    if(m_verbose) cout<<"[INFO]   Conjugate gradient converged in "<<iteration<<" iterations (relative residual "<<(norm2>0. ? sqrt(residual2/norm2) : 0.)<<")\n";
+    if(iteration==s_maxIterations)
+    {
+        cout<<"[WARN]   Maximum number of iterations reached\n";
+    }
+}
+
+
+/*****************************************************************/
+TH1* BSplineSmoother::smooth(const TH1* histo)
+/*****************************************************************/
+{
+    if(m_ndim!=2 && m_ndim!=3)
+    {
+        stringstream error;
+        error << "BSplineSmoother::smooth(): Histograms can only be smoothed in 2D or 3D";
+        throw runtime_error(error.str());
+    }
+    vector<const TAxis*> axes;
+    axes.push_back(histo->GetXaxis());
+    axes.push_back(histo->GetYaxis());
+    if(m_ndim==3) axes.push_back(histo->GetZaxis());
+    // Cubic basis on uniform knots. By default there is one knot every 4 bins
+    m_bases.resize(m_ndim);
+    m_nbins.resize(m_ndim);
+    m_ncoefficients.resize(m_ndim);
+    unsigned int ncoefficients = 1;
+    unsigned int nbins = 1;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        Basis& basis = m_bases[axis];
+        int n = axes[axis]->GetNbins();
+        int knots = (m_knots>0 ? (int)m_knots : max(n/4, 4));
+        m_nbins[axis] = n;
+        m_ncoefficients[axis] = knots+3;
+        basis.min = axes[axis]->GetXmin();
+        basis.spacing = (axes[axis]->GetXmax()-axes[axis]->GetXmin())/(double)knots;
+        basis.first.resize(n);
+        basis.values.resize(4*n);
+        for(int b=0;b<n;b++)
+        {
+            double t = (axes[axis]->GetBinCenter(b+1)-basis.min)/basis.spacing;
+            int cell = min(max((int)floor(t), 0), knots-1);
+            double u = t-(double)cell;
+            basis.first[b] = cell;
+            basis.values[4*b] = (1.-u)*(1.-u)*(1.-u)/6.;
+            basis.values[4*b+1] = (3.*u*u*u-6.*u*u+4.)/6.;
+            basis.values[4*b+2] = (-3.*u*u*u+3.*u*u+3.*u+1.)/6.;
+            basis.values[4*b+3] = u*u*u/6.;
+        }
+        ncoefficients *= m_ncoefficients[axis];
+        nbins *= n;
+    }
+    if(m_verbose) cout<<"[INFO]   Fitting "<<ncoefficients<<" B-spline coefficients\n";
+    vector<double> contents(nbins);
+    vector<double> errors(nbins);
+    unsigned int bin = 0;
+    for(int bx=1;bx<=m_nbins[0];bx++)
+    {
+        for(int by=1;by<=m_nbins[1];by++)
+        {
+            for(int bz=1;bz<=(m_ndim==3 ? m_nbins[2] : 1);bz++)
+            {
+                int histoBin = (m_ndim==2 ? histo->GetBin(bx, by) : histo->GetBin(bx, by, bz));
+                contents[bin] = histo->GetBinContent(histoBin);
+                errors[bin] = histo->GetBinError(histoBin);
+                bin++;
+            }
+        }
+    }
+    // Weighting bins by their own squared errors would bias the fit low, since bins fluctuating down get larger weights.
+    // A first unweighted fit gives the expected contents, and the variances used in the final fit are these
+    // expected contents times the variance per unit of content of each bin (the mean event weight).
+    // Empty bins take the mean over the template, and variances are not allowed to be smaller than the smallest squared error
+    double sumContents = 0.;
+    double sumErrors2 = 0.;
+    double minVariance = 0.;
+    for(bin=0;bin<nbins;bin++)
+    {
+        if(contents[bin]<=0. || errors[bin]<=0.) continue;
+        sumContents += contents[bin];
+        sumErrors2 += errors[bin]*errors[bin];
+        if(minVariance==0. || errors[bin]*errors[bin]<minVariance) minVariance = errors[bin]*errors[bin];
+    }
+    double meanVariancePerContent = (sumContents>0. ? sumErrors2/sumContents : 1.);
+    if(minVariance==0.) minVariance = meanVariancePerContent;
+    vector<double> diagonal;
+    m_binWeights.assign(nbins, 1.);
+    fit(contents, diagonal);
+    vector<double> values;
+    applyBasis(m_coefficients, values, false, false);
+    for(bin=0;bin<nbins;bin++)
+    {
+        double variancePerContent = (contents[bin]>0. && errors[bin]>0. ? errors[bin]*errors[bin]/contents[bin] : meanVariancePerContent);
+        m_binWeights[bin] = 1./max(variancePerContent*values[bin], minVariance);
+    }
+    fit(contents, diagonal);
+    // Errors are approximated by neglecting the correlations between coefficients:
+    // the variance of each coefficient is taken as the inverse of the diagonal of the normal matrix
+    applyBasis(m_coefficients, values, false, false);
+    vector<double> variances(ncoefficients);
+    for(unsigned int c=0;c<ncoefficients;c++) variances[c] = 1./diagonal[c];
+    vector<double> valueVariances;
+    applyBasis(variances, valueVariances, false, true);
+    stringstream hName;
+    hName << histo->GetName() << "_smooth";
+    TH1* smoothedHisto = dynamic_cast<TH1*>(histo->Clone(hName.str().c_str()));
+    smoothedHisto->SetDirectory(0);
+    bin = 0;
+    for(int bx=1;bx<=m_nbins[0];bx++)
+    {
+        for(int by=1;by<=m_nbins[1];by++)
+        {
+            for(int bz=1;bz<=(m_ndim==3 ? m_nbins[2] : 1);bz++)
+            {
+                int histoBin = (m_ndim==2 ? smoothedHisto->GetBin(bx, by) : smoothedHisto->GetBin(bx, by, bz));
+                // The spline can undershoot next to steep edges
+                smoothedHisto->SetBinContent(histoBin, max(values[bin], 0.));
+                smoothedHisto->SetBinError(histoBin, sqrt(valueVariances[bin]));
+                bin++;
+            }
+        }
+    }
+    return smoothedHisto;
+}
+
+
+/*****************************************************************/
+TH1* BSplineSmoother::coefficientHistogram(const string& name) const
+/*****************************************************************/
+{
+    // Coefficient i along an axis is stored in bin i+1, centered on its basis function
+    if(m_coefficients.empty())
+    {
+        stringstream error;
+        error << "BSplineSmoother::coefficientHistogram(): No fitted coefficients";
+        throw runtime_error(error.str());
+    }
+    vector<double> low(m_ndim);
+    vector<double> high(m_ndim);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        low[axis] = m_bases[axis].min-1.5*m_bases[axis].spacing;
+        high[axis] = low[axis]+(double)m_ncoefficients[axis]*m_bases[axis].spacing;
+    }
+    TH1* histo = NULL;
+    if(m_ndim==2) histo = new TH2F(name.c_str(), name.c_str(), m_ncoefficients[0], low[0], high[0], m_ncoefficients[1], low[1], high[1]);
+    else histo = new TH3F(name.c_str(), name.c_str(), m_ncoefficients[0], low[0], high[0], m_ncoefficients[1], low[1], high[1], m_ncoefficients[2], low[2], high[2]);
+    histo->SetDirectory(0);
+    unsigned int c = 0;
+    for(int cx=1;cx<=m_ncoefficients[0];cx++)
+    {
+        for(int cy=1;cy<=m_ncoefficients[1];cy++)
+        {
+            for(int cz=1;cz<=(m_ndim==3 ? m_ncoefficients[2] : 1);cz++)
+            {
+                int histoBin = (m_ndim==2 ? histo->GetBin(cx, cy) : histo->GetBin(cx, cy, cz));
+                histo->SetBinContent(histoBin, m_coefficients[c]);
+                c++;
+            }
+        }
+    }
+    return histo;
+}
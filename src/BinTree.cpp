@@ -1,7 +1,12 @@
 #include "BinTree.h"
+#include "GridND.h"
+#include "RadixSort.h"
+#include "ThreadPool.h"
 
 #include "TAxis.h"
 #include "TH3F.h"
+#include "TVectorD.h"
+#include "TDirectory.h"
 
 #include <iostream>
 #include <sstream>
@@ -35,7 +40,11 @@ EntryList::EntryList(int ndim):
     m_ndim(ndim),
     m_maxWeight(0.),
     m_sumOfWeights(0.),
-    m_sumOfWeightsError(0.)
+    m_sumOfWeightsError(0.),
+    m_totalSize(0.),
+    m_storedSize(0.),
+    m_storedSumOfWeights(0.),
+    m_storedSumOfWeights2(0.)
 /*****************************************************************/
 {
     m_sortedValues.resize(ndim);
@@ -65,6 +74,21 @@ unsigned int EntryList::size() const
     return m_weights.size();
 }
 
+/*****************************************************************/
+double EntryList::totalSize() const
+/*****************************************************************/
+{
+    // Number of entries including the stored ones. It is kept when the entries are cleared
+    return m_totalSize;
+}
+
+/*****************************************************************/
+unsigned int EntryList::dimension() const
+/*****************************************************************/
+{
+    return m_ndim;
+}
+
 /*****************************************************************/
 unsigned int EntryList::effectiveSize() const
 /*****************************************************************/
@@ -75,6 +99,32 @@ unsigned int EntryList::effectiveSize() const
     return (unsigned int)effNEntries;
 }
 
+/*****************************************************************/
+double EntryList::effectiveSize(double sumw, double sumw2, unsigned int nentries) const
+/*****************************************************************/
+{
+    // Effective number of entries of a part of the list, given the sums over its entries in memory.
+    // The part also receives its share of the stored entries
+    double fraction = storedFraction(sumw, nentries);
+    double w = sumw + fraction*m_storedSumOfWeights;
+    double w2 = sumw2 + fraction*m_storedSumOfWeights2;
+    return (w2>0. ? w*w/w2 : 0.);
+}
+
+/*****************************************************************/
+double EntryList::storedFraction(double sumw, unsigned int nentries) const
+/*****************************************************************/
+{
+    // The positions of the stored entries are unknown. They are assumed to be distributed
+    // like the entries in memory, so a part of the list receives the same fraction of them
+    if(!hasStoredEntries()) return 0.;
+    double memorySumOfWeights = m_sumOfWeights-m_storedSumOfWeights;
+    double fraction = 0.5;
+    if(memorySumOfWeights>0.) fraction = sumw/memorySumOfWeights;
+    else if(size()>0) fraction = (double)nentries/(double)size();
+    return max(0., min(1., fraction));
+}
+
 
 /*****************************************************************/
 double EntryList::sumOfWeights() const
@@ -118,10 +168,59 @@ void EntryList::sort()
 /*****************************************************************/
 {
     int nentries = m_weights.size();
+    // Large lists are sorted one axis after the other with all threads working on each axis,
+    // intermediate ones have their axes sorted in parallel, and small ones are sorted serially
+    bool parallelChunks = (nentries>=(int)RadixSorter::s_minParallelSize);
+    bool parallelAxes = (!parallelChunks && nentries>=s_minParallelAxesSize);
+    auto sortAxis = [&](unsigned int d)
+    {
+        // sort values in this dimension
+        RadixSorter::local().sort(m_sortedValues[d], parallelChunks);
+        // then compute the map of sorted positions
+        for(int e=0; e<nentries; e++)
+        {
+            int pos = m_sortedValues[d][e].second;
+            m_sortedPositions[pos][d] = e;
+        }
+    };
+    if(parallelAxes)
+    {
+        ThreadPool::global().parallelFor(m_ndim, sortAxis);
+    }
+    else
+    {
+        for(unsigned int d=0;d<m_ndim; d++) sortAxis(d);
+    }
+    computeSumOfWeights();
+}
+
+/*****************************************************************/
+void EntryList::sort(const EntryOrdering& ordering)
+/*****************************************************************/
+{
+    int nentries = m_weights.size();
+    if(ordering.dimension()!=m_ndim || ordering.size()!=m_weights.size())
+    {
+        stringstream error;
+        error << "EntryList::sort(): Entry ordering ("<<ordering.dimension()<<"D, "<<ordering.size()<<" entries) doesn't match the entry list ("<<m_ndim<<"D, "<<nentries<<" entries)";
+        throw runtime_error(error.str());
+    }
     for(unsigned int d=0;d<m_ndim; d++)
     {
-        // sort values in each dimension
-        std::sort(m_sortedValues[d].begin(), m_sortedValues[d].end(), pair_comp());
+        // reorder values in each dimension with the precomputed ordering
+        const vector<int>& order = ordering.order(d);
+        vector< pair<double,int> > sortedValues(nentries);
+        for(int e=0; e<nentries; e++)
+        {
+            int index = order[e];
+            sortedValues[e] = m_sortedValues[d][m_sortedPositions[index][d]];
+            // protection against an ordering computed for other coordinates
+            if(e>0 && sortedValues[e].first<sortedValues[e-1].first)
+            {
+                throw runtime_error("EntryList::sort(): Entry ordering doesn't sort the entry list");
+            }
+        }
+        m_sortedValues[d].swap(sortedValues);
         // then compute the map of sorted positions
         for(int e=0; e<nentries; e++)
         {
@@ -129,9 +228,40 @@ void EntryList::sort()
             m_sortedPositions[pos][d] = e;
         }
     }
+    computeSumOfWeights();
+}
+
+/*****************************************************************/
+void EntryList::clear()
+/*****************************************************************/
+{
+    // Free the memory used by the entries. Sums of weights and number of entries are kept
+    for(unsigned int d=0;d<m_ndim; d++)
+    {
+        vector< pair<double,int> >().swap(m_sortedValues[d]);
+    }
+    vector< vector<int> >().swap(m_sortedPositions);
+    vector<double>().swap(m_weights);
+}
+
+/*****************************************************************/
+void EntryList::setStoredEntries(double nentries, double sumw, double sumw2)
+/*****************************************************************/
+{
+    m_storedSize = nentries;
+    m_storedSumOfWeights = sumw;
+    m_storedSumOfWeights2 = sumw2;
+    computeSumOfWeights();
+}
+
+/*****************************************************************/
+void EntryList::computeSumOfWeights()
+/*****************************************************************/
+{
     // compute sum of weights, sum of weight stat. uncertainty and maximum weight
-    double sumw = 0.;
-    double sumw2 = 0.;
+    // The stored entries contribute to the sums, not to the maximum weight
+    double sumw = m_storedSumOfWeights;
+    double sumw2 = m_storedSumOfWeights2;
     double maxw = 0.;
     for(unsigned int e=0; e<m_weights.size();e++)
     {
@@ -142,6 +272,7 @@ void EntryList::sort()
     m_sumOfWeights = sumw;
     m_maxWeight = maxw;
     m_sumOfWeightsError = sqrt(sumw2);
+    m_totalSize = m_storedSize+m_weights.size();
 }
 
 /*****************************************************************/
@@ -177,6 +308,13 @@ std::pair<EntryList, EntryList> EntryList::split(unsigned int axis, double cut)
     // The dimension of the cut is already sorted but not the others. So sort the two sub lists.
     leftList.sort();
     rightList.sort();
+    // Stored entries are shared between the two sides
+    if(hasStoredEntries())
+    {
+        double fraction = storedFraction(leftList.sumOfWeights(), leftList.size());
+        leftList.setStoredEntries(fraction*m_storedSize, fraction*m_storedSumOfWeights, fraction*m_storedSumOfWeights2);
+        rightList.setStoredEntries((1.-fraction)*m_storedSize, (1.-fraction)*m_storedSumOfWeights, (1.-fraction)*m_storedSumOfWeights2);
+    }
     return make_pair(leftList, rightList);
 
 }
@@ -214,6 +352,30 @@ std::vector<double> EntryList::percentiles(const std::vector<double>& qs, unsign
     return ps;
 }
 
+/*****************************************************************/
+double EntryList::weightedMedian(unsigned int axis) const
+/*****************************************************************/
+{
+    // Value of the first sorted entry where the cumulative weight goes above half of the sum of weights.
+    // Entries from this one go to the upper side of a cut at this value. With equal weights this is the (unweighted) 50% percentile.
+    // Falls back to the unweighted median if the sum of weights is not positive
+    if(m_sumOfWeights<=0.)
+    {
+        vector<double> perc50;
+        perc50.push_back(50.);
+        return percentiles(perc50, axis)[0];
+    }
+    const vector< pair<double,int> >& values = m_sortedValues[axis];
+    double half = m_sumOfWeights/2.;
+    double sumw = 0.;
+    for(unsigned int i=0;i<values.size();i++)
+    {
+        sumw += m_weights[values[i].second];
+        if(sumw>half) return values[i].first;
+    }
+    return values.back().first;
+}
+
 /*****************************************************************/
 double EntryList::densityGradient(unsigned int axis, double q) const
 /*****************************************************************/
@@ -268,6 +430,57 @@ void EntryList::print()
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////////////////
+
+/*****************************************************************/
+EntryOrdering::EntryOrdering(const EntryList& entries)
+/*****************************************************************/
+{
+    int nentries = entries.size();
+    m_order.resize(entries.dimension());
+    for(unsigned int d=0;d<entries.dimension();d++)
+    {
+        vector< pair<double,int> > values(nentries);
+        for(int e=0; e<nentries; e++)
+        {
+            values[e] = make_pair(entries.value(d,e), e);
+        }
+        RadixSorter::local().sort(values, true);
+        m_order[d].resize(nentries);
+        for(int e=0; e<nentries; e++)
+        {
+            m_order[d][e] = values[e].second;
+        }
+    }
+}
+
+/*****************************************************************/
+EntryOrdering::EntryOrdering(const EntryOrdering& ordering, const std::vector<int>& indexMap)
+/*****************************************************************/
+{
+    // Same ordering for a permutation of the entries: entry i becomes entry indexMap[i]
+    m_order.resize(ordering.dimension());
+    for(unsigned int d=0;d<ordering.dimension();d++)
+    {
+        const vector<int>& order = ordering.order(d);
+        m_order[d].resize(order.size());
+        for(unsigned int e=0; e<order.size(); e++)
+        {
+            m_order[d][e] = indexMap[order[e]];
+        }
+    }
+}
+
+/*****************************************************************/
+unsigned int EntryOrdering::size() const
+/*****************************************************************/
+{
+    return (m_order.size()>0 ? m_order[0].size() : 0);
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////////////////
@@ -284,13 +497,6 @@ BinLeaf::BinLeaf():
     m_binBoundaries.push_back(make_pair(0.,1.));
 }
 
-/*****************************************************************/
-BinLeaf::~BinLeaf()
-/*****************************************************************/
-{
-    
-}
-
 /*****************************************************************/
 BinLeaf::BinLeaf(const std::vector< std::pair<double,double> >& minmax):
     m_ndim(minmax.size()),
@@ -328,20 +534,20 @@ void BinLeaf::setBinBoundaries(const std::vector< std::pair<double,double> >& mi
 }
 
 /*****************************************************************/
-const std::vector< std::pair<double,double> >& BinLeaf::getBinBoundaries()
+const std::vector< std::pair<double,double> >& BinLeaf::getBinBoundaries() const
 /*****************************************************************/
 {
     return m_binBoundaries;
 }
 /*****************************************************************/
-double BinLeaf::getMin(int axis)
+double BinLeaf::getMin(int axis) const
 /*****************************************************************/
 {
     return m_binBoundaries[axis].first;
 }
 
 /*****************************************************************/
-double BinLeaf::getMax(int axis)
+double BinLeaf::getMax(int axis) const
 /*****************************************************************/
 {
     return m_binBoundaries[axis].second;
@@ -349,7 +555,7 @@ double BinLeaf::getMax(int axis)
 
 
 /*****************************************************************/
-double BinLeaf::getWidth(int axis)
+double BinLeaf::getWidth(int axis) const
 /*****************************************************************/
 {
     return (getMax(axis)-getMin(axis));
@@ -357,7 +563,7 @@ double BinLeaf::getWidth(int axis)
 
 
 /*****************************************************************/
-double BinLeaf::getCenter(int axis)
+double BinLeaf::getCenter(int axis) const
 /*****************************************************************/
 {
     return (getMax(axis)+getMin(axis))/2.;
@@ -366,7 +572,7 @@ double BinLeaf::getCenter(int axis)
 
 
 /*****************************************************************/
-bool BinLeaf::isNeighbor(BinLeaf* leaf) 
+bool BinLeaf::isNeighbor(const BinLeaf* leaf) const
 /*****************************************************************/
 {
     bool neighbor = false;
@@ -400,28 +606,28 @@ bool BinLeaf::isNeighbor(BinLeaf* leaf)
 
 
 /*****************************************************************/
-unsigned int BinLeaf::getNEntries()
+unsigned int BinLeaf::getNEntries() const
 /*****************************************************************/
 {
     return m_entryList.size();
 }
 
 /*****************************************************************/
-unsigned int BinLeaf::effectiveNEntries()
+unsigned int BinLeaf::effectiveNEntries() const
 /*****************************************************************/
 {
     return m_entryList.effectiveSize();
 }
 
 /*****************************************************************/
-double BinLeaf::getSumOfWeights()
+double BinLeaf::getSumOfWeights() const
 /*****************************************************************/
 {
     return m_entryList.sumOfWeights();
 }
 
 /*****************************************************************/
-const EntryList& BinLeaf::getEntries()
+const EntryList& BinLeaf::getEntries() const
 /*****************************************************************/
 {
     return m_entryList;
@@ -442,14 +648,14 @@ const EntryList& BinLeaf::getEntries()
 //}
 
 /*****************************************************************/
-std::vector<double> BinLeaf::percentiles(const std::vector<double>& q, unsigned int axis)
+std::vector<double> BinLeaf::percentiles(const std::vector<double>& q, unsigned int axis) const
 /*****************************************************************/
 {
     return m_entryList.percentiles(q, axis);
 }
 
 /*****************************************************************/
-double BinLeaf::densityGradient(unsigned int axis, double q)
+double BinLeaf::densityGradient(unsigned int axis, double q) const
 /*****************************************************************/
 {
     return m_entryList.densityGradient(axis,q);
@@ -457,7 +663,7 @@ double BinLeaf::densityGradient(unsigned int axis, double q)
 
 
 /*****************************************************************/
-bool BinLeaf::inBin(const std::vector<double>& xs)
+bool BinLeaf::inBin(const std::vector<double>& xs) const
 /*****************************************************************/
 {
     if(xs.size()!=m_ndim)
@@ -507,7 +713,28 @@ void BinLeaf::sortEntries()
 }
 
 /*****************************************************************/
-std::vector<TLine*> BinLeaf::getBoundaryTLines()
+void BinLeaf::sortEntries(const EntryOrdering& ordering)
+/*****************************************************************/
+{
+    m_entryList.sort(ordering);
+}
+
+/*****************************************************************/
+void BinLeaf::clearEntries()
+/*****************************************************************/
+{
+    m_entryList.clear();
+}
+
+/*****************************************************************/
+void BinLeaf::setStoredEntries(double nentries, double sumw, double sumw2)
+/*****************************************************************/
+{
+    m_entryList.setStoredEntries(nentries, sumw, sumw2);
+}
+
+/*****************************************************************/
+std::vector<TLine*> BinLeaf::getBoundaryTLines() const
 /*****************************************************************/
 {
     vector<TLine*> lines;
@@ -533,26 +760,26 @@ std::vector<TLine*> BinLeaf::getBoundaryTLines()
 
 
 /*****************************************************************/
-BinTree::BinTree(const std::vector< std::pair<double,double> >& minmax, const std::vector< std::vector<double> >& entries, const std::vector< double >& weights)
-/*****************************************************************/
-{
-    m_treeSons.push_back(NULL);
-    m_treeSons.push_back(NULL);
-    m_cutAxis = 0;
-    m_cut = 0.;
-    m_leaf = new BinLeaf(minmax);
+BinTree::BinTree(const std::vector< std::pair<double,double> >& minmax, const std::vector< std::vector<double> >& entries, const std::vector< double >& weights):
+    m_ndim(minmax.size()),
+    m_boundaries(minmax),
+    m_minLeafEntries(200),
+    m_maxAxisAsymmetry(2.),
+    m_maxBuildSeconds(0.),
+    m_multiAxisSplit(false),
+    m_splitCriterion(GRADIENT),
+    m_gridConstraint(NULL),
+    m_gridConstraintND(NULL),
+    m_verbose(true)
+/*****************************************************************/
+{
+    // The tree starts with one terminal node containing all the entries
+    m_leaves.push_back(BinLeaf(minmax));
     for(unsigned int e=0;e<entries.size();e++)
     {
-        m_leaf->addEntry(entries[e], weights[e]);
+        m_leaves[0].addEntry(entries[e], weights[e]);
     }
-    m_ndim = minmax.size();
-    for(unsigned int axis=0;axis<m_ndim;axis++)
-    {
-        m_vetoSplit.push_back(false);
-    }
-    m_minLeafEntries = 200;
-    m_maxAxisAsymmetry = 2.;
-    m_gridConstraint = NULL;
+    m_leafNodes.push_back(addNode(0));
 }
 
 /*****************************************************************/
@@ -564,16 +791,141 @@ BinTree::~BinTree()
     //    m_gridConstraint->Delete();
     //    m_gridConstraint = NULL;
     //}
-    if(m_leaf)
+}
+
+/*****************************************************************/
+BinTree* BinTree::read(TDirectory* dir)
+/*****************************************************************/
+{
+    // See write() for the format of the stored vectors
+    TVectorD* binning = dynamic_cast<TVectorD*>(dir->Get("binning"));
+    TVectorD* nodes = dynamic_cast<TVectorD*>(dir->Get("nodes"));
+    TVectorD* leaves = dynamic_cast<TVectorD*>(dir->Get("leaves"));
+    if(!binning || !nodes || !leaves)
     {
-        delete m_leaf;
+        stringstream error;
+        error << "BinTree::read(): Cannot find partition in directory '"<<dir->GetName()<<"'";
+        throw runtime_error(error.str());
     }
-    else
+    unsigned int ndim = (unsigned int)(*binning)[0];
+    // Partitions written before the number of entries was stored have 2*ndim+2 values per leaf.
+    // Their sums of weights are not restored
+    unsigned int nterminal = 0;
+    for(int n=0;n<nodes->GetNrows()/5;n++)
     {
-        delete m_treeSons[0];
-        delete m_treeSons[1];
+        if((*nodes)[5*n+2]>=0) nterminal++;
     }
-    
+    unsigned int leafSize = 2*ndim+3;
+    if(nterminal>0 && (unsigned int)leaves->GetNrows()==nterminal*(2*ndim+2)) leafSize = 2*ndim+2;
+    if(binning->GetNrows()!=(int)(3+2*ndim) || nodes->GetNrows()%5!=0 || leaves->GetNrows()%leafSize!=0)
+    {
+        stringstream error;
+        error << "BinTree::read(): Inconsistent partition stored in directory '"<<dir->GetName()<<"'";
+        throw runtime_error(error.str());
+    }
+    vector< pair<double,double> > minmax;
+    for(unsigned int axis=0;axis<ndim;axis++)
+    {
+        minmax.push_back( make_pair((*binning)[3+2*axis], (*binning)[4+2*axis]) );
+    }
+    vector< vector<double> > noEntries;
+    vector< double > noWeights;
+    BinTree* tree = new BinTree(minmax, noEntries, noWeights);
+    tree->setMinLeafEntries((unsigned int)(*binning)[1]);
+    tree->setMaxAxisAsymmetry((*binning)[2]);
+    tree->m_nodes.clear();
+    tree->m_leaves.clear();
+    unsigned int nleaves = leaves->GetNrows()/leafSize;
+    for(unsigned int l=0;l<nleaves;l++)
+    {
+        vector< pair<double,double> > boundaries;
+        for(unsigned int axis=0;axis<ndim;axis++)
+        {
+            boundaries.push_back( make_pair((*leaves)[l*leafSize+2*axis], (*leaves)[l*leafSize+2*axis+1]) );
+        }
+        tree->m_leaves.push_back(BinLeaf(boundaries));
+        tree->m_leaves.back().setIndex(l);
+        if(leafSize==2*ndim+3)
+        {
+            // The entries are not stored, only their statistics, which are updated when new entries are added
+            double sumw = (*leaves)[l*leafSize+2*ndim];
+            double sumwError = (*leaves)[l*leafSize+2*ndim+1];
+            tree->m_leaves.back().setStoredEntries((*leaves)[l*leafSize+2*ndim+2], sumw, sumwError*sumwError);
+        }
+    }
+    tree->m_leafNodes.assign(nleaves, -1);
+    unsigned int nnodes = nodes->GetNrows()/5;
+    for(unsigned int n=0;n<nnodes;n++)
+    {
+        int node = tree->addNode((int)(*nodes)[5*n+2]);
+        BinNode& binNode = tree->m_nodes[node];
+        binNode.sons[0] = (int)(*nodes)[5*n];
+        binNode.sons[1] = (int)(*nodes)[5*n+1];
+        binNode.cutAxis = (unsigned int)(*nodes)[5*n+3];
+        binNode.cut = (*nodes)[5*n+4];
+        bool valid = (binNode.leaf<0 ? binNode.sons[0]>(int)n && binNode.sons[0]<(int)nnodes && binNode.sons[1]>(int)n && binNode.sons[1]<(int)nnodes && binNode.cutAxis<ndim
+                                     : binNode.leaf<(int)nleaves && tree->m_leafNodes[binNode.leaf]==-1);
+        if(!valid)
+        {
+            delete tree;
+            stringstream error;
+            error << "BinTree::read(): Inconsistent node "<<n<<" in partition stored in directory '"<<dir->GetName()<<"'";
+            throw runtime_error(error.str());
+        }
+        if(binNode.leaf>=0) tree->m_leafNodes[binNode.leaf] = node;
+    }
+    if(nnodes==0 || std::find(tree->m_leafNodes.begin(), tree->m_leafNodes.end(), -1)!=tree->m_leafNodes.end())
+    {
+        delete tree;
+        stringstream error;
+        error << "BinTree::read(): Inconsistent partition stored in directory '"<<dir->GetName()<<"'";
+        throw runtime_error(error.str());
+    }
+    return tree;
+}
+
+/*****************************************************************/
+void BinTree::write(TDirectory* dir) const
+/*****************************************************************/
+{
+    // The partition is stored in three vectors:
+    //  - binning: ndim, minLeafEntries, maxAxisAsymmetry, then (min,max) for each axis
+    //  - nodes: 5 values per node: son1, son2, leaf, cut axis, cut. Sons are -1 for terminal nodes, leaf is -1 for other nodes
+    //  - leaves: 2*ndim+3 values per leaf: (min,max) for each axis, sum of weights, its uncertainty and number of entries
+    TVectorD binning(3+2*m_ndim);
+    binning[0] = m_ndim;
+    binning[1] = m_minLeafEntries;
+    binning[2] = m_maxAxisAsymmetry;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        binning[3+2*axis] = m_boundaries[axis].first;
+        binning[4+2*axis] = m_boundaries[axis].second;
+    }
+    TVectorD nodes(5*m_nodes.size());
+    for(unsigned int n=0;n<m_nodes.size();n++)
+    {
+        nodes[5*n] = m_nodes[n].sons[0];
+        nodes[5*n+1] = m_nodes[n].sons[1];
+        nodes[5*n+2] = m_nodes[n].leaf;
+        nodes[5*n+3] = m_nodes[n].cutAxis;
+        nodes[5*n+4] = m_nodes[n].cut;
+    }
+    unsigned int leafSize = 2*m_ndim+3;
+    TVectorD leaves(leafSize*m_leaves.size());
+    for(unsigned int l=0;l<m_leaves.size();l++)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            leaves[l*leafSize+2*axis] = m_leaves[l].getMin(axis);
+            leaves[l*leafSize+2*axis+1] = m_leaves[l].getMax(axis);
+        }
+        leaves[l*leafSize+2*m_ndim] = m_leaves[l].getSumOfWeights();
+        leaves[l*leafSize+2*m_ndim+1] = m_leaves[l].getEntries().sumOfWeightsError();
+        leaves[l*leafSize+2*m_ndim+2] = m_leaves[l].getEntries().totalSize();
+    }
+    dir->WriteTObject(&binning, "binning");
+    dir->WriteTObject(&nodes, "nodes");
+    dir->WriteTObject(&leaves, "leaves");
 }
 
 void BinTree::setGridConstraint(TH1* gridConstraint) 
@@ -589,101 +941,125 @@ void BinTree::setGridConstraint(TH1* gridConstraint)
 }
 
 /*****************************************************************/
-void BinTree::addEntry(const std::vector<double>& xsi, double wi)
+int BinTree::addNode(int leaf)
 /*****************************************************************/
 {
-    m_leaf->addEntry(xsi, wi);
+    BinNode node;
+    node.sons[0] = -1;
+    node.sons[1] = -1;
+    node.leaf = leaf;
+    node.cutAxis = 0;
+    node.cut = 0.;
+    node.vetoSplit = 0;
+    m_nodes.push_back(node);
+    return m_nodes.size()-1;
 }
 
-
 /*****************************************************************/
-std::vector< std::pair<double,double> > BinTree::getBinBoundaries()
+BinLeaf& BinTree::nodeLeaf(int node)
 /*****************************************************************/
 {
-    if(m_leaf)
+    if(m_nodes[node].leaf<0)
     {
-        return m_leaf->getBinBoundaries();
+        stringstream error;
+        error << "BinTree::nodeLeaf(): Node "<<node<<" is not a terminal node";
+        throw runtime_error(error.str());
     }
-    else
+    return m_leaves[m_nodes[node].leaf];
+}
+
+/*****************************************************************/
+void BinTree::setVetoSplit(int node, unsigned int axis, bool veto)
+/*****************************************************************/
+{
+    if(veto) m_nodes[node].vetoSplit |= (1u<<axis);
+    else m_nodes[node].vetoSplit &= ~(1u<<axis);
+}
+
+/*****************************************************************/
+void BinTree::addEntry(const std::vector<double>& xsi, double wi)
+/*****************************************************************/
+{
+    m_splitCandidates.clear();
+    int leaf = findLeaf(xsi);
+    if(leaf>=0)
     {
-        vector< pair<double, double> > boundaries;
-        for(unsigned int axis=0;axis<m_ndim;axis++)
-        {
-            double min = getMin(axis);
-            double max = getMax(axis);
-            boundaries.push_back(make_pair(min,max));
-        }
-        return boundaries;
+        m_leaves[leaf].addEntry(xsi, wi);
     }
 }
 
+
 /*****************************************************************/
-double BinTree::getMin(int axis)
+void BinTree::addEntries(const std::vector< std::vector<double> >& entries, const std::vector< double >& weights)
 /*****************************************************************/
 {
-    if(m_leaf)
+    // Route entries to their leaves, then update the sums of weights of all leaves
+    for(unsigned int e=0;e<entries.size();e++)
     {
-        return m_leaf->getMin(axis);
+        addEntry(entries[e], weights[e]);
     }
-    else
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        double xmin1 = m_treeSons[0]->getMin(axis);
-        double xmin2 = m_treeSons[1]->getMin(axis);
-        double xmin = min(xmin1,xmin2);
-        return xmin;
+        m_leaves[l].sortEntries();
     }
 }
 
 /*****************************************************************/
-double BinTree::getMax(int axis)
+void BinTree::clearEntries()
 /*****************************************************************/
 {
-    if(m_leaf)
+    // Only the partition and the sums of weights in each leaf are kept
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        return m_leaf->getMax(axis);
+        m_leaves[l].clearEntries();
     }
-    else
+}
+
+/*****************************************************************/
+void BinTree::clearStoredEntries()
+/*****************************************************************/
+{
+    // Forget the statistics restored with a stored partition, before adding again all the entries
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        double xmax1 = m_treeSons[0]->getMax(axis);
-        double xmax2 = m_treeSons[1]->getMax(axis);
-        double xmax = max(xmax1,xmax2);
-        return xmax;
+        m_leaves[l].setStoredEntries(0., 0., 0.);
     }
 }
 
-
-
 /*****************************************************************/
-unsigned int BinTree::getNEntries()
+bool BinTree::hasStoredEntries() const
 /*****************************************************************/
 {
-    if(m_leaf)
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        return m_leaf->getNEntries();
+        if(m_leaves[l].getEntries().hasStoredEntries()) return true;
     }
-    else
+    return false;
+}
+
+/*****************************************************************/
+unsigned int BinTree::getNEntries() const
+/*****************************************************************/
+{
+    unsigned int nentries = 0;
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        unsigned int nentries = m_treeSons[0]->getNEntries();
-        nentries += m_treeSons[1]->getNEntries();
-        return nentries;
+        nentries += m_leaves[l].getNEntries();
     }
+    return nentries;
 }
 
 
 /*****************************************************************/
-double BinTree::getSumOfWeights()
+double BinTree::getSumOfWeights() const
 /*****************************************************************/
 {
-    if(m_leaf)
-    {
-        return m_leaf->getSumOfWeights();
-    }
-    else
+    double sumw = 0.;
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        double sumw = m_treeSons[0]->getSumOfWeights();
-        sumw += m_treeSons[1]->getSumOfWeights();
-        return sumw;
+        sumw += m_leaves[l].getSumOfWeights();
     }
+    return sumw;
 }
 
 
@@ -705,260 +1081,439 @@ double BinTree::getSumOfWeights()
 //}
 
 /*****************************************************************/
-BinLeaf* BinTree::getLeaf(const std::vector<double>& xs)
+int BinTree::findLeaf(const std::vector<double>& xs) const
 /*****************************************************************/
 {
-    if(m_leaf)
-    {
-        if(m_leaf->inBin(xs))
-        {
-            return m_leaf;
-        }
-        else
-        {
-            return NULL;
-        }
-    }
-    if(xs[m_cutAxis]<m_cut)
+    // Walk down from the root node, following the cuts
+    int node = 0;
+    while(m_nodes[node].leaf<0)
     {
-        return m_treeSons[0]->getLeaf(xs);
-    }
-    else
-    {
-        return m_treeSons[1]->getLeaf(xs);
+        const BinNode& binNode = m_nodes[node];
+        node = (xs[binNode.cutAxis]<binNode.cut ? binNode.sons[0] : binNode.sons[1]);
     }
+    int leaf = m_nodes[node].leaf;
+    return (m_leaves[leaf].inBin(xs) ? leaf : -1);
+}
+
+/*****************************************************************/
+BinLeaf* BinTree::getLeaf(const std::vector<double>& xs)
+/*****************************************************************/
+{
+    int leaf = findLeaf(xs);
+    return (leaf>=0 ? &m_leaves[leaf] : NULL);
 }
 
 
 /*****************************************************************/
-std::vector<BinLeaf*> BinTree::getLeaves()
+std::vector<const BinLeaf*> BinTree::findNeighborLeaves(const BinLeaf* leaf) const
 /*****************************************************************/
 {
-    vector<BinLeaf*> leaves;
-    if(m_leaf)
-    {
-        leaves.push_back(m_leaf);
-        return leaves;
-    }
-    else
+    vector<const BinLeaf*> neighborLeaves;
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        vector<BinLeaf*> leaves1 = m_treeSons[0]->getLeaves();
-        vector<BinLeaf*> leaves2 = m_treeSons[1]->getLeaves();
-        leaves.insert(leaves.end(),leaves1.begin(), leaves1.end());
-        leaves.insert(leaves.end(),leaves2.begin(), leaves2.end());
-        return leaves;
+        bool isNeighbor = m_leaves[l].isNeighbor(leaf);
+        if(isNeighbor)
+        {
+            neighborLeaves.push_back(&m_leaves[l]);
+        }
     }
+    return neighborLeaves;
 }
 
 
 /*****************************************************************/
-std::vector<BinTree*> BinTree::getTerminalNodes()
+double BinTree::getMinBinWidth(unsigned int axis) const
 /*****************************************************************/
 {
-    vector<BinTree*> nodes;
-    if(m_leaf)
+    double width = m_leaves[0].getWidth(axis);
+    for(unsigned int l=1;l<m_leaves.size();l++)
     {
-        nodes.push_back(this);
-        return nodes;
-    }
-    else
-    {
-        vector<BinTree*> nodes1 = m_treeSons[0]->getTerminalNodes();
-        vector<BinTree*> nodes2 = m_treeSons[1]->getTerminalNodes();
-        nodes.insert(nodes.end(),nodes1.begin(), nodes1.end());
-        nodes.insert(nodes.end(),nodes2.begin(), nodes2.end());
-        return nodes;
+        width = min(width, m_leaves[l].getWidth(axis));
     }
+    return width;
 }
 
 /*****************************************************************/
-std::vector<BinLeaf*> BinTree::findNeighborLeaves(BinLeaf* leaf)
+double BinTree::getMinEntries() const
 /*****************************************************************/
 {
-    vector<BinLeaf*> neighborLeaves;
-    vector<BinLeaf*> allleaves = getLeaves();
-    vector<BinLeaf*>::iterator it = allleaves.begin();
-    vector<BinLeaf*>::iterator itE = allleaves.end();
-    for(;it!=itE;++it)
+    double nentries = m_leaves[0].getNEntries();
+    for(unsigned int l=1;l<m_leaves.size();l++)
     {
-        bool isNeighbor = (*it)->isNeighbor(leaf);
-        if(isNeighbor)
-        {
-            neighborLeaves.push_back(*it);
-        }
+        nentries = min(nentries, (double)m_leaves[l].getNEntries());
     }
-    return neighborLeaves;
+    return nentries;
 }
 
-
 /*****************************************************************/
-unsigned int BinTree::getNLeaves()
+double BinTree::getMaxEntries() const
 /*****************************************************************/
 {
-    return getLeaves().size();
+    double nentries = m_leaves[0].getNEntries();
+    for(unsigned int l=1;l<m_leaves.size();l++)
+    {
+        nentries = max(nentries, (double)m_leaves[l].getNEntries());
+    }
+    return nentries;
 }
 
+
 /*****************************************************************/
-double BinTree::getMinBinWidth(unsigned int axis)
+pair<int,int> BinTree::entriesIfSplit(int node, double cut, unsigned int axis)
 /*****************************************************************/
 {
-    if(m_leaf)
+    if(m_nodes[node].leaf<0)
     {
-        return m_leaf->getWidth(axis);
+        throw runtime_error("BinTree::entriesIfSplit(): This method can only be applied on terminal nodes");
     }
-    else
+    const BinLeaf& leaf = nodeLeaf(node);
+    // Cannot split the bin if the cut value is not contained within the bin boundaries
+    if(cut<=leaf.getMin(axis) || cut>=leaf.getMax(axis))
     {
-        double width1 = m_treeSons[0]->getMinBinWidth(axis);
-        double width2 = m_treeSons[1]->getMinBinWidth(axis);
-        double width = min(width1,width2);
-        return width;
+        stringstream error;
+        error<<"BinTree::entriesIfSplit(): Trying to split a node outside its bin boundaries. "<<cut<<"!=("<<leaf.getMin(axis)<<","<<leaf.getMax(axis)<<")";
+        throw runtime_error(error.str());
     }
+    return leaf.getEntries().entriesIfSplit(axis, cut);
 }
 
 /*****************************************************************/
-double BinTree::getMinEntries()
+void BinTree::splitLeaf(int node, double cut, unsigned int axis)
 /*****************************************************************/
 {
-    if(m_leaf)
-    {
-        return m_leaf->getNEntries();
-    }
-    else
-    {
-        double nentries1 = m_treeSons[0]->getMinEntries();
-        double nentries2 = m_treeSons[1]->getMinEntries();
-        double nentries = min(nentries1,nentries2);
-        return nentries;
-    }
+        if(m_nodes[node].leaf<0)
+        {
+            stringstream error;
+            error << "BinTree.split(): This method can only be applied on terminal nodes";
+            throw runtime_error(error.str());
+        }
+        int leafIndex = m_nodes[node].leaf;
+        const BinLeaf& leaf = m_leaves[leafIndex];
+        // Cannot split the bin if the cut value is not contained within the bin boundaries
+        if(cut<=leaf.getMin(axis) || cut>=leaf.getMax(axis))
+        {
+            stringstream error;
+            error << "BinTree.split(): Trying to split a node outside its bin boundaries. "<<cut<<"!=("<<leaf.getMin(axis)<<","<<leaf.getMax(axis)<<")";
+            throw runtime_error(error.str());
+        }
+        // Create two neighbour bins
+        vector< pair<double,double> > boundaries1 = leaf.getBinBoundaries();
+        vector< pair<double,double> > boundaries2 = leaf.getBinBoundaries();
+        boundaries1[axis].second = cut;
+        boundaries2[axis].first = cut;
+        BinLeaf leaf1(boundaries1);
+        BinLeaf leaf2(boundaries2);
+        // Fill the two leaves that have just been created with entries of the parent node
+        pair<EntryList,EntryList> entryLists = leaf.getEntries().split(axis, cut);
+        leaf1.setEntries(entryLists.first);
+        leaf2.setEntries(entryLists.second);
+        // The first leaf replaces the old leaf, the second one is appended.
+        // The node is not a terminal node anymore
+        int leafIndex2 = m_leaves.size();
+        leaf1.setIndex(leafIndex);
+        leaf2.setIndex(leafIndex2);
+        m_leaves[leafIndex] = std::move(leaf1);
+        m_leaves.push_back(std::move(leaf2));
+        int son1 = addNode(leafIndex);
+        int son2 = addNode(leafIndex2);
+        m_leafNodes[leafIndex] = son1;
+        m_leafNodes.push_back(son2);
+        m_updatedLeaves.resize(m_leaves.size(), false);
+        m_updatedLeaves[leafIndex] = true;
+        m_updatedLeaves[leafIndex2] = true;
+        if(m_splitCandidates.size()>0)
+        {
+            m_splitCandidates.resize(m_leaves.size());
+            m_splitCandidates[leafIndex].clear();
+        }
+        BinNode& binNode = m_nodes[node];
+        binNode.sons[0] = son1;
+        binNode.sons[1] = son2;
+        binNode.leaf = -1;
+        binNode.cutAxis = axis;
+        binNode.cut = cut;
 }
 
+
 /*****************************************************************/
-double BinTree::getMaxEntries()
+bool BinTree::multiSplitLeaf(int node)
 /*****************************************************************/
 {
-    if(m_leaf)
+    // Split the leaf at the (weighted) median or best cut of all the axes that can be split, in one step (4 bins in 2D, 8 bins in 3D).
+    // Returns false if less than 2 axes can be split or if one of the new bins would contain
+    // less than the minimum number of entries. A single axis split has then to be done.
+    vector<unsigned int> axes;
+    vector<double> cuts;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
     {
-        return m_leaf->getNEntries();
+        if(vetoSplit(node,axis) || splitGain(node,axis)<=0.) continue;
+        axes.push_back(axis);
+        // Gradient splits are done at the weighted median, such that the new bins have similar effective numbers of entries
+        cuts.push_back(m_splitCriterion==GRADIENT ? nodeLeaf(node).getEntries().weightedMedian(axis) : splitCut(node,axis));
     }
-    else
+    if(axes.size()<2) return false;
+    // Avoid long bins: in each new bin, the length along one axis must not be smaller than
+    // the length along another axis divided by the maximum asymmetry.
+    // Moving a cut towards the middle only reduces the largest lengths, so one pass is enough.
+    const vector< pair<double,double> >& binBoundaries = nodeLeaf(node).getBinBoundaries();
+    auto minLength = [&](unsigned int i)
     {
-        double nentries1 = m_treeSons[0]->getMaxEntries();
-        double nentries2 = m_treeSons[1]->getMaxEntries();
-        double nentries = max(nentries1,nentries2);
-        return nentries;
+        double maxRelLength = 0.;
+        for(unsigned int j=0;j<axes.size();j++)
+        {
+            if(j==i) continue;
+            const pair<double,double>& bj = binBoundaries[axes[j]];
+            double relLength = max(cuts[j]-bj.first, bj.second-cuts[j])/(getMax(axes[j])-getMin(axes[j]));
+            if(relLength>maxRelLength) maxRelLength = relLength;
+        }
+        return maxRelLength/m_maxAxisAsymmetry*(getMax(axes[i])-getMin(axes[i]));
+    };
+    for(unsigned int i=0;i<axes.size();i++)
+    {
+        const pair<double,double>& bi = binBoundaries[axes[i]];
+        double length = minLength(i);
+        if(2.*length>bi.second-bi.first) return false;
+        if(cuts[i]-bi.first<length) cuts[i] = bi.first+length;
+        else if(bi.second-cuts[i]<length) cuts[i] = bi.second-length;
+    }
+    // Grid constraints don't veto any axis here, since a single axis split is still possible if the multi-split is abandoned
+    bool moved = false;
+    for(unsigned int i=0;i<axes.size();i++)
+    {
+        double cut = cuts[i];
+        if(!constrainedCut(node, axes[i], cut)) return false;
+        if(cut!=cuts[i]) moved = true;
+        cuts[i] = cut;
+    }
+    // Cuts moved to the grid must still avoid long bins
+    for(unsigned int i=0;i<axes.size() && moved;i++)
+    {
+        const pair<double,double>& bi = binBoundaries[axes[i]];
+        double length = minLength(i);
+        if(cuts[i]-bi.first<length || bi.second-cuts[i]<length) return false;
+    }
+    // Effective number of entries in each of the new bins
+    const EntryList& entries = nodeLeaf(node).getEntries();
+    unsigned int nbins = (1u<<axes.size());
+    vector<double> sumw(nbins, 0.);
+    vector<double> sumw2(nbins, 0.);
+    vector<unsigned int> nentries(nbins, 0);
+    for(unsigned int e=0;e<entries.size();e++)
+    {
+        unsigned int bin = 0;
+        for(unsigned int i=0;i<axes.size();i++)
+        {
+            if(entries.value(axes[i],e)>=cuts[i]) bin |= (1u<<i);
+        }
+        double w = entries.weight(e);
+        sumw[bin] += w;
+        sumw2[bin] += w*w;
+        nentries[bin]++;
+    }
+    for(unsigned int b=0;b<nbins;b++)
+    {
+        if(sumw2[b]==0. || entries.effectiveSize(sumw[b],sumw2[b],nentries[b])<m_minLeafEntries) return false;
+    }
+    // Split successively along each axis. The cuts stay within the boundaries of the new bins
+    vector<int> nodes;
+    nodes.push_back(node);
+    for(unsigned int i=0;i<axes.size();i++)
+    {
+        vector<int> newNodes;
+        for(unsigned int n=0;n<nodes.size();n++)
+        {
+            splitLeaf(nodes[n], cuts[i], axes[i]);
+            newNodes.push_back(m_nodes[nodes[n]].sons[0]);
+            newNodes.push_back(m_nodes[nodes[n]].sons[1]);
+        }
+        nodes.swap(newNodes);
     }
+    return true;
 }
 
 
 /*****************************************************************/
-unsigned int BinTree::maxLeafIndex()
+BinTree::SplitCriterion BinTree::splitCriterionFromName(const string& name)
 /*****************************************************************/
 {
-    if(m_leaf)
+    if(name=="gradient") return GRADIENT;
+    if(name=="variance") return VARIANCE;
+    if(name=="poisson") return POISSON;
+    if(name=="contrast") return CONTRAST;
+    stringstream error;
+    error << "BinTree::splitCriterionFromName(): Unknown split criterion '"<<name<<"'. Possible criteria are 'gradient', 'variance', 'poisson' and 'contrast'";
+    throw runtime_error(error.str());
+}
+
+
+/*****************************************************************/
+double BinTree::splitGain(int node, unsigned int axis)
+/*****************************************************************/
+{
+    if(m_splitCriterion==GRADIENT)
     {
-        return m_leaf->index();
+        return nodeLeaf(node).densityGradient(axis);
     }
-    else
+    return splitCandidates(m_nodes[node].leaf)[axis].first;
+}
+
+
+/*****************************************************************/
+double BinTree::splitCut(int node, unsigned int axis)
+/*****************************************************************/
+{
+    if(m_splitCriterion==GRADIENT)
     {
-        return max(m_treeSons[0]->maxLeafIndex(), m_treeSons[1]->maxLeafIndex());
+        vector<double> perc50;
+        perc50.push_back(50.);
+        return nodeLeaf(node).percentiles(perc50,axis)[0];
     }
+    return splitCandidates(m_nodes[node].leaf)[axis].second;
 }
 
 
 /*****************************************************************/
-pair<int,int> BinTree::entriesIfSplit(double cut, unsigned int axis)
+const vector< pair<double,double> >& BinTree::splitCandidates(int leaf)
 /*****************************************************************/
 {
-    if(!m_leaf)
+    // The best cuts only depend on the entries of the leaf, so they are computed once per leaf
+    if(m_splitCandidates.size()<m_leaves.size())
     {
-        throw runtime_error("BinTree::entriesIfSplit(): This method can only be applied on terminal nodes");
+        m_splitCandidates.resize(m_leaves.size());
     }
-    // Cannot split the bin if the cut value is not contained within the bin boundaries
-    if(cut<=getBinBoundaries()[axis].first || cut>=getBinBoundaries()[axis].second)
+    vector< pair<double,double> >& candidates = m_splitCandidates[leaf];
+    if(candidates.size()==0)
     {
-        stringstream error;
-        error<<"BinTree::entriesIfSplit(): Trying to split a node outside its bin boundaries. "<<cut<<"!=("<<getBinBoundaries()[axis].first<<","<<getBinBoundaries()[axis].second<<")";
-        throw runtime_error(error.str());
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            candidates.push_back(bestCut(m_leaves[leaf], axis));
+        }
     }
-    return m_leaf->getEntries().entriesIfSplit(axis, cut);
+    return candidates;
 }
 
+
 /*****************************************************************/
-void BinTree::splitLeaf(double cut, unsigned int maxLeafIndex, unsigned int axis)
+pair<double,double> BinTree::bestCut(const BinLeaf& leaf, unsigned int axis) const
 /*****************************************************************/
 {
-        if(!m_leaf)
+    // Evaluate the split criterion for all the cuts between two consecutive entries, in one sweep over the sorted entries.
+    // Sums of the left part are accumulated, sums of the right part are obtained by difference with the totals.
+    // Only cuts leaving at least the minimum number of effective entries on both sides are considered.
+    // Returns the best gain and the corresponding cut. The gain is 0 if no cut is possible.
+    const EntryList& entries = leaf.getEntries();
+    const vector< pair<double,int> >& values = entries.sortedValues(axis);
+    unsigned int n = values.size();
+    double low = leaf.getMin(axis);
+    double fullLength = getMax(axis)-getMin(axis);
+    double length = leaf.getWidth(axis)/fullLength;
+    // Totals. Coordinates are relative to the region size, in order to compare different axes
+    double sumw = 0.;
+    double sumw2 = 0.;
+    double sumwx = 0.;
+    double sumwx2 = 0.;
+    for(unsigned int i=0;i<n;i++)
+    {
+        double w = entries.weight(values[i].second);
+        double x = (values[i].first-low)/fullLength;
+        sumw += w;
+        sumw2 += w*w;
+        sumwx += w*x;
+        sumwx2 += w*x*x;
+    }
+    double bestGain = 0.;
+    double bestCutValue = 0.;
+    if(n<2 || sumw<=0.) return make_pair(bestGain, bestCutValue);
+    double totalScore = 0.;
+    if(m_splitCriterion==VARIANCE) totalScore = sumwx2-sumwx*sumwx/sumw;
+    else if(m_splitCriterion==POISSON) totalScore = sumw*log(sumw/length);
+    double leftw = 0.;
+    double leftw2 = 0.;
+    double leftwx = 0.;
+    double leftwx2 = 0.;
+    for(unsigned int i=0;i<n-1;i++)
+    {
+        double w = entries.weight(values[i].second);
+        double x = (values[i].first-low)/fullLength;
+        leftw += w;
+        leftw2 += w*w;
+        leftwx += w*x;
+        leftwx2 += w*x*x;
+        // Cut in the middle of two different consecutive values
+        if(values[i+1].first==values[i].first) continue;
+        double rightw = sumw-leftw;
+        double rightw2 = sumw2-leftw2;
+        if(leftw<=0. || rightw<=0. || rightw2<=0.) continue;
+        if(entries.effectiveSize(leftw,leftw2,i+1)<m_minLeafEntries || entries.effectiveSize(rightw,rightw2,n-i-1)<m_minLeafEntries) continue;
+        double cut = (values[i].first+values[i+1].first)/2.;
+        double leftLength = (cut-low)/fullLength;
+        double rightLength = length-leftLength;
+        double gain = 0.;
+        if(m_splitCriterion==VARIANCE)
         {
-            stringstream error;
-            error << "BinTree.split(): This method can only be applied on terminal nodes";
-            throw runtime_error(error.str());
+            double rightwx = sumwx-leftwx;
+            double rightwx2 = sumwx2-leftwx2;
+            gain = totalScore - (leftwx2-leftwx*leftwx/leftw) - (rightwx2-rightwx*rightwx/rightw);
         }
-        // Cannot split the bin if the cut value is not contained within the bin boundaries
-        if(cut<=getBinBoundaries()[axis].first || cut>=getBinBoundaries()[axis].second)
+        else if(m_splitCriterion==POISSON)
         {
-            stringstream error;
-            error << "BinTree.split(): Trying to split a node outside its bin boundaries. "<<cut<<"!=("<<getBinBoundaries()[axis].first<<","<<getBinBoundaries()[axis].second<<")";
-            throw runtime_error(error.str());
+            gain = leftw*log(leftw/leftLength) + rightw*log(rightw/rightLength) - totalScore;
         }
-        // Create two neighbour bins
-        m_cutAxis = axis;
-        m_cut = cut;
-        vector< pair<double,double> > boundaries1 = m_leaf->getBinBoundaries();
-        vector< pair<double,double> > boundaries2 = m_leaf->getBinBoundaries();
-        boundaries1[axis].second = cut;
-        boundaries2[axis].first = cut;
-        vector< vector<double> > emptyEntries;
-        vector< double > emptyWeights;
-        m_treeSons[0] = new BinTree(boundaries1, emptyEntries, emptyWeights);
-        m_treeSons[1] = new BinTree(boundaries2, emptyEntries, emptyWeights);
-        m_treeSons[0]->setMinLeafEntries(m_minLeafEntries);
-        m_treeSons[1]->setMinLeafEntries(m_minLeafEntries);
-        m_treeSons[0]->setMaxAxisAsymmetry(m_maxAxisAsymmetry);
-        m_treeSons[1]->setMaxAxisAsymmetry(m_maxAxisAsymmetry);
-        // Fill the two leaves that have just been created with entries of the parent node
-        pair<EntryList,EntryList> entryLists = m_leaf->getEntries().split(axis, cut);
-        m_treeSons[0]->leaf()->setEntries(entryLists.first);
-        m_treeSons[1]->leaf()->setEntries(entryLists.second);
-        // Assign new leaf indices
-        m_treeSons[0]->leaf()->setIndex(maxLeafIndex+1);
-        m_treeSons[1]->leaf()->setIndex(maxLeafIndex+2);
-        // Set grid constraint
-        m_treeSons[0]->setGridConstraint(m_gridConstraint);
-        m_treeSons[1]->setGridConstraint(m_gridConstraint);
-        // Finally destroy the old leaf. The node is not a terminal node anymore
-        delete m_leaf;
-        m_leaf = NULL;
+        else if(m_splitCriterion==CONTRAST)
+        {
+            gain = fabs(leftw/leftLength-rightw/rightLength);
+        }
+        if(gain>bestGain)
+        {
+            bestGain = gain;
+            bestCutValue = cut;
+        }
+    }
+    return make_pair(bestGain, bestCutValue);
 }
 
 
 /*****************************************************************/
-void BinTree::findBestSplit(BinTree*& bestNode, unsigned int& axis, double& gradient)
+void BinTree::findBestSplit(int& bestNode, unsigned int& axis, double& gradient)
 /*****************************************************************/
 {
-    bestNode = NULL;
-    //unsigned int bestAxis = 0;
-    // If the node is terminal, only the axis needs to be chosen
-    if(m_leaf)
+    bestNode = -1;
+    axis = 0;
+    gradient = 0.;
+    // Depth-first traversal. In case of equal gradients the last terminal node is chosen
+    vector<int> stack;
+    stack.push_back(0);
+    while(stack.size()>0)
     {
-        // Don't split if the bin contains less than 2 times the minimum number of entries
+        int node = stack.back();
+        stack.pop_back();
+        const BinNode& binNode = m_nodes[node];
+        if(binNode.leaf<0)
+        {
+            stack.push_back(binNode.sons[1]);
+            stack.push_back(binNode.sons[0]);
+            continue;
+        }
+        const BinLeaf& leaf = m_leaves[binNode.leaf];
+        // Don't split the bin if it contains less than 2 times the minimum number of entries
         //if(getNEntries()<2.*m_minLeafEntries)
-        if(m_leaf->effectiveNEntries()<2.*m_minLeafEntries)
+        if(leaf.effectiveNEntries()<2.*m_minLeafEntries)
         {
-            bestNode = NULL;
-            axis = 0;
-            gradient = 0.;
-            return;
+            continue;
         }
-        // Best node is self since this is a terminal node
-        bestNode = this;
-        // Compute the density gradients along the axis
+        // Cuts are placed from the entries in memory. Leaves of a stored partition may have none
+        if(leaf.getNEntries()<2)
+        {
+            continue;
+        }
+        // Compute the density gradients (or the gain of the split criterion) along the axis
         // The best axis is the one with the largest gradient
         double maxgrad = 0.;
         int bestAxis = -1;
         for(unsigned int ax=0;ax<m_ndim;ax++)
         {
-            double grad = m_leaf->densityGradient(ax);
-            if(grad>maxgrad && !m_vetoSplit[ax]) // best gradient and no veto
+            double grad = splitGain(node,ax);
+            if(grad>maxgrad && !vetoSplit(node,ax)) // best gradient and no veto
             {
                 maxgrad = grad;
                 bestAxis = (int)ax;
@@ -966,50 +1521,49 @@ void BinTree::findBestSplit(BinTree*& bestNode, unsigned int& axis, double& grad
         }
         if(bestAxis==-1 || maxgrad==0)
         {
-            bestNode = NULL;
-            axis = 0;
-            gradient = 0.;
-            return;
-        }
-        axis = bestAxis;
-        gradient = maxgrad;
-        return;
-    }
-    // If the node is non-terminal, look inside the two sons
-    else
-    {
-        BinTree* bestNode1 = NULL;
-        BinTree* bestNode2 = NULL;
-        unsigned int bestAxis1 = 0;
-        unsigned int bestAxis2 = 0;
-        double bestGrad1 = 0.;
-        double bestGrad2 = 0.;
-        m_treeSons[0]->findBestSplit(bestNode1, bestAxis1, bestGrad1);
-        m_treeSons[1]->findBestSplit(bestNode2, bestAxis2, bestGrad2);
-        // Look at the largest gradient
-        if(bestGrad1>bestGrad2)
-        {
-            bestNode = bestNode1;
-            axis = bestAxis1;
-            gradient = bestGrad1;
-            return;
+            continue;
         }
-        else
+        if(maxgrad>=gradient)
         {
-            bestNode = bestNode2;
-            axis = bestAxis2;
-            gradient = bestGrad2;
-            return;
+            bestNode = node;
+            axis = bestAxis;
+            gradient = maxgrad;
         }
     }
 }
 
 
 /*****************************************************************/
-void BinTree::constrainSplit(int axis, double& cut, bool& veto)
+void BinTree::constrainSplit(int node, int axis, double& cut, bool& veto)
+/*****************************************************************/
+{
+    //  If the constrained cut is outside the bin boundaries, veto this bin and axis
+    if(!vetoSplit(node,axis) && !constrainedCut(node, axis, cut))
+    {
+        setVetoSplit(node, axis, true);
+    }
+    veto = vetoSplit(node,axis);
+}
+
+
+/*****************************************************************/
+bool BinTree::constrainedCut(int node, int axis, double& cut)
 /*****************************************************************/
 {
-    if(m_gridConstraint && !m_vetoSplit[axis])
+    // Move the cut to the closest grid constraint inside the bin.
+    // Returns false if there is no grid constraint strictly inside the bin
+    if(!m_gridConstraint && !m_gridConstraintND) return true;
+    // Find the closest grid constraint for the cut
+    // And modify the cut according to this constraint
+    double low = 0.;
+    double up = 0.;
+    if(m_gridConstraintND)
+    {
+        int b = m_gridConstraintND->findBin(axis, cut);
+        low = m_gridConstraintND->getBinLowEdge(axis, b);
+        up  = m_gridConstraintND->getBinUpEdge(axis, b);
+    }
+    else
     {
         TAxis* gridAxis = NULL;
         if(axis==0)
@@ -1026,52 +1580,45 @@ void BinTree::constrainSplit(int axis, double& cut, bool& veto)
         }
         else
         {
-            stringstream error;
-            error << "BinTree::constrainSplit(): Cannot use grid constrain for more than 3D";
-            throw runtime_error(error.str());
-        }
-        // Find the closest grid constraint for the cut
-        // And modify the cut according to this constraint
-        int b   = gridAxis->FindBin(cut);
-        double low = gridAxis->GetBinLowEdge(b);
-        double up  = gridAxis->GetBinUpEdge(b);
-        if(fabs(up-cut)<fabs(cut-low))
-        {
-            cut = up;
-            // If the constrained cut is outside the bin boundaries, try the other grid constraint
-            if(cut>=getBinBoundaries()[axis].second)
-            {
-                cut = low;
-            }
-        }
-        else
-        {
+            stringstream error;
+            error << "BinTree::constrainedCut(): Cannot use grid constrain for more than 3D";
+            throw runtime_error(error.str());
+        }
+        int b = gridAxis->FindBin(cut);
+        low = gridAxis->GetBinLowEdge(b);
+        up  = gridAxis->GetBinUpEdge(b);
+    }
+    const BinLeaf& leaf = nodeLeaf(node);
+    if(fabs(up-cut)<fabs(cut-low))
+    {
+        cut = up;
+        // If the constrained cut is outside the bin boundaries, try the other grid constraint
+        if(cut>=leaf.getMax(axis))
+        {
             cut = low;
-            // If the constrained cut is outside the bin boundaries, try the other grid constraint
-            if(cut<=getBinBoundaries()[axis].first)
-            {
-                cut = up;
-            }
         }
-        //  If the constrained cut is still outside the bin boundaries, veto this bin and axis
-        if(cut<=getBinBoundaries()[axis].first || cut>=getBinBoundaries()[axis].second)
+    }
+    else
+    {
+        cut = low;
+        // If the constrained cut is outside the bin boundaries, try the other grid constraint
+        if(cut<=leaf.getMin(axis))
         {
-            m_vetoSplit[axis] = true;
+            cut = up;
         }
     }
-    veto = m_vetoSplit[axis];
+    return (cut>leaf.getMin(axis) && cut<leaf.getMax(axis));
 }
 
 
 /*****************************************************************/
-void BinTree::minimizeLongBins(BinTree* tree, unsigned int axis, double& cut, bool& veto)
+void BinTree::minimizeLongBins(int node, unsigned int axis, double& cut, bool& veto)
 /*****************************************************************/
 {
-    if(!tree->vetoSplit(axis))
+    if(!vetoSplit(node,axis))
     {
-        vector< pair<double,double> > binBoundaries = tree->getBinBoundaries();
-        // this is supposed to be the root tree
-        vector< pair<double,double> > fullBoundaries = getBinBoundaries();
+        const vector< pair<double,double> >& binBoundaries = nodeLeaf(node).getBinBoundaries();
+        const vector< pair<double,double> >& fullBoundaries = getBinBoundaries();
         vector<double> fullLengths;
         vector<double> binRelLengths;
         for(unsigned int ax=0;ax<m_ndim;ax++)
@@ -1103,7 +1650,7 @@ void BinTree::minimizeLongBins(BinTree* tree, unsigned int axis, double& cut, bo
                 //cerr<<" 1<max -> cut="<<cut<<"\n";
                 if(cut>=binBoundaries[axis].second || m_maxAxisAsymmetry*cutRelDistance2<maxRelLength)
                 {
-                    tree->setVetoSplit(axis, true);
+                    setVetoSplit(node, axis, true);
                     //cerr<<" veto\n";
                 }
             }
@@ -1117,91 +1664,65 @@ void BinTree::minimizeLongBins(BinTree* tree, unsigned int axis, double& cut, bo
                 //cerr<<" 2<max -> cut="<<cut<<"\n";
                 if(cut<=binBoundaries[axis].first || m_maxAxisAsymmetry*cutRelDistance1<maxRelLength)
                 {
-                    tree->setVetoSplit(axis,true);
+                    setVetoSplit(node, axis, true);
                     //cerr<<" veto\n";
                 }
             }
         }
     }
-    veto = tree->vetoSplit(axis);
+    veto = vetoSplit(node,axis);
 }
 
 
 /*****************************************************************/
-void BinTree::build()
+void BinTree::build(const EntryOrdering* ordering)
 /*****************************************************************/
 {
 
-    m_leaf->sortEntries();
+    if(m_leaves.size()>1)
+    {
+        throw runtime_error("BinTree::build(): The tree has already been built");
+    }
+    m_buildStart = chrono::steady_clock::now();
+    BinLeaf& rootLeaf = m_leaves[0];
+    // Use the shared ordering if provided, to avoid sorting again the same coordinates
+    if(ordering)
+    {
+        rootLeaf.sortEntries(*ordering);
+    }
+    else
+    {
+        rootLeaf.sortEntries();
+    }
     // If the tree already contains too small number of entries, it does nothing
     //if(getNEntries()<2.*m_minLeafEntries)
-    //cerr<<"Effective number of entries = "<<m_leaf->effectiveNEntries()<<"\n";
-    if(m_leaf->effectiveNEntries()<2.*m_minLeafEntries)
+    //cerr<<"Effective number of entries = "<<rootLeaf.effectiveNEntries()<<"\n";
+    if(rootLeaf.effectiveNEntries()<2.*m_minLeafEntries)
     {
-        cout<<"[WARN] Total effective number of entries = "<<m_leaf->effectiveNEntries()<<" < 2 x "<<m_minLeafEntries<<". The procedure stops with one single bin\n";
+        cout<<"[WARN] Total effective number of entries = "<<rootLeaf.effectiveNEntries()<<" < 2 x "<<m_minLeafEntries<<". The procedure stops with one single bin\n";
         cout<<"[WARN]   You'll have to reduce the minimum number of entries per bin if you want to have more than one bin.\n";
         return;
     }
     // Start with first splitting
-    BinTree* tree = NULL;
+    int node = -1;
     unsigned int axis = 0;
     double grad = 0.;
-    vector<double> perc50;
-    perc50.push_back(50.);
-    findBestSplit(tree, axis, grad);
+    findBestSplit(node, axis, grad);
+    if(node<0)
+    {
+        return;
+    }
 
-    double cut = tree->leaf()->percentiles(perc50,axis)[0];
+    double cut = splitCut(node,axis);
     // Modify cut according to grid constraints
     bool veto = false;
-    tree->constrainSplit(axis, cut, veto);
+    constrainSplit(node, axis, cut, veto);
     if(!veto)
     {
-        tree->splitLeaf(cut, maxLeafIndex(), axis);
+        splitLeaf(node, cut, axis);
     }
-    int nsplits = 1;
-    //int totalEntries = getNEntries();
-    //int previousMaxEntries = totalEntries;
     // Split until it is not possible to split (too small number of entries, or vetoed bins)
-    while(tree)
-    {
-        findBestSplit(tree, axis, grad);
-        // This is the end
-        if(!tree)
-        {
-            break;
-        }
-        cut = tree->leaf()->percentiles(perc50,axis)[0];
-        veto = false;
-        //cerr<<"Bin ("<<tree->getMin(0)<<","<<tree->getMax(0)<<")("<<tree->getMin(1)<<","<<tree->getMax(1)<<")("<<tree->getMin(2)<<","<<tree->getMax(2)<<")\n";
-        minimizeLongBins(tree, axis, cut,veto);
-        //cerr<<" axis="<<axis<<", cut="<<cut<<"\n";
-        if(!veto)
-        {
-            // Modify cut according to grid constraints
-            tree->constrainSplit(axis, cut, veto);
-            if(!veto)
-            {
-                tree->splitLeaf(cut, maxLeafIndex(), axis);
-                nsplits += 1;
-                cout<<"[INFO]   Number of bins = "<<getNLeaves()<<"\r"<<flush;
-            }
-        }
-        //int maxEntries = getMaxEntries();
-
-        //if( maxEntries!=previousMaxEntries)
-        //{
-        //    double n = (double)totalEntries/(double)m_minLeafEntries;
-        //    double ratio  =  min( 1.-log((double)maxEntries/(double)m_minLeafEntries)/log(n),1.);
-        //    int   c      =  ratio * 50;
-        //    cout << "[INFO]   "<< setw(3) << (int)(ratio*100) << "% [";
-        //    for (int x=0; x<c; x++) cout << "=";
-        //    for (int x=c; x<50; x++) cout << " ";
-        //    cout << "]\r" << flush;
-        //    previousMaxEntries = maxEntries;
-        //}
-
-    }
-
+    splitLeaves();
 
     // Look if some bins are more than 50% empty. If it is the case, the empty part is separated (including one event)
     // from the part of the bin that contains all the entries
@@ -1272,49 +1793,170 @@ void BinTree::build()
     }*/
 
     // Split leaves close to the boundaries
-    vector< std::pair<double,double> > boundaries = getBinBoundaries();
-    vector<BinTree*> terminalNodes = getTerminalNodes();
+    splitBoundaryLeaves(m_leafNodes);
+    m_updatedLeaves.clear();
+}
+
+/*****************************************************************/
+vector<bool> BinTree::update()
+/*****************************************************************/
+{
+    // Continue the splitting of an existing tree after new entries have been added.
+    // Only leaves exceeding two times the minimum number of entries can be split,
+    // the other leaves are left untouched.
+    // Returns for each leaf whether it has been created or modified by this update.
+    m_buildStart = chrono::steady_clock::now();
+    m_updatedLeaves.assign(m_leaves.size(), false);
+    splitLeaves();
+    // Split leaves close to the boundaries, only among the new leaves
+    vector<int> updatedNodes;
+    for(unsigned int l=0;l<m_leaves.size();l++)
+    {
+        if(m_updatedLeaves[l]) updatedNodes.push_back(m_leafNodes[l]);
+    }
+    splitBoundaryLeaves(updatedNodes);
+    vector<bool> updatedLeaves = m_updatedLeaves;
+    m_updatedLeaves.clear();
+    return updatedLeaves;
+}
+
+/*****************************************************************/
+void BinTree::splitLeaves()
+/*****************************************************************/
+{
+    // Split the leaf with the largest density gradient until it is not possible to split
+    int node = 0;
+    unsigned int axis = 0;
+    double grad = 0.;
+    double cut = 0.;
+    bool veto = false;
+    //int totalEntries = getNEntries();
+    //int previousMaxEntries = totalEntries;
+    while(node>=0)
+    {
+        // Leaves are split by decreasing gradient, so stopping here keeps the most significant splits
+        if(buildTimeSpent())
+        {
+            printBuildProgress();
+            break;
+        }
+        findBestSplit(node, axis, grad);
+        // This is the end
+        if(node<0)
+        {
+            break;
+        }
+        if(m_multiAxisSplit && multiSplitLeaf(node))
+        {
+            if(m_verbose) cout<<"[INFO]   Number of bins = "<<getNLeaves()<<"\r"<<flush;
+            continue;
+        }
+        cut = splitCut(node,axis);
+        veto = false;
+        minimizeLongBins(node, axis, cut,veto);
+        //cerr<<" axis="<<axis<<", cut="<<cut<<"\n";
+        if(!veto)
+        {
+            // Modify cut according to grid constraints
+            constrainSplit(node, axis, cut, veto);
+            if(!veto)
+            {
+                splitLeaf(node, cut, axis);
+                if(m_verbose) cout<<"[INFO]   Number of bins = "<<getNLeaves()<<"\r"<<flush;
+            }
+        }
+        //int maxEntries = getMaxEntries();
+
+        //if( maxEntries!=previousMaxEntries)
+        //{
+        //    double n = (double)totalEntries/(double)m_minLeafEntries;
+        //    double ratio  =  min( 1.-log((double)maxEntries/(double)m_minLeafEntries)/log(n),1.);
+        //    int   c      =  ratio * 50;
+        //    cout << "[INFO]   "<< setw(3) << (int)(ratio*100) << "% [";
+        //    for (int x=0; x<c; x++) cout << "=";
+        //    for (int x=c; x<50; x++) cout << " ";
+        //    cout << "]\r" << flush;
+        //    previousMaxEntries = maxEntries;
+        //}
+
+    }
+}
+
+/*****************************************************************/
+bool BinTree::buildTimeSpent() const
+/*****************************************************************/
+{
+    if(m_maxBuildSeconds<=0.) return false;
+    chrono::duration<double> elapsed = chrono::steady_clock::now()-m_buildStart;
+    return elapsed.count()>=m_maxBuildSeconds;
+}
+
+/*****************************************************************/
+void BinTree::printBuildProgress() const
+/*****************************************************************/
+{
+    // Compare the current partition with the target number of entries per bin
+    unsigned int nlarge = 0;
+    unsigned int maxEntries = 0;
+    for(unsigned int l=0;l<m_leaves.size();l++)
+    {
+        unsigned int n = m_leaves[l].effectiveNEntries();
+        if(n>=2.*m_minLeafEntries) nlarge++;
+        if(n>maxEntries) maxEntries = n;
+    }
+    cout<<"\n";
+    cout<<"[WARN] Time budget of "<<m_maxBuildSeconds<<" s spent. The procedure stops with "<<m_leaves.size()<<" bins\n";
+    cout<<"[WARN]   "<<nlarge<<" bins still contain more than 2 x "<<m_minLeafEntries<<" effective entries (largest bin: "<<maxEntries<<" entries)\n";
+}
+
+/*****************************************************************/
+void BinTree::splitBoundaryLeaves(std::vector<int> terminalNodes)
+/*****************************************************************/
+{
+    // Split the given terminal nodes when they are close to the boundaries
+    const vector< std::pair<double,double> >& boundaries = getBinBoundaries();
+    int nsplits = 0;
     for(unsigned int i=0;i<terminalNodes.size();i++)
     {
-        BinTree* node = terminalNodes[i];
-        BinLeaf* leaf = node->leaf();
+        if(buildTimeSpent()) break;
+        int node = terminalNodes[i];
         int nSplitAxis = 0;
         vector<bool> splits;
         for(unsigned int axis=0;axis<m_ndim;axis++)
         {
             splits.push_back(false);
-            if(leaf->getMin(axis)==boundaries[axis].first || leaf->getMax(axis)==boundaries[axis].second)
+            if(nodeLeaf(node).getMin(axis)==boundaries[axis].first || nodeLeaf(node).getMax(axis)==boundaries[axis].second)
             {
                 splits[axis] = true;
                 nSplitAxis ++;
                 //cout<<"Will split bin ["<<leaf->getMin(axis)<<","<<leaf->getMax(axis)<<"] along axis "<<axis<<"\n";
             }
         }
-        vector<BinTree*> nodes;
-        vector< pair<BinTree*,int> > nodesToSplitFurther;
+        vector<int> nodes;
+        vector< pair<int,int> > nodesToSplitFurther;
         nodes.push_back(node);
         for(unsigned int axis=0;axis<m_ndim;axis++)
         {
             if(splits[axis])
             {
-                vector<BinTree*> newNodes;
+                vector<int> newNodes;
                 for(unsigned int n=0;n<nodes.size();n++)
                 {
-                    BinTree* node = nodes[n];
-                    double middle = (node->getMax(axis)+node->getMin(axis))/2.;
+                    int node = nodes[n];
+                    double middle = (nodeLeaf(node).getMax(axis)+nodeLeaf(node).getMin(axis))/2.;
                     //cout<<"  Splitting border bin at "<<middle<<" on axis "<<axis<<"\n";
                     //cout<<"    Nentries before = "<<node->getNEntries()<<"\n";
-                    pair<int,int> entriesAfterCut = node->entriesIfSplit(middle,axis);
+                    pair<int,int> entriesAfterCut = entriesIfSplit(node,middle,axis);
                     //cout<<"    Nentries after = "<<entriesAfterCut.first<<"+"<<entriesAfterCut.second<<"\n";
                     //if(node->getNEntries()>0)
                     //{
                     //    cout<<"    Ratio = "<<(double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<<"\n";
                     //}
-                    if(node->getNEntries()>0 && (double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<0.7)
+                    if(nodeLeaf(node).getNEntries()>0 && (double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<0.7)
                     {
-                        node->splitLeaf(middle, maxLeafIndex(), axis);
-                        newNodes.push_back(node->getSons()[0]);
-                        newNodes.push_back(node->getSons()[1]);
+                        splitLeaf(node, middle, axis);
+                        newNodes.push_back(m_nodes[node].sons[0]);
+                        newNodes.push_back(m_nodes[node].sons[1]);
                         //cout<<"    Splitting\n";
                         //cout<<"    Nentries after = "<<node->getSons()[0]->getNEntries()<<"+"<<node->getSons()[1]->getNEntries()<<"\n";
                         if(nSplitAxis==1)
@@ -1322,8 +1964,8 @@ void BinTree::build()
                         //        (double)min(node->getSons()[0]->getNEntries(),node->getSons()[1]->getNEntries())/(double)max(node->getSons()[0]->getNEntries(),node->getSons()[1]->getNEntries())<0.7)
                         {
                         //    cout<<"   Ratio = "<<(double)min(node->getSons()[0]->getNEntries(),node->getSons()[1]->getNEntries())/(double)max(node->getSons()[0]->getNEntries(),node->getSons()[1]->getNEntries())<<"\n";
-                            nodesToSplitFurther.push_back(make_pair(node->getSons()[0],axis));
-                            nodesToSplitFurther.push_back(make_pair(node->getSons()[1],axis));
+                            nodesToSplitFurther.push_back(make_pair(m_nodes[node].sons[0],(int)axis));
+                            nodesToSplitFurther.push_back(make_pair(m_nodes[node].sons[1],(int)axis));
                         }
                         nsplits += 1;
                     }
@@ -1340,32 +1982,32 @@ void BinTree::build()
         while(nodesToSplitFurther.size()>0 && ns<2)
         {
             //cout<<"ns = "<<ns<<"\n";
-            vector< pair<BinTree*,int> > newNodesToSplitFurther;
+            vector< pair<int,int> > newNodesToSplitFurther;
             for(unsigned int j=0;j<nodesToSplitFurther.size();j++)
             {
-                BinTree* node2 = nodesToSplitFurther[j].first;
+                int node2 = nodesToSplitFurther[j].first;
                 int axis = nodesToSplitFurther[j].second;
-                if(node2->getMin(axis)==boundaries[axis].first || node2->getMax(axis)==boundaries[axis].second)
+                if(nodeLeaf(node2).getMin(axis)==boundaries[axis].first || nodeLeaf(node2).getMax(axis)==boundaries[axis].second)
                 {
-                    //cout<<"    Split bin ["<<node2->getMin(axis)<<","<<node2->getMax(axis)<<"] along axis "<<axis<<"\n";
-                    double middle = (node2->getMax(axis)+node2->getMin(axis))/2.;
-                    pair<int,int> entriesAfterCut = node2->entriesIfSplit(middle,axis);
+                    //cout<<"    Split bin ["<<nodeLeaf(node2).getMin(axis)<<","<<nodeLeaf(node2).getMax(axis)<<"] along axis "<<axis<<"\n";
+                    double middle = (nodeLeaf(node2).getMax(axis)+nodeLeaf(node2).getMin(axis))/2.;
+                    pair<int,int> entriesAfterCut = entriesIfSplit(node2,middle,axis);
                     //cout<<"    Nentries after = "<<entriesAfterCut.first<<"+"<<entriesAfterCut.second<<"\n";
                     //if(node2->getNEntries()>0)
                     //{
                     //    cout<<"    Ratio = "<<(double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<<"\n";
                     //}
-                    if(node2->getNEntries()>0 && (double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<0.5)
+                    if(nodeLeaf(node2).getNEntries()>0 && (double)min(entriesAfterCut.first,entriesAfterCut.second)/(double)max(entriesAfterCut.first,entriesAfterCut.second)<0.5)
                     {
-                        node2->splitLeaf(middle, maxLeafIndex(), axis);
+                        splitLeaf(node2, middle, axis);
                         //cout<<"    Splitting\n";
                         nsplits += 1;
                         //if(nSplitAxis==1 && min(node2->getSons()[0]->getNEntries(),node2->getSons()[1]->getNEntries())>0 &&
                         //        (double)min(node2->getSons()[0]->getNEntries(),node2->getSons()[1]->getNEntries())/(double)max(node2->getSons()[0]->getNEntries(),node2->getSons()[1]->getNEntries())<0.7)
                         //{
                          //   cout<<"   Ratio = "<<(double)min(node2->getSons()[0]->getNEntries(),node2->getSons()[1]->getNEntries())/(double)max(node2->getSons()[0]->getNEntries(),node2->getSons()[1]->getNEntries())<<"\n";
-                            newNodesToSplitFurther.push_back(make_pair(node2->getSons()[0],axis));
-                            newNodesToSplitFurther.push_back(make_pair(node2->getSons()[1],axis));
+                            newNodesToSplitFurther.push_back(make_pair(m_nodes[node2].sons[0],axis));
+                            newNodesToSplitFurther.push_back(make_pair(m_nodes[node2].sons[1],axis));
                         //}
                     }
                 }
@@ -1381,23 +2023,16 @@ void BinTree::build()
 }
 
 /*****************************************************************/
-std::vector<TLine*> BinTree::getBoundaryTLines()
+std::vector<TLine*> BinTree::getBoundaryTLines() const
 /*****************************************************************/
 {
-    if(m_leaf)
-    {
-        return m_leaf->getBoundaryTLines();
-    }
-    else
+    vector<TLine*> lines;
+    for(unsigned int l=0;l<m_leaves.size();l++)
     {
-        vector<TLine*> lines;
-        vector<TLine*> lines1 = m_treeSons[0]->getBoundaryTLines();
-        vector<TLine*> lines2 = m_treeSons[1]->getBoundaryTLines();
-        
-        lines.insert(lines.end(),lines1.begin(), lines1.end());
-        lines.insert(lines.end(),lines2.begin(), lines2.end());
-        return lines;
+        vector<TLine*> leafLines = m_leaves[l].getBoundaryTLines();
+        lines.insert(lines.end(),leafLines.begin(), leafLines.end());
     }
+    return lines;
 }
 
 
@@ -1414,14 +2049,15 @@ TH1* BinTree::fillHistogram()
         if(m_ndim>3)
         {
             stringstream error;
-            error << "BinTree::fillHistogram(): Cannot fill histograms with more than 3 dimensions";
+            error << "BinTree::fillHistogram(): Cannot fill histograms with more than 3 dimensions. Use fillGrid()";
             throw runtime_error(error.str());
         }
         TH1* histo = (TH1*)m_gridConstraint->Clone("histoFromTree");
         int nbinsx = histo->GetNbinsX();
         int nbinsy = histo->GetNbinsY();
         int nbinsz = histo->GetNbinsZ();
-        map<BinLeaf*, vector< vector<int> > > binsInLeaf;
+        // TH bins contained in each leaf, indexed by leaf index
+        vector< vector< vector<int> > > binsInLeaf(m_leaves.size());
         // First find the list of TH2 bins for each BinLeaf bin
         for(int bx=1;bx<nbinsx+1;bx++) 
         {
@@ -1441,17 +2077,12 @@ TH1* BinTree::fillHistogram()
                         point.push_back(x);
                         point.push_back(y);
                         point.push_back(z);
-                        BinLeaf* leaf = getLeaf(point);
-                        if(binsInLeaf.find(leaf)==binsInLeaf.end())
-                        {
-                            vector< vector<int> > empty;
-                            binsInLeaf[leaf] = empty;
-                        }
+                        int leaf = findLeaf(point);
                         vector<int> bin;
                         bin.push_back(bx);
                         bin.push_back(by);
                         bin.push_back(bz);
-                        binsInLeaf[leaf].push_back(bin);
+                        if(leaf>=0) binsInLeaf[leaf].push_back(bin);
                     }
                 }
                 else if(m_ndim==2)
@@ -1464,57 +2095,36 @@ TH1* BinTree::fillHistogram()
                     vector<double> point;
                     point.push_back(x);
                     point.push_back(y);
-                    BinLeaf* leaf = getLeaf(point);
-                    if(binsInLeaf.find(leaf)==binsInLeaf.end())
-                    {
-                        vector< vector<int> > empty;
-                        binsInLeaf[leaf] = empty;
-                    }
+                    int leaf = findLeaf(point);
                     vector<int> bin;
                     bin.push_back(bx);
                     bin.push_back(by);
-                    binsInLeaf[leaf].push_back(bin);
+                    if(leaf>=0) binsInLeaf[leaf].push_back(bin);
                 }
             }
         }
-        // Then all the TH2 bins are filled according to the entries in the BinLeaf bins
-        map<BinLeaf*, vector< vector<int> > >::iterator it = binsInLeaf.begin();
-        map<BinLeaf*, vector< vector<int> > >::iterator itE = binsInLeaf.end();
-        for(;it!=itE;++it)
+        // Then all the TH2 bins are filled according to the sums of weights in the BinLeaf bins.
+        // The sums also include the entries of a stored partition, which are not in memory
+        for(unsigned int l=0;l<m_leaves.size();l++)
         {
-            BinLeaf* leaf = it->first;
-            vector< vector<int> > bins = it->second;
-            const EntryList& entries = leaf->getEntries();
+            const vector< vector<int> >& bins = binsInLeaf[l];
             int nbins = bins.size();
+            if(nbins==0) continue;
+            double content = m_leaves[l].getSumOfWeights()/(double)nbins;
+            double error = m_leaves[l].getEntries().sumOfWeightsError()/(double)nbins;
             for(int b=0;b<nbins;b++)
             {
                 if(m_ndim==2)
                 {
                     TH2F* h2f = dynamic_cast<TH2F*>(histo);
-                    int bx = bins[b][0];
-                    int by = bins[b][1];
-                    double x = h2f->GetXaxis()->GetBinCenter(bx);
-                    double y = h2f->GetYaxis()->GetBinCenter(by);
-                    for(unsigned int e=0;e<entries.size();e++)
-                    {
-                        double value = entries.weight(e)/(double)nbins;
-                        h2f->Fill(x,y,value);
-                    }
+                    h2f->SetBinContent(bins[b][0],bins[b][1],content);
+                    h2f->SetBinError(bins[b][0],bins[b][1],error);
                 }
                 else if(m_ndim==3)
                 {
                     TH3F* h3f = dynamic_cast<TH3F*>(histo);
-                    int bx = bins[b][0];
-                    int by = bins[b][1];
-                    int bz = bins[b][2];
-                    double x = h3f->GetXaxis()->GetBinCenter(bx);
-                    double y = h3f->GetYaxis()->GetBinCenter(by);
-                    double z = h3f->GetZaxis()->GetBinCenter(bz);
-                    for(unsigned int e=0;e<entries.size();e++)
-                    {
-                        double value = entries.weight(e)/(double)nbins;
-                        h3f->Fill(x,y,z,value);
-                    }
+                    h3f->SetBinContent(bins[b][0],bins[b][1],bins[b][2],content);
+                    h3f->SetBinError(bins[b][0],bins[b][1],bins[b][2],error);
                 }
             }
         }
@@ -1523,7 +2133,7 @@ TH1* BinTree::fillHistogram()
 
 
 /*****************************************************************/
-vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
+vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate, const vector<TH1*>* previousWidths, const vector<bool>* updatedLeaves)
 /*****************************************************************/
 {
     if(!widthTemplate && !m_gridConstraint)
@@ -1535,9 +2145,26 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
     if(m_ndim>3)
     {
         stringstream error;
-        error << "BinTree::fillWidths(): Cannot fill histograms with more than 3 dimensions";
+        error << "BinTree::fillWidths(): Cannot fill histograms with more than 3 dimensions. Use fillWidthsGrid()";
         throw runtime_error(error.str());
     }
+    // When the widths of a previous partition are given, only bins in the neighbourhood of updated leaves are recomputed.
+    // The width in a bin only depends on the leaf containing the bin center and on its neighbors
+    vector<bool> affectedLeaves;
+    if(previousWidths && updatedLeaves)
+    {
+        affectedLeaves.resize(m_leaves.size(), false);
+        for(unsigned int l=0;l<m_leaves.size() && l<updatedLeaves->size();l++)
+        {
+            if(!(*updatedLeaves)[l]) continue;
+            affectedLeaves[l] = true;
+            vector<const BinLeaf*> neighborLeaves = findNeighborLeaves(&m_leaves[l]);
+            for(unsigned int n=0;n<neighborLeaves.size();n++)
+            {
+                affectedLeaves[neighborLeaves[n]->index()] = true;
+            }
+        }
+    }
     vector<TH1*> widths;
     if(m_ndim==2)
     {
@@ -1553,7 +2180,7 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
             for(int by=1;by<nbinsy+1;by++)
             {
                 counter++;
-                if(counter % (total/100) == 0)
+                if(m_verbose && counter % (total/100) == 0)
                 {
                     double ratio  =  (double)counter/(double)total;
                     int   c      =  ratio * 50;
@@ -1568,11 +2195,19 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
                 point.push_back(x);
                 point.push_back(y);
                 //cout<<"Computing width for ("<<x<<","<<y<<")\n";
-                BinLeaf* leaf = getLeaf(point);
-                vector<BinLeaf*> neighborLeaves = findNeighborLeaves(leaf);
+                const BinLeaf* leaf = getLeaf(point);
+                if(affectedLeaves.size()>0 && !affectedLeaves[leaf->index()])
+                {
+                    hWidthX->SetBinContent(bx,by,(*previousWidths)[0]->GetBinContent(bx,by));
+                    hWidthY->SetBinContent(bx,by,(*previousWidths)[1]->GetBinContent(bx,by));
+                    hWidthX->SetBinError(bx,by,0.);
+                    hWidthY->SetBinError(bx,by,0.);
+                    continue;
+                }
+                vector<const BinLeaf*> neighborLeaves = findNeighborLeaves(leaf);
                 neighborLeaves.push_back(leaf);
-                vector<BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
-                vector<BinLeaf*>::iterator itELeaf = neighborLeaves.end();
+                vector<const BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
+                vector<const BinLeaf*>::iterator itELeaf = neighborLeaves.end();
                 double sumw = 0.;
                 double sumwx = 0.;
                 double sumwy = 0.;
@@ -1624,7 +2259,7 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
                 for(int bz=1;bz<nbinsz+1;bz++)
                 {
                     counter++;
-                    if(counter % (total/100) == 0)
+                    if(m_verbose && counter % (total/100) == 0)
                     {
                         double ratio  =  (double)counter/(double)total;
                         int   c      =  ratio * 50;
@@ -1641,11 +2276,21 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
                     point.push_back(y);
                     point.push_back(z);
                     //cout<<"Computing width for ("<<x<<","<<y<<")\n";
-                    BinLeaf* leaf = getLeaf(point);
-                    vector<BinLeaf*> neighborLeaves = findNeighborLeaves(leaf);
+                    const BinLeaf* leaf = getLeaf(point);
+                    if(affectedLeaves.size()>0 && !affectedLeaves[leaf->index()])
+                    {
+                        hWidthX->SetBinContent(bx,by,bz,(*previousWidths)[0]->GetBinContent(bx,by,bz));
+                        hWidthY->SetBinContent(bx,by,bz,(*previousWidths)[1]->GetBinContent(bx,by,bz));
+                        hWidthZ->SetBinContent(bx,by,bz,(*previousWidths)[2]->GetBinContent(bx,by,bz));
+                        hWidthX->SetBinError(bx,by,bz,0.);
+                        hWidthY->SetBinError(bx,by,bz,0.);
+                        hWidthZ->SetBinError(bx,by,bz,0.);
+                        continue;
+                    }
+                    vector<const BinLeaf*> neighborLeaves = findNeighborLeaves(leaf);
                     neighborLeaves.push_back(leaf);
-                    vector<BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
-                    vector<BinLeaf*>::iterator itELeaf = neighborLeaves.end();
+                    vector<const BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
+                    vector<const BinLeaf*>::iterator itELeaf = neighborLeaves.end();
                     double sumw = 0.;
                     double sumwx = 0.;
                     double sumwy = 0.;
@@ -1689,9 +2334,12 @@ vector<TH1*> BinTree::fillWidthsHighStat(const TH1* widthTemplate)
         widths.push_back(hWidthY);
         widths.push_back(hWidthZ);
     }
-    cout << "[INFO]   "<< setw(3) << 100 << "% [";
-    for (int x=0; x<50; x++) cout << "=";
-    cout << "]" << endl;
+    if(m_verbose)
+    {
+        cout << "[INFO]   "<< setw(3) << 100 << "% [";
+        for (int x=0; x<50; x++) cout << "=";
+        cout << "]" << endl;
+    }
     return widths;
 }
 
@@ -1708,7 +2356,7 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
     if(m_ndim>3)
     {
         stringstream error;
-        error << "BinTree::fillWidths(): Cannot fill histograms with more than 3 dimensions";
+        error << "BinTree::fillWidths(): Cannot fill histograms with more than 3 dimensions. Use fillWidthsGrid()";
         throw runtime_error(error.str());
     }
     vector<TH1*> widths;
@@ -1721,13 +2369,13 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
         int nbinsy = hWidthX->GetNbinsY();
         int counter = 0;
         int total = nbinsx*nbinsy;
-        vector<BinLeaf*> neighborLeaves = getLeaves();
+        const vector<BinLeaf>& neighborLeaves = getLeaves();
         for(int bx=1;bx<nbinsx+1;bx++) 
         {
             for(int by=1;by<nbinsy+1;by++)
             {
                 counter++;
-                if(counter % (total/100) == 0)
+                if(m_verbose && counter % (total/100) == 0)
                 {
                     double ratio  =  (double)counter/(double)total;
                     int   c      =  ratio * 50;
@@ -1744,7 +2392,7 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                 point.push_back(x);
                 point.push_back(y);
                 //cout<<"Computing width for ("<<x<<","<<y<<")\n";
-                BinLeaf* leaf = getLeaf(point);
+                const BinLeaf* leaf = getLeaf(point);
                 if(leaf->getWidth(0)<=xBinWidth && leaf->getWidth(1)<=yBinWidth) 
                 {
                     hWidthX->SetBinContent(bx,by,leaf->getWidth(0));
@@ -1753,8 +2401,8 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                     hWidthY->SetBinError(bx,by,0.);
                     continue;
                 }
-                vector<BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
-                vector<BinLeaf*>::iterator itELeaf = neighborLeaves.end();
+                vector<BinLeaf>::const_iterator itLeaf = neighborLeaves.begin();
+                vector<BinLeaf>::const_iterator itELeaf = neighborLeaves.end();
                 double sumw = 0.;
                 double sumwx = 0.;
                 double sumwy = 0.;
@@ -1763,12 +2411,12 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                 double yRegionSize = getMax(1)-getMin(1);
                 for(;itLeaf!=itELeaf;++itLeaf)
                 {
-                    double xi = (*itLeaf)->getCenter(0);
-                    double yi = (*itLeaf)->getCenter(1);
+                    double xi = itLeaf->getCenter(0);
+                    double yi = itLeaf->getCenter(1);
                     double dx = fabs(xi-x)/xRegionSize;
                     double dy = fabs(yi-y)/yRegionSize;
-                    double wxi = (*itLeaf)->getWidth(0);
-                    double wyi = (*itLeaf)->getWidth(1);
+                    double wxi = itLeaf->getWidth(0);
+                    double wyi = itLeaf->getWidth(1);
                     if(dx<0.001*wxi) dx = 0.001*wxi;
                     if(dy<0.001*wyi) dy = 0.001*wyi;
                     double dr2 = dx*dx+dy*dy;
@@ -1803,7 +2451,7 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
         int nbinsz = hWidthX->GetNbinsZ();
         int counter = 0;
         int total = nbinsx*nbinsy*nbinsz;
-        vector<BinLeaf*> neighborLeaves = getLeaves();
+        const vector<BinLeaf>& neighborLeaves = getLeaves();
         for(int bx=1;bx<nbinsx+1;bx++) 
         {
             for(int by=1;by<nbinsy+1;by++)
@@ -1811,7 +2459,7 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                 for(int bz=1;bz<nbinsz+1;bz++)
                 {
                     counter++;
-                    if(counter % (total/100) == 0)
+                    if(m_verbose && counter % (total/100) == 0)
                     {
                         double ratio  =  (double)counter/(double)total;
                         int   c      =  ratio * 50;
@@ -1830,7 +2478,7 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                     point.push_back(x);
                     point.push_back(y);
                     point.push_back(z);
-                    BinLeaf* leaf = getLeaf(point);
+                    const BinLeaf* leaf = getLeaf(point);
                     if(leaf->getWidth(0)<=xBinWidth && leaf->getWidth(1)<=yBinWidth && leaf->getWidth(2)<=zBinWidth)
                     {
                         hWidthX->SetBinContent(bx,by,bz, leaf->getWidth(0));
@@ -1842,8 +2490,8 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                         continue;
                     }
                     //cout<<"Computing width for ("<<x<<","<<y<<")\n";
-                    vector<BinLeaf*>::iterator itLeaf = neighborLeaves.begin();
-                    vector<BinLeaf*>::iterator itELeaf = neighborLeaves.end();
+                    vector<BinLeaf>::const_iterator itLeaf = neighborLeaves.begin();
+                    vector<BinLeaf>::const_iterator itELeaf = neighborLeaves.end();
                     double sumw = 0.;
                     double sumwx = 0.;
                     double sumwy = 0.;
@@ -1851,15 +2499,15 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
                     //cout<<" "<<neighborLeaves.size()<<" neighbor leaves\n";
                     for(;itLeaf!=itELeaf;++itLeaf)
                     {
-                        double xi = (*itLeaf)->getCenter(0);
-                        double yi = (*itLeaf)->getCenter(1);
-                        double zi = (*itLeaf)->getCenter(2);
+                        double xi = itLeaf->getCenter(0);
+                        double yi = itLeaf->getCenter(1);
+                        double zi = itLeaf->getCenter(2);
                         double dx = fabs(xi-x);
                         double dy = fabs(yi-y);
                         double dz = fabs(zi-z);
-                        double wxi = (*itLeaf)->getWidth(0);
-                        double wyi = (*itLeaf)->getWidth(1);
-                        double wzi = (*itLeaf)->getWidth(2);
+                        double wxi = itLeaf->getWidth(0);
+                        double wyi = itLeaf->getWidth(1);
+                        double wzi = itLeaf->getWidth(2);
                         if(dx<0.001*wxi) dx = 0.001*wxi;
                         if(dy<0.001*wyi) dy = 0.001*wyi;
                         if(dz<0.001*wzi) dz = 0.001*wzi;
@@ -1887,9 +2535,12 @@ vector<TH1*> BinTree::fillWidthsLowStat(const TH1* widthTemplate)
         widths.push_back(hWidthY);
         widths.push_back(hWidthZ);
     }
-    cout << "[INFO]   "<< setw(3) << 100 << "% [";
-    for (int x=0; x<50; x++) cout << "=";
-    cout << "]" << endl;
+    if(m_verbose)
+    {
+        cout << "[INFO]   "<< setw(3) << 100 << "% [";
+        for (int x=0; x<50; x++) cout << "=";
+        cout << "]" << endl;
+    }
     return widths;
 }
 
@@ -1907,7 +2558,230 @@ vector<TH1*> BinTree::fillWidths(const TH1* widthTemplate)
     }
 }
 
+/*****************************************************************/
+vector<TH1*> BinTree::fillWidths(const TH1* widthTemplate, const vector<TH1*>& previousWidths, const vector<bool>& updatedLeaves)
+/*****************************************************************/
+{
+    // Widths of a previous version of the tree are reused where the partition hasn't changed.
+    // This is only possible when widths are computed from neighbor bins, with the same binning as before
+    const TH1* gridRef = (widthTemplate ? widthTemplate : m_gridConstraint);
+    bool compatible = (getNLeaves()>=500 && gridRef && previousWidths.size()==m_ndim);
+    for(unsigned int axis=0;axis<previousWidths.size() && compatible;axis++)
+    {
+        const TH1* previous = previousWidths[axis];
+        if(!previous ||
+                previous->GetNbinsX()!=gridRef->GetNbinsX() ||
+                previous->GetNbinsY()!=gridRef->GetNbinsY() ||
+                previous->GetNbinsZ()!=gridRef->GetNbinsZ())
+        {
+            compatible = false;
+        }
+    }
+    if(!compatible)
+    {
+        return fillWidths(widthTemplate);
+    }
+    unsigned int nupdated = 0;
+    for(unsigned int l=0;l<updatedLeaves.size();l++)
+    {
+        if(updatedLeaves[l]) nupdated++;
+    }
+    if(m_verbose) cout<<"[INFO]   Recomputing widths around "<<nupdated<<" updated bins\n";
+    return fillWidthsHighStat(widthTemplate, &previousWidths, &updatedLeaves);
+}
 
+/*****************************************************************/
+vector<int> BinTree::leafGridBins(const BinLeaf& leaf) const
+/*****************************************************************/
+{
+    // Indices of the grid bins with their center inside the leaf
+    const GridND& grid = *m_gridConstraintND;
+    vector<int> first(m_ndim);
+    vector<int> last(m_ndim);
+    unsigned int nbins = 1;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        double low = (leaf.getMin(axis)-grid.getMinMax()[axis].first)/grid.getBinWidth(axis);
+        double up = (leaf.getMax(axis)-grid.getMinMax()[axis].first)/grid.getBinWidth(axis);
+        first[axis] = max((int)ceil(low+0.5), 1);
+        last[axis] = min((int)ceil(up+0.5)-1, grid.getNbins(axis));
+        if(last[axis]<first[axis]) return vector<int>();
+        nbins *= (last[axis]-first[axis]+1);
+    }
+    vector<int> indices;
+    indices.reserve(nbins);
+    vector<int> bins(first);
+    while(true)
+    {
+        indices.push_back(grid.index(bins));
+        unsigned int axis = 0;
+        for(;axis<m_ndim;axis++)
+        {
+            if(bins[axis]<last[axis])
+            {
+                bins[axis]++;
+                break;
+            }
+            bins[axis] = first[axis];
+        }
+        if(axis==m_ndim) break;
+    }
+    return indices;
+}
 
+/*****************************************************************/
+GridND* BinTree::fillGrid() const
+/*****************************************************************/
+{
+    if(!m_gridConstraintND)
+    {
+        stringstream error;
+        error << "BinTree::fillGrid(): Trying to fill grid, but the binning is unknown. Define first the gridConstraintND";
+        throw runtime_error(error.str());
+    }
+    // The content of each leaf is shared uniformly between the grid bins it contains
+    GridND* grid = new GridND(*m_gridConstraintND);
+    grid->setName("gridFromTree");
+    grid->reset();
+    for(unsigned int l=0;l<m_leaves.size();l++)
+    {
+        vector<int> indices = leafGridBins(m_leaves[l]);
+        if(indices.size()==0) continue;
+        double nbins = (double)indices.size();
+        double content = m_leaves[l].getSumOfWeights()/nbins;
+        double error = m_leaves[l].getEntries().sumOfWeightsError()/nbins;
+        for(unsigned int i=0;i<indices.size();i++)
+        {
+            grid->setBinContent(indices[i], content);
+            grid->setBinError(indices[i], error);
+        }
+    }
+    return grid;
+}
 
-
+/*****************************************************************/
+vector<GridND*> BinTree::fillWidthsGrid() const
+/*****************************************************************/
+{
+    if(!m_gridConstraintND)
+    {
+        stringstream error;
+        error << "BinTree::fillWidthsGrid(): Trying to fill widths, but the binning is unknown. Define first the gridConstraintND";
+        throw runtime_error(error.str());
+    }
+    // Same procedure as fillWidthsLowStat() and fillWidthsHighStat(), for any number of dimensions:
+    // with less than 500 leaves all leaves are used, otherwise only the neighbor leaves
+    const GridND& gridRef = *m_gridConstraintND;
+    bool lowStat = (getNLeaves()<500);
+    vector<GridND*> widths;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        stringstream name;
+        name << "width" << axis << "FromTree";
+        widths.push_back(new GridND(gridRef));
+        widths.back()->setName(name.str());
+        widths.back()->reset();
+    }
+    // Leaf containing each grid bin
+    vector<int> leafOfBin(gridRef.size(), -1);
+    for(unsigned int l=0;l<m_leaves.size();l++)
+    {
+        vector<int> indices = leafGridBins(m_leaves[l]);
+        for(unsigned int i=0;i<indices.size();i++)
+        {
+            leafOfBin[indices[i]] = l;
+        }
+    }
+    vector<double> regionSizes;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        regionSizes.push_back(getMax(axis)-getMin(axis));
+    }
+    // Neighbors are searched only once per leaf
+    map<int, vector<const BinLeaf*> > neighborCache;
+    vector<double> point;
+    vector<double> sumwWidths(m_ndim);
+    unsigned int total = gridRef.size();
+    for(unsigned int index=0;index<total;index++)
+    {
+        if(m_verbose && total>=100 && index % (total/100) == 0)
+        {
+            double ratio  =  (double)index/(double)total;
+            int   c      =  ratio * 50;
+            cout << "[INFO]   "<< setw(3) << (int)(ratio*100) << "% [";
+            for (int x=0; x<c; x++) cout << "=";
+            for (int x=c; x<50; x++) cout << " ";
+            cout << "]\r" << flush;
+        }
+        if(leafOfBin[index]<0) continue;
+        const BinLeaf& leaf = m_leaves[leafOfBin[index]];
+        gridRef.binCenter(index, point);
+        vector<const BinLeaf*> leaves;
+        if(lowStat)
+        {
+            bool smallLeaf = true;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                if(leaf.getWidth(axis)>gridRef.getBinWidth(axis)) smallLeaf = false;
+            }
+            if(smallLeaf)
+            {
+                for(unsigned int axis=0;axis<m_ndim;axis++)
+                {
+                    widths[axis]->setBinContent(index, leaf.getWidth(axis));
+                }
+                continue;
+            }
+            for(unsigned int l=0;l<m_leaves.size();l++) leaves.push_back(&m_leaves[l]);
+        }
+        else
+        {
+            map<int, vector<const BinLeaf*> >::iterator itCache = neighborCache.find(leaf.index());
+            if(itCache==neighborCache.end())
+            {
+                vector<const BinLeaf*> neighborLeaves = findNeighborLeaves(&leaf);
+                neighborLeaves.push_back(&leaf);
+                itCache = neighborCache.insert(make_pair((int)leaf.index(), neighborLeaves)).first;
+            }
+            leaves = itCache->second;
+        }
+        double sumw = 0.;
+        sumwWidths.assign(m_ndim, 0.);
+        for(unsigned int l=0;l<leaves.size();l++)
+        {
+            double dr2 = 0.;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                double d = fabs(leaves[l]->getCenter(axis)-point[axis]);
+                double w = leaves[l]->getWidth(axis);
+                if(lowStat)
+                {
+                    d /= regionSizes[axis];
+                    if(d<0.001*w) d = 0.001*w;
+                }
+                else if(d<0.05*w)
+                {
+                    d = 0.05*w;
+                }
+                dr2 += d*d;
+            }
+            double dr = (lowStat ? dr2 : sqrt(dr2));
+            sumw += 1./dr;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                sumwWidths[axis] += leaves[l]->getWidth(axis)/dr;
+            }
+        }
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            widths[axis]->setBinContent(index, sumwWidths[axis]/sumw);
+        }
+    }
+    if(m_verbose)
+    {
+        cout << "[INFO]   "<< setw(3) << 100 << "% [";
+        for (int x=0; x<50; x++) cout << "=";
+        cout << "]" << endl;
+    }
+    return widths;
+}
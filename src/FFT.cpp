@@ -0,0 +1,136 @@
+
+
+
+#include "FFT.h"
+#include "ThreadPool.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+
+
+/*****************************************************************/
+unsigned int FFT::nextPowerOfTwo(unsigned int n)
+/*****************************************************************/
+{
+    unsigned int power = 1;
+    while(power<n) power <<= 1;
+    return power;
+}
+
+
+/*****************************************************************/
+void FFT::twiddleFactors(unsigned int n, bool inverse, vector< complex<double> >& twiddles)
+/*****************************************************************/
+{
+    // exp(-+2i.pi.k/n) for k<n/2
+    twiddles.resize(n/2);
+    double sign = (inverse ? 1. : -1.);
+    for(unsigned int k=0;k<n/2;k++)
+    {
+        twiddles[k] = polar(1., sign*2.*M_PI*(double)k/(double)n);
+    }
+}
+
+
+/*****************************************************************/
+void FFT::transformLine(complex<double>* line, unsigned int n, const vector< complex<double> >& twiddles)
+/*****************************************************************/
+{
+    // Iterative Cooley-Tukey: bit reversal permutation, then butterflies of increasing size
+    for(unsigned int i=1, j=0;i<n;i++)
+    {
+        unsigned int bit = n>>1;
+        for(;j&bit;bit>>=1) j ^= bit;
+        j ^= bit;
+        if(i<j) swap(line[i], line[j]);
+    }
+    for(unsigned int length=2;length<=n;length<<=1)
+    {
+        unsigned int step = n/length;
+        for(unsigned int start=0;start<n;start+=length)
+        {
+            for(unsigned int k=0;k<length/2;k++)
+            {
+                // Product written explicitly: complex<double> multiplication checks for NaN/inf and is much slower
+                const complex<double>& w = twiddles[k*step];
+                const complex<double>& x = line[start+k+length/2];
+                complex<double> v(x.real()*w.real()-x.imag()*w.imag(), x.real()*w.imag()+x.imag()*w.real());
+                complex<double> u = line[start+k];
+                line[start+k] = u+v;
+                line[start+k+length/2] = u-v;
+            }
+        }
+    }
+}
+
+
+/*****************************************************************/
+void FFT::transform(vector< complex<double> >& data, bool inverse)
+/*****************************************************************/
+{
+    vector<unsigned int> sizes(1, data.size());
+    transform(data, sizes, inverse);
+}
+
+
+/*****************************************************************/
+void FFT::transform(vector< complex<double> >& data, const vector<unsigned int>& sizes, bool inverse)
+/*****************************************************************/
+{
+    unsigned int total = 1;
+    for(unsigned int axis=0;axis<sizes.size();axis++)
+    {
+        if(sizes[axis]==0 || (sizes[axis]&(sizes[axis]-1))!=0)
+        {
+            stringstream error;
+            error << "FFT::transform(): Size "<<sizes[axis]<<" along axis "<<axis<<" is not a power of 2";
+            throw runtime_error(error.str());
+        }
+        total *= sizes[axis];
+    }
+    if(total!=data.size())
+    {
+        stringstream error;
+        error << "FFT::transform(): Array size ("<<data.size()<<") doesn't match the dimensions ("<<total<<")";
+        throw runtime_error(error.str());
+    }
+    unsigned int stride = total;
+    for(unsigned int axis=0;axis<sizes.size();axis++)
+    {
+        unsigned int n = sizes[axis];
+        stride /= n;
+        if(n==1) continue;
+        vector< complex<double> > twiddles;
+        twiddleFactors(n, inverse, twiddles);
+        // Lines along this axis start at (outer*n*stride + inner), with outer<total/(n*stride) and inner<stride.
+        // Blocks of lines with consecutive inner positions are gathered together, which reads contiguous memory
+        unsigned int block = min(stride, 16u);
+        unsigned int nblocksPerOuter = (stride+block-1)/block;
+        unsigned int nouter = total/(n*stride);
+        ThreadPool::global().parallelFor(nouter*nblocksPerOuter, [&](unsigned int task)
+        {
+            unsigned int outer = task/nblocksPerOuter;
+            unsigned int firstInner = (task%nblocksPerOuter)*block;
+            unsigned int nlines = min(block, stride-firstInner);
+            unsigned int first = outer*n*stride + firstInner;
+            vector< complex<double> > lines(nlines*n);
+            for(unsigned int i=0;i<n;i++)
+            {
+                for(unsigned int l=0;l<nlines;l++) lines[l*n+i] = data[first+i*stride+l];
+            }
+            for(unsigned int l=0;l<nlines;l++) transformLine(&lines[l*n], n, twiddles);
+            for(unsigned int i=0;i<n;i++)
+            {
+                for(unsigned int l=0;l<nlines;l++) data[first+i*stride+l] = lines[l*n+i];
+            }
+        });
+    }
+    if(inverse)
+    {
+        double norm = 1./(double)total;
+        for(unsigned int i=0;i<total;i++) data[i] *= norm;
+    }
+}
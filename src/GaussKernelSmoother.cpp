@@ -18,6 +18,9 @@
 
 
 #include "GaussKernelSmoother.h"
+#include "GridND.h"
+#include "ThreadPool.h"
+#include "FFT.h"
 
 #include <TMath.h>
 #include <TH2F.h>
@@ -27,6 +30,10 @@
 #include <iostream>
 #include <iomanip>
 #include <stdexcept>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <cmath>
 
 using namespace std;
 
@@ -34,7 +41,19 @@ using namespace std;
 /*****************************************************************/
 GaussKernelSmoother::GaussKernelSmoother():
     m_ndim(2),
-    m_widthScalingFactor(1.)
+    m_widthScalingFactor(1.),
+    m_nhistos(1),
+    m_total(0),
+    m_widthTolerance(0.),
+    m_truncationTolerance(0.),
+    m_kernelShape(GAUSSIAN),
+    m_fftBandStep(0.),
+    m_boxFilter(false),
+    m_pyramidLevels(0),
+    m_dampingScale(1.),
+    m_mirrorAxis(-1),
+    m_antiMirror(false),
+    m_verbose(true)
 /*****************************************************************/
 {
 }
@@ -42,11 +61,36 @@ GaussKernelSmoother::GaussKernelSmoother():
 /*****************************************************************/
 GaussKernelSmoother::GaussKernelSmoother(unsigned int ndim):
     m_ndim(ndim),
-    m_widthScalingFactor(1.)
+    m_widthScalingFactor(1.),
+    m_nhistos(1),
+    m_total(0),
+    m_widthTolerance(0.),
+    m_truncationTolerance(0.),
+    m_kernelShape(GAUSSIAN),
+    m_fftBandStep(0.),
+    m_boxFilter(false),
+    m_pyramidLevels(0),
+    m_dampingScale(1.),
+    m_mirrorAxis(-1),
+    m_antiMirror(false),
+    m_verbose(true)
 /*****************************************************************/
 {
 }
 
+/*****************************************************************/
+GaussKernelSmoother::KernelShape GaussKernelSmoother::kernelShapeFromName(const string& name)
+/*****************************************************************/
+{
+    if(name=="gaussian") return GAUSSIAN;
+    if(name=="epanechnikov") return EPANECHNIKOV;
+    if(name=="tricube") return TRICUBE;
+    if(name=="biweight") return BIWEIGHT;
+    stringstream error;
+    error << "GaussKernelSmoother::kernelShapeFromName(): Unknown kernel shape '"<<name<<"'. Possible shapes are 'gaussian', 'epanechnikov', 'tricube' and 'biweight'";
+    throw runtime_error(error.str());
+}
+
 /*****************************************************************/
 GaussKernelSmoother::~GaussKernelSmoother()
 /*****************************************************************/
@@ -56,107 +100,314 @@ GaussKernelSmoother::~GaussKernelSmoother()
         if(m_widths[axis]) m_widths[axis]->Delete();
     }
     m_widths.clear();
+    for(unsigned int axis=0;axis<m_widthsND.size();axis++)
+    {
+        delete m_widthsND[axis];
+    }
+    m_widthsND.clear();
 }
 
 /*****************************************************************/
 TH1* GaussKernelSmoother::smooth(const TH1* histo)
 /*****************************************************************/
 {
+    vector<const TH1*> histos(1, histo);
+    return smooth(histos)[0];
+}
+
+/*****************************************************************/
+vector<TH1*> GaussKernelSmoother::smooth(const vector<const TH1*>& histos)
+/*****************************************************************/
+{
+    // The kernel of each bin is computed once and applied to all the histograms,
+    // which must have the same binning
     if(m_ndim!=2 && m_ndim!=3)
     {
         stringstream error;
         error << "GaussKernelSmoother::smooth(): Smoothing in 2D or 3D only is implemented";
         throw runtime_error(error.str());
     }
-    TH1* smoothedHisto = NULL;
-    if(m_ndim==2)
+    if(histos.empty())
+    {
+        stringstream error;
+        error << "GaussKernelSmoother::smooth(): No histogram to smooth";
+        throw runtime_error(error.str());
+    }
+    const TH1* reference = histos[0];
+    for(unsigned int h=1;h<histos.size();h++)
+    {
+        const TH1* histo = histos[h];
+        bool sameBinning = (histo->GetNbinsX()==reference->GetNbinsX() && histo->GetNbinsY()==reference->GetNbinsY() && histo->GetNbinsZ()==reference->GetNbinsZ());
+        sameBinning = sameBinning && histo->GetXaxis()->GetXmin()==reference->GetXaxis()->GetXmin() && histo->GetXaxis()->GetXmax()==reference->GetXaxis()->GetXmax();
+        sameBinning = sameBinning && histo->GetYaxis()->GetXmin()==reference->GetYaxis()->GetXmin() && histo->GetYaxis()->GetXmax()==reference->GetYaxis()->GetXmax();
+        sameBinning = sameBinning && histo->GetZaxis()->GetXmin()==reference->GetZaxis()->GetXmin() && histo->GetZaxis()->GetXmax()==reference->GetZaxis()->GetXmax();
+        if(!sameBinning)
+        {
+            stringstream error;
+            error << "GaussKernelSmoother::smooth(): Histograms '"<<reference->GetName()<<"' and '"<<histo->GetName()<<"' don't have the same binning";
+            throw runtime_error(error.str());
+        }
+    }
+    // Each bin is computed independently. Results are stored per bin and copied
+    // in the histograms afterwards, so the output doesn't depend on the number of threads
+    fillArrays(histos);
+    vector< pair<double,double> > valueErrors(m_nhistos*m_total);
+    smoothArrays(valueErrors);
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int nbinsz = (m_ndim==3 ? m_nbins[2] : 1);
+    vector<TH1*> smoothedHistos;
+    for(unsigned int h=0;h<m_nhistos;h++)
     {
-        int nbinsx = histo->GetNbinsX();
-        int nbinsy = histo->GetNbinsY();
         stringstream hName;
-        hName << histo->GetName() << "_smooth";
-        TH2F* smoothedHisto2F = dynamic_cast<TH2F*>(histo->Clone(hName.str().c_str()));
-        smoothedHisto2F->SetDirectory(0);
-        int counter = 0;
-        int total = nbinsx*nbinsy;
+        hName << histos[h]->GetName() << "_smooth";
+        TH1* smoothedHisto = NULL;
+        if(m_ndim==2) smoothedHisto = dynamic_cast<TH2F*>(histos[h]->Clone(hName.str().c_str()));
+        else smoothedHisto = dynamic_cast<TH3F*>(histos[h]->Clone(hName.str().c_str()));
+        smoothedHisto->SetDirectory(0);
+        const pair<double,double>* histoValueErrors = &valueErrors[h*m_total];
         for(int bx=1;bx<=nbinsx;bx++)
         {
             for(int by=1;by<=nbinsy;by++)
             {
-                if(counter % (total/100) == 0)
+                for(int bz=1;bz<=nbinsz;bz++)
                 {
-                    double ratio  =  (double)counter/(double)total;
-                    int   c      =  ratio * 50;
-                    cout << "[INFO]   "<< setw(3) << (int)(ratio*100) << "% [";
-                    for (int x=0; x<c; x++) cout << "=";
-                    for (int x=c; x<50; x++) cout << " ";
-                    cout << "]\r" << flush;
+                    const pair<double,double>& valueError = histoValueErrors[((bx-1)*nbinsy+(by-1))*nbinsz+(bz-1)];
+                    int bin = (m_ndim==2 ? smoothedHisto->GetBin(bx, by) : smoothedHisto->GetBin(bx, by, bz));
+                    smoothedHisto->SetBinContent(bin, valueError.first);
+                    smoothedHisto->SetBinError(bin, valueError.second);
                 }
-                counter++;
-                double x0 = histo->GetXaxis()->GetBinCenter(bx);
-                double y0 = histo->GetYaxis()->GetBinCenter(by);
-                vector<double> point;
-                point.push_back(x0);
-                point.push_back(y0);
-                pair<double,double> valueError = smoothedValueError(histo, point);
-                //cout<<"Bin "<<bx<<","<<by<<": smoothed = "<<valueError.first<<"\n";
-                smoothedHisto2F->SetBinContent(bx, by, valueError.first);
-                smoothedHisto2F->SetBinError(bx, by, valueError.second);
             }
         }
-        smoothedHisto = smoothedHisto2F;
+        smoothedHistos.push_back(smoothedHisto);
     }
-    else if(m_ndim==3)
+    return smoothedHistos;
+}
+
+
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothArrays(vector< pair<double,double> >& valueErrors)
+/*****************************************************************/
+{
+    // Smooth the flat arrays filled by fillArrays(), with box filters or FFT convolutions if requested, direct sums otherwise
+    bool mirror = (m_mirrorAxis>=0 && m_mirrorAxis<(int)m_ndim);
+    if(mirror) foldArrays();
+    if(m_boxFilter)
     {
-        int nbinsx = histo->GetNbinsX();
-        int nbinsy = histo->GetNbinsY();
-        int nbinsz = histo->GetNbinsZ();
-        stringstream hName;
-        hName << histo->GetName() << "_smooth";
-        TH3F* smoothedHisto3F = dynamic_cast<TH3F*>(histo->Clone(hName.str().c_str()));
-        smoothedHisto3F->SetDirectory(0);
-        int counter = 0;
-        int total = nbinsx*nbinsy*nbinsz;
-        for(int bx=1;bx<=nbinsx;bx++)
+        smoothBoxSAT(valueErrors);
+        if(mirror) unfoldValueErrors(valueErrors);
+        return;
+    }
+    if(m_fftBandStep>0.)
+    {
+        if(smoothFFT(valueErrors))
         {
-            for(int by=1;by<=nbinsy;by++)
+            if(mirror) unfoldValueErrors(valueErrors);
+            return;
+        }
+        cout<<"[WARN]   Kernels are too wide for FFT smoothing. Using direct smoothing\n";
+    }
+    if(m_pyramidLevels>0)
+    {
+        smoothPyramid(valueErrors);
+        if(mirror) unfoldValueErrors(valueErrors);
+        return;
+    }
+    m_binLevels.clear();
+    buildStencils();
+    if(!mirror)
+    {
+        smoothBins(m_total, [&](unsigned int bin)
+        {
+            smoothedValueErrors(bin, valueErrors);
+        });
+        return;
+    }
+    // Only the first half along the mirror axis (with the middle bin) is smoothed
+    int nbins = m_nbins[m_mirrorAxis];
+    unsigned int inner = 1;
+    for(unsigned int axis=m_mirrorAxis+1;axis<m_ndim;axis++) inner *= m_nbins[axis];
+    unsigned int half = (unsigned int)((nbins+1)/2)*inner;
+    smoothBins(m_total/nbins/inner*half, [&](unsigned int i)
+    {
+        smoothedValueErrors((i/half)*nbins*inner+i%half, valueErrors);
+    });
+    unfoldValueErrors(valueErrors);
+}
+
+
+/*****************************************************************/
+void GaussKernelSmoother::foldArrays()
+/*****************************************************************/
+{
+    // Symmetrize (or antisymmetrize) the contents along the mirror axis, and symmetrize the widths.
+    // Smoothing the folded arrays over the full range is then the same as smoothing one half with a
+    // reflective boundary at the mirror plane, and the smoothed template has exactly the symmetry
+    int nbins = m_nbins[m_mirrorAxis];
+    unsigned int inner = 1;
+    for(unsigned int axis=m_mirrorAxis+1;axis<m_ndim;axis++) inner *= m_nbins[axis];
+    for(unsigned int bin=0;bin<m_total;bin++)
+    {
+        int b = (int)((bin/inner)%nbins);
+        // The middle bin of an antisymmetric template is its own mirror, and vanishes
+        if(2*b==nbins-1 && m_antiMirror)
+        {
+            for(unsigned int h=0;h<m_nhistos;h++) m_contents[h*m_total+bin] = 0.;
+        }
+        if(2*b>=nbins-1) continue;
+        unsigned int mirrorBin = bin+(unsigned int)(nbins-1-2*b)*inner;
+        for(unsigned int h=0;h<m_nhistos;h++)
+        {
+            double& content = m_contents[h*m_total+bin];
+            double& mirrorContent = m_contents[h*m_total+mirrorBin];
+            double average = (m_antiMirror ? content-mirrorContent : content+mirrorContent)/2.;
+            content = average;
+            mirrorContent = (m_antiMirror ? -average : average);
+            double& error = m_errors[h*m_total+bin];
+            double& mirrorError = m_errors[h*m_total+mirrorBin];
+            error = sqrt(error*error+mirrorError*mirrorError)/2.;
+            mirrorError = error;
+        }
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            double width = (m_widthArrays[axis][bin]+m_widthArrays[axis][mirrorBin])/2.;
+            m_widthArrays[axis][bin] = width;
+            m_widthArrays[axis][mirrorBin] = width;
+        }
+    }
+}
+
+
+/*****************************************************************/
+void GaussKernelSmoother::unfoldValueErrors(vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    // Copy the first half along the mirror axis to the second half
+    int nbins = m_nbins[m_mirrorAxis];
+    unsigned int inner = 1;
+    for(unsigned int axis=m_mirrorAxis+1;axis<m_ndim;axis++) inner *= m_nbins[axis];
+    for(unsigned int bin=0;bin<m_total;bin++)
+    {
+        int b = (int)((bin/inner)%nbins);
+        if(2*b>=nbins-1) continue;
+        unsigned int mirrorBin = bin+(unsigned int)(nbins-1-2*b)*inner;
+        for(unsigned int h=0;h<m_nhistos;h++)
+        {
+            const pair<double,double>& valueError = valueErrors[h*m_total+bin];
+            valueErrors[h*m_total+mirrorBin] = make_pair((m_antiMirror ? -valueError.first : valueError.first), valueError.second);
+        }
+    }
+}
+
+
+
+/*****************************************************************/
+GridND* GaussKernelSmoother::smooth(const GridND* grid)
+/*****************************************************************/
+{
+    if(grid->dimension()!=m_ndim || m_widthsND.size()!=m_ndim)
+    {
+        stringstream error;
+        error << "GaussKernelSmoother::smooth(): Grid or width maps don't have "<<m_ndim<<" dimensions";
+        throw runtime_error(error.str());
+    }
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        if(!m_widthsND[axis]->sameBinning(*grid))
+        {
+            stringstream error;
+            error << "GaussKernelSmoother::smooth(): Width maps should have the same binning as the smoothed grid";
+            throw runtime_error(error.str());
+        }
+    }
+    GridND* smoothedGrid = new GridND(*grid);
+    smoothedGrid->setName(grid->getName()+"_smooth");
+    unsigned int total = grid->size();
+    // Truncation of the kernels, computed once per distinct width along each axis
+    vector< map<double,int> > halfWidths(m_ndim);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        for(unsigned int index=0;index<total;index++)
+        {
+            double width = m_widthsND[axis]->getBinContent(index)*m_widthScalingFactor;
+            if(halfWidths[axis].find(width)==halfWidths[axis].end())
             {
-                for(int bz=1;bz<=nbinsz;bz++)
-                {
-                    if(counter % (total/100) == 0)
-                    {
-                        double ratio  =  (double)counter/(double)total;
-                        int   c      =  ratio * 50;
-                        cout << "[INFO]   "<< setw(3) << (int)(ratio*100) << "% [";
-                        for (int x=0; x<c; x++) cout << "=";
-                        for (int x=c; x<50; x++) cout << " ";
-                        cout << "]\r" << flush;
-                    }
-                    counter++;
-                    double x0 = histo->GetXaxis()->GetBinCenter(bx);
-                    double y0 = histo->GetYaxis()->GetBinCenter(by);
-                    double z0 = histo->GetZaxis()->GetBinCenter(bz);
-                    vector<double> point;
-                    point.push_back(x0);
-                    point.push_back(y0);
-                    point.push_back(z0);
-                    pair<double,double> valueError = smoothedValueError(histo, point);
-                    //cout<<"Bin "<<bx<<","<<by<<","<<bz<<": smoothed = "<<valueError.first<<"\n";
-                    smoothedHisto3F->SetBinContent(bx, by, bz, valueError.first);
-                    smoothedHisto3F->SetBinError(bx, by, bz, valueError.second);
-                }
+                halfWidths[axis][width] = truncationBins(width, grid->getBinWidth(axis));
             }
         }
-        smoothedHisto = smoothedHisto3F;
     }
+    // The input grid is only read, so bins can be written directly in the output grid
+    smoothBins(total, [&](unsigned int index)
+    {
+        pair<double,double> valueError = smoothedNDValueError(grid, index, halfWidths);
+        smoothedGrid->setBinContent(index, valueError.first);
+        smoothedGrid->setBinError(index, valueError.second);
+    });
+    return smoothedGrid;
+}
+
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothBins(unsigned int nbins, const std::function<void(unsigned int)>& smoothBin) const
+/*****************************************************************/
+{
+    // Bins 0..nbins-1 are processed by tiles of consecutive bins on the thread pool.
+    // The progress is counted by all the threads and printed by the one crossing each percent
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (nbins+tileSize-1)/tileSize;
+    atomic<unsigned int> done(0);
+    mutex printMutex;
+    int printed = -1;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        unsigned int first = tile*tileSize;
+        unsigned int last = min(first+tileSize, nbins);
+        for(unsigned int bin=first;bin<last;bin++)
+        {
+            smoothBin(bin);
+        }
+        unsigned int ndone = (done += last-first);
+        int percent = (int)((unsigned long long)ndone*100/nbins);
+        if(!m_verbose) return;
+        lock_guard<mutex> lock(printMutex);
+        if(percent>printed && percent<100)
+        {
+            printed = percent;
+            int c = percent/2;
+            cout << "[INFO]   "<< setw(3) << percent << "% [";
+            for (int x=0; x<c; x++) cout << "=";
+            for (int x=c; x<50; x++) cout << " ";
+            cout << "]\r" << flush;
+        }
+    });
+    if(!m_verbose) return;
     cout << "[INFO]   "<< setw(3) << 100 << "% [";
     for (int x=0; x<50; x++) cout << "=";
     cout << "]" << endl;
-    return smoothedHisto;
 }
 
 
 
+/*****************************************************************/
+void GaussKernelSmoother::setWidths(const std::vector<GridND*>& widths)
+/*****************************************************************/
+{
+    for(unsigned int axis=0;axis<m_widthsND.size();axis++)
+    {
+        delete m_widthsND[axis];
+    }
+    m_widthsND.clear();
+    for(unsigned int axis=0;axis<widths.size();axis++)
+    {
+        stringstream name;
+        name << "smoother_width" << axis;
+        m_widthsND.push_back(new GridND(*widths[axis]));
+        m_widthsND.back()->setName(name.str());
+    }
+}
+
+
 /*****************************************************************/
 void GaussKernelSmoother::setWidths(const std::vector<TH1*>& widths)
 /*****************************************************************/
@@ -177,348 +428,1206 @@ void GaussKernelSmoother::setWidths(const std::vector<TH1*>& widths)
 
 
 /*****************************************************************/
-double GaussKernelSmoother::weight(const std::vector<double>& x0, const std::vector<double>& xi)
+void GaussKernelSmoother::fillArrays(const vector<const TH1*>& histos)
 /*****************************************************************/
 {
-    // N-dimension weight
-    double dr2 = 0.;
-    for(unsigned int axis=0;axis<x0.size();axis++)
+    // Copy bin contents, errors and widths in flat arrays (last axis running fastest),
+    // such that the kernel loops don't need histogram accesses.
+    // Each histogram has its own contiguous block of contents and errors.
+    // Widths are taken at the center of each histogram bin
+    const TH1* reference = histos[0];
+    m_nbins.clear();
+    m_binWidths.clear();
+    m_nbins.push_back(reference->GetNbinsX());
+    m_nbins.push_back(reference->GetNbinsY());
+    m_binWidths.push_back(reference->GetXaxis()->GetBinWidth(1));
+    m_binWidths.push_back(reference->GetYaxis()->GetBinWidth(1));
+    if(m_ndim==3)
     {
-        double width = 1.;
-        if(m_ndim==2)
+        m_nbins.push_back(reference->GetNbinsZ());
+        m_binWidths.push_back(reference->GetZaxis()->GetBinWidth(1));
+    }
+    int nbinsz = (m_ndim==3 ? m_nbins[2] : 1);
+    m_nhistos = histos.size();
+    m_total = m_nbins[0]*m_nbins[1]*nbinsz;
+    m_contents.resize(m_nhistos*m_total);
+    m_errors.resize(m_nhistos*m_total);
+    m_widthArrays.assign(m_ndim, vector<double>(m_total));
+    unsigned int bin = 0;
+    for(int bx=1;bx<=m_nbins[0];bx++)
+    {
+        double x0 = reference->GetXaxis()->GetBinCenter(bx);
+        for(int by=1;by<=m_nbins[1];by++)
         {
-            int binx = m_widths[axis]->GetXaxis()->FindBin(x0[0]);
-            int biny = m_widths[axis]->GetYaxis()->FindBin(x0[1]);
-            width = m_widths[axis]->GetBinContent(binx, biny)/2.;
+            double y0 = reference->GetYaxis()->GetBinCenter(by);
+            for(int bz=1;bz<=nbinsz;bz++)
+            {
+                if(m_ndim==2)
+                {
+                    for(unsigned int h=0;h<m_nhistos;h++)
+                    {
+                        m_contents[h*m_total+bin] = histos[h]->GetBinContent(bx,by);
+                        m_errors[h*m_total+bin] = histos[h]->GetBinError(bx,by);
+                    }
+                    for(unsigned int axis=0;axis<m_ndim;axis++)
+                    {
+                        int wbx = m_widths[axis]->GetXaxis()->FindBin(x0);
+                        int wby = m_widths[axis]->GetYaxis()->FindBin(y0);
+                        m_widthArrays[axis][bin] = m_widths[axis]->GetBinContent(wbx, wby)*m_widthScalingFactor;
+                    }
+                }
+                else
+                {
+                    double z0 = reference->GetZaxis()->GetBinCenter(bz);
+                    for(unsigned int h=0;h<m_nhistos;h++)
+                    {
+                        m_contents[h*m_total+bin] = histos[h]->GetBinContent(bx,by,bz);
+                        m_errors[h*m_total+bin] = histos[h]->GetBinError(bx,by,bz);
+                    }
+                    for(unsigned int axis=0;axis<m_ndim;axis++)
+                    {
+                        int wbx = m_widths[axis]->GetXaxis()->FindBin(x0);
+                        int wby = m_widths[axis]->GetYaxis()->FindBin(y0);
+                        int wbz = m_widths[axis]->GetZaxis()->FindBin(z0);
+                        m_widthArrays[axis][bin] = m_widths[axis]->GetBinContent(wbx, wby, wbz)*m_widthScalingFactor;
+                    }
+                }
+                bin++;
+            }
         }
-        else if(m_ndim==3)
+    }
+}
+
+/*****************************************************************/
+double GaussKernelSmoother::gaus(double x) const
+/*****************************************************************/
+{
+    // Gaussian exp(-x^2/2). With quantized widths it is interpolated in a table of exp(-u), for u=x^2/2 in [0,8]
+    // (the kernel is truncated at 4 sigma). The relative interpolation error is below (umax/nsteps)^2/8 = 3e-8
+    static const int nsteps = 16384;
+    static const double umax = 8.;
+    static vector<double> table;
+    static once_flag tableFlag;
+    double u = x*x/2.;
+    if(m_widthTolerance<=0. || u>=umax) return exp(-u);
+    call_once(tableFlag, []()
+    {
+        table.resize(nsteps+2);
+        for(int i=0;i<=nsteps+1;i++) table[i] = exp(-umax*(double)i/(double)nsteps);
+    });
+    double pos = u/umax*(double)nsteps;
+    int i = (int)pos;
+    double frac = pos-(double)i;
+    return table[i] + frac*(table[i+1]-table[i]);
+}
+
+/*****************************************************************/
+int GaussKernelSmoother::truncationBins(double width, double binWidth) const
+/*****************************************************************/
+{
+    // Number of bins kept on each side of the kernel center (kernel sigmas are width/2).
+    // Compact kernels keep their whole support. Without tolerance Gaussian kernels are cut at 4 sigmas. Otherwise the smallest number of bins is kept such that
+    // the discarded fraction of the sampled Gaussian is below m_truncationTolerance/ndim along each axis.
+    // The distance damping only moves weight toward the center, so this also bounds the discarded fraction of the damped kernel
+    switch(m_kernelShape)
+    {
+        case EPANECHNIKOV: return EpanechnikovKernel::radius()*width/2./binWidth;
+        case TRICUBE: return TricubeKernel::radius()*width/2./binWidth;
+        case BIWEIGHT: return BiweightKernel::radius()*width/2./binWidth;
+        default: break;
+    }
+    if(m_truncationTolerance<=0.) return 2.*width/binWidth;
+    double sigma = width/2./binWidth;
+    if(sigma<=0.) return 0;
+    double total = 1.;
+    for(int db=1;;db++)
+    {
+        double term = 2.*exp(-(double)db*(double)db/(2.*sigma*sigma));
+        total += term;
+        if(term<1.e-17*total) break;
+    }
+    double maxDiscarded = m_truncationTolerance/(double)m_ndim*total;
+    double kept = 1.;
+    int nbinsWidth = 0;
+    while(total-kept>maxDiscarded)
+    {
+        nbinsWidth++;
+        kept += 2.*exp(-(double)nbinsWidth*(double)nbinsWidth/(2.*sigma*sigma));
+    }
+    return nbinsWidth;
+}
+
+/*****************************************************************/
+double GaussKernelSmoother::truncationBound(const vector< vector<double> >& widths, const vector< vector<int> >& halfWidths) const
+/*****************************************************************/
+{
+    // Largest fraction of the (undamped) kernel weights discarded by the truncation, among the kernels of the given widths.
+    // The discrete tails are summed along each axis, and the fractions t_axis are combined as 1-prod(1-t_axis)
+    if(m_kernelShape!=GAUSSIAN) return 0.;
+    vector<double> bounds(widths.size(), 0.);
+    ThreadPool::global().parallelFor(widths.size(), [&](unsigned int i)
+    {
+        double inside = 1.;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
         {
-            int binx = m_widths[axis]->GetXaxis()->FindBin(x0[0]);
-            int biny = m_widths[axis]->GetYaxis()->FindBin(x0[1]);
-            int binz = m_widths[axis]->GetZaxis()->FindBin(x0[2]);
-            width = m_widths[axis]->GetBinContent(binx, biny, binz)/2.;
+            double sigma = widths[i][axis]/2./m_binWidths[axis];
+            if(sigma<=0.) continue;
+            int nbinsWidth = halfWidths[i][axis];
+            double kept = 1.;
+            for(int db=1;db<=nbinsWidth;db++) kept += 2.*exp(-(double)(db*db)/(2.*sigma*sigma));
+            double tail = 0.;
+            for(int db=nbinsWidth+1;;db++)
+            {
+                double term = 2.*exp(-(double)db*(double)db/(2.*sigma*sigma));
+                tail += term;
+                if(term<1.e-17*kept) break;
+            }
+            inside *= kept/(kept+tail);
         }
-        width *= m_widthScalingFactor;
-        //cout<<"  Width="<<width<<"\n";
-        double dx = (xi[axis]-x0[axis])/width;
-        dr2 += dx*dx;
-        //cout<<"  dr2 = "<<dr2<<"\n";
+        bounds[i] = 1.-inside;
+    });
+    double bound = 0.;
+    for(unsigned int i=0;i<bounds.size();i++) bound = max(bound, bounds[i]);
+    return bound;
+}
+
+/*****************************************************************/
+void GaussKernelSmoother::axisWeights(double width, double binWidth, int nbinsWidth, vector<double>& weights) const
+/*****************************************************************/
+{
+    // Factorized kernel weights along one axis, for distances of 0 to nbinsWidth bins (given by truncationBins()).
+    // The kernel shape is dispatched once per axis, compact kernels being evaluated by compactAxisWeights()
+    // FIXME: this assumes that all bins have the same size
+    switch(m_kernelShape)
+    {
+        case EPANECHNIKOV: compactAxisWeights<EpanechnikovKernel>(width, binWidth, nbinsWidth, weights); return;
+        case TRICUBE: compactAxisWeights<TricubeKernel>(width, binWidth, nbinsWidth, weights); return;
+        case BIWEIGHT: compactAxisWeights<BiweightKernel>(width, binWidth, nbinsWidth, weights); return;
+        default: break;
+    }
+    weights.resize(nbinsWidth+1);
+    for(int db=0;db<=nbinsWidth;db++)
+    {
+        double dx = (double)db*binWidth;
+        weights[db] = gaus( dx/(width/2.) );
     }
-    double wi = TMath::Gaus( sqrt(dr2) );
+}
 
-    return wi;
+/*****************************************************************/
+template<typename Kernel>
+void GaussKernelSmoother::compactAxisWeights(double width, double binWidth, int nbinsWidth, vector<double>& weights) const
+/*****************************************************************/
+{
+    // Weights of a compact kernel along one axis, without transcendental functions
+    Kernel kernel;
+    double support = Kernel::radius()*width/2.;
+    weights.resize(nbinsWidth+1);
+    weights[0] = 1.;
+    for(int db=1;db<=nbinsWidth;db++)
+    {
+        weights[db] = kernel( (double)db*binWidth/support );
+    }
 }
 
 /*****************************************************************/
-double GaussKernelSmoother::weight(const std::vector<double>& x0, double dx, int axis)
+void GaussKernelSmoother::printTruncation(const vector< vector<double> >& widths, const vector< vector<int> >& halfWidths) const
 /*****************************************************************/
 {
-    // 1-dimension weight (can be factorized to obtain N-dimension weights)
-    double width = 1.;
-    if(m_ndim==2)
+    if(!m_verbose) return;
+    if(m_kernelShape!=GAUSSIAN)
     {
-        int binx = m_widths[axis]->GetXaxis()->FindBin(x0[0]);
-        int biny = m_widths[axis]->GetYaxis()->FindBin(x0[1]);
-        width = m_widths[axis]->GetBinContent(binx, biny)/2.;
+        cout<<"[INFO]   Kernels with compact support, not truncated\n";
+        return;
     }
-    else if(m_ndim==3)
+    cout<<"[INFO]   Kernels truncated ";
+    if(m_truncationTolerance>0.) cout<<"with a tolerance of "<<m_truncationTolerance;
+    else cout<<"at 4 sigmas";
+    cout<<", discarding at most "<<truncationBound(widths, halfWidths)<<" of their weights\n";
+}
+
+/*****************************************************************/
+vector<double> GaussKernelSmoother::stencilWidths(unsigned int bin) const
+/*****************************************************************/
+{
+    // Kernel widths of a bin, rounded to a power of (1+tolerance) if a width tolerance is set
+    vector<double> widths(m_ndim);
+    double logStep = log(1.+m_widthTolerance);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
     {
-        int binx = m_widths[axis]->GetXaxis()->FindBin(x0[0]);
-        int biny = m_widths[axis]->GetYaxis()->FindBin(x0[1]);
-        int binz = m_widths[axis]->GetZaxis()->FindBin(x0[2]);
-        width = m_widths[axis]->GetBinContent(binx, biny, binz)/2.;
+        double width = m_widthArrays[axis][bin];
+        if(m_widthTolerance>0. && width>0.)
+        {
+            width = exp(floor(log(width)/logStep+0.5)*logStep);
+        }
+        widths[axis] = width;
     }
-    width *= m_widthScalingFactor;
-    double dxw = dx/width;
-    double wi = TMath::Gaus( dxw );
-    return wi;
+    return widths;
 }
 
 /*****************************************************************/
-pair<double,double> GaussKernelSmoother::smoothedValueError(const TH1* histo, const std::vector<double>& x0)
+void GaussKernelSmoother::buildStencil(const vector<double>& widths, const vector<int>& halfWidths, Stencil& stencil) const
 /*****************************************************************/
 {
-    if(m_ndim==2)
+    // Normalized kernel weights for all the neighbor shifts, in rows along the last axis.
+    // In 2D the z shift is always 0
+    double maxWidth = 0.;
+    for(unsigned int axis=0;axis<m_ndim;axis++) maxWidth = max(maxWidth, widths[axis]);
+    vector< vector<double> > weights(3, vector<double>(1, 1.));
+    vector<double> widthRatios(3, 0.);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
     {
-        return smoothed2DValueError(histo, x0);
+        axisWeights(widths[axis], m_binWidths[axis], halfWidths[axis], weights[axis]);
+        widthRatios[axis] = widths[axis]/maxWidth;
     }
-    else if(m_ndim==3)
+    int nx = weights[0].size()-1;
+    int ny = weights[1].size()-1;
+    int nz = weights[2].size()-1;
+    stencil.halfWidths.clear();
+    stencil.halfWidths.push_back(nx);
+    stencil.halfWidths.push_back(ny);
+    if(m_ndim==3) stencil.halfWidths.push_back(nz);
+    stencil.weights.resize((2*nx+1)*(2*ny+1)*(2*nz+1));
+    double sumw = 0.;
+    unsigned int i = 0;
+    for(int dbx=-nx;dbx<=nx;dbx++)
+    {
+        for(int dby=-ny;dby<=ny;dby++)
+        {
+            for(int dbz=-nz;dbz<=nz;dbz++)
+            {
+                // Distances in full resolution bins, also for coarse pyramid levels
+                double dbr = m_dampingScale*sqrt( (double)(dbx*dbx)*widthRatios[0]+(double)(dby*dby)*widthRatios[1]+(double)(dbz*dbz)*widthRatios[2] );
+                double wi = weights[0][abs(dbx)]*weights[1][abs(dby)]*weights[2][abs(dbz)];
+                // Distance damping: 1/(dbr+1) in 2D and 1/(dbr+1)^2 in 3D
+                wi *= (m_ndim==2 ? 1./(dbr+1.) : 1./((dbr+1.)*(dbr+1.)));
+                stencil.weights[i] = wi;
+                sumw += wi;
+                i++;
+            }
+        }
+    }
+    // Bins outside the histogram are replaced by the boundary bins, so the sum of weights
+    // is the same for all bins and the stencil can be normalized here
+    for(i=0;i<stencil.weights.size();i++)
     {
-        return smoothed3DValueError(histo, x0);
+        stencil.weights[i] = (sumw>0. ? stencil.weights[i]/sumw : 0.);
     }
-    return make_pair<double,double>(0.,0.);
 }
 
 /*****************************************************************/
-pair<double,double> GaussKernelSmoother::smoothed2DValueError(const TH1* histo, const std::vector<double>& x0)
+void GaussKernelSmoother::buildStencils()
 /*****************************************************************/
 {
-    int nbinsx = histo->GetNbinsX();
-    int nbinsy = histo->GetNbinsY();
-    double widthx = 1.;
-    double widthy = 1.;
-    int binx = m_widths[0]->GetXaxis()->FindBin(x0[0]);
-    int biny = m_widths[0]->GetYaxis()->FindBin(x0[1]);
-    widthx = m_widths[0]->GetBinContent(binx, biny);
-    widthx *= m_widthScalingFactor;
-    binx = m_widths[1]->GetXaxis()->FindBin(x0[0]);
-    biny = m_widths[1]->GetYaxis()->FindBin(x0[1]);
-    widthy = m_widths[1]->GetBinContent(binx, biny);
-    widthy *= m_widthScalingFactor;
-    double maxWidth = max(widthx, widthy);
-    double widthRatiox = widthx/maxWidth;
-    double widthRatioy = widthy/maxWidth;
+    // Bins with the same (quantized) widths share the same stencil. The stencils used by most bins
+    // are computed once beforehand, within a memory budget. The other ones are computed for each bin
+    unsigned int total = m_total;
+    // Truncation half widths of each distinct set of widths (also of inactive bins), and its stencil id once an active bin uses it
+    map<vector<double>, pair<int, vector<int> > > kernels;
+    vector<unsigned int> counts;
+    m_stencilWidths.clear();
+    m_stencilHalfWidths.clear();
+    m_binStencils.resize(total);
+    bool mirror = (m_mirrorAxis>=0 && m_mirrorAxis<(int)m_ndim && m_binLevels.empty());
+    int mirrorNbins = (mirror ? m_nbins[m_mirrorAxis] : 1);
+    unsigned int mirrorInner = 1;
+    for(unsigned int axis=m_mirrorAxis+1;mirror && axis<m_ndim;axis++) mirrorInner *= m_nbins[axis];
+    // Summed-area table of the occupied bins (non-zero content or error in any histogram),
+    // to find the bins whose kernel support is empty
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int nbinsz = (m_ndim==3 ? m_nbins[2] : 1);
+    vector<unsigned int> occupancy((nbinsx+1)*(nbinsy+1)*(nbinsz+1), 0);
+    auto sat = [&](int x, int y, int z) -> unsigned int& {return occupancy[(x*(nbinsy+1)+y)*(nbinsz+1)+z];};
+    for(int x=1;x<=nbinsx;x++)
+    {
+        for(int y=1;y<=nbinsy;y++)
+        {
+            for(int z=1;z<=nbinsz;z++)
+            {
+                unsigned int bin = ((x-1)*nbinsy+(y-1))*nbinsz+(z-1);
+                unsigned int occupied = 0;
+                for(unsigned int h=0;h<m_nhistos && !occupied;h++)
+                {
+                    if(m_contents[h*total+bin]!=0. || m_errors[h*total+bin]!=0.) occupied = 1;
+                }
+                sat(x,y,z) = occupied + sat(x-1,y,z) + sat(x,y-1,z) + sat(x,y,z-1)
+                    - sat(x-1,y-1,z) - sat(x-1,y,z-1) - sat(x,y-1,z-1) + sat(x-1,y-1,z-1);
+            }
+        }
+    }
+    unsigned int nactive = 0;
+    unsigned int ninactive = 0;
+    for(unsigned int bin=0;bin<total;bin++)
+    {
+        // Bins smoothed at a coarser pyramid level don't need stencils
+        if(!m_binLevels.empty() && m_binLevels[bin]>0) continue;
+        // Neither do bins copied from the first half along the mirror axis in the direct sum
+        if(mirror && 2*(int)((bin/mirrorInner)%mirrorNbins)>mirrorNbins-1) continue;
+        vector<double> widths = stencilWidths(bin);
+        map<vector<double>, pair<int, vector<int> > >::iterator it = kernels.find(widths);
+        if(it==kernels.end())
+        {
+            vector<int> halfWidths(m_ndim);
+            for(unsigned int axis=0;axis<m_ndim;axis++) halfWidths[axis] = truncationBins(widths[axis], m_binWidths[axis]);
+            it = kernels.insert(make_pair(widths, make_pair(-1, halfWidths))).first;
+        }
+        const vector<int>& halfWidths = it->second.second;
+        // Nor inactive bins, without any occupied bin in the kernel support (clipped to the histogram,
+        // as outside bins are replaced by the boundary bins). Their smoothed values and errors are zero
+        int low[3] = {0, 0, 0};
+        int high[3] = {nbinsx, nbinsy, nbinsz};
+        int position[3] = {(int)(bin/nbinsz/nbinsy), (int)((bin/nbinsz)%nbinsy), (int)(bin%nbinsz)};
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            low[axis] = max(position[axis]-halfWidths[axis], 0);
+            high[axis] = min(position[axis]+halfWidths[axis]+1, high[axis]);
+        }
+        unsigned int noccupied = sat(high[0],high[1],high[2]) - sat(low[0],high[1],high[2]) - sat(high[0],low[1],high[2]) - sat(high[0],high[1],low[2])
+            + sat(low[0],low[1],high[2]) + sat(low[0],high[1],low[2]) + sat(high[0],low[1],low[2]) - sat(low[0],low[1],low[2]);
+        if(noccupied==0)
+        {
+            m_binStencils[bin] = s_inactiveBin;
+            ninactive++;
+            continue;
+        }
+        nactive++;
+        if(it->second.first<0)
+        {
+            it->second.first = m_stencilWidths.size();
+            m_stencilWidths.push_back(widths);
+            m_stencilHalfWidths.push_back(halfWidths);
+            counts.push_back(0);
+        }
+        m_binStencils[bin] = it->second.first;
+        counts[it->second.first]++;
+    }
+    vector< pair<unsigned int, unsigned int> > order;
+    for(unsigned int id=0;id<counts.size();id++)
+    {
+        order.push_back(make_pair(counts[id], id));
+    }
+    sort(order.begin(), order.end(), [](const pair<unsigned int, unsigned int>& a, const pair<unsigned int, unsigned int>& b)
+    {
+        return (a.first!=b.first ? a.first>b.first : a.second<b.second);
+    });
+    vector<unsigned int> cached;
+    double cacheSize = 0.;
+    for(unsigned int i=0;i<order.size();i++)
+    {
+        // Stencils used by a single bin are not worth caching
+        if(order[i].first<2) break;
+        const vector<int>& halfWidths = m_stencilHalfWidths[order[i].second];
+        double size = 1.;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            size *= 2.*halfWidths[axis] + 1.;
+        }
+        if(cacheSize+size>(double)s_maxStencilCacheSize) continue;
+        cacheSize += size;
+        cached.push_back(order[i].second);
+    }
+    m_stencils.assign(m_stencilWidths.size(), Stencil());
+    ThreadPool::global().parallelFor(cached.size(), [&](unsigned int i)
+    {
+        buildStencil(m_stencilWidths[cached[i]], m_stencilHalfWidths[cached[i]], m_stencils[cached[i]]);
+    });
+    if(m_verbose)
+    {
+        cout<<"[INFO]   "<<nactive<<" active bins ("<<ninactive<<" with empty kernel support skipped), ";
+        cout<<m_stencilWidths.size()<<" different kernels, "<<cached.size()<<" of them cached\n";
+    }
+    printTruncation(m_stencilWidths, m_stencilHalfWidths);
+}
 
-    binx = histo->GetXaxis()->FindBin(x0[0]);
-    biny = histo->GetYaxis()->FindBin(x0[1]);
-    double binWidthx = histo->GetXaxis()->GetBinWidth(binx);
-    double binWidthy = histo->GetYaxis()->GetBinWidth(biny);
-    // FIXME: Gaussian is truncated at 2sigma. We may want to be able to configure this cut
-    int nbinsWidthX = 2.*widthx/binWidthx;
-    int nbinsWidthY = 2.*widthy/binWidthy;
-    //cout<<"widthx="<<widthx<<" widthy="<<widthy<<" binwidthx="<<binWidthx<<" binwidthy="<<binWidthy<<"\n";
-    //cout<<"nbinsWidthX="<<nbinsWidthX<<"\n";
-    //cout<<"nbinsWidthY="<<nbinsWidthY<<"\n";
+/*****************************************************************/
+int GaussKernelSmoother::rowWeights(int bin, int nbins, const vector<double>& weights, double weight0, double dbr2, double widthRatio, vector<double>& row) const
+/*****************************************************************/
+{
+    // Weights of the stencil row along the last axis, around 'bin'.
+    // Bins outside the histogram are replaced by the boundary bins, so their weights are added to the boundary bins.
+    // The row then covers contiguous bins, and the first one is returned
+    int nbinsWidth = weights.size()-1;
+    int first = max(bin-nbinsWidth, 1);
+    int last = min(bin+nbinsWidth, nbins);
+    row.assign(last-first+1, 0.);
+    for(int b=bin-nbinsWidth;b<=bin+nbinsWidth;b++)
+    {
+        int db = abs(b-bin);
+        double dbr = m_dampingScale*sqrt( dbr2+(double)(db*db)*widthRatio );
+        double wi = weight0*weights[db];
+        // Distance damping: 1/(dbr+1) in 2D and 1/(dbr+1)^2 in 3D
+        wi *= (m_ndim==2 ? 1./(dbr+1.) : 1./((dbr+1.)*(dbr+1.)));
+        row[min(max(b,first),last)-first] += wi;
+    }
+    return first;
+}
 
-    // First compute the factorized weights in each direction
-    vector<double> weightsX;
-    vector<double> weightsY;
-    // FIXME: this assumes that all bins have the same size
-    for(int dbx=0;dbx<=nbinsWidthX;dbx++)
+/*****************************************************************/
+void GaussKernelSmoother::smoothPyramid(vector< pair<double,double> >& valueErrors)
+/*****************************************************************/
+{
+    // Bins with wide kernels are smoothed at a coarser level of a pyramid, where bins are merged by 2^level along each axis.
+    // A bin uses the coarsest level (up to m_pyramidLevels) where its kernel sigma still spans s_pyramidMinSigma coarse bins
+    // along each axis. Coarse bins are smoothed with their average widths, and the fine bins take the multilinear
+    // interpolation of the coarse results around their center. The other bins are smoothed at full resolution
+    int nbinsz = (m_ndim==3 ? m_nbins[2] : 1);
+    int nbins[3] = {m_nbins[0], m_nbins[1], nbinsz};
+    m_binLevels.assign(m_total, 0);
+    vector<unsigned int> levelCounts(m_pyramidLevels+1, 0);
+    for(unsigned int bin=0;bin<m_total;bin++)
     {
-        double dx = (double)dbx*binWidthx;
-        double wxi = weight(x0, dx, 0);
-        weightsX.push_back(wxi);
+        unsigned int level = m_pyramidLevels;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            double sigma = m_widthArrays[axis][bin]/2./m_binWidths[axis];
+            while(level>0 && (sigma<(double)(s_pyramidMinSigma<<level) || (nbins[axis]>>level)<2)) level--;
+        }
+        m_binLevels[bin] = level;
+        levelCounts[level]++;
     }
-    for(int dby=0;dby<=nbinsWidthY;dby++)
+    if(m_verbose)
     {
-        double dy = (double)dby*binWidthy;
-        double wyi = weight(x0, dy, 1);
-        weightsY.push_back(wyi);
+        cout<<"[INFO]   Pyramid smoothing: "<<levelCounts[0]<<" bins at full resolution";
+        for(unsigned int level=1;level<=m_pyramidLevels;level++) cout<<", "<<levelCounts[level]<<" at level "<<level;
+        cout<<"\n";
     }
 
+    // Smoothed coarse grids. Boundary bins are repeated to complete the last coarse bins
+    vector< vector< pair<double,double> > > coarseValueErrors(m_pyramidLevels+1);
+    vector< vector<int> > coarseNbins(m_pyramidLevels+1, vector<int>(3, 1));
+    for(unsigned int level=1;level<=m_pyramidLevels;level++)
+    {
+        if(levelCounts[level]==0) continue;
+        int factor = (1<<level);
+        GaussKernelSmoother coarse(m_ndim);
+        coarse.m_widthTolerance = m_widthTolerance;
+        coarse.m_truncationTolerance = m_truncationTolerance;
+        coarse.m_kernelShape = m_kernelShape;
+        coarse.m_verbose = m_verbose;
+        coarse.m_dampingScale = m_dampingScale*(double)factor;
+        coarse.m_nhistos = m_nhistos;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            coarseNbins[level][axis] = (nbins[axis]+factor-1)/factor;
+            coarse.m_nbins.push_back(coarseNbins[level][axis]);
+            coarse.m_binWidths.push_back(m_binWidths[axis]*(double)factor);
+        }
+        const vector<int>& cnbins = coarseNbins[level];
+        coarse.m_total = cnbins[0]*cnbins[1]*cnbins[2];
+        coarse.m_contents.assign(m_nhistos*coarse.m_total, 0.);
+        coarse.m_errors.assign(m_nhistos*coarse.m_total, 0.);
+        coarse.m_widthArrays.assign(m_ndim, vector<double>(coarse.m_total, 0.));
+        double norm = 1./pow((double)factor, (double)m_ndim);
+        unsigned int cbin = 0;
+        for(int cx=0;cx<cnbins[0];cx++)
+        {
+            for(int cy=0;cy<cnbins[1];cy++)
+            {
+                for(int cz=0;cz<cnbins[2];cz++)
+                {
+                    for(int fx=cx*factor;fx<(cx+1)*factor;fx++)
+                    {
+                        for(int fy=cy*factor;fy<(cy+1)*factor;fy++)
+                        {
+                            for(int fz=cz*factor;fz<(m_ndim==3 ? (cz+1)*factor : 1);fz++)
+                            {
+                                unsigned int bin = (min(fx,nbins[0]-1)*nbins[1] + min(fy,nbins[1]-1))*nbinsz + min(fz,nbinsz-1);
+                                for(unsigned int h=0;h<m_nhistos;h++)
+                                {
+                                    coarse.m_contents[h*coarse.m_total+cbin] += m_contents[h*m_total+bin]*norm;
+                                    coarse.m_errors[h*coarse.m_total+cbin] += m_errors[h*m_total+bin]*norm;
+                                }
+                                for(unsigned int axis=0;axis<m_ndim;axis++)
+                                {
+                                    coarse.m_widthArrays[axis][cbin] += m_widthArrays[axis][bin]*norm;
+                                }
+                            }
+                        }
+                    }
+                    cbin++;
+                }
+            }
+        }
+        if(m_verbose) cout<<"[INFO]   Smoothing pyramid level "<<level<<" ("<<coarse.m_total<<" bins)\n";
+        coarseValueErrors[level].resize(m_nhistos*coarse.m_total);
+        coarse.buildStencils();
+        coarse.smoothBins(coarse.m_total, [&](unsigned int bin)
+        {
+            coarse.smoothedValueErrors(bin, coarseValueErrors[level]);
+        });
+    }
 
-    double sumw = 0.;
-    double sumwv = 0.;
-    double sumwe = 0.;
-    //cout<<"Smoothing "<<x0<<","<<y0<<"\n";
-    //for(int bx=max(binx-nbinsWidthX,1);bx<=min(binx+nbinsWidthX,nbinsx);bx++)
-    for(int bx=binx-nbinsWidthX;bx<=binx+nbinsWidthX;bx++)
+    buildStencils();
+    smoothBins(m_total, [&](unsigned int bin)
     {
-        int bxcp = bx;
-        //double xshift = 0.;
-        if(bx<1) 
+        unsigned int level = m_binLevels[bin];
+        if(level==0)
         {
-            bxcp = 1;
-            //xshift = (bx-1)*binWidthx;
+            smoothedValueErrors(bin, valueErrors);
+            return;
         }
-        else if(bx>nbinsx) 
+        // Position of the bin center in coarse bin units, and the coarse bins around it
+        int factor = (1<<level);
+        const vector<int>& cnbins = coarseNbins[level];
+        unsigned int ctotal = cnbins[0]*cnbins[1]*cnbins[2];
+        int fine[3] = {(int)(bin/(nbins[1]*nbinsz)), (int)((bin/nbinsz)%nbins[1]), (int)(bin%nbinsz)};
+        int low[3] = {0, 0, 0};
+        int high[3] = {0, 0, 0};
+        double fractions[3] = {0., 0., 0.};
+        for(unsigned int axis=0;axis<m_ndim;axis++)
         {
-            bxcp = nbinsx;
-            //xshift = (bx-nbinsx)*binWidthx;
+            double position = ((double)fine[axis]+0.5)/(double)factor - 0.5;
+            int lower = (int)floor(position);
+            fractions[axis] = position-(double)lower;
+            low[axis] = min(max(lower, 0), cnbins[axis]-1);
+            high[axis] = min(max(lower+1, 0), cnbins[axis]-1);
         }
-        // FIXME: this assumes that all bins have the same size
-        int dbx = abs(bx-binx);
-        double wi1 = weightsX[dbx];
-        //for(int by=max(biny-nbinsWidthY,1);by<=min(biny+nbinsWidthY,nbinsy);by++)
-        for(int by=biny-nbinsWidthY;by<=biny+nbinsWidthY;by++)
+        for(unsigned int h=0;h<m_nhistos;h++)
+        {
+            double value = 0.;
+            double error = 0.;
+            for(unsigned int corner=0;corner<(1u<<m_ndim);corner++)
+            {
+                double weight = 1.;
+                int cbins[3] = {0, 0, 0};
+                for(unsigned int axis=0;axis<m_ndim;axis++)
+                {
+                    bool up = (corner>>axis)&1;
+                    cbins[axis] = (up ? high[axis] : low[axis]);
+                    weight *= (up ? fractions[axis] : 1.-fractions[axis]);
+                }
+                const pair<double,double>& coarseValueError = coarseValueErrors[level][h*ctotal + (cbins[0]*cnbins[1] + cbins[1])*cnbins[2] + cbins[2]];
+                value += weight*coarseValueError.first;
+                error += weight*coarseValueError.second;
+            }
+            valueErrors[h*m_total+bin] = make_pair(value, error);
+        }
+    });
+}
+
+/*****************************************************************/
+bool GaussKernelSmoother::smoothFFT(vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    // Kernel widths are banded on a logarithmic grid with step log(1+m_fftBandStep) along each axis.
+    // For each node of the grid, the whole histogram is convolved with the fixed kernel of the node widths with FFT.
+    // Each bin then takes the multilinear interpolation (in log(width)) of the 2^ndim nodes around its widths.
+    // Boundary bins are repeated outside the histogram, as in the direct sum.
+    // With several histograms, the kernel bands are shared and each histogram is convolved in turn.
+    // Returns false if the FFT arrays would be too large.
+    unsigned int total = m_total;
+    double logStep = log(1.+m_fftBandStep);
+    unsigned int ncorners = (1u<<m_ndim);
+    map<vector<int>, unsigned int> nodeIds;
+    vector< vector<int> > nodes;
+    vector< vector< pair<unsigned int,double> > > nodeBins;
+    vector<int> lower(m_ndim);
+    vector<double> fractions(m_ndim);
+    vector<int> node(m_ndim);
+    for(unsigned int bin=0;bin<total;bin++)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            // Widths smaller than 1/1000 of a bin don't smooth anything
+            double width = max(m_widthArrays[axis][bin], m_binWidths[axis]*1.e-3);
+            double position = log(width)/logStep;
+            lower[axis] = (int)floor(position);
+            fractions[axis] = position-(double)lower[axis];
+        }
+        for(unsigned int corner=0;corner<ncorners;corner++)
         {
-            int bycp = by;
-            //double yshift = 0.;
-            if(by<1) 
+            double weight = 1.;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
             {
-                bycp = 1;
-                //yshift = (by-1)*binWidthy;
+                bool up = (corner>>axis)&1;
+                node[axis] = lower[axis] + (up ? 1 : 0);
+                weight *= (up ? fractions[axis] : 1.-fractions[axis]);
             }
-            else if(by>nbinsy) 
+            if(weight==0.) continue;
+            map<vector<int>, unsigned int>::iterator it = nodeIds.find(node);
+            if(it==nodeIds.end())
             {
-                bycp = nbinsy;
-                //yshift = (by-nbinsy)*binWidthy;
+                it = nodeIds.insert(make_pair(node, (unsigned int)nodes.size())).first;
+                nodes.push_back(node);
+                nodeBins.push_back(vector< pair<unsigned int,double> >());
             }
-            // FIXME: this assumes that all bins have the same size
-            int dby = abs(by-biny);
-            double dbr = sqrt( (double)(dbx*dbx)*widthRatiox+(double)(dby*dby)*widthRatioy);
-            double wi = wi1*weightsY[dby];
-            wi *= 1./(dbr+1.);
-            //////////////////////////
-            //double xi = histo->GetXaxis()->GetBinCenter(bxcp) + xshift;
-            //double yi = histo->GetYaxis()->GetBinCenter(bycp) + yshift;
-            //vector<double> xxi;
-            //xxi.push_back(xi);
-            //xxi.push_back(yi);
-            //double wi = weight(x0, xxi);
-            double vi = histo->GetBinContent(bxcp,bycp);
-            double ei = histo->GetBinError(bxcp,bycp);
-            sumw += wi;
-            sumwv += wi*vi;
-            sumwe += wi*ei;
-            //cout<<"  Bin "<<bx<<", "<<by<<": weight="<<wi<<" z="<<zi<<"\n";
+            nodeBins[it->second].push_back(make_pair(bin, weight));
         }
     }
-    double value = 0.;
-    double error = 0.;
-    if(sumw>0.)
+    // All the convolutions are done with the same padding, such that the histogram is transformed only once
+    vector<Stencil> stencils(nodes.size());
+    vector< vector<double> > nodeWidths(nodes.size(), vector<double>(m_ndim));
+    vector< vector<int> > nodeHalfWidths(nodes.size(), vector<int>(m_ndim));
+    vector<int> padding(m_ndim, 0);
+    for(unsigned int n=0;n<nodes.size();n++)
     {
-        value = sumwv/sumw;
-        error = sumwe/sumw;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            nodeWidths[n][axis] = exp((double)nodes[n][axis]*logStep);
+            nodeHalfWidths[n][axis] = truncationBins(nodeWidths[n][axis], m_binWidths[axis]);
+        }
+        buildStencil(nodeWidths[n], nodeHalfWidths[n], stencils[n]);
+        for(unsigned int axis=0;axis<m_ndim;axis++) padding[axis] = max(padding[axis], stencils[n].halfWidths[axis]);
     }
-    else
+    vector<unsigned int> sizes(m_ndim);
+    double totalSize = 1.;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
     {
-        //cout<<"sumofweights=0\n";
+        sizes[axis] = FFT::nextPowerOfTwo(m_nbins[axis]+2*padding[axis]);
+        totalSize *= (double)sizes[axis];
     }
+    if(totalSize>(double)s_maxFFTSize) return false;
+    unsigned int size = (unsigned int)totalSize;
+    if(m_verbose) cout<<"[INFO]   Convolving with "<<nodes.size()<<" kernel bands with FFT\n";
+    printTruncation(nodeWidths, nodeHalfWidths);
 
-    return make_pair(value,error);
+    vector<unsigned int> strides(m_ndim, 1);
+    vector<unsigned int> paddedStrides(m_ndim, 1);
+    for(int axis=(int)m_ndim-2;axis>=0;axis--)
+    {
+        strides[axis] = strides[axis+1]*m_nbins[axis+1];
+        paddedStrides[axis] = paddedStrides[axis+1]*sizes[axis+1];
+    }
+    for(unsigned int h=0;h<m_nhistos;h++)
+    {
+        // Contents in the real part and errors in the imaginary part, such that both are convolved at once.
+        // The histogram starts at 'padding' along each axis, and is extended with its boundary bins
+        vector< complex<double> > data(size);
+        vector<int> position(m_ndim, 0);
+        for(unsigned int i=0;i<size;i++)
+        {
+            unsigned int bin = 0;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                int b = min(max(position[axis]-padding[axis], 0), m_nbins[axis]-1);
+                bin += b*strides[axis];
+            }
+            data[i] = complex<double>(m_contents[h*total+bin], m_errors[h*total+bin]);
+            for(int axis=(int)m_ndim-1;axis>=0;axis--)
+            {
+                if(++position[axis]<(int)sizes[axis]) break;
+                position[axis] = 0;
+            }
+        }
+        FFT::transform(data, sizes);
+
+        vector<double> values(total, 0.);
+        vector<double> errors(total, 0.);
+        vector< complex<double> > kernels(size);
+        vector< complex<double> > product(size);
+        for(unsigned int n=0;n<nodes.size();n++)
+        {
+            // Kernels are real and even, so their transforms are real. Two kernels are transformed at once,
+            // in the real and imaginary parts
+            if(n%2==0)
+            {
+                kernels.assign(size, complex<double>(0.,0.));
+                for(unsigned int k=n;k<min(n+2,(unsigned int)nodes.size());k++)
+                {
+                    const Stencil& stencil = stencils[k];
+                    vector<int> shift(m_ndim);
+                    for(unsigned int axis=0;axis<m_ndim;axis++) shift[axis] = -stencil.halfWidths[axis];
+                    for(unsigned int w=0;w<stencil.weights.size();w++)
+                    {
+                        // Shifts are stored circularly
+                        unsigned int index = 0;
+                        for(unsigned int axis=0;axis<m_ndim;axis++)
+                        {
+                            index += ((shift[axis]+(int)sizes[axis])%sizes[axis])*paddedStrides[axis];
+                        }
+                        if(k==n) kernels[index].real(stencil.weights[w]);
+                        else kernels[index].imag(stencil.weights[w]);
+                        for(int axis=(int)m_ndim-1;axis>=0;axis--)
+                        {
+                            if(++shift[axis]<=stencil.halfWidths[axis]) break;
+                            shift[axis] = -stencil.halfWidths[axis];
+                        }
+                    }
+                }
+                FFT::transform(kernels, sizes);
+            }
+            for(unsigned int i=0;i<size;i++)
+            {
+                product[i] = data[i]*(n%2==0 ? kernels[i].real() : kernels[i].imag());
+            }
+            FFT::transform(product, sizes, true);
+            const vector< pair<unsigned int,double> >& bins = nodeBins[n];
+            for(unsigned int b=0;b<bins.size();b++)
+            {
+                unsigned int bin = bins[b].first;
+                unsigned int index = 0;
+                for(unsigned int axis=0;axis<m_ndim;axis++)
+                {
+                    int p = (bin/strides[axis])%m_nbins[axis] + padding[axis];
+                    index += p*paddedStrides[axis];
+                }
+                values[bin] += bins[b].second*product[index].real();
+                errors[bin] += bins[b].second*product[index].imag();
+            }
+        }
+        for(unsigned int bin=0;bin<total;bin++)
+        {
+            valueErrors[h*total+bin] = make_pair(values[bin], errors[bin]);
+        }
+    }
+    return true;
 }
 
 /*****************************************************************/
-pair<double,double> GaussKernelSmoother::smoothed3DValueError(const TH1* histo, const std::vector<double>& x0)
-/*****************************************************************/
-{
-    int nbinsx = histo->GetNbinsX();
-    int nbinsy = histo->GetNbinsY();
-    int nbinsz = histo->GetNbinsZ();
-    double widthx = 1.;
-    double widthy = 1.;
-    double widthz = 1.;
-    int binx = m_widths[0]->GetXaxis()->FindBin(x0[0]);
-    int biny = m_widths[0]->GetYaxis()->FindBin(x0[1]);
-    int binz = m_widths[0]->GetZaxis()->FindBin(x0[2]);
-    widthx = m_widths[0]->GetBinContent(binx, biny, binz);
-    widthx *= m_widthScalingFactor;
-    binx = m_widths[1]->GetXaxis()->FindBin(x0[0]);
-    biny = m_widths[1]->GetYaxis()->FindBin(x0[1]);
-    binz = m_widths[1]->GetZaxis()->FindBin(x0[2]);
-    widthy = m_widths[1]->GetBinContent(binx, biny, binz);
-    widthy *= m_widthScalingFactor;
-    binx = m_widths[2]->GetXaxis()->FindBin(x0[0]);
-    biny = m_widths[2]->GetYaxis()->FindBin(x0[1]);
-    binz = m_widths[2]->GetZaxis()->FindBin(x0[2]);
-    widthz = m_widths[2]->GetBinContent(binx, biny, binz);
-    widthz *= m_widthScalingFactor;
-    double maxWidth = max(max(widthx, widthy),widthz);
-    double widthRatiox = widthx/maxWidth;
-    double widthRatioy = widthy/maxWidth;
-    double widthRatioz = widthz/maxWidth;
+void GaussKernelSmoother::smoothBoxSAT(vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    // Gaussian kernel approximated by 3 iterated box filters, each box sum being computed in O(1) from a summed-area table.
+    // The box half-size r (in bins) of each bin is given by the Gaussian sigma (width/2): 3 boxes of 2r+1 bins
+    // have a variance 3((2r+1)^2-1)/12 = sigma^2. Non-integer half-sizes are interpolated between the two closest boxes.
+    // Boxes are cut at the boundaries, and normalized by the number of bins inside.
+    // Contrary to the "adaptive" kernel, there is no additional damping with the distance.
+    // Box sizes are shared by all the histograms
+    unsigned int total = m_total;
+    int nbins[3] = {m_nbins[0], m_nbins[1], (m_ndim==3 ? m_nbins[2] : 1)};
+    vector<int> radii(total*3, 0);
+    vector<double> fractions(total*3, 0.);
+    for(unsigned int bin=0;bin<total;bin++)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            double sigma = m_widthArrays[axis][bin]/2./m_binWidths[axis];
+            double radius = (sqrt(4.*sigma*sigma+1.)-1.)/2.;
+            radii[bin*3+axis] = (int)radius;
+            fractions[bin*3+axis] = radius-(double)radii[bin*3+axis];
+        }
+    }
+    vector<double> contentSAT((nbins[0]+1)*(nbins[1]+1)*(nbins[2]+1));
+    vector<double> errorSAT(contentSAT.size());
+    int satStrides[3] = {(nbins[1]+1)*(nbins[2]+1), nbins[2]+1, 1};
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (total+tileSize-1)/tileSize;
+    for(unsigned int h=0;h<m_nhistos;h++)
+    {
+        vector<double> contents(m_contents.begin()+h*total, m_contents.begin()+(h+1)*total);
+        vector<double> errors(m_errors.begin()+h*total, m_errors.begin()+(h+1)*total);
+        pair<double,double>* histoValueErrors = &valueErrors[h*total];
+        for(int pass=0;pass<3;pass++)
+        {
+            // Summed-area tables: SAT(i,j,k) = sum of bins with x<i, y<j, z<k
+            for(int i=0;i<=nbins[0];i++)
+            {
+                for(int j=0;j<=nbins[1];j++)
+                {
+                    for(int k=0;k<=nbins[2];k++)
+                    {
+                        unsigned int index = i*satStrides[0] + j*satStrides[1] + k;
+                        if(i==0 || j==0 || k==0)
+                        {
+                            contentSAT[index] = 0.;
+                            errorSAT[index] = 0.;
+                            continue;
+                        }
+                        unsigned int bin = ((i-1)*nbins[1] + (j-1))*nbins[2] + (k-1);
+                        double content = contents[bin];
+                        double error = errors[bin];
+                        // Inclusion-exclusion over the 7 preceding corners
+                        for(int corner=1;corner<8;corner++)
+                        {
+                            unsigned int cornerIndex = index;
+                            int sign = -1;
+                            for(int axis=0;axis<3;axis++)
+                            {
+                                if((corner>>axis)&1)
+                                {
+                                    cornerIndex -= satStrides[axis];
+                                    sign = -sign;
+                                }
+                            }
+                            content += sign*contentSAT[cornerIndex];
+                            error += sign*errorSAT[cornerIndex];
+                        }
+                        contentSAT[index] = content;
+                        errorSAT[index] = error;
+                    }
+                }
+            }
+            ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+            {
+                unsigned int last = min((tile+1)*tileSize, total);
+                for(unsigned int bin=tile*tileSize;bin<last;bin++)
+                {
+                    int center[3] = {(int)(bin/(nbins[1]*nbins[2])), (int)((bin/nbins[2])%nbins[1]), (int)(bin%nbins[2])};
+                    double sum = 0.;
+                    double sumError = 0.;
+                    double norm = 0.;
+                    // Interpolation between the boxes of half-size r and r+1 along each axis
+                    for(int combination=0;combination<8;combination++)
+                    {
+                        double weight = 1.;
+                        int low[3];
+                        int high[3];
+                        for(int axis=0;axis<3;axis++)
+                        {
+                            bool larger = (combination>>axis)&1;
+                            double fraction = fractions[bin*3+axis];
+                            weight *= (larger ? fraction : 1.-fraction);
+                            int radius = radii[bin*3+axis] + (larger ? 1 : 0);
+                            low[axis] = max(center[axis]-radius, 0);
+                            high[axis] = min(center[axis]+radius, nbins[axis]-1) + 1;
+                        }
+                        if(weight==0.) continue;
+                        double content = 0.;
+                        double error = 0.;
+                        for(int corner=0;corner<8;corner++)
+                        {
+                            unsigned int index = 0;
+                            int sign = 1;
+                            for(int axis=0;axis<3;axis++)
+                            {
+                                bool lowCorner = (corner>>axis)&1;
+                                index += (lowCorner ? low[axis] : high[axis])*satStrides[axis];
+                                if(lowCorner) sign = -sign;
+                            }
+                            content += sign*contentSAT[index];
+                            error += sign*errorSAT[index];
+                        }
+                        double count = (double)(high[0]-low[0])*(double)(high[1]-low[1])*(double)(high[2]-low[2]);
+                        sum += weight*content;
+                        sumError += weight*error;
+                        norm += weight*count;
+                    }
+                    histoValueErrors[bin] = make_pair(sum/norm, sumError/norm);
+                }
+            });
+            for(unsigned int bin=0;bin<total;bin++)
+            {
+                contents[bin] = histoValueErrors[bin].first;
+                errors[bin] = histoValueErrors[bin].second;
+            }
+        }
+    }
+}
 
-    histo->GetXaxis()->FindBin(x0[0]);
-    histo->GetYaxis()->FindBin(x0[1]);
-    histo->GetZaxis()->FindBin(x0[2]);
-    double binWidthx = histo->GetXaxis()->GetBinWidth(binx);
-    double binWidthy = histo->GetYaxis()->GetBinWidth(biny);
-    double binWidthz = histo->GetZaxis()->GetBinWidth(binz);
-    // FIXME: Gaussian is truncated at 2sigma. We may want to be able to configure this cut
-    int nbinsWidthX = 2.*widthx/binWidthx;
-    int nbinsWidthY = 2.*widthy/binWidthy;
-    int nbinsWidthZ = 2.*widthz/binWidthz;
-    //cout<<"widthx="<<widthx<<" widthy="<<widthy<<" widthz="<<widthz<<" binwidthx="<<binWidthx<<" binwidthy="<<binWidthy<<" binwidthz="<<binWidthz<<"\n";
-    //cout<<"nbinsWidthX="<<nbinsWidthX<<"\n";
-    //cout<<"nbinsWidthY="<<nbinsWidthY<<"\n";
-    //cout<<"nbinsWidthZ="<<nbinsWidthZ<<"\n";
+/*****************************************************************/
+void GaussKernelSmoother::accumulateRow(const double* weights, const double* contents, const double* errors, int n, double& sumw, double& sumwv, double& sumwe)
+/*****************************************************************/
+{
+    // Weighted sums over contiguous arrays, with 4 independent partial sums
+    // which the compiler maps on SIMD registers. The summation order is fixed
+    double w[4] = {0.,0.,0.,0.};
+    double wv[4] = {0.,0.,0.,0.};
+    double we[4] = {0.,0.,0.,0.};
+    int i = 0;
+    for(;i+4<=n;i+=4)
+    {
+        for(int k=0;k<4;k++)
+        {
+            w[k] += weights[i+k];
+            wv[k] += weights[i+k]*contents[i+k];
+            we[k] += weights[i+k]*errors[i+k];
+        }
+    }
+    for(;i<n;i++)
+    {
+        w[0] += weights[i];
+        wv[0] += weights[i]*contents[i];
+        we[0] += weights[i]*errors[i];
+    }
+    sumw += (w[0]+w[1])+(w[2]+w[3]);
+    sumwv += (wv[0]+wv[1])+(wv[2]+wv[3]);
+    sumwe += (we[0]+we[1])+(we[2]+we[3]);
+}
 
-    double sumw = 0.;
-    double sumwv = 0.;
-    double sumwe = 0.;
-    //cout<<"Smoothing "<<x0<<","<<y0<<"\n";
-    //for(int bx=max(binx-nbinsWidthX,1);bx<=min(binx+nbinsWidthX,nbinsx);bx++)
+/*****************************************************************/
+void GaussKernelSmoother::accumulateRows(const double* weights, unsigned int offset, int n, double& sumw, vector<double>& sumwv, vector<double>& sumwe) const
+/*****************************************************************/
+{
+    // Same row of weights applied to all the histograms, while the weights are in cache.
+    // 'offset' is the index of the first bin in the arrays of the first histogram
+    accumulateRow(weights, &m_contents[offset], &m_errors[offset], n, sumw, sumwv[0], sumwe[0]);
+    double sumwOther = 0.;
+    for(unsigned int h=1;h<m_nhistos;h++)
+    {
+        accumulateRow(weights, &m_contents[h*m_total+offset], &m_errors[h*m_total+offset], n, sumwOther, sumwv[h], sumwe[h]);
+    }
+}
 
-    // First compute the factorized weights in each direction
-    vector<double> weightsX;
-    vector<double> weightsY;
-    vector<double> weightsZ;
-    // FIXME: this assumes that all bins have the same size
-    for(int dbx=0;dbx<=nbinsWidthX;dbx++)
+/*****************************************************************/
+void GaussKernelSmoother::accumulateStencilRow(const double* weights, int halfWidth, int bin, int nbins, unsigned int offset, vector<double>& folded, double& sumw, vector<double>& sumwv, vector<double>& sumwe) const
+/*****************************************************************/
+{
+    // Sums over one stencil row along the last axis, centered on 'bin'. 'offset' is the index of the first bin of the histogram row.
+    // Close to the boundaries, weights of bins outside the histogram are added to the boundary bins
+    int first = bin-halfWidth;
+    int last = bin+halfWidth;
+    if(first>=1 && last<=nbins)
     {
-        double dx = (double)dbx*binWidthx;
-        double wxi = weight(x0, dx, 0);
-        weightsX.push_back(wxi);
+        accumulateRows(weights, offset+first-1, 2*halfWidth+1, sumw, sumwv, sumwe);
+        return;
     }
-    for(int dby=0;dby<=nbinsWidthY;dby++)
+    int firstIn = max(first, 1);
+    int lastIn = min(last, nbins);
+    folded.assign(lastIn-firstIn+1, 0.);
+    for(int b=first;b<=last;b++)
+    {
+        folded[min(max(b,firstIn),lastIn)-firstIn] += weights[b-first];
+    }
+    accumulateRows(&folded[0], offset+firstIn-1, folded.size(), sumw, sumwv, sumwe);
+}
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothedValueErrors(unsigned int bin, vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    // Smoothed values and errors of 'bin' for all the histograms, stored at bin+h*m_total
+    unsigned int id = m_binStencils[bin];
+    if(id==s_inactiveBin)
+    {
+        for(unsigned int h=0;h<m_nhistos;h++) valueErrors[h*m_total+bin] = make_pair(0., 0.);
+        return;
+    }
+    bool cached = !m_stencils[id].weights.empty();
+    if(m_ndim==2)
+    {
+        if(cached) smoothed2DValueErrors(bin, m_stencils[id], valueErrors);
+        else smoothed2DValueErrors(bin, m_stencilWidths[id], m_stencilHalfWidths[id], valueErrors);
+    }
+    else if(m_ndim==3)
+    {
+        if(cached) smoothed3DValueErrors(bin, m_stencils[id], valueErrors);
+        else smoothed3DValueErrors(bin, m_stencilWidths[id], m_stencilHalfWidths[id], valueErrors);
+    }
+}
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothed2DValueErrors(unsigned int bin, const Stencil& stencil, vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int binx = bin/nbinsy + 1;
+    int biny = bin%nbinsy + 1;
+    int nbinsWidthX = stencil.halfWidths[0];
+    int nbinsWidthY = stencil.halfWidths[1];
+    int rowLength = 2*nbinsWidthY+1;
+
+    double sumw = 0.;
+    vector<double> sumwv(m_nhistos, 0.);
+    vector<double> sumwe(m_nhistos, 0.);
+    vector<double> folded;
+    for(int bx=binx-nbinsWidthX;bx<=binx+nbinsWidthX;bx++)
     {
-        double dy = (double)dby*binWidthy;
-        double wyi = weight(x0, dy, 1);
-        weightsY.push_back(wyi);
+        int bxcp = min(max(bx,1),nbinsx);
+        const double* row = &stencil.weights[(bx-binx+nbinsWidthX)*rowLength];
+        accumulateStencilRow(row, nbinsWidthY, biny, nbinsy, (bxcp-1)*nbinsy, folded, sumw, sumwv, sumwe);
     }
-    for(int dbz=0;dbz<=nbinsWidthZ;dbz++)
+    // The stencil is normalized
+    for(unsigned int h=0;h<m_nhistos;h++)
     {
-        double dz = (double)dbz*binWidthz;
-        double wzi = weight(x0, dz, 2);
-        weightsZ.push_back(wzi);
+        valueErrors[h*m_total+bin] = make_pair(sumwv[h],sumwe[h]);
     }
+}
 
+/*****************************************************************/
+void GaussKernelSmoother::smoothed3DValueErrors(unsigned int bin, const Stencil& stencil, vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int nbinsz = m_nbins[2];
+    int binx = bin/(nbinsy*nbinsz) + 1;
+    int biny = (bin/nbinsz)%nbinsy + 1;
+    int binz = bin%nbinsz + 1;
+    int nbinsWidthX = stencil.halfWidths[0];
+    int nbinsWidthY = stencil.halfWidths[1];
+    int nbinsWidthZ = stencil.halfWidths[2];
+    int rowLength = 2*nbinsWidthZ+1;
 
+    double sumw = 0.;
+    vector<double> sumwv(m_nhistos, 0.);
+    vector<double> sumwe(m_nhistos, 0.);
+    vector<double> folded;
     for(int bx=binx-nbinsWidthX;bx<=binx+nbinsWidthX;bx++)
     {
-        int bxcp = bx;
-        //double xshift = 0.;
-        if(bx<1) 
+        int bxcp = min(max(bx,1),nbinsx);
+        for(int by=biny-nbinsWidthY;by<=biny+nbinsWidthY;by++)
         {
-            bxcp = 1;
-            //xshift = (bx-1)*binWidthx;
+            int bycp = min(max(by,1),nbinsy);
+            const double* row = &stencil.weights[((bx-binx+nbinsWidthX)*(2*nbinsWidthY+1) + (by-biny+nbinsWidthY))*rowLength];
+            accumulateStencilRow(row, nbinsWidthZ, binz, nbinsz, ((bxcp-1)*nbinsy + (bycp-1))*nbinsz, folded, sumw, sumwv, sumwe);
         }
-        else if(bx>nbinsx) 
+    }
+    // The stencil is normalized
+    for(unsigned int h=0;h<m_nhistos;h++)
+    {
+        valueErrors[h*m_total+bin] = make_pair(sumwv[h],sumwe[h]);
+    }
+}
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothed2DValueErrors(unsigned int bin, const vector<double>& widths, const vector<int>& halfWidths, vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int binx = bin/nbinsy + 1;
+    int biny = bin%nbinsy + 1;
+    // Kernel computed directly, for bins with a stencil which is not cached
+    double widthx = widths[0];
+    double widthy = widths[1];
+    double maxWidth = max(widthx, widthy);
+    double widthRatiox = widthx/maxWidth;
+    double widthRatioy = widthy/maxWidth;
+
+    // First compute the factorized weights in each direction
+    vector<double> weightsX;
+    vector<double> weightsY;
+    axisWeights(widthx, m_binWidths[0], halfWidths[0], weightsX);
+    axisWeights(widthy, m_binWidths[1], halfWidths[1], weightsY);
+    int nbinsWidthX = weightsX.size()-1;
+
+    double sumw = 0.;
+    vector<double> sumwv(m_nhistos, 0.);
+    vector<double> sumwe(m_nhistos, 0.);
+    vector<double> row;
+    for(int bx=binx-nbinsWidthX;bx<=binx+nbinsWidthX;bx++)
+    {
+        int bxcp = min(max(bx,1),nbinsx);
+        int dbx = abs(bx-binx);
+        int firsty = rowWeights(biny, nbinsy, weightsY, weightsX[dbx], (double)(dbx*dbx)*widthRatiox, widthRatioy, row);
+        unsigned int offset = (bxcp-1)*nbinsy + (firsty-1);
+        accumulateRows(&row[0], offset, row.size(), sumw, sumwv, sumwe);
+    }
+    for(unsigned int h=0;h<m_nhistos;h++)
+    {
+        double value = 0.;
+        double error = 0.;
+        if(sumw>0.)
         {
-            bxcp = nbinsx;
-            //xshift = (bx-nbinsx)*binWidthx;
+            value = sumwv[h]/sumw;
+            error = sumwe[h]/sumw;
         }
-        // FIXME: this assumes that all bins have the same size
+        valueErrors[h*m_total+bin] = make_pair(value,error);
+    }
+}
+
+/*****************************************************************/
+void GaussKernelSmoother::smoothed3DValueErrors(unsigned int bin, const vector<double>& widths, const vector<int>& halfWidths, vector< pair<double,double> >& valueErrors) const
+/*****************************************************************/
+{
+    int nbinsx = m_nbins[0];
+    int nbinsy = m_nbins[1];
+    int nbinsz = m_nbins[2];
+    int binx = bin/(nbinsy*nbinsz) + 1;
+    int biny = (bin/nbinsz)%nbinsy + 1;
+    int binz = bin%nbinsz + 1;
+    // Kernel computed directly, for bins with a stencil which is not cached
+    double widthx = widths[0];
+    double widthy = widths[1];
+    double widthz = widths[2];
+    double maxWidth = max(max(widthx, widthy),widthz);
+    double widthRatiox = widthx/maxWidth;
+    double widthRatioy = widthy/maxWidth;
+    double widthRatioz = widthz/maxWidth;
+
+    // First compute the factorized weights in each direction
+    vector<double> weightsX;
+    vector<double> weightsY;
+    vector<double> weightsZ;
+    axisWeights(widthx, m_binWidths[0], halfWidths[0], weightsX);
+    axisWeights(widthy, m_binWidths[1], halfWidths[1], weightsY);
+    axisWeights(widthz, m_binWidths[2], halfWidths[2], weightsZ);
+    int nbinsWidthX = weightsX.size()-1;
+    int nbinsWidthY = weightsY.size()-1;
+
+    double sumw = 0.;
+    vector<double> sumwv(m_nhistos, 0.);
+    vector<double> sumwe(m_nhistos, 0.);
+    vector<double> row;
+    for(int bx=binx-nbinsWidthX;bx<=binx+nbinsWidthX;bx++)
+    {
+        int bxcp = min(max(bx,1),nbinsx);
         int dbx = abs(bx-binx);
-        double wi1 = weightsX[dbx];
-        //for(int by=max(biny-nbinsWidthY,1);by<=min(biny+nbinsWidthY,nbinsy);by++)
         for(int by=biny-nbinsWidthY;by<=biny+nbinsWidthY;by++)
         {
-            int bycp = by;
-            //double yshift = 0.;
-            if(by<1) 
-            {
-                bycp = 1;
-                //yshift = (by-1)*binWidthy;
-            }
-            else if(by>nbinsy) 
-            {
-                bycp = nbinsy;
-                //yshift = (by-nbinsy)*binWidthy;
-            }
-            // FIXME: this assumes that all bins have the same size
+            int bycp = min(max(by,1),nbinsy);
             int dby = abs(by-biny);
-            double wi2 = wi1*weightsY[dby];
-            for(int bz=binz-nbinsWidthZ;bz<=binz+nbinsWidthZ;bz++)
+            double dbr2 = (double)(dbx*dbx)*widthRatiox+(double)(dby*dby)*widthRatioy;
+            int firstz = rowWeights(binz, nbinsz, weightsZ, weightsX[dbx]*weightsY[dby], dbr2, widthRatioz, row);
+            unsigned int offset = ((bxcp-1)*nbinsy + (bycp-1))*nbinsz + (firstz-1);
+            accumulateRows(&row[0], offset, row.size(), sumw, sumwv, sumwe);
+        }
+    }
+    for(unsigned int h=0;h<m_nhistos;h++)
+    {
+        double value = 0.;
+        double error = 0.;
+        if(sumw>0.)
+        {
+            value = sumwv[h]/sumw;
+            error = sumwe[h]/sumw;
+        }
+        valueErrors[h*m_total+bin] = make_pair(value,error);
+    }
+}
+
+/*****************************************************************/
+pair<double,double> GaussKernelSmoother::smoothedNDValueError(const GridND* grid, unsigned int index, const vector< map<double,int> >& halfWidths)
+/*****************************************************************/
+{
+    // Same kernel as smoothed2DValueError() and smoothed3DValueError(), for any number of dimensions.
+    // The distance damping factor 1/(dbr+1)^(ndim-1) reduces to the 2D and 3D ones.
+    vector<int> bins;
+    grid->bins(index, bins);
+    vector<double> x0;
+    grid->binCenter(index, x0);
+    vector<double> widths(m_ndim);
+    double maxWidth = 0.;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        widths[axis] = m_widthsND[axis]->getBinContent(index)*m_widthScalingFactor;
+        maxWidth = max(maxWidth, widths[axis]);
+    }
+    vector<int> nbinsWidth(m_ndim);
+    vector<double> widthRatios(m_ndim);
+    vector< vector<double> > weights(m_ndim);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        // First compute the factorized weights in each direction
+        axisWeights(widths[axis], grid->getBinWidth(axis), halfWidths[axis].find(widths[axis])->second, weights[axis]);
+        nbinsWidth[axis] = weights[axis].size()-1;
+        widthRatios[axis] = widths[axis]/maxWidth;
+    }
+    double sumw = 0.;
+    double sumwv = 0.;
+    double sumwe = 0.;
+    vector<int> shifts(m_ndim);
+    vector<int> neighbor(m_ndim);
+    for(unsigned int axis=0;axis<m_ndim;axis++) shifts[axis] = -nbinsWidth[axis];
+    while(true)
+    {
+        double wi = 1.;
+        double dbr2 = 0.;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            int db = abs(shifts[axis]);
+            wi *= weights[axis][db];
+            dbr2 += (double)(db*db)*widthRatios[axis];
+            // Bins outside the grid are replaced by the boundary bins
+            neighbor[axis] = min(max(bins[axis]+shifts[axis], 1), grid->getNbins(axis));
+        }
+        wi *= 1./pow(sqrt(dbr2)+1., (double)m_ndim-1.);
+        unsigned int neighborIndex = grid->index(neighbor);
+        sumw += wi;
+        sumwv += wi*grid->getBinContent(neighborIndex);
+        sumwe += wi*grid->getBinError(neighborIndex);
+        unsigned int axis = 0;
+        for(;axis<m_ndim;axis++)
+        {
+            if(shifts[axis]<nbinsWidth[axis])
             {
-                int bzcp = bz;
-                //double zshift = 0.;
-                if(bz<1) 
-                {
-                    bzcp = 1;
-                    //zshift = (bz-1)*binWidthz;
-                }
-                else if(bz>nbinsz) 
-                {
-                    bzcp = nbinsz;
-                    //zshift = (bz-nbinsz)*binWidthz;
-                }
-                // FIXME: this assumes that all bins have the same size
-                int dbz = abs(bz-binz);
-                //double dbr = sqrt( (double)(dbx*dbx+dby*dby+dbz*dbz) );
-                double dbr = sqrt( (double)(dbx*dbx)*widthRatiox+(double)(dby*dby)*widthRatioy+(double)(dbz*dbz)*widthRatioz);
-                double wi = wi2*weightsZ[dbz];
-                wi *= 1./((dbr+1.)*(dbr+1.));
-                //////////////////////////////////////////////////////////////
-                //double xi = histo->GetXaxis()->GetBinCenter(bxcp) + xshift;
-                //double yi = histo->GetYaxis()->GetBinCenter(bycp) + yshift;
-                //double zi = histo->GetZaxis()->GetBinCenter(bzcp) + zshift;
-                //vector<double> xxi;
-                //xxi.push_back(xi);
-                //xxi.push_back(yi);
-                //xxi.push_back(zi);
-                //double wi = weight(x0, xxi);
-                //double wi = weightsX[dbx]*weightsY[dby]*weightsZ[dbz];
-                double vi = histo->GetBinContent(bxcp,bycp,bzcp);
-                double ei = histo->GetBinError(bxcp,bycp,bzcp);
-                sumw += wi;
-                sumwv += wi*vi;
-                sumwe += wi*ei;
-                //cout<<"  Bin "<<bx<<", "<<by<<","<<bz<<": weight="<<wi<<" vi="<<vi<<"\n";
+                shifts[axis]++;
+                break;
             }
+            shifts[axis] = -nbinsWidth[axis];
         }
+        if(axis==m_ndim) break;
     }
     double value = 0.;
     double error = 0.;
@@ -527,10 +1636,5 @@ pair<double,double> GaussKernelSmoother::smoothed3DValueError(const TH1* histo,
         value = sumwv/sumw;
         error = sumwe/sumw;
     }
-    else
-    {
-        //cout<<"sumofweights=0\n";
-    }
-
     return make_pair(value,error);
 }
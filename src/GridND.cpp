@@ -0,0 +1,288 @@
+
+
+
+#include "GridND.h"
+
+#include "TH1D.h"
+#include "THn.h"
+#include "THnSparse.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+
+
+/*****************************************************************/
+GridND::GridND(const string& name, const vector<unsigned int>& nbins, const vector< pair<double,double> >& minmax):
+    m_name(name),
+    m_nbins(nbins),
+    m_minmax(minmax)
+/*****************************************************************/
+{
+    if(nbins.size()!=minmax.size() || nbins.size()==0)
+    {
+        stringstream error;
+        error << "GridND::GridND(): Inconsistent number of dimensions for grid '"<<name<<"'";
+        throw runtime_error(error.str());
+    }
+    double size = 1.;
+    unsigned int stride = 1;
+    for(unsigned int axis=0;axis<nbins.size();axis++)
+    {
+        if(nbins[axis]==0 || minmax[axis].second<=minmax[axis].first)
+        {
+            stringstream error;
+            error << "GridND::GridND(): Wrong binning along axis "<<axis<<" for grid '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        size *= (double)nbins[axis];
+        m_binWidths.push_back( (minmax[axis].second-minmax[axis].first)/(double)nbins[axis] );
+        m_strides.push_back(stride);
+        stride *= nbins[axis];
+    }
+    if(size>(double)s_maxSize)
+    {
+        stringstream error;
+        error << "GridND::GridND(): Too many bins ("<<size<<") for grid '"<<name<<"'. The maximum is "<<s_maxSize;
+        throw runtime_error(error.str());
+    }
+    m_contents.resize((unsigned int)size, 0.);
+    m_sumw2.resize((unsigned int)size, 0.);
+}
+
+
+/*****************************************************************/
+int GridND::findBin(unsigned int axis, double x) const
+/*****************************************************************/
+{
+    // 0 below the lower boundary and nbins+1 above the upper boundary, as in ROOT histograms
+    if(x<m_minmax[axis].first) return 0;
+    if(x>=m_minmax[axis].second) return m_nbins[axis]+1;
+    int bin = (int)((x-m_minmax[axis].first)/m_binWidths[axis]) + 1;
+    return min(bin, (int)m_nbins[axis]);
+}
+
+
+/*****************************************************************/
+bool GridND::sameBinning(const GridND& grid) const
+/*****************************************************************/
+{
+    return (m_nbins==grid.getNbins() && m_minmax==grid.getMinMax());
+}
+
+
+/*****************************************************************/
+unsigned int GridND::index(const vector<int>& bins) const
+/*****************************************************************/
+{
+    unsigned int index = 0;
+    for(unsigned int axis=0;axis<m_nbins.size();axis++)
+    {
+        index += (bins[axis]-1)*m_strides[axis];
+    }
+    return index;
+}
+
+
+/*****************************************************************/
+void GridND::bins(unsigned int index, vector<int>& bins) const
+/*****************************************************************/
+{
+    bins.resize(m_nbins.size());
+    for(unsigned int axis=0;axis<m_nbins.size();axis++)
+    {
+        bins[axis] = index%m_nbins[axis] + 1;
+        index /= m_nbins[axis];
+    }
+}
+
+
+/*****************************************************************/
+void GridND::binCenter(unsigned int index, vector<double>& point) const
+/*****************************************************************/
+{
+    point.resize(m_nbins.size());
+    for(unsigned int axis=0;axis<m_nbins.size();axis++)
+    {
+        int bin = index%m_nbins[axis] + 1;
+        index /= m_nbins[axis];
+        point[axis] = getBinCenter(axis, bin);
+    }
+}
+
+
+/*****************************************************************/
+int GridND::fill(const vector<double>& point, double weight)
+/*****************************************************************/
+{
+    // Returns the index of the filled bin, or -1 if the point is outside the grid
+    unsigned int index = 0;
+    for(unsigned int axis=0;axis<m_nbins.size();axis++)
+    {
+        int bin = findBin(axis, point[axis]);
+        if(bin<1 || bin>(int)m_nbins[axis]) return -1;
+        index += (bin-1)*m_strides[axis];
+    }
+    m_contents[index] += weight;
+    m_sumw2[index] += weight*weight;
+    return (int)index;
+}
+
+
+/*****************************************************************/
+double GridND::getBinError(unsigned int index) const
+/*****************************************************************/
+{
+    return sqrt(m_sumw2[index]);
+}
+
+
+/*****************************************************************/
+double GridND::getSumOfWeights() const
+/*****************************************************************/
+{
+    double sumOfWeights = 0.;
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        sumOfWeights += m_contents[i];
+    }
+    return sumOfWeights;
+}
+
+
+/*****************************************************************/
+double GridND::getMinimum() const
+/*****************************************************************/
+{
+    double minimum = m_contents[0];
+    for(unsigned int i=1;i<m_contents.size();i++)
+    {
+        minimum = min(minimum, m_contents[i]);
+    }
+    return minimum;
+}
+
+
+/*****************************************************************/
+double GridND::filledFraction() const
+/*****************************************************************/
+{
+    unsigned int nfilled = 0;
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        if(m_contents[i]!=0. || m_sumw2[i]!=0.) nfilled++;
+    }
+    return (double)nfilled/(double)m_contents.size();
+}
+
+
+/*****************************************************************/
+void GridND::reset()
+/*****************************************************************/
+{
+    m_contents.assign(m_contents.size(), 0.);
+    m_sumw2.assign(m_sumw2.size(), 0.);
+}
+
+
+/*****************************************************************/
+void GridND::scale(double factor)
+/*****************************************************************/
+{
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        m_contents[i] *= factor;
+        m_sumw2[i] *= factor*factor;
+    }
+}
+
+
+/*****************************************************************/
+void GridND::add(const GridND& grid, double factor)
+/*****************************************************************/
+{
+    if(!sameBinning(grid))
+    {
+        stringstream error;
+        error << "GridND::add(): Trying to add grids with different binning ("<<m_name<<" & "<<grid.getName()<<")";
+        throw runtime_error(error.str());
+    }
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        m_contents[i] += factor*grid.m_contents[i];
+        m_sumw2[i] += factor*factor*grid.m_sumw2[i];
+    }
+}
+
+
+/*****************************************************************/
+void GridND::scaleSlice(unsigned int axis, int bin, double factor)
+/*****************************************************************/
+{
+    // Scale all the bins with the given bin number along one axis
+    unsigned int stride = m_strides[axis];
+    unsigned int block = stride*m_nbins[axis];
+    for(unsigned int start=(bin-1)*stride;start<m_contents.size();start+=block)
+    {
+        for(unsigned int i=start;i<start+stride;i++)
+        {
+            m_contents[i] *= factor;
+            m_sumw2[i] *= factor*factor;
+        }
+    }
+}
+
+
+/*****************************************************************/
+TH1D* GridND::projection(unsigned int axis, const string& name) const
+/*****************************************************************/
+{
+    TH1D* projection = new TH1D(name.c_str(), name.c_str(), m_nbins[axis], m_minmax[axis].first, m_minmax[axis].second);
+    projection->Sumw2();
+    vector<double> contents(m_nbins[axis]+2, 0.);
+    vector<double> sumw2(m_nbins[axis]+2, 0.);
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        int bin = (i/m_strides[axis])%m_nbins[axis] + 1;
+        contents[bin] += m_contents[i];
+        sumw2[bin] += m_sumw2[i];
+    }
+    for(unsigned int b=1;b<=m_nbins[axis];b++)
+    {
+        projection->SetBinContent(b, contents[b]);
+        projection->SetBinError(b, sqrt(sumw2[b]));
+    }
+    return projection;
+}
+
+
+/*****************************************************************/
+THnBase* GridND::toTHn(bool sparse) const
+/*****************************************************************/
+{
+    // Export to ROOT N-dimensional histograms. Only non-empty bins are set, which is enough for sparse histograms
+    unsigned int ndim = m_nbins.size();
+    vector<int> nbins(m_nbins.begin(), m_nbins.end());
+    vector<double> mins;
+    vector<double> maxs;
+    for(unsigned int axis=0;axis<ndim;axis++)
+    {
+        mins.push_back(m_minmax[axis].first);
+        maxs.push_back(m_minmax[axis].second);
+    }
+    THnBase* histo = NULL;
+    if(sparse) histo = new THnSparseF(m_name.c_str(), m_name.c_str(), ndim, &nbins[0], &mins[0], &maxs[0]);
+    else histo = new THnF(m_name.c_str(), m_name.c_str(), ndim, &nbins[0], &mins[0], &maxs[0]);
+    histo->Sumw2();
+    vector<int> binIndices;
+    for(unsigned int i=0;i<m_contents.size();i++)
+    {
+        if(m_contents[i]==0. && m_sumw2[i]==0.) continue;
+        bins(i, binIndices);
+        histo->SetBinContent(&binIndices[0], m_contents[i]);
+        histo->SetBinError(&binIndices[0], sqrt(m_sumw2[i]));
+    }
+    return histo;
+}
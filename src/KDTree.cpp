@@ -0,0 +1,273 @@
+
+
+
+
+#include "KDTree.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+/*****************************************************************/
+KDTree::KDTree(const vector< vector<double> >& points, unsigned int leafSize):
+    m_ndim(points.empty() ? 0 : points[0].size()),
+    m_leafSize(max(leafSize, 1u))
+/*****************************************************************/
+{
+    if(points.empty() || m_ndim==0)
+    {
+        stringstream error;
+        error << "KDTree::KDTree(): Cannot build a tree without points";
+        throw runtime_error(error.str());
+    }
+    unsigned int npoints = points.size();
+    m_points.resize(npoints*m_ndim);
+    m_indices.resize(npoints);
+    for(unsigned int i=0;i<npoints;i++)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            m_points[i*m_ndim+axis] = points[i][axis];
+        }
+        m_indices[i] = i;
+    }
+    build(0, npoints);
+    // Store the points in tree order
+    vector<double> ordered(m_points.size());
+    for(unsigned int position=0;position<npoints;position++)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            ordered[position*m_ndim+axis] = m_points[m_indices[position]*m_ndim+axis];
+        }
+    }
+    m_points.swap(ordered);
+    m_extents.assign(npoints, 0.);
+    m_supportLow = m_low;
+    m_supportHigh = m_high;
+}
+
+
+/*****************************************************************/
+int KDTree::build(unsigned int first, unsigned int last)
+/*****************************************************************/
+{
+    // Points are still in input order during the build, and accessed through m_indices
+    int node = m_nodes.size();
+    Node newNode = {first, last, -1, -1};
+    m_nodes.push_back(newNode);
+    m_low.resize(m_nodes.size()*m_ndim);
+    m_high.resize(m_nodes.size()*m_ndim);
+    computeBox(first, last, &m_low[node*m_ndim], &m_high[node*m_ndim]);
+    if(last-first<=m_leafSize) return node;
+    unsigned int splitAxis = 0;
+    double maxExtent = -1.;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        double extent = m_high[node*m_ndim+axis]-m_low[node*m_ndim+axis];
+        if(extent>maxExtent)
+        {
+            maxExtent = extent;
+            splitAxis = axis;
+        }
+    }
+    // All the points at the same position
+    if(maxExtent<=0.) return node;
+    unsigned int middle = (first+last)/2;
+    const vector<double>& coordinates = m_points;
+    unsigned int ndim = m_ndim;
+    nth_element(m_indices.begin()+first, m_indices.begin()+middle, m_indices.begin()+last, [&](unsigned int a, unsigned int b)
+    {
+        return coordinates[a*ndim+splitAxis]<coordinates[b*ndim+splitAxis];
+    });
+    int left = build(first, middle);
+    int right = build(middle, last);
+    m_nodes[node].left = left;
+    m_nodes[node].right = right;
+    return node;
+}
+
+
+/*****************************************************************/
+void KDTree::computeBox(unsigned int first, unsigned int last, double* low, double* high) const
+/*****************************************************************/
+{
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        low[axis] = m_points[m_indices[first]*m_ndim+axis];
+        high[axis] = low[axis];
+    }
+    for(unsigned int i=first+1;i<last;i++)
+    {
+        const double* p = &m_points[m_indices[i]*m_ndim];
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            low[axis] = min(low[axis], p[axis]);
+            high[axis] = max(high[axis], p[axis]);
+        }
+    }
+}
+
+
+/*****************************************************************/
+double KDTree::minDistance2(int node, const double* x) const
+/*****************************************************************/
+{
+    // Squared distance between x and the bounding box of the node
+    double distance2 = 0.;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        double low = m_low[node*m_ndim+axis];
+        double high = m_high[node*m_ndim+axis];
+        double d = (x[axis]<low ? low-x[axis] : (x[axis]>high ? x[axis]-high : 0.));
+        distance2 += d*d;
+    }
+    return distance2;
+}
+
+
+/*****************************************************************/
+double KDTree::neighborDistance(unsigned int position, unsigned int k) const
+/*****************************************************************/
+{
+    // Distance between the point at 'position' and its k-th nearest neighbor (the point itself is not counted).
+    // If there are less than k other points, the distance to the farthest one is returned
+    vector<double> heap;
+    heap.reserve(k+1);
+    searchNeighbors(0, point(position), k+1, heap);
+    return sqrt(heap.front());
+}
+
+
+/*****************************************************************/
+void KDTree::searchNeighbors(int node, const double* x, unsigned int k, vector<double>& heap) const
+/*****************************************************************/
+{
+    // 'heap' is a max-heap of the squared distances of the k closest points found so far
+    if(heap.size()==k && minDistance2(node, x)>=heap.front()) return;
+    const Node& current = m_nodes[node];
+    if(current.left<0)
+    {
+        for(unsigned int position=current.first;position<current.last;position++)
+        {
+            const double* p = point(position);
+            double distance2 = 0.;
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                double d = p[axis]-x[axis];
+                distance2 += d*d;
+            }
+            if(heap.size()<k)
+            {
+                heap.push_back(distance2);
+                push_heap(heap.begin(), heap.end());
+            }
+            else if(distance2<heap.front())
+            {
+                pop_heap(heap.begin(), heap.end());
+                heap.back() = distance2;
+                push_heap(heap.begin(), heap.end());
+            }
+        }
+        return;
+    }
+    // Closest child first, such that the other one is more likely to be pruned
+    int first = current.left;
+    int second = current.right;
+    if(minDistance2(second, x)<minDistance2(first, x)) swap(first, second);
+    searchNeighbors(first, x, k, heap);
+    searchNeighbors(second, x, k, heap);
+}
+
+
+/*****************************************************************/
+void KDTree::setExtents(const vector<double>& extents)
+/*****************************************************************/
+{
+    // Extents are given in tree order
+    if(extents.size()!=size())
+    {
+        stringstream error;
+        error << "KDTree::setExtents(): Wrong number of extents ("<<extents.size()<<" instead of "<<size()<<")";
+        throw runtime_error(error.str());
+    }
+    m_extents = extents;
+    updateSupports(0);
+}
+
+
+/*****************************************************************/
+void KDTree::updateSupports(int node)
+/*****************************************************************/
+{
+    const Node& current = m_nodes[node];
+    double* low = &m_supportLow[node*m_ndim];
+    double* high = &m_supportHigh[node*m_ndim];
+    if(current.left<0)
+    {
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            low[axis] = point(current.first)[axis]-m_extents[current.first];
+            high[axis] = point(current.first)[axis]+m_extents[current.first];
+        }
+        for(unsigned int position=current.first+1;position<current.last;position++)
+        {
+            for(unsigned int axis=0;axis<m_ndim;axis++)
+            {
+                low[axis] = min(low[axis], point(position)[axis]-m_extents[position]);
+                high[axis] = max(high[axis], point(position)[axis]+m_extents[position]);
+            }
+        }
+        return;
+    }
+    updateSupports(current.left);
+    updateSupports(current.right);
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        low[axis] = min(m_supportLow[current.left*m_ndim+axis], m_supportLow[current.right*m_ndim+axis]);
+        high[axis] = max(m_supportHigh[current.left*m_ndim+axis], m_supportHigh[current.right*m_ndim+axis]);
+    }
+}
+
+
+/*****************************************************************/
+void KDTree::findContaining(const vector<double>& x, vector<unsigned int>& positions) const
+/*****************************************************************/
+{
+    // Positions (in tree order, increasing) of the points whose box of half-size 'extent' contains x
+    positions.clear();
+    searchContaining(0, &x[0], positions);
+}
+
+
+/*****************************************************************/
+void KDTree::searchContaining(int node, const double* x, vector<unsigned int>& positions) const
+/*****************************************************************/
+{
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        if(x[axis]<m_supportLow[node*m_ndim+axis] || x[axis]>m_supportHigh[node*m_ndim+axis]) return;
+    }
+    const Node& current = m_nodes[node];
+    if(current.left<0)
+    {
+        for(unsigned int position=current.first;position<current.last;position++)
+        {
+            const double* p = point(position);
+            double extent = m_extents[position];
+            bool inside = true;
+            for(unsigned int axis=0;axis<m_ndim && inside;axis++)
+            {
+                inside = (fabs(x[axis]-p[axis])<=extent);
+            }
+            if(inside) positions.push_back(position);
+        }
+        return;
+    }
+    searchContaining(current.left, x, positions);
+    searchContaining(current.right, x, positions);
+}
@@ -0,0 +1,293 @@
+
+
+
+
+#include "KernelDensityEstimator.h"
+#include "KDTree.h"
+#include "GridND.h"
+#include "ThreadPool.h"
+
+#include "TH2F.h"
+#include "TH3F.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+const double KernelDensityEstimator::s_truncation = 4.;
+
+
+/*****************************************************************/
+KernelDensityEstimator::KernelDensityEstimator(const vector< pair<double,double> >& minmax):
+    m_minmax(minmax),
+    m_neighbors(200),
+    m_widthScalingFactor(1.),
+    m_tree(NULL),
+    m_verbose(true)
+/*****************************************************************/
+{
+}
+
+
+/*****************************************************************/
+KernelDensityEstimator::~KernelDensityEstimator()
+/*****************************************************************/
+{
+    if(m_tree) delete m_tree;
+}
+
+
+/*****************************************************************/
+void KernelDensityEstimator::setEntries(const vector< vector<double> >& entries, const vector<double>& weights)
+/*****************************************************************/
+{
+    if(entries.empty() || entries.size()!=weights.size())
+    {
+        stringstream error;
+        error << "KernelDensityEstimator::setEntries(): No entries, or inconsistent numbers of entries and weights";
+        throw runtime_error(error.str());
+    }
+    unsigned int ndim = m_minmax.size();
+    // Only finite entries inside the template range are used, as when filling the histogram
+    vector< vector<double> > points;
+    vector<double> pointWeights;
+    points.reserve(entries.size());
+    pointWeights.reserve(entries.size());
+    for(unsigned int e=0;e<entries.size();e++)
+    {
+        bool inRange = std::isfinite(weights[e]);
+        vector<double> point(ndim);
+        for(unsigned int axis=0;axis<ndim && inRange;axis++)
+        {
+            double value = entries[e][axis];
+            inRange = (std::isfinite(value) && value>=m_minmax[axis].first && value<=m_minmax[axis].second);
+            point[axis] = (value-m_minmax[axis].first)/(m_minmax[axis].second-m_minmax[axis].first);
+        }
+        if(!inRange) continue;
+        points.push_back(point);
+        pointWeights.push_back(weights[e]);
+    }
+    if(points.empty())
+    {
+        stringstream error;
+        error << "KernelDensityEstimator::setEntries(): No entries inside the template range";
+        throw runtime_error(error.str());
+    }
+    if(m_verbose && points.size()<entries.size()) cout<<"[INFO]   "<<entries.size()-points.size()<<" entries outside the template range or not finite are ignored\n";
+    unsigned int nentries = points.size();
+    if(m_tree) delete m_tree;
+    m_tree = new KDTree(points);
+    m_weights.resize(nentries);
+    for(unsigned int position=0;position<nentries;position++)
+    {
+        m_weights[position] = pointWeights[m_tree->originalIndex(position)];
+    }
+    // Width of the cube with the same volume as the ball containing the k nearest neighbors
+    if(m_verbose) cout<<"[INFO]   Computing kernel widths from the "<<m_neighbors<<" nearest neighbors of "<<nentries<<" entries\n";
+    double ballVolume = pow(M_PI, (double)ndim/2.)/tgamma((double)ndim/2.+1.);
+    double cubeSide = pow(ballVolume, 1./(double)ndim);
+    m_widths.resize(nentries);
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (nentries+tileSize-1)/tileSize;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        unsigned int last = min((tile+1)*tileSize, nentries);
+        for(unsigned int position=tile*tileSize;position<last;position++)
+        {
+            m_widths[position] = m_tree->neighborDistance(position, m_neighbors)*cubeSide*m_widthScalingFactor;
+        }
+    });
+}
+
+
+/*****************************************************************/
+void KernelDensityEstimator::prepareKernels(const vector<double>& binWidths)
+/*****************************************************************/
+{
+    // Sigmas are half the k-neighbor widths, as for the binned smoothing. They are not allowed to be smaller
+    // than half a bin, otherwise the kernels could fall between the bin centers.
+    // Each kernel is normalized to 1 inside the template range, such that entries close to the boundaries keep their weight
+    unsigned int ndim = m_minmax.size();
+    unsigned int nentries = m_weights.size();
+    m_sigmas.resize(nentries*ndim);
+    m_norms.resize(nentries);
+    vector<double> extents(nentries);
+    for(unsigned int position=0;position<nentries;position++)
+    {
+        const double* u = m_tree->point(position);
+        double norm = 1.;
+        double maxSigma = 0.;
+        for(unsigned int axis=0;axis<ndim;axis++)
+        {
+            double sigma = max(m_widths[position]/2., binWidths[axis]/2.);
+            m_sigmas[position*ndim+axis] = sigma;
+            maxSigma = max(maxSigma, sigma);
+            double high = min((1.-u[axis])/sigma, s_truncation);
+            double low = max(-u[axis]/sigma, -s_truncation);
+            norm *= 0.5*(erfc(-high/sqrt(2.))-erfc(-low/sqrt(2.)));
+        }
+        m_norms[position] = norm;
+        extents[position] = s_truncation*maxSigma;
+    }
+    m_tree->setExtents(extents);
+}
+
+
+/*****************************************************************/
+pair<double,double> KernelDensityEstimator::valueError(const vector<double>& x, double binVolume, vector<unsigned int>& positions) const
+/*****************************************************************/
+{
+    // Sum of the kernels at x (normalized coordinates), times the bin volume. Entries are summed in tree order,
+    // so the result doesn't depend on the number of threads
+    unsigned int ndim = m_minmax.size();
+    m_tree->findContaining(x, positions);
+    double value = 0.;
+    double error2 = 0.;
+    for(unsigned int i=0;i<positions.size();i++)
+    {
+        unsigned int position = positions[i];
+        const double* u = m_tree->point(position);
+        const double* sigmas = &m_sigmas[position*ndim];
+        double kernel = 1.;
+        bool inside = true;
+        for(unsigned int axis=0;axis<ndim && inside;axis++)
+        {
+            double t = (x[axis]-u[axis])/sigmas[axis];
+            inside = (fabs(t)<=s_truncation);
+            kernel *= exp(-t*t/2.)/(sqrt(2.*M_PI)*sigmas[axis]);
+        }
+        if(!inside || m_norms[position]<=0.) continue;
+        double content = m_weights[position]*kernel/m_norms[position]*binVolume;
+        value += content;
+        error2 += content*content;
+    }
+    return make_pair(value, sqrt(error2));
+}
+
+
+/*****************************************************************/
+void KernelDensityEstimator::estimateBins(unsigned int nbins, const vector<double>& binWidths, const function<void(unsigned int, vector<double>&)>& binCenter, vector< pair<double,double> >& valueErrors)
+/*****************************************************************/
+{
+    // Bins 0..nbins-1 are processed by tiles on the thread pool. 'binCenter' gives the normalized center of a bin
+    if(!m_tree)
+    {
+        stringstream error;
+        error << "KernelDensityEstimator::estimateBins(): Entries have not been set";
+        throw runtime_error(error.str());
+    }
+    prepareKernels(binWidths);
+    double binVolume = 1.;
+    for(unsigned int axis=0;axis<binWidths.size();axis++) binVolume *= binWidths[axis];
+    valueErrors.resize(nbins);
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (nbins+tileSize-1)/tileSize;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        vector<double> x;
+        vector<unsigned int> positions;
+        unsigned int last = min((tile+1)*tileSize, nbins);
+        for(unsigned int bin=tile*tileSize;bin<last;bin++)
+        {
+            binCenter(bin, x);
+            valueErrors[bin] = valueError(x, binVolume, positions);
+        }
+    });
+}
+
+
+/*****************************************************************/
+TH1* KernelDensityEstimator::estimate(const TH1* histo)
+/*****************************************************************/
+{
+    unsigned int ndim = m_minmax.size();
+    if(ndim!=2 && ndim!=3)
+    {
+        stringstream error;
+        error << "KernelDensityEstimator::estimate(): Histograms can only be estimated in 2D or 3D";
+        throw runtime_error(error.str());
+    }
+    int nbinsx = histo->GetNbinsX();
+    int nbinsy = histo->GetNbinsY();
+    int nbinsz = (ndim==3 ? histo->GetNbinsZ() : 1);
+    vector<const TAxis*> axes;
+    axes.push_back(histo->GetXaxis());
+    axes.push_back(histo->GetYaxis());
+    if(ndim==3) axes.push_back(histo->GetZaxis());
+    vector<double> binWidths(ndim);
+    for(unsigned int axis=0;axis<ndim;axis++)
+    {
+        binWidths[axis] = axes[axis]->GetBinWidth(1)/(m_minmax[axis].second-m_minmax[axis].first);
+    }
+    // Flat bin numbering with the last axis running fastest
+    vector< pair<double,double> > valueErrors;
+    estimateBins(nbinsx*nbinsy*nbinsz, binWidths, [&](unsigned int bin, vector<double>& x)
+    {
+        int bins[3] = {(int)(bin/(nbinsy*nbinsz))+1, (int)((bin/nbinsz)%nbinsy)+1, (int)(bin%nbinsz)+1};
+        x.resize(ndim);
+        for(unsigned int axis=0;axis<ndim;axis++)
+        {
+            x[axis] = (axes[axis]->GetBinCenter(bins[axis])-m_minmax[axis].first)/(m_minmax[axis].second-m_minmax[axis].first);
+        }
+    }, valueErrors);
+    stringstream hName;
+    hName << histo->GetName() << "_smooth";
+    TH1* estimatedHisto = dynamic_cast<TH1*>(histo->Clone(hName.str().c_str()));
+    estimatedHisto->SetDirectory(0);
+    unsigned int bin = 0;
+    for(int bx=1;bx<=nbinsx;bx++)
+    {
+        for(int by=1;by<=nbinsy;by++)
+        {
+            for(int bz=1;bz<=nbinsz;bz++)
+            {
+                int histoBin = (ndim==2 ? estimatedHisto->GetBin(bx, by) : estimatedHisto->GetBin(bx, by, bz));
+                estimatedHisto->SetBinContent(histoBin, valueErrors[bin].first);
+                estimatedHisto->SetBinError(histoBin, valueErrors[bin].second);
+                bin++;
+            }
+        }
+    }
+    return estimatedHisto;
+}
+
+
+/*****************************************************************/
+GridND* KernelDensityEstimator::estimate(const GridND* grid)
+/*****************************************************************/
+{
+    unsigned int ndim = m_minmax.size();
+    if(grid->dimension()!=ndim)
+    {
+        stringstream error;
+        error << "KernelDensityEstimator::estimate(): Grid doesn't have "<<ndim<<" dimensions";
+        throw runtime_error(error.str());
+    }
+    vector<double> binWidths(ndim);
+    for(unsigned int axis=0;axis<ndim;axis++)
+    {
+        binWidths[axis] = grid->getBinWidth(axis)/(m_minmax[axis].second-m_minmax[axis].first);
+    }
+    vector< pair<double,double> > valueErrors;
+    estimateBins(grid->size(), binWidths, [&](unsigned int index, vector<double>& x)
+    {
+        grid->binCenter(index, x);
+        for(unsigned int axis=0;axis<ndim;axis++)
+        {
+            x[axis] = (x[axis]-m_minmax[axis].first)/(m_minmax[axis].second-m_minmax[axis].first);
+        }
+    }, valueErrors);
+    GridND* estimatedGrid = new GridND(*grid);
+    estimatedGrid->setName(grid->getName()+"_smooth");
+    for(unsigned int index=0;index<grid->size();index++)
+    {
+        estimatedGrid->setBinContent(index, valueErrors[index].first);
+        estimatedGrid->setBinError(index, valueErrors[index].second);
+    }
+    return estimatedGrid;
+}
@@ -0,0 +1,318 @@
+
+
+
+
+#include "LeafGraphSmoother.h"
+#include "BinTree.h"
+#include "ThreadPool.h"
+
+#include "TH2F.h"
+#include "TH3F.h"
+
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+/*****************************************************************/
+LeafGraphSmoother::LeafGraphSmoother(BinTree* partition):
+    m_partition(partition),
+    m_ndim(partition->getBinBoundaries().size()),
+    m_widthScalingFactor(1.),
+    m_verbose(true)
+/*****************************************************************/
+{
+}
+
+
+/*****************************************************************/
+void LeafGraphSmoother::mapBins(const TH1* histo)
+/*****************************************************************/
+{
+    // Leaf containing the center of each template bin, and leaf densities (mean bin content)
+    vector<const TAxis*> axes;
+    axes.push_back(histo->GetXaxis());
+    axes.push_back(histo->GetYaxis());
+    if(m_ndim==3) axes.push_back(histo->GetZaxis());
+    m_nbins.resize(m_ndim);
+    m_binCenters.resize(m_ndim);
+    unsigned int total = 1;
+    for(unsigned int axis=0;axis<m_ndim;axis++)
+    {
+        m_nbins[axis] = axes[axis]->GetNbins();
+        m_binCenters[axis].resize(m_nbins[axis]);
+        for(int b=0;b<m_nbins[axis];b++) m_binCenters[axis][b] = axes[axis]->GetBinCenter(b+1);
+        total *= m_nbins[axis];
+    }
+    m_binLeaves.resize(total);
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (total+tileSize-1)/tileSize;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        vector<double> x(m_ndim);
+        unsigned int last = min((tile+1)*tileSize, total);
+        for(unsigned int bin=tile*tileSize;bin<last;bin++)
+        {
+            unsigned int rest = bin;
+            for(int axis=m_ndim-1;axis>=0;axis--)
+            {
+                x[axis] = m_binCenters[axis][rest%m_nbins[axis]];
+                rest /= m_nbins[axis];
+            }
+            const BinLeaf* leaf = m_partition->getLeaf(x);
+            m_binLeaves[bin] = (leaf ? (int)leaf->index() : -1);
+        }
+    });
+    unsigned int nleaves = m_partition->getNLeaves();
+    m_leafBins.assign(nleaves, 0);
+    m_densities.assign(nleaves, 0.);
+    m_errors.assign(nleaves, 0.);
+    unsigned int bin = 0;
+    for(int bx=1;bx<=m_nbins[0];bx++)
+    {
+        for(int by=1;by<=m_nbins[1];by++)
+        {
+            for(int bz=1;bz<=(m_ndim==3 ? m_nbins[2] : 1);bz++)
+            {
+                int leaf = m_binLeaves[bin];
+                bin++;
+                if(leaf<0) continue;
+                int histoBin = (m_ndim==2 ? histo->GetBin(bx, by) : histo->GetBin(bx, by, bz));
+                m_leafBins[leaf]++;
+                m_densities[leaf] += histo->GetBinContent(histoBin);
+                m_errors[leaf] += histo->GetBinError(histoBin)*histo->GetBinError(histoBin);
+            }
+        }
+    }
+    for(unsigned int leaf=0;leaf<nleaves;leaf++)
+    {
+        if(m_leafBins[leaf]==0) continue;
+        m_densities[leaf] /= (double)m_leafBins[leaf];
+        m_errors[leaf] = sqrt(m_errors[leaf])/(double)m_leafBins[leaf];
+    }
+}
+
+
+/*****************************************************************/
+void LeafGraphSmoother::buildGraph()
+/*****************************************************************/
+{
+    // Two leaves are neighbors if they contain adjacent template bins. This is the same adjacency as
+    // BinTree::findNeighborLeaves(), restricted to the leaves containing bins, but linear in the number of bins
+    vector<unsigned int> strides(m_ndim, 1);
+    for(int axis=m_ndim-2;axis>=0;axis--) strides[axis] = strides[axis+1]*m_nbins[axis+1];
+    m_neighbors.assign(m_partition->getNLeaves(), vector<unsigned int>());
+    for(unsigned int bin=0;bin<m_binLeaves.size();bin++)
+    {
+        int leaf = m_binLeaves[bin];
+        if(leaf<0) continue;
+        for(unsigned int axis=0;axis<m_ndim;axis++)
+        {
+            if((int)((bin/strides[axis])%m_nbins[axis])==m_nbins[axis]-1) continue;
+            int neighbor = m_binLeaves[bin+strides[axis]];
+            if(neighbor<0 || neighbor==leaf) continue;
+            m_neighbors[leaf].push_back(neighbor);
+            m_neighbors[neighbor].push_back(leaf);
+        }
+    }
+    unsigned int nedges = 0;
+    for(unsigned int leaf=0;leaf<m_neighbors.size();leaf++)
+    {
+        vector<unsigned int>& neighbors = m_neighbors[leaf];
+        sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        nedges += neighbors.size();
+    }
+    if(m_verbose) cout<<"[INFO]   Leaf graph with "<<m_neighbors.size()<<" leaves and "<<nedges/2<<" neighbor pairs\n";
+}
+
+
+/*****************************************************************/
+void LeafGraphSmoother::fitLeaves()
+/*****************************************************************/
+{
+    // Local linear regression around each leaf: the smoothed density is the constant term of the linear fit of
+    // the neighbor densities, as a function of the distance to the leaf center. It is a linear combination of
+    // the densities, which also gives the error. If there are not enough neighbors to constrain the slopes
+    // (e.g. leaves in a corner), the weighted mean is used
+    const vector<BinLeaf>& leaves = m_partition->getLeaves();
+    unsigned int nleaves = leaves.size();
+    unsigned int npars = m_ndim+1;
+    m_smoothed.assign(nleaves, make_pair(0., 0.));
+    const unsigned int tileSize = 64;
+    unsigned int ntiles = (nleaves+tileSize-1)/tileSize;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        vector<unsigned int> points;
+        vector< vector<double> > xs;
+        vector<double> ws;
+        vector<double> matrix(npars*npars);
+        vector<double> z(npars);
+        unsigned int last = min((tile+1)*tileSize, nleaves);
+        for(unsigned int leaf=tile*tileSize;leaf<last;leaf++)
+        {
+            if(m_leafBins[leaf]==0) continue;
+            points.assign(1, leaf);
+            points.insert(points.end(), m_neighbors[leaf].begin(), m_neighbors[leaf].end());
+            xs.assign(points.size(), vector<double>(npars, 1.));
+            ws.resize(points.size());
+            fill(matrix.begin(), matrix.end(), 0.);
+            for(unsigned int p=0;p<points.size();p++)
+            {
+                double distance2 = 0.;
+                for(unsigned int axis=0;axis<m_ndim;axis++)
+                {
+                    double d = (leaves[points[p]].getCenter(axis)-leaves[leaf].getCenter(axis))/leaves[leaf].getWidth(axis);
+                    xs[p][axis+1] = d;
+                    distance2 += d*d;
+                }
+                ws[p] = (double)m_leafBins[points[p]]*exp(-0.5*distance2/(m_widthScalingFactor*m_widthScalingFactor));
+                for(unsigned int i=0;i<npars;i++)
+                {
+                    for(unsigned int j=0;j<npars;j++) matrix[i*npars+j] += ws[p]*xs[p][i]*xs[p][j];
+                }
+            }
+            // Solve matrix.z = (1,0,...,0) with Gaussian elimination and partial pivoting
+            fill(z.begin(), z.end(), 0.);
+            z[0] = 1.;
+            double tolerance = 1.e-9*matrix[0];
+            bool singular = false;
+            for(unsigned int c=0;c<npars && !singular;c++)
+            {
+                unsigned int pivot = c;
+                for(unsigned int r=c+1;r<npars;r++)
+                {
+                    if(fabs(matrix[r*npars+c])>fabs(matrix[pivot*npars+c])) pivot = r;
+                }
+                if(fabs(matrix[pivot*npars+c])<=tolerance)
+                {
+                    singular = true;
+                    break;
+                }
+                if(pivot!=c)
+                {
+                    for(unsigned int j=0;j<npars;j++) swap(matrix[c*npars+j], matrix[pivot*npars+j]);
+                    swap(z[c], z[pivot]);
+                }
+                for(unsigned int r=c+1;r<npars;r++)
+                {
+                    double factor = matrix[r*npars+c]/matrix[c*npars+c];
+                    for(unsigned int j=c;j<npars;j++) matrix[r*npars+j] -= factor*matrix[c*npars+j];
+                    z[r] -= factor*z[c];
+                }
+            }
+            if(!singular)
+            {
+                for(int r=npars-1;r>=0;r--)
+                {
+                    for(unsigned int j=r+1;j<npars;j++) z[r] -= matrix[r*npars+j]*z[j];
+                    z[r] /= matrix[r*npars+r];
+                }
+            }
+            double sumw = 0.;
+            for(unsigned int p=0;p<points.size();p++) sumw += ws[p];
+            double value = 0.;
+            double error2 = 0.;
+            for(unsigned int p=0;p<points.size();p++)
+            {
+                double coefficient = ws[p]/sumw;
+                if(!singular)
+                {
+                    coefficient = 0.;
+                    for(unsigned int i=0;i<npars;i++) coefficient += ws[p]*xs[p][i]*z[i];
+                }
+                value += coefficient*m_densities[points[p]];
+                error2 += coefficient*coefficient*m_errors[points[p]]*m_errors[points[p]];
+            }
+            // The linear fit can extrapolate below zero next to steep edges
+            m_smoothed[leaf] = make_pair(max(value, 0.), sqrt(error2));
+        }
+    });
+}
+
+
+/*****************************************************************/
+pair<double,double> LeafGraphSmoother::interpolate(unsigned int bin, const vector<double>& x) const
+/*****************************************************************/
+{
+    // Tent weights of the leaf containing the bin and of its neighbors. The weight of the containing leaf
+    // is always positive, since x is less than half a leaf width away from its center
+    int leaf = m_binLeaves[bin];
+    if(leaf<0) return make_pair(0., 0.);
+    const vector<BinLeaf>& leaves = m_partition->getLeaves();
+    double sumw = 0.;
+    double value = 0.;
+    double error = 0.;
+    for(int n=-1;n<(int)m_neighbors[leaf].size();n++)
+    {
+        unsigned int other = (n<0 ? leaf : m_neighbors[leaf][n]);
+        double weight = 1.;
+        for(unsigned int axis=0;axis<m_ndim && weight>0.;axis++)
+        {
+            weight *= max(1.-fabs(x[axis]-leaves[other].getCenter(axis))/leaves[other].getWidth(axis), 0.);
+        }
+        if(weight<=0.) continue;
+        sumw += weight;
+        value += weight*m_smoothed[other].first;
+        error += weight*m_smoothed[other].second;
+    }
+    return make_pair(value/sumw, error/sumw);
+}
+
+
+/*****************************************************************/
+TH1* LeafGraphSmoother::smooth(const TH1* histo)
+/*****************************************************************/
+{
+    if(m_ndim!=2 && m_ndim!=3)
+    {
+        stringstream error;
+        error << "LeafGraphSmoother::smooth(): Histograms can only be smoothed in 2D or 3D";
+        throw runtime_error(error.str());
+    }
+    mapBins(histo);
+    buildGraph();
+    fitLeaves();
+    vector< pair<double,double> > valueErrors(m_binLeaves.size());
+    unsigned int total = m_binLeaves.size();
+    const unsigned int tileSize = 256;
+    unsigned int ntiles = (total+tileSize-1)/tileSize;
+    ThreadPool::global().parallelFor(ntiles, [&](unsigned int tile)
+    {
+        vector<double> x(m_ndim);
+        unsigned int last = min((tile+1)*tileSize, total);
+        for(unsigned int bin=tile*tileSize;bin<last;bin++)
+        {
+            unsigned int rest = bin;
+            for(int axis=m_ndim-1;axis>=0;axis--)
+            {
+                x[axis] = m_binCenters[axis][rest%m_nbins[axis]];
+                rest /= m_nbins[axis];
+            }
+            valueErrors[bin] = interpolate(bin, x);
+        }
+    });
+    stringstream hName;
+    hName << histo->GetName() << "_smooth";
+    TH1* smoothedHisto = dynamic_cast<TH1*>(histo->Clone(hName.str().c_str()));
+    smoothedHisto->SetDirectory(0);
+    unsigned int bin = 0;
+    for(int bx=1;bx<=m_nbins[0];bx++)
+    {
+        for(int by=1;by<=m_nbins[1];by++)
+        {
+            for(int bz=1;bz<=(m_ndim==3 ? m_nbins[2] : 1);bz++)
+            {
+                int histoBin = (m_ndim==2 ? smoothedHisto->GetBin(bx, by) : smoothedHisto->GetBin(bx, by, bz));
+                smoothedHisto->SetBinContent(histoBin, valueErrors[bin].first);
+                smoothedHisto->SetBinError(histoBin, valueErrors[bin].second);
+                bin++;
+            }
+        }
+    }
+    return smoothedHisto;
+}
@@ -0,0 +1,197 @@
+#include "RadixSort.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+    const unsigned int digitBits = 11;
+    const unsigned int nbuckets = 1<<digitBits;
+    const uint64_t digitMask = nbuckets-1;
+    const unsigned int npasses = (64+digitBits-1)/digitBits;
+    const uint64_t signBit = 0x8000000000000000ULL;
+
+    // Map a double to an unsigned integer with the same ordering:
+    // the sign bit is flipped for positive values and all bits are flipped for negative values
+    inline uint64_t valueToKey(double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return (bits & signBit ? ~bits : bits | signBit);
+    }
+
+    inline double keyToValue(uint64_t key)
+    {
+        uint64_t bits = (key & signBit ? key & ~signBit : ~key);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    inline unsigned int digit(uint64_t key, unsigned int pass)
+    {
+        return (unsigned int)((key>>(pass*digitBits)) & digitMask);
+    }
+
+    bool valueLess(const pair<double,int>& lhs, const pair<double,int>& rhs)
+    {
+        return lhs.first < rhs.first;
+    }
+}
+
+
+/*****************************************************************/
+RadixSorter& RadixSorter::local()
+/*****************************************************************/
+{
+    static thread_local RadixSorter sorter;
+    return sorter;
+}
+
+/*****************************************************************/
+void RadixSorter::sort(vector< pair<double,int> >& values, bool parallel)
+/*****************************************************************/
+{
+    unsigned int nentries = values.size();
+    if(nentries<s_minRadixSize)
+    {
+        std::stable_sort(values.begin(), values.end(), valueLess);
+        return;
+    }
+    if(m_records.size()<nentries)
+    {
+        m_records.resize(nentries);
+        m_buffer.resize(nentries);
+    }
+    for(unsigned int e=0;e<nentries;e++)
+    {
+        m_records[e].key = valueToKey(values[e].first);
+        m_records[e].index = values[e].second;
+    }
+    unsigned int nthreads = ThreadPool::global().nThreads();
+    if(parallel && nthreads>1 && nentries>=s_minParallelSize)
+    {
+        sortParallel(nentries, nthreads);
+    }
+    else
+    {
+        sortSerial(nentries);
+    }
+    for(unsigned int e=0;e<nentries;e++)
+    {
+        values[e].first = keyToValue(m_records[e].key);
+        values[e].second = m_records[e].index;
+    }
+}
+
+/*****************************************************************/
+void RadixSorter::sortSerial(unsigned int nentries)
+/*****************************************************************/
+{
+    // histograms of all the digits filled in one pass over the keys
+    m_counts.assign(npasses*nbuckets, 0);
+    for(unsigned int e=0;e<nentries;e++)
+    {
+        uint64_t key = m_records[e].key;
+        for(unsigned int p=0;p<npasses;p++)
+        {
+            m_counts[p*nbuckets + digit(key,p)]++;
+        }
+    }
+    for(unsigned int p=0;p<npasses;p++)
+    {
+        unsigned int* counts = &m_counts[p*nbuckets];
+        // all keys have the same digit, nothing to reorder
+        if(counts[digit(m_records[0].key,p)]==nentries) continue;
+        unsigned int offset = 0;
+        for(unsigned int b=0;b<nbuckets;b++)
+        {
+            unsigned int count = counts[b];
+            counts[b] = offset;
+            offset += count;
+        }
+        for(unsigned int e=0;e<nentries;e++)
+        {
+            unsigned int pos = counts[digit(m_records[e].key,p)]++;
+            m_buffer[pos] = m_records[e];
+        }
+        m_records.swap(m_buffer);
+    }
+}
+
+/*****************************************************************/
+void RadixSorter::sortParallel(unsigned int nentries, unsigned int nchunks)
+/*****************************************************************/
+{
+    ThreadPool& pool = ThreadPool::global();
+    vector<unsigned int> chunkBounds(nchunks+1);
+    for(unsigned int c=0;c<=nchunks;c++)
+    {
+        chunkBounds[c] = (unsigned int)((unsigned long long)nentries*c/nchunks);
+    }
+    // m_counts holds one histogram per chunk
+    m_counts.resize(nchunks*nbuckets);
+    // digits which are identical for all keys are looked for in a first pass
+    vector<uint64_t> chunkAnd(nchunks, ~0ULL);
+    vector<uint64_t> chunkOr(nchunks, 0ULL);
+    pool.parallelFor(nchunks, [&](unsigned int c)
+    {
+        uint64_t keyAnd = ~0ULL;
+        uint64_t keyOr = 0ULL;
+        for(unsigned int e=chunkBounds[c];e<chunkBounds[c+1];e++)
+        {
+            keyAnd &= m_records[e].key;
+            keyOr |= m_records[e].key;
+        }
+        chunkAnd[c] = keyAnd;
+        chunkOr[c] = keyOr;
+    });
+    uint64_t keyAnd = ~0ULL;
+    uint64_t keyOr = 0ULL;
+    for(unsigned int c=0;c<nchunks;c++)
+    {
+        keyAnd &= chunkAnd[c];
+        keyOr |= chunkOr[c];
+    }
+    uint64_t varyingBits = (keyAnd ^ keyOr);
+
+    for(unsigned int p=0;p<npasses;p++)
+    {
+        if(digit(varyingBits,p)==0) continue;
+        // count digits in each chunk
+        pool.parallelFor(nchunks, [&](unsigned int c)
+        {
+            unsigned int* counts = &m_counts[c*nbuckets];
+            fill(counts, counts+nbuckets, 0);
+            for(unsigned int e=chunkBounds[c];e<chunkBounds[c+1];e++)
+            {
+                counts[digit(m_records[e].key,p)]++;
+            }
+        });
+        // output positions: buckets in order, and chunks in order inside each bucket, which keeps the sort stable
+        unsigned int offset = 0;
+        for(unsigned int b=0;b<nbuckets;b++)
+        {
+            for(unsigned int c=0;c<nchunks;c++)
+            {
+                unsigned int count = m_counts[c*nbuckets+b];
+                m_counts[c*nbuckets+b] = offset;
+                offset += count;
+            }
+        }
+        // scatter, each chunk writing to its own positions
+        pool.parallelFor(nchunks, [&](unsigned int c)
+        {
+            unsigned int* counts = &m_counts[c*nbuckets];
+            for(unsigned int e=chunkBounds[c];e<chunkBounds[c+1];e++)
+            {
+                unsigned int pos = counts[digit(m_records[e].key,p)]++;
+                m_buffer[pos] = m_records[e];
+            }
+        });
+        m_records.swap(m_buffer);
+    }
+}
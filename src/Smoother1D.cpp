@@ -54,7 +54,8 @@ Smoother1D::Smoother1D():
     m_rebinHisto(NULL),
     m_rebinHistoX(NULL),
     m_smoothWidth(NULL),
-    m_smoothHisto(NULL)
+    m_smoothHisto(NULL),
+    m_verbose(true)
 /*****************************************************************/
 {
 }
@@ -635,7 +636,7 @@ TH1D* Smoother1D::smooth(TH1D* rawHisto)
     double chi2Histo = chi2(m_rawHisto, m_smoothHisto);
     int ndf = m_rawHisto->GetNbinsX()-m_rebinHisto->GetNbinsX();
     double chi2oNdf = (ndf>0 ? chi2Histo/(double)ndf : chi2Histo);
-    cout<<"[INFO]     chi2/ndf(ref-raw) = "<<chi2Histo<<"/"<<ndf<<" = "<<chi2oNdf<<"\n";
+    if(m_verbose) cout<<"[INFO]     chi2/ndf(ref-raw) = "<<chi2Histo<<"/"<<ndf<<" = "<<chi2oNdf<<"\n";
     if(chi2oNdf>5)
     {
         cout<<"[WARN]     The reference histogram used for reweighting seems not good. Please check the produced control plot in the output file.\n";
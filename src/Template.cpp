@@ -18,10 +18,15 @@
 
 
 #include "Template.h"
+#include "BinTree.h"
+#include "GridND.h"
 
 #include "TH2F.h"
 #include "TH3F.h"
 
+#include <random>
+#include <functional>
+
 #include <iostream>
 
 
@@ -47,8 +52,23 @@ PostProcessing::~PostProcessing()
 /*****************************************************************/
 Template::Template():m_template(NULL),
     m_rawTemplate(NULL),
+    m_templateND(NULL),
+    m_rawTemplateND(NULL),
+    m_maxBuildSeconds(0.),
+    m_multiAxisSplit(false),
+    m_splitCriterion("gradient"),
+    m_sharedEntries(NULL),
     m_originalSumOfWeights(0.),
-    m_conserveSumOfWeights(false)
+    m_conserveSumOfWeights(false),
+    m_updatePartition(false),
+    m_partition(NULL),
+    m_bootstrap(0),
+    m_bootstrapSeed(0),
+    m_bootstrapMean(NULL),
+    m_bootstrapRMS(NULL),
+    m_splineCoefficients(NULL),
+    m_makeControlPlots(true),
+    m_verbose(true)
 /*****************************************************************/
 {
 }
@@ -62,6 +82,21 @@ Template::Template(const Template& tmp)
     m_name = hname.str();
     m_template = NULL;
     m_rawTemplate = NULL;
+    m_templateND = NULL;
+    m_rawTemplateND = NULL;
+    m_maxBuildSeconds = 0.;
+    m_multiAxisSplit = false;
+    m_splitCriterion = "gradient";
+    m_sharedEntries = NULL;
+    m_updatePartition = false;
+    m_partition = NULL;
+    m_bootstrap = 0;
+    m_bootstrapSeed = 0;
+    m_bootstrapMean = NULL;
+    m_bootstrapRMS = NULL;
+    m_splineCoefficients = NULL;
+    m_makeControlPlots = true;
+    m_verbose = true;
     if(tmp.getTemplate())
     {
         m_template = dynamic_cast<TH1*>(tmp.getTemplate()->Clone(hname.str().c_str()));
@@ -72,7 +107,10 @@ Template::Template(const Template& tmp)
         nameRaw << m_name << "_raw_";
         m_rawTemplate = dynamic_cast<TH1*>(tmp.getRawTemplate()->Clone(nameRaw.str().c_str()));
     }
+    if(tmp.getTemplateND()) setTemplateND(tmp.getTemplateND());
+    if(tmp.getRawTemplateND()) setRawTemplateND(tmp.getRawTemplateND());
     setWidths(tmp.getWidths());
+    setWidthsND(tmp.getWidthsND());
     setRaw1DTemplates(tmp.getRaw1DTemplates());
     setOriginalSumOfWeights(tmp.originalSumOfWeights());
     m_conserveSumOfWeights = false;
@@ -94,6 +132,10 @@ Template::~Template()
         delete m_rawTemplate;
         m_rawTemplate = NULL;
     }
+    delete m_templateND;
+    m_templateND = NULL;
+    delete m_rawTemplateND;
+    m_rawTemplateND = NULL;
     for(unsigned int axis=0;axis<m_widths.size();axis++)
     {
         if(m_widths[axis])
@@ -102,6 +144,11 @@ Template::~Template()
         }
     }
     m_widths.clear();
+    for(unsigned int axis=0;axis<m_widthsND.size();axis++)
+    {
+        delete m_widthsND[axis];
+    }
+    m_widthsND.clear();
     for(unsigned int axis=0;axis<m_raw1DTemplates.size();axis++)
     {
         if(m_raw1DTemplates[axis])
@@ -126,13 +173,20 @@ Template::~Template()
         }
     }
     m_controlPlots.clear();
+    if(m_partition)
+    {
+        delete m_partition;
+        m_partition = NULL;
+    }
+    setBootstrapHistograms(NULL, NULL);
+    setSplineCoefficients(NULL);
 }
 
 /*****************************************************************/
 const string& Template::getVariable(unsigned int index) const
 /*****************************************************************/
 {
-    assert(index<3);
+    assert(index<m_variables.size());
     return m_variables.at(index);
 }
 
@@ -147,6 +201,12 @@ TH1D* Template::getProjected1DTemplate(unsigned int axis)
         error << "Template::getProjected1DTemplate(): Projection requested on axis "<<axis<<" for "<<numberOfDimensions()<<"D template '"<<m_name<<"'\n";
         throw runtime_error(error.str());
     }
+    if(m_templateND)
+    {
+        stringstream projName;
+        projName << m_templateND->getName() << "_projFromTmp"<< axis;
+        return m_templateND->projection(axis, projName.str());
+    }
     unsigned int nbins1 = 0;
     unsigned int nbins2 = 0;
     if(axis==0)      
@@ -274,6 +334,10 @@ void Template::createTemplate(const vector<unsigned int>& nbins, const vector< p
         delete m_rawTemplate;
         m_rawTemplate = NULL;
     }
+    delete m_templateND;
+    m_templateND = NULL;
+    delete m_rawTemplateND;
+    m_rawTemplateND = NULL;
     for(unsigned int axis=0;axis<m_widths.size();axis++)
     {
         if(m_widths[axis])
@@ -282,6 +346,11 @@ void Template::createTemplate(const vector<unsigned int>& nbins, const vector< p
         }
         m_widths.clear();
     }
+    for(unsigned int axis=0;axis<m_widthsND.size();axis++)
+    {
+        delete m_widthsND[axis];
+    }
+    m_widthsND.clear();
     for(unsigned int axis=0;axis<m_raw1DTemplates.size();axis++)
     {
         if(m_raw1DTemplates[axis])
@@ -315,8 +384,15 @@ void Template::createTemplate(const vector<unsigned int>& nbins, const vector< p
         nameRaw << m_name << "_raw";
         m_rawTemplate = new TH3F(nameRaw.str().c_str(),nameRaw.str().c_str(),nbins[0],minmax[0].first,minmax[0].second,nbins[1],minmax[1].first,minmax[1].second,nbins[2],minmax[2].first,minmax[2].second);
     }
-    m_template->Sumw2();
-    m_rawTemplate->Sumw2();
+    else if(nbins.size()>3)
+    {
+        m_templateND = new GridND(m_name, nbins, minmax);
+        stringstream nameRaw;
+        nameRaw << m_name << "_raw";
+        m_rawTemplateND = new GridND(nameRaw.str(), nbins, minmax);
+    }
+    if(m_template) m_template->Sumw2();
+    if(m_rawTemplate) m_rawTemplate->Sumw2();
 
     // Initialize 1D projections and width maps
     for(unsigned int axis=0;axis<nbins.size();axis++)
@@ -332,7 +408,14 @@ void Template::createTemplate(const vector<unsigned int>& nbins, const vector< p
         {
             m_widths.push_back(new TH3F(nameWidth.str().c_str(),nameWidth.str().c_str(),nbins[0],minmax[0].first,minmax[0].second,nbins[1],minmax[1].first,minmax[1].second,nbins[2],minmax[2].first,minmax[2].second));
         }
-        m_widths.back()->Sumw2();
+        if(nbins.size()>3)
+        {
+            m_widthsND.push_back(new GridND(nameWidth.str(), nbins, minmax));
+        }
+        else
+        {
+            m_widths.back()->Sumw2();
+        }
         m_raw1DTemplates.push_back(new TH1D(nameProj.str().c_str(),nameProj.str().c_str(),nbins[axis],minmax[axis].first,minmax[axis].second));
         m_raw1DTemplates.back()->Sumw2();
     }
@@ -436,7 +519,169 @@ void Template::setWidths(const vector<TH1*>& widths)
 }
 
 /*****************************************************************/
-bool Template::inTemplate(const vector<double>& vs)
+void Template::setTemplateND(const GridND* grid)
+/*****************************************************************/
+{
+    delete m_templateND;
+    m_templateND = new GridND(*grid);
+    m_templateND->setName(m_name);
+}
+
+/*****************************************************************/
+void Template::setRawTemplateND(const GridND* grid)
+/*****************************************************************/
+{
+    delete m_rawTemplateND;
+    stringstream nameRaw;
+    nameRaw << m_name << "_raw";
+    m_rawTemplateND = new GridND(*grid);
+    m_rawTemplateND->setName(nameRaw.str());
+}
+
+/*****************************************************************/
+void Template::setWidthsND(const vector<GridND*>& widths)
+/*****************************************************************/
+{
+    for(unsigned int axis=0;axis<m_widthsND.size();axis++)
+    {
+        delete m_widthsND[axis];
+    }
+    m_widthsND.clear();
+    for(unsigned int axis=0;axis<widths.size();axis++)
+    {
+        stringstream nameWidth;
+        nameWidth << m_name << "_width" << axis;
+        m_widthsND.push_back(new GridND(*widths[axis]));
+        m_widthsND.back()->setName(nameWidth.str());
+    }
+}
+
+/*****************************************************************/
+double Template::getSumOfWeights() const
+/*****************************************************************/
+{
+    return (m_templateND ? m_templateND->getSumOfWeights() : m_template->GetSumOfWeights());
+}
+
+/*****************************************************************/
+void Template::scale(double factor)
+/*****************************************************************/
+{
+    // Scale the template together with the raw distributions
+    if(m_templateND)
+    {
+        m_templateND->scale(factor);
+        m_rawTemplateND->scale(factor);
+    }
+    else
+    {
+        m_template->Scale(factor);
+        m_rawTemplate->Scale(factor);
+    }
+    for(unsigned int axis=0;axis<m_raw1DTemplates.size();axis++)
+    {
+        m_raw1DTemplates[axis]->Scale(factor);
+    }
+    if(m_splineCoefficients) m_splineCoefficients->Scale(factor);
+}
+
+/*****************************************************************/
+void Template::setPartition(BinTree* partition)
+/*****************************************************************/
+{
+    // The template takes ownership of the partition
+    if(m_partition && m_partition!=partition)
+    {
+        delete m_partition;
+    }
+    m_partition = partition;
+}
+
+/*****************************************************************/
+void Template::setBootstrapHistograms(TH1* mean, TH1* rms)
+/*****************************************************************/
+{
+    // The template takes ownership of the histograms
+    if(m_bootstrapMean && m_bootstrapMean!=mean) delete m_bootstrapMean;
+    if(m_bootstrapRMS && m_bootstrapRMS!=rms) delete m_bootstrapRMS;
+    m_bootstrapMean = mean;
+    m_bootstrapRMS = rms;
+}
+
+/*****************************************************************/
+void Template::setSplineCoefficients(TH1* coefficients)
+/*****************************************************************/
+{
+    // The template takes ownership of the coefficients
+    if(m_splineCoefficients && m_splineCoefficients!=coefficients) delete m_splineCoefficients;
+    m_splineCoefficients = coefficients;
+}
+
+/*****************************************************************/
+Template* Template::bootstrapReplica(unsigned int replica) const
+/*****************************************************************/
+{
+    // New template with the same definition and entries, but with each event weight
+    // multiplied by a Poisson(1) random number. The entries are not copied: the replica reads the ones
+    // of this template, which must outlive it, and only owns its weights. The seed combines the base seed, the
+    // template name and the replica index, such that replicas of different templates are independent.
+    Template* tmp = new Template();
+    tmp->m_name = m_name;
+    tmp->m_origin = m_origin;
+    tmp->m_inputFileAndTreeNames = m_inputFileAndTreeNames;
+    tmp->m_treeName = m_treeName;
+    tmp->m_selection = m_selection;
+    tmp->m_assertion = m_assertion;
+    tmp->m_weight = m_weight;
+    tmp->m_variables = m_variables;
+    tmp->m_binningType = m_binningType;
+    tmp->m_entriesPerBin = m_entriesPerBin;
+    tmp->m_maxBuildSeconds = m_maxBuildSeconds;
+    tmp->m_multiAxisSplit = m_multiAxisSplit;
+    tmp->m_splitCriterion = m_splitCriterion;
+    tmp->m_binningGroup = m_binningGroup;
+    tmp->m_postProcessings = m_postProcessings;
+    tmp->m_conserveSumOfWeights = m_conserveSumOfWeights;
+    tmp->m_fillOverflows = m_fillOverflows;
+    tmp->m_partitionFile = m_partitionFile;
+    tmp->m_partitionName = m_partitionName;
+    tmp->m_updatePartition = m_updatePartition;
+    tmp->m_sharedEntries = &entries();
+    tmp->m_inputFileNEntries = m_inputFileNEntries;
+    tmp->m_bootstrapSeed = m_bootstrapSeed;
+    tmp->m_makeControlPlots = false;
+    tmp->m_verbose = false;
+    size_t nameHash = hash<string>()(m_name);
+    seed_seq seeds{m_bootstrapSeed, (unsigned int)(nameHash&0xffffffff), (unsigned int)((unsigned long long)nameHash>>32), replica};
+    mt19937 generator(seeds);
+    poisson_distribution<int> poisson(1.);
+    double sumOfWeights = 0.;
+    double replicaSumOfWeights = 0.;
+    tmp->m_weights.resize(m_weights.size());
+    for(unsigned int e=0;e<m_weights.size();e++)
+    {
+        tmp->m_weights[e] = m_weights[e]*poisson(generator);
+        sumOfWeights += m_weights[e];
+        replicaSumOfWeights += tmp->m_weights[e];
+    }
+    tmp->m_originalSumOfWeights = (sumOfWeights!=0. ? m_originalSumOfWeights*replicaSumOfWeights/sumOfWeights : 0.);
+    vector<unsigned int> nbins;
+    if(m_templateND)
+    {
+        nbins = m_templateND->getNbins();
+    }
+    else
+    {
+        nbins.push_back(m_template->GetNbinsX());
+        nbins.push_back(m_template->GetNbinsY());
+        if(numberOfDimensions()==3) nbins.push_back(m_template->GetNbinsZ());
+    }
+    tmp->createTemplate(nbins, m_minmax);
+    return tmp;
+}
+
+/*****************************************************************/
+bool Template::inTemplate(const vector<double>& vs) const
 /*****************************************************************/
 {
     for(unsigned int d=0;d<vs.size();d++)
@@ -469,6 +714,11 @@ void Template::reweight1D(unsigned int axis, unsigned int bin, double weight)
         error << "Template::reweight1D(): Reweighting requested on axis "<<axis<<" for "<<numberOfDimensions()<<"D template '"<<m_name<<"'\n";
         throw runtime_error(error.str());
     }
+    if(m_templateND)
+    {
+        m_templateND->scaleSlice(axis, bin, weight);
+        return;
+    }
     unsigned int nbins1 = 0;
     unsigned int nbins2 = 0;
     if(axis==0)
@@ -515,6 +765,7 @@ void Template::reweight1D(unsigned int axis, unsigned int bin, double weight)
 void Template::makeProjectionControlPlot(const string& tag)
 /*****************************************************************/
 {
+    if(!m_makeControlPlots) return;
     for(unsigned int axis=0;axis<numberOfDimensions();axis++)
     {
         stringstream plotName, rawName, projName;
@@ -542,6 +793,8 @@ void Template::makeProjectionControlPlot(const string& tag)
 void Template::makeResidualsControlPlot(const string& tag, unsigned int rebin)
 /*****************************************************************/
 {
+    if(!m_makeControlPlots) return;
+    if(!m_template) return;
     if(numberOfDimensions()>0 && m_template->GetNbinsX()%rebin!=0) return;
     if(numberOfDimensions()>1 && m_template->GetNbinsY()%rebin!=0) return;
     if(numberOfDimensions()>2 && m_template->GetNbinsZ()%rebin!=0) return;
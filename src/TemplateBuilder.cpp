@@ -1,16 +1,29 @@
 
 #include "TemplateBuilder.h"
 #include "BinTree.h"
+#include "BSplineSmoother.h"
+#include "GridND.h"
 #include "GaussKernelSmoother.h"
+#include "KernelDensityEstimator.h"
+#include "LeafGraphSmoother.h"
 #include "Smoother1D.h"
+#include "ThreadPool.h"
 
 #include "TH2F.h"
 #include "TH3F.h"
 #include "TGraph.h"
+#include "TFile.h"
+#include "TObjString.h"
+#include "TROOT.h"
+#include "RVersion.h"
 
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <set>
+#include <algorithm>
+#include <memory>
+#include <cmath>
 
 using namespace std;
 
@@ -25,6 +38,37 @@ TemplateBuilder::~TemplateBuilder()
     {
         delete it->second;
     }
+    // Orderings can be shared by several templates
+    set<EntryOrdering*> orderings;
+    map<string, EntryOrdering*>::iterator itOrd = m_entryOrderings.begin();
+    map<string, EntryOrdering*>::iterator itOrdE = m_entryOrderings.end();
+    for(;itOrd!=itOrdE;++itOrd)
+    {
+        orderings.insert(itOrd->second);
+    }
+    set<EntryOrdering*>::iterator itSet = orderings.begin();
+    set<EntryOrdering*>::iterator itSetE = orderings.end();
+    for(;itSet!=itSetE;++itSet)
+    {
+        delete *itSet;
+    }
+    map<string, BinTree*>::iterator itGroup = m_groupPartitions.begin();
+    map<string, BinTree*>::iterator itGroupE = m_groupPartitions.end();
+    for(;itGroup!=itGroupE;++itGroup)
+    {
+        delete itGroup->second;
+        vector<TH1*>& widths = m_groupWidths[itGroup->first];
+        for(unsigned int axis=0;axis<widths.size();axis++)
+        {
+            delete widths[axis];
+        }
+    }
+    map<const Template*, TH1*>::iterator itSmoothed = m_groupSmoothedTemplates.begin();
+    map<const Template*, TH1*>::iterator itSmoothedE = m_groupSmoothedTemplates.end();
+    for(;itSmoothed!=itSmoothedE;++itSmoothed)
+    {
+        itSmoothed->second->Delete();
+    }
 }
 
 /*****************************************************************/
@@ -66,110 +110,156 @@ Template* TemplateBuilder::getTemplate(const std::string& name)
 void TemplateBuilder::fillTemplates()
 /*****************************************************************/
 {
+    buildBinningGroups();
     map<string, Template*>::iterator tmpIt = m_templates.begin();
     map<string, Template*>::iterator tmpItE = m_templates.end();
     for(;tmpIt!=tmpItE;++tmpIt)
     {
         Template* tmp = tmpIt->second;
         if(tmp->getOrigin()!=Template::Origin::FILES) continue;
+        fillTemplate(tmp);
+    }
+}
 
-        if(tmp->getBinningType()==Template::BinningType::FIXED)
+
+/*****************************************************************/
+void TemplateBuilder::fillTemplate(Template* tmp)
+/*****************************************************************/
+{
+    if(tmp->getBinningType()==Template::BinningType::FIXED)
+    {
+        if(tmp->verbose()) cout<< "[INFO] Building "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"' with fixed size binning\n";
+        int overflows = 0;
+        if(tmp->numberOfDimensions()==2)
         {
-            cout<< "[INFO] Building "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"' with fixed size binning\n";
-            int overflows = 0;
-            if(tmp->numberOfDimensions()==2)
+            TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
+            TH2F* histoRaw = dynamic_cast<TH2F*>(tmp->getRawTemplate());
+            for(unsigned int e=0;e<tmp->entries().size();e++)
             {
-                TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
-                TH2F* histoRaw = dynamic_cast<TH2F*>(tmp->getRawTemplate());
-                for(unsigned int e=0;e<tmp->entries().size();e++)
+                int bin = histo->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
+                histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
+                if(bin!=-1)
                 {
-                    int bin = histo->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
-                    histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
-                    if(bin!=-1)
-                    {
-                        tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
-                        tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
-                    }
-                    else
-                    {
-                        overflows++;
-                    }
+                    tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
+                    tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
                 }
-            }
-            else if(tmp->numberOfDimensions()==3)
-            {
-                TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
-                TH3F* histoRaw = dynamic_cast<TH3F*>(tmp->getRawTemplate());
-                for(unsigned int e=0;e<tmp->entries().size();e++)
+                else
                 {
-                    int bin = histo->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
-                    histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
-                    if(bin!=-1)
-                    {
-                        tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
-                        tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
-                        tmp->getRaw1DTemplate(2)->Fill(tmp->entries()[e][2], tmp->weights()[e]);
-                    }
-                    else
-                    {
-                        overflows++;
-                    }
+                    overflows++;
                 }
             }
-            if(overflows>0)
-            {
-                cout<<"[WARN]   "<<overflows<<" events in under/overflow bins\n";
-            }
         }
-        else if(tmp->getBinningType()==Template::BinningType::ADAPTIVE)
+        else if(tmp->numberOfDimensions()==3)
         {
-            cout<< "[INFO] Deriving adaptive binning for "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"'\n";
-            if(tmp->numberOfDimensions()==2)
+            TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
+            TH3F* histoRaw = dynamic_cast<TH3F*>(tmp->getRawTemplate());
+            for(unsigned int e=0;e<tmp->entries().size();e++)
             {
-                TH2F* histoRaw = dynamic_cast<TH2F*>(tmp->getRawTemplate());
-                for(unsigned int e=0;e<tmp->entries().size();e++)
+                int bin = histo->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
+                histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
+                if(bin!=-1)
                 {
-                    histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
                     tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
                     tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
+                    tmp->getRaw1DTemplate(2)->Fill(tmp->entries()[e][2], tmp->weights()[e]);
+                }
+                else
+                {
+                    overflows++;
                 }
             }
-            else if(tmp->numberOfDimensions()==3)
+        }
+        else if(tmp->numberOfDimensions()>3)
+        {
+            GridND* grid = tmp->getTemplateND();
+            GridND* gridRaw = tmp->getRawTemplateND();
+            for(unsigned int e=0;e<tmp->entries().size();e++)
             {
-                TH3F* histoRaw = dynamic_cast<TH3F*>(tmp->getRawTemplate());
-                for(unsigned int e=0;e<tmp->entries().size();e++)
+                int bin = grid->fill(tmp->entries()[e],tmp->weights()[e]);
+                gridRaw->fill(tmp->entries()[e],tmp->weights()[e]);
+                if(bin!=-1)
                 {
-                    histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
-                    tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
-                    tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
-                    tmp->getRaw1DTemplate(2)->Fill(tmp->entries()[e][2], tmp->weights()[e]);
+                    for(unsigned int axis=0;axis<tmp->numberOfDimensions();axis++)
+                    {
+                        tmp->getRaw1DTemplate(axis)->Fill(tmp->entries()[e][axis], tmp->weights()[e]);
+                    }
+                }
+                else
+                {
+                    overflows++;
                 }
             }
-            BinTree bintree(tmp->getMinMax(), tmp->entries(), tmp->weights());
-            bintree.setMinLeafEntries(tmp->getEntriesPerBin());
-            TH1* gridConstraint = (TH1*)tmp->getTemplate()->Clone("gridConstraint");
-            bintree.setGridConstraint(gridConstraint);
-            bintree.build();
-            cout<<"[INFO]   Number of bins = "<<bintree.getNLeaves()<<"\n";
-            cout<<"[INFO]   Smallest bin widths: wx="<<bintree.getMinBinWidth(0)<<", wy="<<bintree.getMinBinWidth(1);
-            if(tmp->numberOfDimensions()==3)
+        }
+        if(overflows>0)
+        {
+            cout<<"[WARN]   "<<overflows<<" events in under/overflow bins\n";
+        }
+    }
+    else if(tmp->getBinningType()==Template::BinningType::ADAPTIVE)
+    {
+        if(tmp->verbose()) cout<< "[INFO] Deriving adaptive binning for "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"'\n";
+        if(tmp->numberOfDimensions()==2)
+        {
+            TH2F* histoRaw = dynamic_cast<TH2F*>(tmp->getRawTemplate());
+            for(unsigned int e=0;e<tmp->entries().size();e++)
             {
-                cout<<", wz="<<bintree.getMinBinWidth(2)<<"\n";
+                histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->weights()[e]);
+                tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
+                tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
             }
-            else
+        }
+        else if(tmp->numberOfDimensions()==3)
+        {
+            TH3F* histoRaw = dynamic_cast<TH3F*>(tmp->getRawTemplate());
+            for(unsigned int e=0;e<tmp->entries().size();e++)
             {
-                cout<<"\n";
+                histoRaw->Fill(tmp->entries()[e][0],tmp->entries()[e][1],tmp->entries()[e][2],tmp->weights()[e]);
+                tmp->getRaw1DTemplate(0)->Fill(tmp->entries()[e][0], tmp->weights()[e]);
+                tmp->getRaw1DTemplate(1)->Fill(tmp->entries()[e][1], tmp->weights()[e]);
+                tmp->getRaw1DTemplate(2)->Fill(tmp->entries()[e][2], tmp->weights()[e]);
+            }
+        }
+        else if(tmp->numberOfDimensions()>3)
+        {
+            GridND* gridRaw = tmp->getRawTemplateND();
+            for(unsigned int e=0;e<tmp->entries().size();e++)
+            {
+                gridRaw->fill(tmp->entries()[e],tmp->weights()[e]);
+                for(unsigned int axis=0;axis<tmp->numberOfDimensions();axis++)
+                {
+                    tmp->getRaw1DTemplate(axis)->Fill(tmp->entries()[e][axis], tmp->weights()[e]);
+                }
             }
-            TH1* histo = dynamic_cast<TH1*>(bintree.fillHistogram());
-            tmp->setTemplate(histo);
-            cout<< "[INFO] Computing width maps from adaptive binning for template '"<<tmp->getName()<<"'\n";
-            vector<TH1*> widths = bintree.fillWidths();
-            tmp->setWidths(widths);
-            gridConstraint->Delete();
+            // The adaptive binning is constrained by the template grid
+            vector<TH1*> noWidths;
+            BinTree* bintree = adaptiveBinning(tmp, tmp->getEntriesPerBin(), noWidths);
+            GridND* grid = bintree->fillGrid();
+            tmp->setTemplateND(grid);
+            delete grid;
+            if(tmp->verbose()) cout<< "[INFO]   Computing width maps from adaptive binning\n";
+            vector<GridND*> widths = bintree->fillWidthsGrid();
+            tmp->setWidthsND(widths);
+            for(unsigned int axis=0;axis<widths.size();axis++) delete widths[axis];
+            bintree->setGridConstraintND(NULL);
+            bintree->clearEntries();
+            tmp->setPartition(bintree);
+            tmp->makeProjectionControlPlot("afterFill");
+            return;
         }
-        // make control plot
-        tmp->makeProjectionControlPlot("afterFill");
+        TH1* gridConstraint = (TH1*)tmp->getTemplate()->Clone("gridConstraint");
+        vector<TH1*> widths;
+        BinTree* bintree = (tmp->getBinningGroup()!="" ? groupBinning(tmp, widths, gridConstraint) : adaptiveBinning(tmp, tmp->getEntriesPerBin(), widths, gridConstraint));
+        TH1* histo = dynamic_cast<TH1*>(bintree->fillHistogram());
+        tmp->setTemplate(histo);
+        tmp->setWidths(widths);
+        bintree->setGridConstraint(NULL);
+        gridConstraint->Delete();
+        // Keep the partition, to be stored with the template
+        bintree->clearEntries();
+        tmp->setPartition(bintree);
     }
+    // make control plot
+    tmp->makeProjectionControlPlot("afterFill");
 }
 
 
@@ -177,300 +267,652 @@ void TemplateBuilder::fillTemplates()
 void TemplateBuilder::postProcessing(Template::Origin origin)
 /*****************************************************************/
 {
+    if(origin==Template::Origin::FILES) smoothBinningGroups();
     map<string, Template*>::iterator tmpIt = m_templates.begin();
     map<string, Template*>::iterator tmpItE = m_templates.end();
     for(;tmpIt!=tmpItE;++tmpIt)
     {
         Template* tmp = tmpIt->second;
         if(tmp->getOrigin()!=origin) continue;
+        postProcess(tmp, origin);
+        // Bootstrap replicas still need the sorted entries of the template
+        if(origin!=Template::Origin::FILES || tmp->getBootstrap()==0 || tmp->numberOfDimensions()>3) releaseEntryOrdering(tmp);
+    }
+}
 
-        double sumOfweightsBefore = tmp->getTemplate()->GetSumOfWeights();
-        double scaleFactor = 1.;
 
-        vector<PostProcessing>::iterator it = tmp->postProcessingBegin();
-        vector<PostProcessing>::iterator itE = tmp->postProcessingEnd();
-        for(;it!=itE;++it)
+/*****************************************************************/
+void TemplateBuilder::setSmoothingParameters(GaussKernelSmoother& smoother, const PostProcessing& pp) const
+/*****************************************************************/
+{
+    smoother.setWidthScalingFactor(pp.getParameter<double>("rescalewidth"));
+    smoother.setWidthTolerance(pp.getParameter<double>("widthtolerance"));
+    smoother.setTruncationTolerance(pp.getParameter<double>("truncationtolerance"));
+    smoother.setKernelShape(GaussKernelSmoother::kernelShapeFromName(pp.getParameter<string>("kernelshape")));
+    smoother.setBoxFilter(pp.getParameter<string>("kernel")=="boxsat");
+    smoother.setPyramidLevels(pp.getParameter<unsigned int>("pyramidlevels"));
+    if(pp.getParameter<string>("engine")=="fft")
+    {
+        smoother.setFFTBandStep(pp.getParameter<double>("fftbandstep"));
+    }
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::smoothBinningGroups()
+/*****************************************************************/
+{
+    // Templates of a binning group share the same width maps. When they all start their postprocessing
+    // with the same adaptive smoothing, they are smoothed together: the kernel of each bin is computed once
+    // and applied to all the templates. The results are picked up by postProcess()
+    map<string, vector<Template*> > groups;
+    map<string, Template*>::iterator tmpIt = m_templates.begin();
+    map<string, Template*>::iterator tmpItE = m_templates.end();
+    for(;tmpIt!=tmpItE;++tmpIt)
+    {
+        Template* tmp = tmpIt->second;
+        if(tmp->getOrigin()!=Template::Origin::FILES || tmp->getBinningGroup()=="") continue;
+        if(tmp->getBinningType()!=Template::BinningType::ADAPTIVE || tmp->numberOfDimensions()>3) continue;
+        if(tmp->postProcessingBegin()==tmp->postProcessingEnd() || tmp->postProcessingBegin()->type()!=PostProcessing::Type::SMOOTH) continue;
+        string kernel = tmp->postProcessingBegin()->getParameter<string>("kernel");
+        if(kernel!="adaptive" && kernel!="boxsat") continue;
+        groups[tmp->getBinningGroup()].push_back(tmp);
+    }
+    map<string, vector<Template*> >::iterator itGroup = groups.begin();
+    map<string, vector<Template*> >::iterator itGroupE = groups.end();
+    for(;itGroup!=itGroupE;++itGroup)
+    {
+        const vector<Template*>& members = itGroup->second;
+        if(members.size()<2) continue;
+        const PostProcessing& ref = *members[0]->postProcessingBegin();
+        bool sameSmoothing = true;
+        for(unsigned int i=1;i<members.size();i++)
+        {
+            const PostProcessing& pp = *members[i]->postProcessingBegin();
+            sameSmoothing = sameSmoothing && pp.getParameter<string>("kernel")==ref.getParameter<string>("kernel");
+            sameSmoothing = sameSmoothing && pp.getParameter<double>("rescalewidth")==ref.getParameter<double>("rescalewidth");
+            sameSmoothing = sameSmoothing && pp.getParameter<double>("widthtolerance")==ref.getParameter<double>("widthtolerance");
+            sameSmoothing = sameSmoothing && pp.getParameter<double>("truncationtolerance")==ref.getParameter<double>("truncationtolerance");
+            sameSmoothing = sameSmoothing && pp.getParameter<string>("kernelshape")==ref.getParameter<string>("kernelshape");
+            sameSmoothing = sameSmoothing && pp.getParameter<string>("engine")==ref.getParameter<string>("engine");
+            sameSmoothing = sameSmoothing && pp.getParameter<double>("fftbandstep")==ref.getParameter<double>("fftbandstep");
+            sameSmoothing = sameSmoothing && pp.getParameter<unsigned int>("pyramidlevels")==ref.getParameter<unsigned int>("pyramidlevels");
+        }
+        if(!sameSmoothing) continue;
+        cout<<"[INFO] Smoothing the "<<members.size()<<" templates of binning group '"<<itGroup->first<<"' together\n";
+        GaussKernelSmoother smoother(members[0]->numberOfDimensions());
+        smoother.setWidths(members[0]->getWidths());
+        setSmoothingParameters(smoother, ref);
+        vector<const TH1*> histos;
+        for(unsigned int i=0;i<members.size();i++)
+        {
+            histos.push_back(members[i]->getTemplate());
+        }
+        vector<TH1*> smoothedHistos = smoother.smooth(histos);
+        for(unsigned int i=0;i<members.size();i++)
+        {
+            m_groupSmoothedTemplates[members[i]] = smoothedHistos[i];
+        }
+    }
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::bootstrap()
+/*****************************************************************/
+{
+    map<string, Template*>::iterator tmpIt = m_templates.begin();
+    map<string, Template*>::iterator tmpItE = m_templates.end();
+    for(;tmpIt!=tmpItE;++tmpIt)
+    {
+        Template* tmp = tmpIt->second;
+        if(tmp->getOrigin()!=Template::Origin::FILES || tmp->getBootstrap()==0) continue;
+        if(tmp->numberOfDimensions()>3)
+        {
+            cout<<"[WARN] Bootstrap replicas are only available for 2D and 3D templates. Skipping template '"<<tmp->getName()<<"'\n";
+            continue;
+        }
+        bootstrap(tmp);
+        releaseEntryOrdering(tmp);
+    }
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::bootstrap(Template* tmp)
+/*****************************************************************/
+{
+    // Build Poisson-weighted replicas of the template with the same procedure (binning, smoothing, reweighting, etc.)
+    // and compute the mean and RMS of each bin over the replicas.
+    // Replicas share the entries coordinates, and their sorting, with the template.
+    unsigned int nreplicas = tmp->getBootstrap();
+    cout<<"[INFO] Building "<<nreplicas<<" bootstrap replicas of template '"<<tmp->getName()<<"'\n";
+    TH1* sumw = dynamic_cast<TH1*>(tmp->getTemplate()->Clone((tmp->getName()+"_bootstrapMean").c_str()));
+    TH1* sumw2 = dynamic_cast<TH1*>(tmp->getTemplate()->Clone((tmp->getName()+"_bootstrapRMS").c_str()));
+    sumw->SetDirectory(0);
+    sumw2->SetDirectory(0);
+    sumw->Reset();
+    sumw2->Reset();
+    int nbinsx = sumw->GetNbinsX();
+    int nbinsy = sumw->GetNbinsY();
+    int nbinsz = (tmp->numberOfDimensions()==3 ? sumw->GetNbinsZ() : 0);
+    mutex sumMutex;
+    unsigned int nfinished = 0;
+    // Replicas are not verbose (see Template::bootstrapReplica()). Only the progress and warnings are printed
+    bool addDirectory = TH1::AddDirectoryStatus();
+    TH1::AddDirectory(kFALSE);
+    auto buildReplica = [&](unsigned int r)
+    {
+        Template* replica = tmp->bootstrapReplica(r);
+        try
+        {
+            fillTemplate(replica);
+            postProcess(replica, Template::Origin::FILES);
+        }
+        catch(...)
+        {
+            delete replica;
+            throw;
+        }
+        lock_guard<mutex> lock(sumMutex);
+        const TH1* histo = replica->getTemplate();
+        for(int bx=1;bx<=nbinsx;bx++)
+        {
+            for(int by=1;by<=nbinsy;by++)
+            {
+                for(int bz=(nbinsz>0 ? 1 : 0);bz<=nbinsz;bz++)
+                {
+                    int bin = sumw->GetBin(bx,by,bz);
+                    double content = histo->GetBinContent(bin);
+                    sumw->SetBinContent(bin, sumw->GetBinContent(bin)+content);
+                    sumw2->SetBinContent(bin, sumw2->GetBinContent(bin)+content*content);
+                }
+            }
+        }
+        delete replica;
+        nfinished++;
+        cout<<"[INFO]   "<<nfinished<<"/"<<nreplicas<<" replicas\r"<<flush;
+    };
+    try
+    {
+        // ROOT objects can only be created in several threads at the same time with ROOT 6
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,0,0)
+        ROOT::EnableThreadSafety();
+        ThreadPool::global().parallelFor(nreplicas, buildReplica);
+#else
+        for(unsigned int r=0;r<nreplicas;r++)
+        {
+            buildReplica(r);
+        }
+#endif
+    }
+    catch(...)
+    {
+        TH1::AddDirectory(addDirectory);
+        delete sumw;
+        delete sumw2;
+        throw;
+    }
+    TH1::AddDirectory(addDirectory);
+    cout<<"\n";
+    // Mean and RMS
+    for(int bx=1;bx<=nbinsx;bx++)
+    {
+        for(int by=1;by<=nbinsy;by++)
         {
-            switch(it->type())
+            for(int bz=(nbinsz>0 ? 1 : 0);bz<=nbinsz;bz++)
             {
-                case PostProcessing::Type::SMOOTH:
+                int bin = sumw->GetBin(bx,by,bz);
+                double mean = sumw->GetBinContent(bin)/(double)nreplicas;
+                double variance = sumw2->GetBinContent(bin)/(double)nreplicas - mean*mean;
+                sumw->SetBinContent(bin, mean);
+                sumw->SetBinError(bin, 0.);
+                sumw2->SetBinContent(bin, sqrt(max(variance, 0.)));
+                sumw2->SetBinError(bin, 0.);
+            }
+        }
+    }
+    tmp->setBootstrapHistograms(sumw, sumw2);
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::postProcess(Template* tmp, Template::Origin origin)
+/*****************************************************************/
+{
+    double sumOfweightsBefore = tmp->getSumOfWeights();
+    double scaleFactor = 1.;
+
+    vector<PostProcessing>::iterator it = tmp->postProcessingBegin();
+    vector<PostProcessing>::iterator itE = tmp->postProcessingEnd();
+    // With a mirror postprocessing in 2D or 3D, the adaptive smoothing before it is only computed on one half of the template
+    // (the other half being the mirror), and the reweightings between this smoothing and the mirror keep the symmetry.
+    // The mirror itself is still applied, and doesn't change the template anymore
+    vector<PostProcessing>::iterator itMirror = itE;
+    int mirrorAxis = -1;
+    bool mirrorAntisymmetric = false;
+    bool symmetric = false;
+    for(;it!=itE && (tmp->numberOfDimensions()==2 || tmp->numberOfDimensions()==3);++it)
+    {
+        if(it->type()!=PostProcessing::Type::MIRROR || it->getParameter<unsigned int>("axis")>=tmp->numberOfDimensions()) continue;
+        itMirror = it;
+        mirrorAxis = it->getParameter<unsigned int>("axis");
+        mirrorAntisymmetric = it->getParameter<bool>("antisymmetric");
+    }
+    for(it=tmp->postProcessingBegin();it!=itE;++it)
+    {
+        // B-spline coefficients describe the template as it was after the bspline smoothing.
+        // Steps changing the shape make them stale, so they are dropped (the final rescaling is applied to them)
+        if(it->type()!=PostProcessing::Type::RESCALE && tmp->getSplineCoefficients())
+        {
+            if(tmp->verbose()) cout<<"[WARN] Template '"<<tmp->getName()<<"' is modified after the bspline smoothing. The spline coefficients are not stored\n";
+            tmp->setSplineCoefficients(NULL);
+        }
+        switch(it->type())
+        {
+            case PostProcessing::Type::SMOOTH:
+                {
+                    string kernel = it->getParameter<string>("kernel");
+                    if(kernel=="k5b")
+                    {
+                        if(tmp->numberOfDimensions()!=2)
+                        {
+                            stringstream error;
+                            error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Can only apply k5b smoothing for 2D templates\n";
+                            throw runtime_error(error.str());
+                        }
+                        if(tmp->verbose()) cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with k5b kernel\n";
+                        tmp->getTemplate()->Smooth(1, "k5b");
+                    }
+                    else if(kernel=="adaptive" || kernel=="boxsat")
                     {
-                        string kernel = it->getParameter<string>("kernel");
-                        if(kernel=="k5b")
+                        if(tmp->verbose()) cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with variable "<<(kernel=="boxsat" ? "box filter" : "Gaussian")<<" kernel\n";
+                        if(tmp->numberOfDimensions()>3)
                         {
-                            if(tmp->numberOfDimensions()!=2)
+                            if(kernel=="boxsat")
                             {
                                 stringstream error;
-                                error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Can only apply k5b smoothing for 2D templates\n";
+                                error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Can only apply boxsat smoothing for 2D and 3D templates\n";
                                 throw runtime_error(error.str());
                             }
-                            cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with k5b kernel\n";
-                            tmp->getTemplate()->Smooth(1, "k5b");
-                        }
-                        else if(kernel=="adaptive")
-                        {
-                            cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with variable Gaussian kernel\n";
-                            // First derive adaptive binning if not already done previously
-                            // This is needed to define kernel widths
                             if(tmp->getBinningType()!=Template::BinningType::ADAPTIVE)
                             {
-                                vector< pair<double,double> > minmax = tmp->getMinMax();
-                                BinTree bintree(minmax, tmp->entries(), tmp->weights());
                                 unsigned int entriesPerBin = it->getParameter<unsigned int>("entriesperbin");
-                                bintree.setMinLeafEntries(entriesPerBin);
-                                cout<< "[INFO]   First deriving "<<tmp->numberOfDimensions()<<"D adaptive binning\n";
-                                bintree.build();
-                                cout<<"[INFO]   Number of bins = "<<bintree.getNLeaves()<<"\n";
-                                cout<<"[INFO]   Smallest bin widths: wx="<<bintree.getMinBinWidth(0)<<", wy="<<bintree.getMinBinWidth(1);
-                                if(tmp->numberOfDimensions()==3)
-                                {
-                                    cout<<", wz="<<bintree.getMinBinWidth(2)<<"\n";
-                                }
-                                else
-                                {
-                                    cout<<"\n";
-                                }
-                                TH1* widthTemplate = (TH1*)tmp->getTemplate()->Clone("widthTemplate");
-                                cout<< "[INFO]   Computing width maps from adaptive binning\n";
-                                vector<TH1*> widths = bintree.fillWidths(widthTemplate);
-                                tmp->setWidths(widths);
-                                widthTemplate->Delete();
-                                cout<< "[INFO]   Applying smoothing based on the width map\n";
+                                if(tmp->verbose()) cout<< "[INFO]   First deriving "<<tmp->numberOfDimensions()<<"D adaptive binning\n";
+                                vector<TH1*> noWidths;
+                                BinTree* bintree = adaptiveBinning(tmp, entriesPerBin, noWidths);
+                                vector<GridND*> widths = bintree->fillWidthsGrid();
+                                tmp->setWidthsND(widths);
+                                for(unsigned int axis=0;axis<widths.size();axis++) delete widths[axis];
+                                bintree->setGridConstraintND(NULL);
+                                bintree->clearEntries();
+                                tmp->setPartition(bintree);
+                                if(tmp->verbose()) cout<< "[INFO]   Applying smoothing based on the width map\n";
                             }
                             GaussKernelSmoother smoother(tmp->numberOfDimensions());
+                            smoother.setVerbose(tmp->verbose());
+                            smoother.setWidths(tmp->getWidthsND());
+                            // Same kernel parameters as in 2D and 3D. The engine, pyramid levels and box filter only exist for histograms
+                            setSmoothingParameters(smoother, *it);
+                            GridND* gridSmooth = smoother.smooth(tmp->getTemplateND());
+                            tmp->setTemplateND(gridSmooth);
+                            delete gridSmooth;
+                            tmp->makeProjectionControlPlot("afterSmooth");
+                            break;
+                        }
+                        // First derive adaptive binning if not already done previously
+                        // This is needed to define kernel widths
+                        if(tmp->getBinningType()!=Template::BinningType::ADAPTIVE)
+                        {
+                            unsigned int entriesPerBin = it->getParameter<unsigned int>("entriesperbin");
+                            if(tmp->verbose()) cout<< "[INFO]   First deriving "<<tmp->numberOfDimensions()<<"D adaptive binning\n";
+                            TH1* widthTemplate = (TH1*)tmp->getTemplate()->Clone("widthTemplate");
+                            vector<TH1*> widths;
+                            BinTree* bintree = adaptiveBinning(tmp, entriesPerBin, widths, NULL, widthTemplate);
+                            tmp->setWidths(widths);
+                            widthTemplate->Delete();
+                            bintree->clearEntries();
+                            tmp->setPartition(bintree);
+                            if(tmp->verbose()) cout<< "[INFO]   Applying smoothing based on the width map\n";
+                        }
+                        map<const Template*, TH1*>::iterator itSmoothed = m_groupSmoothedTemplates.find(tmp);
+                        if(it==tmp->postProcessingBegin() && itSmoothed!=m_groupSmoothedTemplates.end())
+                        {
+                            if(tmp->verbose()) cout<< "[INFO]   Already smoothed with binning group '"<<tmp->getBinningGroup()<<"'\n";
+                            tmp->setTemplate(itSmoothed->second);
+                            itSmoothed->second->Delete();
+                            m_groupSmoothedTemplates.erase(itSmoothed);
+                        }
+                        else
+                        {
+                            GaussKernelSmoother smoother(tmp->numberOfDimensions());
+                            smoother.setVerbose(tmp->verbose());
                             smoother.setWidths(tmp->getWidths());
-                            double widthScalingFactor= it->getParameter<double>("rescalewidth");
-                            smoother.setWidthScalingFactor(widthScalingFactor);
+                            setSmoothingParameters(smoother, *it);
+                            if(itMirror!=itE && it<itMirror)
+                            {
+                                if(tmp->verbose()) cout<< "[INFO]   Smoothing one half of the template, "<<(mirrorAntisymmetric ? "antisymmetric" : "symmetric")<<" along axis "<<mirrorAxis<<"\n";
+                                smoother.setMirror(mirrorAxis, mirrorAntisymmetric);
+                                symmetric = true;
+                            }
                             TH1* histoSmooth = smoother.smooth(tmp->getTemplate());
                             tmp->setTemplate(histoSmooth);
                         }
-                        else
+                    }
+                    else if(kernel=="leafgraph")
+                    {
+                        if(tmp->numberOfDimensions()!=2 && tmp->numberOfDimensions()!=3)
                         {
                             stringstream error;
-                            error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Unknown smoothing kernel '"<<kernel<<"'\n";
+                            error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Can only apply leafgraph smoothing for 2D and 3D templates\n";
                             throw runtime_error(error.str());
                         }
-                        tmp->makeProjectionControlPlot("afterSmooth");
-                        //tmp->makeResidualsControlPlot("afterSmooth");
-                        //tmp->makeResidualsControlPlot("afterSmooth", 2);
-                        //tmp->makeResidualsControlPlot("afterSmooth", 5);
-                        //tmp->makeResidualsControlPlot("afterSmooth", 10);
-                        break;
+                        if(tmp->verbose()) cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' on the graph of adaptive bins\n";
+                        // First derive adaptive binning if not already done previously
+                        // Its leaves are the nodes of the graph
+                        if(tmp->getBinningType()!=Template::BinningType::ADAPTIVE)
+                        {
+                            unsigned int entriesPerBin = it->getParameter<unsigned int>("entriesperbin");
+                            if(tmp->verbose()) cout<< "[INFO]   First deriving "<<tmp->numberOfDimensions()<<"D adaptive binning\n";
+                            TH1* widthTemplate = (TH1*)tmp->getTemplate()->Clone("widthTemplate");
+                            vector<TH1*> widths;
+                            BinTree* bintree = adaptiveBinning(tmp, entriesPerBin, widths, NULL, widthTemplate);
+                            tmp->setWidths(widths);
+                            widthTemplate->Delete();
+                            bintree->clearEntries();
+                            tmp->setPartition(bintree);
+                        }
+                        LeafGraphSmoother smoother(tmp->getPartition());
+                        smoother.setVerbose(tmp->verbose());
+                        smoother.setWidthScalingFactor(it->getParameter<double>("rescalewidth"));
+                        TH1* histoSmooth = smoother.smooth(tmp->getTemplate());
+                        tmp->setTemplate(histoSmooth);
+                        histoSmooth->Delete();
                     }
-                case PostProcessing::Type::MIRROR:
+                    else if(kernel=="bspline")
                     {
-                        bool antiMirror = it->getParameter<bool>("antisymmetric");
-                        unsigned int axis = it->getParameter<unsigned int>("axis");
-                        if((unsigned int)axis>=tmp->numberOfDimensions())
+                        if(tmp->numberOfDimensions()!=2 && tmp->numberOfDimensions()!=3)
                         {
                             stringstream error;
-                            error << "TemplateBuilder::postProcessing(): Mirroring "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"' along axis "<<axis<<" is not possible (axis numbering starts at 0)\n";
+                            error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Can only apply bspline smoothing for 2D and 3D templates\n";
                             throw runtime_error(error.str());
                         }
-                        cout<<"[INFO] "<<(antiMirror ? "Anti-mirroring" : "Mirroring")<<" template '"<<tmp->getName()<<"' along axis "<<axis<<"\n";
-                        if(tmp->numberOfDimensions()==2)
+                        if(tmp->verbose()) cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with a penalized B-spline fit\n";
+                        BSplineSmoother smoother(tmp->numberOfDimensions());
+                        smoother.setVerbose(tmp->verbose());
+                        smoother.setNumberOfKnots(it->getParameter<unsigned int>("bsplineknots"));
+                        smoother.setPenalty(it->getParameter<double>("bsplinepenalty"));
+                        TH1* histoSmooth = smoother.smooth(tmp->getTemplate());
+                        tmp->setTemplate(histoSmooth);
+                        histoSmooth->Delete();
+                        tmp->setSplineCoefficients(smoother.coefficientHistogram(tmp->getName()+"_splineCoefficients"));
+                    }
+                    else if(kernel=="kde")
+                    {
+                        // The density is estimated from the entries, so previous postprocessing steps would be lost
+                        if(it!=tmp->postProcessingBegin())
                         {
-                            TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
-                            if(axis==0)
+                            stringstream error;
+                            error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') kde smoothing is computed from the entries and must be the first postprocessing\n";
+                            throw runtime_error(error.str());
+                        }
+                        if(tmp->verbose()) cout<<"[INFO] Smoothing template '"<<tmp->getName()<<"' with adaptive kernel density estimation from the entries\n";
+                        KernelDensityEstimator kde(tmp->getMinMax());
+                        kde.setVerbose(tmp->verbose());
+                        kde.setNeighbors(it->getParameter<unsigned int>("entriesperbin"));
+                        kde.setWidthScalingFactor(it->getParameter<double>("rescalewidth"));
+                        kde.setEntries(tmp->entries(), tmp->weights());
+                        if(tmp->numberOfDimensions()>3)
+                        {
+                            GridND* gridSmooth = kde.estimate(tmp->getTemplateND());
+                            tmp->setTemplateND(gridSmooth);
+                            delete gridSmooth;
+                        }
+                        else
+                        {
+                            TH1* histoSmooth = kde.estimate(tmp->getTemplate());
+                            tmp->setTemplate(histoSmooth);
+                            histoSmooth->Delete();
+                        }
+                    }
+                    else
+                    {
+                        stringstream error;
+                        error << "TemplateBuilder::postProcessing(): ('"<<tmp->getName()<<"') Unknown smoothing kernel '"<<kernel<<"'\n";
+                        throw runtime_error(error.str());
+                    }
+                    tmp->makeProjectionControlPlot("afterSmooth");
+                    //tmp->makeResidualsControlPlot("afterSmooth");
+                    //tmp->makeResidualsControlPlot("afterSmooth", 2);
+                    //tmp->makeResidualsControlPlot("afterSmooth", 5);
+                    //tmp->makeResidualsControlPlot("afterSmooth", 10);
+                    break;
+                }
+            case PostProcessing::Type::MIRROR:
+                {
+                    bool antiMirror = it->getParameter<bool>("antisymmetric");
+                    unsigned int axis = it->getParameter<unsigned int>("axis");
+                    if((unsigned int)axis>=tmp->numberOfDimensions())
+                    {
+                        stringstream error;
+                        error << "TemplateBuilder::postProcessing(): Mirroring "<<tmp->numberOfDimensions()<<"D template '"<<tmp->getName()<<"' along axis "<<axis<<" is not possible (axis numbering starts at 0)\n";
+                        throw runtime_error(error.str());
+                    }
+                    if(tmp->verbose()) cout<<"[INFO] "<<(antiMirror ? "Anti-mirroring" : "Mirroring")<<" template '"<<tmp->getName()<<"' along axis "<<axis<<"\n";
+                    if(tmp->numberOfDimensions()==2)
+                    {
+                        TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
+                        if(axis==0)
+                        {
+                            for (int binx=0;binx<histo->GetNbinsX()/2; binx++)
                             {
-                                for (int binx=0;binx<histo->GetNbinsX()/2; binx++)
+                                for (int biny=0;biny<histo->GetNbinsY(); biny++)
                                 {
-                                    for (int biny=0;biny<histo->GetNbinsY(); biny++)
-                                    {
-                                        double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1) - histo->GetBinContent(histo->GetNbinsX()-binx,biny+1) : histo->GetBinContent(binx+1,biny+1) + histo->GetBinContent(histo->GetNbinsX()-binx,biny+1));
-                                        histo->SetBinContent(binx+1, biny+1, avr/2.);
-                                        histo->SetBinContent(histo->GetNbinsX()-binx, biny+1, (antiMirror ? -avr/2. : avr/2.));
-                                    } 
-                                }
+                                    double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1) - histo->GetBinContent(histo->GetNbinsX()-binx,biny+1) : histo->GetBinContent(binx+1,biny+1) + histo->GetBinContent(histo->GetNbinsX()-binx,biny+1));
+                                    histo->SetBinContent(binx+1, biny+1, avr/2.);
+                                    histo->SetBinContent(histo->GetNbinsX()-binx, biny+1, (antiMirror ? -avr/2. : avr/2.));
+                                } 
                             }
-                            else if(axis==1)
+                        }
+                        else if(axis==1)
+                        {
+                            for (int binx=0;binx<histo->GetNbinsX(); binx++)
                             {
-                                for (int binx=0;binx<histo->GetNbinsX(); binx++)
+                                for (int biny=0;biny<histo->GetNbinsY()/2; biny++)
                                 {
-                                    for (int biny=0;biny<histo->GetNbinsY()/2; biny++)
-                                    {
-                                        double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1) - histo->GetBinContent(binx+1,histo->GetNbinsY()-biny) : histo->GetBinContent(binx+1,biny+1) + histo->GetBinContent(binx+1,histo->GetNbinsY()-biny));
-                                        histo->SetBinContent(binx+1, biny+1, avr/2.);
-                                        histo->SetBinContent(binx+1, histo->GetNbinsY()-biny, (antiMirror ? -avr/2. : avr/2.));
-                                    } 
-                                }
+                                    double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1) - histo->GetBinContent(binx+1,histo->GetNbinsY()-biny) : histo->GetBinContent(binx+1,biny+1) + histo->GetBinContent(binx+1,histo->GetNbinsY()-biny));
+                                    histo->SetBinContent(binx+1, biny+1, avr/2.);
+                                    histo->SetBinContent(binx+1, histo->GetNbinsY()-biny, (antiMirror ? -avr/2. : avr/2.));
+                                } 
                             }
                         }
-                        else if(tmp->numberOfDimensions()==3)
+                    }
+                    else if(tmp->numberOfDimensions()==3)
+                    {
+                        TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
+                        if(axis==0)
                         {
-                            TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
-                            if(axis==0)
+                            for (int binx=0;binx<histo->GetNbinsX()/2; binx++)
                             {
-                                for (int binx=0;binx<histo->GetNbinsX()/2; binx++)
+                                for (int biny=0;biny<histo->GetNbinsY(); biny++)
                                 {
-                                    for (int biny=0;biny<histo->GetNbinsY(); biny++)
+                                    for (int binz=0;binz<histo->GetNbinsZ(); binz++)
                                     {
-                                        for (int binz=0;binz<histo->GetNbinsZ(); binz++)
-                                        {
-                                            double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(histo->GetNbinsX()-binx,biny+1,binz+1) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(histo->GetNbinsX()-binx,biny+1,binz+1));
-                                            histo->SetBinContent(binx+1, biny+1, binz+1, avr/2.);
-                                            histo->SetBinContent(histo->GetNbinsX()-binx, biny+1, biny+1, (antiMirror ? -avr/2. : avr/2.));
-                                        }
-                                    } 
-                                }
+                                        double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(histo->GetNbinsX()-binx,biny+1,binz+1) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(histo->GetNbinsX()-binx,biny+1,binz+1));
+                                        histo->SetBinContent(binx+1, biny+1, binz+1, avr/2.);
+                                        histo->SetBinContent(histo->GetNbinsX()-binx, biny+1, binz+1, (antiMirror ? -avr/2. : avr/2.));
+                                    }
+                                } 
                             }
-                            else if(axis==1)
+                        }
+                        else if(axis==1)
+                        {
+                            for (int binx=0;binx<histo->GetNbinsX(); binx++)
                             {
-                                for (int binx=0;binx<histo->GetNbinsX(); binx++)
+                                for (int biny=0;biny<histo->GetNbinsY()/2; biny++)
                                 {
-                                    for (int biny=0;biny<histo->GetNbinsY()/2; biny++)
+                                    for (int binz=0;binz<histo->GetNbinsZ(); binz++)
                                     {
-                                        for (int binz=0;binz<histo->GetNbinsZ(); binz++)
-                                        {
 
-                                            double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(binx+1,histo->GetNbinsY()-biny,binz+1) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(binx+1,histo->GetNbinsY()-biny,binz+1));
-                                            histo->SetBinContent(binx+1, biny+1,binz+1, avr/2.);
-                                            histo->SetBinContent(binx+1, histo->GetNbinsY()-biny,binz+1, (antiMirror ? -avr/2. : avr/2.));
-                                        } 
-                                    }
+                                        double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(binx+1,histo->GetNbinsY()-biny,binz+1) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(binx+1,histo->GetNbinsY()-biny,binz+1));
+                                        histo->SetBinContent(binx+1, biny+1,binz+1, avr/2.);
+                                        histo->SetBinContent(binx+1, histo->GetNbinsY()-biny,binz+1, (antiMirror ? -avr/2. : avr/2.));
+                                    } 
                                 }
                             }
-                            else if(axis==2)
+                        }
+                        else if(axis==2)
+                        {
+                            for (int binx=0;binx<histo->GetNbinsX(); binx++)
                             {
-                                for (int binx=0;binx<histo->GetNbinsX(); binx++)
+                                for (int biny=0;biny<histo->GetNbinsY(); biny++)
                                 {
-                                    for (int biny=0;biny<histo->GetNbinsY(); biny++)
+                                    for (int binz=0;binz<histo->GetNbinsZ()/2; binz++)
                                     {
-                                        for (int binz=0;binz<histo->GetNbinsZ()/2; binz++)
-                                        {
-                                            double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(binx+1,biny+1,histo->GetNbinsZ()-binz) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(binx+1,biny+1,histo->GetNbinsZ()-binz));
-                                            histo->SetBinContent(binx+1, biny+1,binz+1, avr/2.);
-                                            histo->SetBinContent(binx+1,biny+1, histo->GetNbinsZ()-binz, (antiMirror ? -avr/2. : avr/2.));
-                                        } 
-                                    }
+                                        double avr = (antiMirror ? histo->GetBinContent(binx+1,biny+1,binz+1) - histo->GetBinContent(binx+1,biny+1,histo->GetNbinsZ()-binz) : histo->GetBinContent(binx+1,biny+1,binz+1) + histo->GetBinContent(binx+1,biny+1,histo->GetNbinsZ()-binz));
+                                        histo->SetBinContent(binx+1, biny+1,binz+1, avr/2.);
+                                        histo->SetBinContent(binx+1,biny+1, histo->GetNbinsZ()-binz, (antiMirror ? -avr/2. : avr/2.));
+                                    } 
                                 }
                             }
                         }
-                        tmp->makeProjectionControlPlot("afterMirror");
-                        //tmp->makeResidualsControlPlot("afterMirror");
-                        //tmp->makeResidualsControlPlot("afterMirror", 2);
-                        //tmp->makeResidualsControlPlot("afterMirror", 5);
-                        //tmp->makeResidualsControlPlot("afterMirror", 10);
-                        break;
                     }
-                case PostProcessing::Type::FLOOR:
+                    else if(tmp->numberOfDimensions()>3)
                     {
-                        cout<<"[INFO] Flooring template '"<<tmp->getName()<<"'\n";
-                        if(tmp->getTemplate()->GetMinimum()>0.)
+                        GridND* grid = tmp->getTemplateND();
+                        int nbins = grid->getNbins(axis);
+                        vector<int> bins;
+                        for(unsigned int index=0;index<grid->size();index++)
                         {
-                            cout<<"[INFO]   No zero bin. Flooring is not needed.\n";
-                            break;
+                            grid->bins(index, bins);
+                            if(bins[axis]>nbins/2) continue;
+                            bins[axis] = nbins+1-bins[axis];
+                            unsigned int mirrorIndex = grid->index(bins);
+                            double avr = (antiMirror ? grid->getBinContent(index) - grid->getBinContent(mirrorIndex) : grid->getBinContent(index) + grid->getBinContent(mirrorIndex));
+                            grid->setBinContent(index, avr/2.);
+                            grid->setBinContent(mirrorIndex, (antiMirror ? -avr/2. : avr/2.));
                         }
-                        if(tmp->numberOfDimensions()==2)
+                    }
+                    tmp->makeProjectionControlPlot("afterMirror");
+                    //tmp->makeResidualsControlPlot("afterMirror");
+                    //tmp->makeResidualsControlPlot("afterMirror", 2);
+                    //tmp->makeResidualsControlPlot("afterMirror", 5);
+                    //tmp->makeResidualsControlPlot("afterMirror", 10);
+                    break;
+                }
+            case PostProcessing::Type::FLOOR:
+                {
+                    if(tmp->verbose()) cout<<"[INFO] Flooring template '"<<tmp->getName()<<"'\n";
+                    if((tmp->getTemplateND() ? tmp->getTemplateND()->getMinimum() : tmp->getTemplate()->GetMinimum())>0.)
+                    {
+                        if(tmp->verbose()) cout<<"[INFO]   No zero bin. Flooring is not needed.\n";
+                        break;
+                    }
+                    if(tmp->numberOfDimensions()==2)
+                    {
+                        TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
+                        double floorN = ((histo->Integral())/(histo->GetNbinsX()*histo->GetNbinsY()))*(0.001/100.);
+                        for(int binx = 1; binx <= histo->GetNbinsX(); binx++)
                         {
-                            TH2F* histo = dynamic_cast<TH2F*>(tmp->getTemplate());
-                            double floorN = ((histo->Integral())/(histo->GetNbinsX()*histo->GetNbinsY()))*(0.001/100.);
-                            for(int binx = 1; binx <= histo->GetNbinsX(); binx++)
+                            for(int biny = 1; biny <= histo->GetNbinsY(); biny++)
                             {
-                                for(int biny = 1; biny <= histo->GetNbinsY(); biny++)
-                                {
-                                    double orig = histo->GetBinContent(binx,biny);
-                                    histo->SetBinContent(binx,biny,(orig+floorN));
-                                }
+                                double orig = histo->GetBinContent(binx,biny);
+                                histo->SetBinContent(binx,biny,(orig+floorN));
                             }
                         }
-                        else if(tmp->numberOfDimensions()==3)
+                    }
+                    else if(tmp->numberOfDimensions()==3)
+                    {
+                        TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
+                        double floorN = ((histo->Integral())/(histo->GetNbinsX()*histo->GetNbinsY()*histo->GetNbinsZ()))*(0.001/100.);
+                        for(int binx = 1; binx <= histo->GetNbinsX(); binx++)
                         {
-                            TH3F* histo = dynamic_cast<TH3F*>(tmp->getTemplate());
-                            double floorN = ((histo->Integral())/(histo->GetNbinsX()*histo->GetNbinsY()*histo->GetNbinsZ()))*(0.001/100.);
-                            for(int binx = 1; binx <= histo->GetNbinsX(); binx++)
+                            for(int biny = 1; biny <= histo->GetNbinsY(); biny++)
                             {
-                                for(int biny = 1; biny <= histo->GetNbinsY(); biny++)
+                                for(int binz = 1; binz <= histo->GetNbinsZ(); binz++)
                                 {
-                                    for(int binz = 1; binz <= histo->GetNbinsZ(); binz++)
-                                    {
-                                        double orig = histo->GetBinContent(binx,biny,binz);
-                                        histo->SetBinContent(binx,biny,binz,(orig+floorN));
-                                    }
+                                    double orig = histo->GetBinContent(binx,biny,binz);
+                                    histo->SetBinContent(binx,biny,binz,(orig+floorN));
                                 }
                             }
                         }
-                        tmp->makeProjectionControlPlot("afterFloor");
-                        //tmp->makeResidualsControlPlot("afterFloor");
-                        //tmp->makeResidualsControlPlot("afterFloor", 2);
-                        //tmp->makeResidualsControlPlot("afterFloor", 5);
-                        //tmp->makeResidualsControlPlot("afterFloor", 10);
-                        break;
-                    }
-                case PostProcessing::Type::RESCALE:
-                    {
-                        double factor = it->getParameter<double>("factor");
-                        scaleFactor *= factor;
-                        break;
                     }
-                case PostProcessing::Type::REWEIGHT:
+                    else if(tmp->numberOfDimensions()>3)
                     {
-                        cout<<"[INFO] Reweighting template '"<<tmp->getName()<<"'\n";
-                        applyReweighting(tmp,*it);
-                        tmp->makeProjectionControlPlot("afterReweight");
-                        //tmp->makeResidualsControlPlot("afterReweight");
-                        //tmp->makeResidualsControlPlot("afterReweight", 2);
-                        //tmp->makeResidualsControlPlot("afterReweight", 5);
-                        //tmp->makeResidualsControlPlot("afterReweight", 10);
-                        break;
+                        GridND* grid = tmp->getTemplateND();
+                        double floorN = (grid->getSumOfWeights()/grid->size())*(0.001/100.);
+                        for(unsigned int index=0;index<grid->size();index++)
+                        {
+                            grid->setBinContent(index, grid->getBinContent(index)+floorN);
+                        }
                     }
-                default:
+                    tmp->makeProjectionControlPlot("afterFloor");
+                    //tmp->makeResidualsControlPlot("afterFloor");
+                    //tmp->makeResidualsControlPlot("afterFloor", 2);
+                    //tmp->makeResidualsControlPlot("afterFloor", 5);
+                    //tmp->makeResidualsControlPlot("afterFloor", 10);
                     break;
-            }
-            if(it->type()!=PostProcessing::Type::RESCALE)
-            {
-                double sumOfWeightsAfter = tmp->getTemplate()->GetSumOfWeights();
-                cout<<"[INFO]   Sum of weights after/before = "<<sumOfWeightsAfter<<" / "<<sumOfweightsBefore<<" = "<<sumOfWeightsAfter/sumOfweightsBefore<<"\n";
-                sumOfweightsBefore = sumOfWeightsAfter;
-            }
+                }
+            case PostProcessing::Type::RESCALE:
+                {
+                    double factor = it->getParameter<double>("factor");
+                    scaleFactor *= factor;
+                    break;
+                }
+            case PostProcessing::Type::REWEIGHT:
+                {
+                    if(tmp->verbose()) cout<<"[INFO] Reweighting template '"<<tmp->getName()<<"'\n";
+                    applyReweighting(tmp, *it, (symmetric && itMirror!=itE && it<itMirror ? mirrorAxis : -1));
+                    tmp->makeProjectionControlPlot("afterReweight");
+                    //tmp->makeResidualsControlPlot("afterReweight");
+                    //tmp->makeResidualsControlPlot("afterReweight", 2);
+                    //tmp->makeResidualsControlPlot("afterReweight", 5);
+                    //tmp->makeResidualsControlPlot("afterReweight", 10);
+                    break;
+                }
+            default:
+                break;
         }
-        // normalize
-        if(origin==Template::Origin::FILES)
+        if(it->type()!=PostProcessing::Type::RESCALE)
         {
-            double targetSumOfWeights = 1., normalizeScaleFactor = 1.;
-            double sumOfWeights = tmp->getTemplate()->GetSumOfWeights();
-            if (sumOfWeights == 0)
-            {
-                cout << "[WARN] Template '" << tmp->getName() << "' is empty, nothing to normalize\n";
-            }
-            else if(tmp->conserveSumOfWeights())
-            {
-                targetSumOfWeights = tmp->originalSumOfWeights();
-                normalizeScaleFactor = targetSumOfWeights / sumOfWeights;
-                cout<<"[INFO] Normalizing template '"<<tmp->getName()<<"' to the original sum of weights = "<<targetSumOfWeights<<"\n";
-            }
-            else
-            {
-                normalizeScaleFactor = targetSumOfWeights / sumOfWeights;
-                cout<<"[INFO] Normalizing template '"<<tmp->getName()<<"' to 1\n";
-            }
-            tmp->getTemplate()->Scale(normalizeScaleFactor);
-            sumOfWeights = tmp->getRawTemplate()->GetSumOfWeights();
-            tmp->getRawTemplate()->Scale(normalizeScaleFactor);
-            for(unsigned int axis=0;axis<tmp->numberOfDimensions();axis++)
-            {
-                sumOfWeights = tmp->getRaw1DTemplate(axis)->GetSumOfWeights();
-                tmp->getRaw1DTemplate(axis)->Scale(normalizeScaleFactor);
-            }
+            double sumOfWeightsAfter = tmp->getSumOfWeights();
+            if(tmp->verbose()) cout<<"[INFO]   Sum of weights after/before = "<<sumOfWeightsAfter<<" / "<<sumOfweightsBefore<<" = "<<sumOfWeightsAfter/sumOfweightsBefore<<"\n";
+            sumOfweightsBefore = sumOfWeightsAfter;
         }
-        //double scaleFactor = tmp->getRescaling();
-        if(scaleFactor!=1.)
+    }
+    // normalize
+    if(origin==Template::Origin::FILES)
+    {
+        double targetSumOfWeights = 1., normalizeScaleFactor = 1.;
+        double sumOfWeights = tmp->getSumOfWeights();
+        if (sumOfWeights == 0)
         {
-            cout<<"[INFO] Rescaling template '"<<tmp->getName()<<"' with factor "<<scaleFactor<<"\n";
-            tmp->getTemplate()->Scale(scaleFactor);
-            tmp->getRawTemplate()->Scale(scaleFactor);
-            for(unsigned int axis=0;axis<tmp->numberOfDimensions();axis++)
-            {
-                tmp->getRaw1DTemplate(axis)->Scale(scaleFactor);
-            }
+            cout << "[WARN] Template '" << tmp->getName() << "' is empty, nothing to normalize\n";
         }
-        tmp->makeProjectionControlPlot("afterNormalization");
-        //tmp->makeResidualsControlPlot("afterNormalization");
-        //tmp->makeResidualsControlPlot("afterNormalization", 2);
-        //tmp->makeResidualsControlPlot("afterNormalization", 5);
-        //tmp->makeResidualsControlPlot("afterNormalization", 10);
+        else if(tmp->conserveSumOfWeights())
+        {
+            targetSumOfWeights = tmp->originalSumOfWeights();
+            normalizeScaleFactor = targetSumOfWeights / sumOfWeights;
+            if(tmp->verbose()) cout<<"[INFO] Normalizing template '"<<tmp->getName()<<"' to the original sum of weights = "<<targetSumOfWeights<<"\n";
+        }
+        else
+        {
+            normalizeScaleFactor = targetSumOfWeights / sumOfWeights;
+            if(tmp->verbose()) cout<<"[INFO] Normalizing template '"<<tmp->getName()<<"' to 1\n";
+        }
+        tmp->scale(normalizeScaleFactor);
     }
-
+    //double scaleFactor = tmp->getRescaling();
+    if(scaleFactor!=1.)
+    {
+        if(tmp->verbose()) cout<<"[INFO] Rescaling template '"<<tmp->getName()<<"' with factor "<<scaleFactor<<"\n";
+        tmp->scale(scaleFactor);
+    }
+    tmp->makeProjectionControlPlot("afterNormalization");
+    //tmp->makeResidualsControlPlot("afterNormalization");
+    //tmp->makeResidualsControlPlot("afterNormalization", 2);
+    //tmp->makeResidualsControlPlot("afterNormalization", 5);
+    //tmp->makeResidualsControlPlot("afterNormalization", 10);
 }
 
 /*****************************************************************/
@@ -500,7 +942,34 @@ void TemplateBuilder::buildTemplatesFromTemplates()
                 throw runtime_error(error.str());
             }
             Template* inTmp = inTmpIt->second;
-            if(!tmp->getTemplate())
+            if(inTmp->numberOfDimensions()>3)
+            {
+                cout<<"[INFO]   + ("<<factor<<") x "<<inTmp->getName()<<"\n";
+                if(!tmp->getTemplateND())
+                {
+                    tmp->setTemplateND(inTmp->getTemplateND());
+                    tmp->setRawTemplateND(inTmp->getRawTemplateND());
+                    tmp->setWidthsND(inTmp->getWidthsND());
+                    tmp->setRaw1DTemplates(inTmp->getRaw1DTemplates());
+                    tmp->scale(factor);
+                    vector<string> vars;
+                    for(unsigned int v=0;v<inTmp->numberOfDimensions();v++)
+                    {
+                        vars.push_back(inTmp->getVariable(v));
+                    }
+                    tmp->setVariables(vars);
+                }
+                else
+                {
+                    tmp->getTemplateND()->add(*inTmp->getTemplateND(), factor);
+                    tmp->getRawTemplateND()->add(*inTmp->getRawTemplateND(), factor);
+                    for(unsigned int axis=0;axis<inTmp->numberOfDimensions();axis++)
+                    {
+                        tmp->getRaw1DTemplate(axis)->Add(inTmp->getRaw1DTemplate(axis), factor);
+                    }
+                }
+            }
+            else if(!tmp->getTemplate())
             {
                 cout<<"[INFO]   + ("<<factor<<") x "<<inTmp->getName()<<"\n";
                 tmp->setTemplate(inTmp->getTemplate());
@@ -803,9 +1272,10 @@ void TemplateBuilder::buildTemplatesFromTemplates()
 
 
 /*****************************************************************/
-void TemplateBuilder::applyReweighting(Template* tmp, const PostProcessing& pp)
+void TemplateBuilder::applyReweighting(Template* tmp, const PostProcessing& pp, int mirrorAxis)
 /*****************************************************************/
 {
+    // When the template is (anti)symmetric along 'mirrorAxis', reweighting factors along this axis are symmetrized
     vector<unsigned int> axes = pp.getParameter< vector<unsigned int> >("axes");
     vector< vector<double> > rebinning = pp.getParameter< vector< vector<double> > >("rebinning");
     vector<unsigned int>::const_iterator it = axes.begin();
@@ -813,7 +1283,7 @@ void TemplateBuilder::applyReweighting(Template* tmp, const PostProcessing& pp)
     for(;it!=itE;++it)
     {
         unsigned int axis = *it;
-        cout<<"[INFO]   Reweighting along axis "<<axis<<"\n";
+        if(tmp->verbose()) cout<<"[INFO]   Reweighting along axis "<<axis<<"\n";
         TH1D* refHisto = tmp->getRaw1DTemplate(axis);
         TH1D* projTmp = tmp->getProjected1DTemplate(axis);
         // rebin
@@ -853,14 +1323,20 @@ void TemplateBuilder::applyReweighting(Template* tmp, const PostProcessing& pp)
         else // No rebinning. Automatic procedure
         {
             Smoother1D smoother;
+            smoother.setVerbose(tmp->verbose());
             refHisto = smoother.smooth(refHisto);
         }
         unsigned int nbins = refHisto->GetNbinsX();
+        vector<double> weights(nbins+1, 1.);
         for(unsigned int b=1;b<=nbins;b++)
         {
             double ref = refHisto->GetBinContent(b);
             double old = projTmp->GetBinContent(b);
-            double weight = (old!=0. ? ref/old : 1.);
+            weights[b] = (old!=0. ? ref/old : 1.);
+        }
+        for(unsigned int b=1;b<=nbins;b++)
+        {
+            double weight = ((int)axis==mirrorAxis ? (weights[b]+weights[nbins+1-b])/2. : weights[b]);
             tmp->reweight1D(axis, b, weight);
         }
         if(rebin)
@@ -870,3 +1346,520 @@ void TemplateBuilder::applyReweighting(Template* tmp, const PostProcessing& pp)
         delete projTmp;
     }
 }
+
+
+/*****************************************************************/
+BinTree* TemplateBuilder::adaptiveBinning(Template* tmp, unsigned int entriesPerBin, vector<TH1*>& widths, TH1* gridConstraint, const TH1* widthTemplate)
+/*****************************************************************/
+{
+    BinTree* bintree = NULL;
+    vector<TH1*> previousWidths;
+    vector<bool> updatedLeaves;
+    if(tmp->getPartitionFile()!="")
+    {
+        // Reuse a partition stored in a previous run. Only the entries have to be dispatched in the bins
+        vector<string> partitionInputs;
+        bintree = readPartition(tmp, (tmp->updatePartition() ? &previousWidths : NULL), &partitionInputs);
+        bintree->setVerbose(tmp->verbose());
+        if(tmp->verbose()) cout<<"[INFO]   Using partition '"<<tmp->getPartitionName()<<"' stored in "<<tmp->getPartitionFile()<<"\n";
+        vector<bool> newFiles;
+        if(tmp->updatePartition() && newInputFiles(tmp, bintree, partitionInputs, newFiles))
+        {
+            // The leaves already contain the statistics of the entries from the files used for the stored partition.
+            // Only the entries of the other files are dispatched in the bins
+            vector< vector<double> > entries;
+            vector<double> weights;
+            unsigned int offset = 0;
+            for(unsigned int i=0;i<newFiles.size();i++)
+            {
+                unsigned int nentries = tmp->inputFileNEntries()[i];
+                if(newFiles[i])
+                {
+                    entries.insert(entries.end(), tmp->entries().begin()+offset, tmp->entries().begin()+offset+nentries);
+                    weights.insert(weights.end(), tmp->weights().begin()+offset, tmp->weights().begin()+offset+nentries);
+                }
+                offset += nentries;
+            }
+            if(tmp->verbose()) cout<<"[INFO]   Adding "<<entries.size()<<" entries from "<<std::count(newFiles.begin(), newFiles.end(), true)<<" new input files\n";
+            bintree->addEntries(entries, weights);
+        }
+        else
+        {
+            bintree->clearStoredEntries();
+            bintree->addEntries(tmp->entries(), tmp->weights());
+        }
+        bintree->setGridConstraint(gridConstraint);
+        if(tmp->numberOfDimensions()>3) bintree->setGridConstraintND(tmp->getTemplateND());
+        bintree->setMaxBuildSeconds(tmp->getMaxBuildSeconds());
+        bintree->setMultiAxisSplit(tmp->multiAxisSplit());
+        bintree->setSplitCriterion(BinTree::splitCriterionFromName(tmp->getSplitCriterion()));
+        if(tmp->updatePartition())
+        {
+            // Only bins that now contain more than 2 x the stored minimum number of entries are split further
+            if(tmp->verbose()) cout<<"[INFO]   Updating partition with "<<bintree->minLeafEntries()<<" entries per bin\n";
+            unsigned int nleaves = bintree->getNLeaves();
+            updatedLeaves = bintree->update();
+            if(tmp->verbose()) cout<<"[INFO]   "<<bintree->getNLeaves()-nleaves<<" bins added to the partition\n";
+        }
+    }
+    else
+    {
+        bintree = new BinTree(tmp->getMinMax(), tmp->entries(), tmp->weights());
+        bintree->setVerbose(tmp->verbose());
+        bintree->setMinLeafEntries(entriesPerBin);
+        bintree->setGridConstraint(gridConstraint);
+        if(tmp->numberOfDimensions()>3) bintree->setGridConstraintND(tmp->getTemplateND());
+        bintree->setMaxBuildSeconds(tmp->getMaxBuildSeconds());
+        bintree->setMultiAxisSplit(tmp->multiAxisSplit());
+        bintree->setSplitCriterion(BinTree::splitCriterionFromName(tmp->getSplitCriterion()));
+        bintree->build(entryOrdering(tmp, *bintree));
+    }
+    if(tmp->verbose())
+    {
+        cout<<"[INFO]   Number of bins = "<<bintree->getNLeaves()<<"\n";
+        cout<<"[INFO]   Smallest bin widths: wx="<<bintree->getMinBinWidth(0)<<", wy="<<bintree->getMinBinWidth(1);
+        if(tmp->numberOfDimensions()==3)
+        {
+            cout<<", wz="<<bintree->getMinBinWidth(2)<<"\n";
+        }
+        else
+        {
+            cout<<"\n";
+        }
+    }
+    if(tmp->numberOfDimensions()>3)
+    {
+        // N-dimensional width maps are filled by the caller on the template grid (BinTree::fillWidthsGrid())
+        for(unsigned int axis=0;axis<previousWidths.size();axis++)
+        {
+            delete previousWidths[axis];
+        }
+        return bintree;
+    }
+    if(tmp->verbose()) cout<< "[INFO]   Computing width maps from adaptive binning\n";
+    if(previousWidths.size()>0)
+    {
+        widths = bintree->fillWidths(widthTemplate, previousWidths, updatedLeaves);
+        for(unsigned int axis=0;axis<previousWidths.size();axis++)
+        {
+            delete previousWidths[axis];
+        }
+    }
+    else
+    {
+        widths = bintree->fillWidths(widthTemplate);
+    }
+    return bintree;
+}
+
+
+/*****************************************************************/
+bool TemplateBuilder::newInputFiles(const Template* tmp, const BinTree* bintree, const vector<string>& partitionInputs, vector<bool>& newFiles) const
+/*****************************************************************/
+{
+    // Find the input files of the template that were not used for the stored partition.
+    // Returns false if the partition cannot be updated with these files only, in which case all the entries are used:
+    // partitions stored without statistics or list of inputs, or bootstrap replicas, whose weights differ from the stored ones
+    unsigned int nfiles = tmp->inputFileAndTreeEnd()-tmp->inputFileAndTreeBegin();
+    if(tmp->isBootstrapReplica() || partitionInputs.size()==0 || !bintree->hasStoredEntries() || tmp->inputFileNEntries().size()!=nfiles)
+    {
+        if(tmp->verbose()) cout<<"[INFO]   Partition will be updated with all the entries\n";
+        return false;
+    }
+    newFiles.assign(nfiles, true);
+    for(unsigned int j=0;j<partitionInputs.size();j++)
+    {
+        unsigned int i = 0;
+        for(;i<nfiles;i++)
+        {
+            const pair<string,string>& file = *(tmp->inputFileAndTreeBegin()+i);
+            if(file.first+":"+file.second==partitionInputs[j]) break;
+        }
+        if(i==nfiles)
+        {
+            stringstream error;
+            error << "TemplateBuilder::newInputFiles(): Input '"<<partitionInputs[j]<<"' of partition '"<<tmp->getPartitionName()<<"' is not an input of template '"<<tmp->getName()<<"'. Its entries cannot be removed from the partition\n";
+            throw runtime_error(error.str());
+        }
+        newFiles[i] = false;
+    }
+    return true;
+}
+
+
+/*****************************************************************/
+BinTree* TemplateBuilder::readPartition(const Template* tmp, vector<TH1*>* widths, vector<string>* inputs) const
+/*****************************************************************/
+{
+    // The file is closed and deleted when leaving, also on errors
+    unique_ptr<TFile> file(TFile::Open(tmp->getPartitionFile().c_str()));
+    if(!file || file->IsZombie())
+    {
+        stringstream error;
+        error << "TemplateBuilder::readPartition(): Cannot open partition file '"<<tmp->getPartitionFile()<<"' for template '"<<tmp->getName()<<"'\n";
+        throw runtime_error(error.str());
+    }
+    string dirName = "partitions/"+tmp->getPartitionName();
+    TDirectory* dir = file->GetDirectory(dirName.c_str());
+    if(!dir)
+    {
+        stringstream error;
+        error << "TemplateBuilder::readPartition(): Cannot find partition '"<<tmp->getPartitionName()<<"' in file '"<<tmp->getPartitionFile()<<"' for template '"<<tmp->getName()<<"'\n";
+        throw runtime_error(error.str());
+    }
+    BinTree* bintree = BinTree::read(dir);
+    // Input files ("file:tree") whose entries are included in the stored partition, if any
+    TObjString* inputList = dynamic_cast<TObjString*>(dir->Get("inputs"));
+    if(inputs && inputList)
+    {
+        stringstream inputStream(inputList->GetString().Data());
+        string input;
+        while(getline(inputStream, input))
+        {
+            if(input!="") inputs->push_back(input);
+        }
+    }
+    // Width maps stored with the partition, if any
+    if(widths)
+    {
+        for(unsigned int axis=0;axis<bintree->getBinBoundaries().size();axis++)
+        {
+            stringstream name;
+            name << "width" << axis;
+            TH1* width = dynamic_cast<TH1*>(dir->Get(name.str().c_str()));
+            if(!width)
+            {
+                // Incomplete: the widths will be fully recomputed
+                for(unsigned int a=0;a<widths->size();a++) delete (*widths)[a];
+                widths->clear();
+                break;
+            }
+            width = dynamic_cast<TH1*>(width->Clone());
+            width->SetDirectory(0);
+            widths->push_back(width);
+        }
+    }
+    file.reset();
+    // The partition must cover the same region of the same space
+    const vector< pair<double,double> >& minmax = tmp->getMinMax();
+    bool compatible = (bintree->getBinBoundaries().size()==minmax.size());
+    for(unsigned int axis=0;axis<minmax.size() && compatible;axis++)
+    {
+        if(bintree->getMin(axis)!=minmax[axis].first || bintree->getMax(axis)!=minmax[axis].second) compatible = false;
+    }
+    if(!compatible)
+    {
+        delete bintree;
+        if(widths)
+        {
+            for(unsigned int a=0;a<widths->size();a++) delete (*widths)[a];
+            widths->clear();
+        }
+        stringstream error;
+        error << "TemplateBuilder::readPartition(): Partition '"<<tmp->getPartitionName()<<"' doesn't have the same dimensions or boundaries as template '"<<tmp->getName()<<"'\n";
+        throw runtime_error(error.str());
+    }
+    return bintree;
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::buildBinningGroups()
+/*****************************************************************/
+{
+    // Templates of a binning group share one adaptive binning, built from the union of their entries.
+    // The weights of each template are normalized to 1, such that all templates have the same importance.
+    map<string, vector<Template*> > groups;
+    map<string, Template*>::iterator tmpIt = m_templates.begin();
+    map<string, Template*>::iterator tmpItE = m_templates.end();
+    for(;tmpIt!=tmpItE;++tmpIt)
+    {
+        Template* tmp = tmpIt->second;
+        if(tmp->getOrigin()!=Template::Origin::FILES || tmp->getBinningGroup()=="") continue;
+        groups[tmp->getBinningGroup()].push_back(tmp);
+    }
+    map<string, vector<Template*> >::iterator groupIt = groups.begin();
+    map<string, vector<Template*> >::iterator groupItE = groups.end();
+    for(;groupIt!=groupItE;++groupIt)
+    {
+        const string& group = groupIt->first;
+        if(m_groupPartitions.find(group)!=m_groupPartitions.end()) continue;
+        const vector<Template*>& members = groupIt->second;
+        // The binning parameters are taken from the first template of the group
+        const Template* ref = members[0];
+        if(ref->numberOfDimensions()>3)
+        {
+            stringstream error;
+            error << "TemplateBuilder::buildBinningGroups(): Binning groups are only available for 2D and 3D templates (group '"<<group<<"')\n";
+            throw runtime_error(error.str());
+        }
+        const TH1* refHisto = ref->getTemplate();
+        unsigned int entriesPerBin = 0;
+        vector< vector<double> > entries;
+        vector<double> weights;
+        for(unsigned int t=0;t<members.size();t++)
+        {
+            const Template* tmp = members[t];
+            const TH1* histo = tmp->getTemplate();
+            if(tmp->getMinMax()!=ref->getMinMax() ||
+                    histo->GetNbinsX()!=refHisto->GetNbinsX() ||
+                    histo->GetNbinsY()!=refHisto->GetNbinsY() ||
+                    histo->GetNbinsZ()!=refHisto->GetNbinsZ())
+            {
+                stringstream error;
+                error << "TemplateBuilder::buildBinningGroups(): Templates '"<<ref->getName()<<"' and '"<<tmp->getName()<<"' of binning group '"<<group<<"' don't have the same dimensions or bins\n";
+                throw runtime_error(error.str());
+            }
+            double sumOfWeights = 0.;
+            for(unsigned int e=0;e<tmp->weights().size();e++)
+            {
+                sumOfWeights += tmp->weights()[e];
+            }
+            if(sumOfWeights<=0.)
+            {
+                stringstream error;
+                error << "TemplateBuilder::buildBinningGroups(): Template '"<<tmp->getName()<<"' of binning group '"<<group<<"' has a sum of weights <= 0\n";
+                throw runtime_error(error.str());
+            }
+            entries.insert(entries.end(), tmp->entries().begin(), tmp->entries().end());
+            for(unsigned int e=0;e<tmp->weights().size();e++)
+            {
+                weights.push_back(tmp->weights()[e]/sumOfWeights);
+            }
+            entriesPerBin = max(entriesPerBin, tmp->getEntriesPerBin());
+        }
+        cout<< "[INFO] Deriving adaptive binning for binning group '"<<group<<"' ("<<members.size()<<" templates, "<<entries.size()<<" entries)\n";
+        TH1* gridConstraint = (TH1*)refHisto->Clone("gridConstraint");
+        BinTree* bintree = new BinTree(ref->getMinMax(), entries, weights);
+        vector< vector<double> >().swap(entries);
+        vector<double>().swap(weights);
+        bintree->setMinLeafEntries(entriesPerBin);
+        bintree->setGridConstraint(gridConstraint);
+        bintree->setMaxBuildSeconds(ref->getMaxBuildSeconds());
+        bintree->setMultiAxisSplit(ref->multiAxisSplit());
+        bintree->setSplitCriterion(BinTree::splitCriterionFromName(ref->getSplitCriterion()));
+        bintree->build();
+        cout<<"[INFO]   Number of bins = "<<bintree->getNLeaves()<<"\n";
+        cout<< "[INFO]   Computing width maps from adaptive binning\n";
+        m_groupWidths[group] = bintree->fillWidths();
+        for(unsigned int axis=0;axis<m_groupWidths[group].size();axis++)
+        {
+            m_groupWidths[group][axis]->SetDirectory(0);
+        }
+        bintree->setGridConstraint(NULL);
+        gridConstraint->Delete();
+        bintree->clearEntries();
+        m_groupPartitions[group] = bintree;
+    }
+}
+
+
+/*****************************************************************/
+BinTree* TemplateBuilder::groupBinning(Template* tmp, vector<TH1*>& widths, TH1* gridConstraint) const
+/*****************************************************************/
+{
+    // Copy of the group binning, filled with the entries of this template only
+    map<string, BinTree*>::const_iterator it = m_groupPartitions.find(tmp->getBinningGroup());
+    if(it==m_groupPartitions.end())
+    {
+        stringstream error;
+        error << "TemplateBuilder::groupBinning(): Binning group '"<<tmp->getBinningGroup()<<"' of template '"<<tmp->getName()<<"' has not been built\n";
+        throw runtime_error(error.str());
+    }
+    if(tmp->verbose()) cout<<"[INFO]   Using binning of group '"<<tmp->getBinningGroup()<<"'\n";
+    BinTree* bintree = new BinTree(*it->second);
+    bintree->setVerbose(tmp->verbose());
+    bintree->addEntries(tmp->entries(), tmp->weights());
+    bintree->setGridConstraint(gridConstraint);
+    const vector<TH1*>& groupWidths = m_groupWidths.find(tmp->getBinningGroup())->second;
+    widths.clear();
+    for(unsigned int axis=0;axis<groupWidths.size();axis++)
+    {
+        TH1* width = dynamic_cast<TH1*>(groupWidths[axis]->Clone());
+        width->SetDirectory(0);
+        widths.push_back(width);
+    }
+    return bintree;
+}
+
+
+/*****************************************************************/
+const EntryOrdering* TemplateBuilder::entryOrdering(const Template* tmp, BinTree& bintree)
+/*****************************************************************/
+{
+    // Templates built from the same inputs, variables, selection and boundaries share the same coordinates.
+    // Only the weights differ, so the entries are sorted only once.
+    // Bootstrap replicas have the name of their template, so they find directly its ordering.
+    lock_guard<mutex> lock(m_entryOrderingMutex);
+    map<string, EntryOrdering*>::iterator itTmp = m_entryOrderings.find(tmp->getName());
+    if(itTmp!=m_entryOrderings.end())
+    {
+        return itTmp->second;
+    }
+    string key = entryOrderingKey(tmp);
+    map<string, const Template*>::iterator itRef = m_entryOrderingReferences.find(key);
+    if(itRef!=m_entryOrderingReferences.end())
+    {
+        const Template* ref = itRef->second;
+        vector<int> refToTmp;
+        if(entryIndexMap(ref, tmp, refToTmp))
+        {
+            EntryOrdering* refOrdering = m_entryOrderings[ref->getName()];
+            bool identity = true;
+            for(unsigned int i=0;i<refToTmp.size() && identity;i++)
+            {
+                if(refToTmp[i]!=(int)i) identity = false;
+            }
+            if(tmp->verbose()) cout<<"[INFO]   Reusing sorted entries of template '"<<ref->getName()<<"'\n";
+            // Same entries in the same order: share the ordering. Otherwise only translate the indices.
+            EntryOrdering* ordering = (identity ? refOrdering : new EntryOrdering(*refOrdering, refToTmp));
+            m_entryOrderings[tmp->getName()] = ordering;
+            return ordering;
+        }
+    }
+    EntryOrdering* ordering = new EntryOrdering(bintree.leaf()->getEntries());
+    m_entryOrderings[tmp->getName()] = ordering;
+    if(itRef==m_entryOrderingReferences.end())
+    {
+        m_entryOrderingReferences[key] = tmp;
+    }
+    return ordering;
+}
+
+
+/*****************************************************************/
+void TemplateBuilder::releaseEntryOrdering(const Template* tmp)
+/*****************************************************************/
+{
+    // Called when 'tmp' has been built, postprocessed and bootstrapped. The ordering of a template is kept
+    // as long as it is the reference of templates with the same coordinates which are not finished yet
+    lock_guard<mutex> lock(m_entryOrderingMutex);
+    m_entryOrderingReleased.insert(tmp);
+    string key = entryOrderingKey(tmp);
+    bool pending = false;
+    vector<const Template*> released;
+    map<string, Template*>::const_iterator itTmp = m_templates.begin();
+    map<string, Template*>::const_iterator itTmpE = m_templates.end();
+    for(;itTmp!=itTmpE;++itTmp)
+    {
+        if(entryOrderingKey(itTmp->second)!=key) continue;
+        if(m_entryOrderingReleased.count(itTmp->second)==0) pending = true;
+        else released.push_back(itTmp->second);
+    }
+    map<string, const Template*>::iterator itRef = m_entryOrderingReferences.find(key);
+    const Template* ref = (itRef!=m_entryOrderingReferences.end() ? itRef->second : NULL);
+    if(!pending && ref) m_entryOrderingReferences.erase(itRef);
+    for(unsigned int i=0;i<released.size();i++)
+    {
+        if(pending && released[i]==ref) continue;
+        map<string, EntryOrdering*>::iterator itOrd = m_entryOrderings.find(released[i]->getName());
+        if(itOrd==m_entryOrderings.end()) continue;
+        EntryOrdering* ordering = itOrd->second;
+        m_entryOrderings.erase(itOrd);
+        // Orderings can be shared by several templates
+        bool shared = false;
+        map<string, EntryOrdering*>::const_iterator it = m_entryOrderings.begin();
+        map<string, EntryOrdering*>::const_iterator itE = m_entryOrderings.end();
+        for(;it!=itE && !shared;++it)
+        {
+            if(it->second==ordering) shared = true;
+        }
+        if(!shared) delete ordering;
+    }
+}
+
+
+/*****************************************************************/
+bool TemplateBuilder::entryIndexMap(const Template* ref, const Template* tmp, vector<int>& refToTmp) const
+/*****************************************************************/
+{
+    // Entries are stored file by file, in the order of the input files.
+    // Templates listing the same files in a different order have the same entries, permuted by blocks.
+    const vector<unsigned int>& refNEntries = ref->inputFileNEntries();
+    const vector<unsigned int>& tmpNEntries = tmp->inputFileNEntries();
+    unsigned int nfiles = tmp->inputFileAndTreeEnd()-tmp->inputFileAndTreeBegin();
+    if(ref->entries().size()!=tmp->entries().size() || refNEntries.size()!=nfiles || tmpNEntries.size()!=nfiles)
+    {
+        return false;
+    }
+    // Indices of entries within the template boundaries (the ones stored in the BinTree)
+    vector<int> refFiltered(ref->entries().size(), -1);
+    vector<int> tmpFiltered(tmp->entries().size(), -1);
+    int nRef = 0;
+    int nTmp = 0;
+    for(unsigned int e=0;e<ref->entries().size();e++)
+    {
+        if(ref->inTemplate(ref->entries()[e])) refFiltered[e] = nRef++;
+        if(tmp->inTemplate(tmp->entries()[e])) tmpFiltered[e] = nTmp++;
+    }
+    if(nRef!=nTmp)
+    {
+        return false;
+    }
+    refToTmp.assign(nRef, -1);
+    unsigned int tmpOffset = 0;
+    for(unsigned int i=0;i<nfiles;i++)
+    {
+        const pair<string,string>& file = *(tmp->inputFileAndTreeBegin()+i);
+        unsigned int refOffset = 0;
+        unsigned int j = 0;
+        for(;j<nfiles;j++)
+        {
+            if(*(ref->inputFileAndTreeBegin()+j)==file) break;
+            refOffset += refNEntries[j];
+        }
+        if(j==nfiles || refNEntries[j]!=tmpNEntries[i])
+        {
+            return false;
+        }
+        for(unsigned int k=0;k<tmpNEntries[i];k++)
+        {
+            unsigned int eRef = refOffset+k;
+            unsigned int eTmp = tmpOffset+k;
+            // Entries with zero weight are not stored, so the coordinates may differ
+            if(ref->entries()[eRef]!=tmp->entries()[eTmp])
+            {
+                return false;
+            }
+            if(refFiltered[eRef]!=-1)
+            {
+                refToTmp[refFiltered[eRef]] = tmpFiltered[eTmp];
+            }
+        }
+        tmpOffset += tmpNEntries[i];
+    }
+    return true;
+}
+
+
+/*****************************************************************/
+string TemplateBuilder::entryOrderingKey(const Template* tmp) const
+/*****************************************************************/
+{
+    // The order of the input files doesn't matter
+    vector<string> inputs;
+    vector<pair<string,string> >::const_iterator it = tmp->inputFileAndTreeBegin();
+    vector<pair<string,string> >::const_iterator itE = tmp->inputFileAndTreeEnd();
+    for(;it!=itE;++it)
+    {
+        inputs.push_back(it->first+":"+it->second);
+    }
+    std::sort(inputs.begin(), inputs.end());
+    stringstream key;
+    for(unsigned int i=0;i<inputs.size();i++)
+    {
+        key << inputs[i] << ";";
+    }
+    key << "|";
+    for(unsigned int v=0;v<tmp->numberOfDimensions();v++)
+    {
+        key << tmp->getVariable(v) << ";";
+    }
+    key << "|" << tmp->getSelection() << "|" << tmp->fillOverflows() << "|";
+    key.precision(17);
+    for(unsigned int v=0;v<tmp->getMinMax().size();v++)
+    {
+        key << tmp->getMinMax()[v].first << "," << tmp->getMinMax()[v].second << ";";
+    }
+    return key.str();
+}
@@ -16,9 +16,14 @@
  */
 
 #include "TemplateManager.h"
+#include "ThreadPool.h"
+#include "BinTree.h"
+#include "GridND.h"
 
 #include <TTree.h>
+#include <THnBase.h>
 #include <TFile.h>
+#include <TObjString.h>
 #include <TEntryList.h>
 #include <TTreeFormula.h>
 
@@ -82,6 +87,9 @@ bool TemplateManager::initialize(const std::string& parameterFile)
     }
     cout<<"[INFO]   Output file: "<<m_outputFileName<<"\n";
 
+    ThreadPool::global().setNThreads(m_reader.nThreads());
+    cout<<"[INFO]   Number of threads: "<<m_reader.nThreads()<<"\n";
+
     unsigned int nTemplates = 0;
     vector<Template*>::iterator tmpIt = m_reader.templateBegin();
     vector<Template*>::iterator tmpItE = m_reader.templateEnd();
@@ -132,6 +140,7 @@ void TemplateManager::loop()
                 error << "TemplateManager::loop(): Cannot open file '"<<fileName<<"'\n";
                 throw runtime_error(error.str());
             }
+            unsigned int nStoredEntries = tmp->entries().size();
             //TTree* tree = dynamic_cast<TTree*>(inputFile->Get(tmp->getTreeName().c_str()));
             TTree* tree = dynamic_cast<TTree*>(inputFile->Get(fIt->second.c_str()));
             tree->Draw(">>elist", tmp->getSelection().c_str(), "entrylist");
@@ -242,6 +251,7 @@ void TemplateManager::loop()
                 //execute();
             }
             tmp->setOriginalSumOfWeights(tmp->originalSumOfWeights() + sumOfWeights);
+            tmp->addInputFileNEntries(tmp->entries().size()-nStoredEntries);
             if(weightForm)
             {
                 weightForm->Delete();
@@ -258,6 +268,7 @@ void TemplateManager::loop()
     }
     m_templates.fillTemplates();
     m_templates.postProcessing(Template::Origin::FILES);
+    m_templates.bootstrap();
     m_templates.buildTemplatesFromTemplates();
     m_templates.postProcessing(Template::Origin::TEMPLATES);
     save();
@@ -275,14 +286,58 @@ void TemplateManager::save()
     {
         const string& tmpName = tmpIt->first;
         Template* tmp = tmpIt->second;
-        tmp->getTemplate()->SetName(tmpName.c_str());
-        tmp->getTemplate()->Write();
+        if(tmp->getTemplateND())
+        {
+            // N-dimensional templates are stored as sparse histograms when most of the bins are empty
+            THnBase* histo = tmp->getTemplateND()->toTHn(tmp->getTemplateND()->filledFraction()<0.5);
+            m_outputFile->WriteTObject(histo, tmpName.c_str());
+            delete histo;
+        }
+        else
+        {
+            tmp->getTemplate()->SetName(tmpName.c_str());
+            tmp->getTemplate()->Write();
+        }
+        // bootstrap mean and RMS
+        if(tmp->getBootstrapMean()) tmp->getBootstrapMean()->Write();
+        if(tmp->getBootstrapRMS()) tmp->getBootstrapRMS()->Write();
+        // B-spline coefficients
+        if(tmp->getSplineCoefficients()) m_outputFile->WriteTObject(tmp->getSplineCoefficients(), (tmpName+"_splineCoefficients").c_str());
 
         // TMP: fill kernel widths
         //tmp->getWidth(0)->Write();
         //tmp->getWidth(1)->Write();
         //tmp->getWidth(2)->Write();
     }
+    // write adaptive partitions
+    TDirectory* partitionDir = NULL;
+    tmpIt = m_templates.templateBegin();
+    for(;tmpIt!=tmpItE;++tmpIt)
+    {
+        Template* tmp = tmpIt->second;
+        if(!tmp->getPartition()) continue;
+        if(!partitionDir) partitionDir = m_outputFile->mkdir("partitions");
+        TDirectory* dir = partitionDir->mkdir(tmpIt->first.c_str());
+        tmp->getPartition()->write(dir);
+        // widths are stored as well, for incremental updates of the partition
+        const vector<TH1*>& widths = tmp->getWidths();
+        for(unsigned int axis=0;axis<widths.size();axis++)
+        {
+            stringstream name;
+            name << "width" << axis;
+            dir->WriteTObject(widths[axis], name.str().c_str());
+        }
+        // and the input files, whose entries are included in the sums of weights of the leaves
+        stringstream inputs;
+        vector<pair<string,string> >::const_iterator fIt = tmp->inputFileAndTreeBegin();
+        vector<pair<string,string> >::const_iterator fItE = tmp->inputFileAndTreeEnd();
+        for(;fIt!=fItE;++fIt)
+        {
+            inputs << fIt->first << ":" << fIt->second << "\n";
+        }
+        TObjString inputList(inputs.str().c_str());
+        dir->WriteTObject(&inputList, "inputs");
+    }
     // write control plots
     m_outputFile->mkdir("controlPlots");
     m_outputFile->cd("controlPlots");
@@ -19,6 +19,8 @@
 
 
 #include "TemplateParameters.h"
+#include "BinTree.h"
+#include "GaussKernelSmoother.h"
 
 #include "json/json.h"
 
@@ -52,6 +54,13 @@ void TemplateParameters::read(const string& parFile)
 
     m_inputDirectory = root.get("inputDirectory", "./" ).asString();
     m_outputFileName = root.get("outputFile", "templates.root" ).asString();
+    m_nThreads = root.get("nthreads", 1 ).asUInt();
+    if(m_nThreads==0)
+    {
+        stringstream error;
+        error << "TemplateParameters::read(): nthreads should be at least 1";
+        throw runtime_error(error.str());
+    }
 
     const Json::Value templates = root["templates"];
     if(templates.isNull())
@@ -136,10 +145,10 @@ void TemplateParameters::readTemplate(const Json::Value& tmp)
             error << "TemplateParameters::readTemplate(): No variables defined for template '"<<name<<"'";
             throw runtime_error(error.str());
         }
-        if(variables.size()!=2 && variables.size()!=3)
+        if(variables.size()<2)
         {
             stringstream error;
-            error << "TemplateParameters::readTemplate(): ('"<<name<<"') Only 2 or 3 dimensions templates are possible\n";
+            error << "TemplateParameters::readTemplate(): ('"<<name<<"') Templates should have at least 2 dimensions\n";
             throw runtime_error(error.str());
         }
         vector<string> vars;
@@ -171,6 +180,60 @@ void TemplateParameters::readTemplate(const Json::Value& tmp)
         m_templates.back()->setBinningType( type );
         unsigned int entriesPerBin = binning.get("entriesperbin", 200).asUInt();
         m_templates.back()->setEntriesPerBin( entriesPerBin );
+        // time budget for building the adaptive binning, 0 means no limit
+        double maxBuildSeconds = binning.get("maxbuildseconds", 0.).asDouble();
+        if(maxBuildSeconds<0.)
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): 'maxbuildseconds' should be positive for template '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setMaxBuildSeconds( maxBuildSeconds );
+        bool multiAxisSplit = binning.get("multiaxissplit", false).asBool();
+        m_templates.back()->setMultiAxisSplit( multiAxisSplit );
+        std::string splitCriterion = binning.get("splitcriterion", "gradient").asString();
+        try
+        {
+            BinTree::splitCriterionFromName(splitCriterion);
+        }
+        catch(runtime_error& e)
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): Template '"<<name<<"': "<<e.what();
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setSplitCriterion( splitCriterion );
+        // adaptive partition stored by a previous run, given as "file.root:templateName"
+        std::string partition = binning.get("partition", "").asString();
+        if(partition!="")
+        {
+            size_t separator = partition.rfind(':');
+            if(separator==string::npos || separator==0 || separator==partition.size()-1)
+            {
+                stringstream error;
+                error << "TemplateParameters::readTemplate(): Partition should be of the form \"file.root:templateName\" for template '"<<name<<"'";
+                throw runtime_error(error.str());
+            }
+            m_templates.back()->setPartitionReference(partition.substr(0,separator), partition.substr(separator+1));
+        }
+        // continue the splitting of the stored partition with the new entries
+        bool updatePartition = binning.get("updatepartition", false).asBool();
+        if(updatePartition && partition=="")
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): 'updatepartition' requires a stored 'partition' for template '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setUpdatePartition(updatePartition);
+        // adaptive binning shared with the other templates of the same group
+        std::string binningGroup = binning.get("binninggroup", "").asString();
+        if(binningGroup!="" && (type!=Template::BinningType::ADAPTIVE || partition!=""))
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): 'binninggroup' can only be used with adaptive binning and without stored 'partition' for template '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setBinningGroup(binningGroup);
         const Json::Value bins = binning["bins"]; 
         if(bins.isNull())
         {
@@ -195,6 +258,24 @@ void TemplateParameters::readTemplate(const Json::Value& tmp)
         //  what to do with overflows
         bool fillOverflows = tmp.get("filloverflows", false).asBool();
         m_templates.back()->setFillOverflows(fillOverflows);
+        // number of bootstrap replicas
+        const Json::Value bootstrap = tmp.get("bootstrap", 0);
+        if(!bootstrap.isUInt() && !(bootstrap.isInt() && bootstrap.asInt()>=0))
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): 'bootstrap' should be a positive integer for template '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setBootstrap(bootstrap.asUInt());
+        // base seed of the bootstrap replicas
+        const Json::Value bootstrapSeed = tmp.get("bootstrapseed", 0);
+        if(!bootstrapSeed.isUInt() && !(bootstrapSeed.isInt() && bootstrapSeed.asInt()>=0))
+        {
+            stringstream error;
+            error << "TemplateParameters::readTemplate(): 'bootstrapseed' should be a positive integer for template '"<<name<<"'";
+            throw runtime_error(error.str());
+        }
+        m_templates.back()->setBootstrapSeed(bootstrapSeed.asUInt());
     }
 
     // postprocessing 
@@ -266,16 +347,78 @@ void TemplateParameters::readSmoothingParameters(const Json::Value& smooth, Post
 {
     unsigned int entriesPerBin = smooth.get("entriesperbin", 200).asUInt();
     double rescaleWidth = smooth.get("rescalewidth", 1.).asDouble();
+    double widthTolerance = smooth.get("widthtolerance", 0.).asDouble();
+    double truncationTolerance = smooth.get("truncationtolerance", 0.).asDouble();
+    string kernelShape = smooth.get("kernelshape", "gaussian").asString();
+    string engine = smooth.get("engine", "direct").asString();
+    double fftBandStep = smooth.get("fftbandstep", 0.25).asDouble();
+    unsigned int pyramidLevels = smooth.get("pyramidlevels", 0).asUInt();
+    unsigned int bsplineKnots = smooth.get("bsplineknots", 0).asUInt();
+    double bsplinePenalty = smooth.get("bsplinepenalty", 0.01).asDouble();
     string kernel = smooth.get("kernel", "adaptive").asString();
-    if(kernel!="adaptive" && kernel!="k5b")
+    if(kernel!="adaptive" && kernel!="boxsat" && kernel!="kde" && kernel!="leafgraph" && kernel!="bspline" && kernel!="k5b")
     {
         stringstream error;
         error << "TemplateParameters::readSmoothingParameters(): Unknown smoothing kernel '"<<kernel<<"'";
         throw runtime_error(error.str());
     }
+    if(widthTolerance<0.)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): 'widthtolerance' should be positive";
+        throw runtime_error(error.str());
+    }
+    if(truncationTolerance<0. || truncationTolerance>=1.)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): 'truncationtolerance' should be in [0,1)";
+        throw runtime_error(error.str());
+    }
+    try
+    {
+        GaussKernelSmoother::kernelShapeFromName(kernelShape);
+    }
+    catch(runtime_error& e)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): "<<e.what();
+        throw runtime_error(error.str());
+    }
+    if(engine!="direct" && engine!="fft")
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): Unknown smoothing engine '"<<engine<<"'";
+        throw runtime_error(error.str());
+    }
+    if(fftBandStep<=0.)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): 'fftbandstep' should be strictly positive";
+        throw runtime_error(error.str());
+    }
+    if(pyramidLevels>8)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): 'pyramidlevels' should be at most 8";
+        throw runtime_error(error.str());
+    }
+    if(bsplinePenalty<0.)
+    {
+        stringstream error;
+        error << "TemplateParameters::readSmoothingParameters(): 'bsplinepenalty' should be positive";
+        throw runtime_error(error.str());
+    }
     postproc.addParameter("kernel", kernel);
     postproc.addParameter("entriesperbin", entriesPerBin);
     postproc.addParameter("rescalewidth", rescaleWidth);
+    postproc.addParameter("widthtolerance", widthTolerance);
+    postproc.addParameter("truncationtolerance", truncationTolerance);
+    postproc.addParameter("kernelshape", kernelShape);
+    postproc.addParameter("engine", engine);
+    postproc.addParameter("fftbandstep", fftBandStep);
+    postproc.addParameter("pyramidlevels", pyramidLevels);
+    postproc.addParameter("bsplineknots", bsplineKnots);
+    postproc.addParameter("bsplinepenalty", bsplinePenalty);
 }
 
 /*****************************************************************/
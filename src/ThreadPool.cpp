@@ -0,0 +1,163 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+// True when the current thread is executing tasks of a pool
+static thread_local bool t_inPool = false;
+
+
+/*****************************************************************/
+ThreadPool::ThreadPool(unsigned int nthreads):
+    m_nthreads(max(nthreads,1u)),
+    m_task(NULL),
+    m_ntasks(0),
+    m_nextTask(0),
+    m_runningTasks(0),
+    m_stop(false)
+/*****************************************************************/
+{
+    startWorkers();
+}
+
+/*****************************************************************/
+ThreadPool::~ThreadPool()
+/*****************************************************************/
+{
+    stopWorkers();
+}
+
+/*****************************************************************/
+ThreadPool& ThreadPool::global()
+/*****************************************************************/
+{
+    static ThreadPool pool(1);
+    return pool;
+}
+
+/*****************************************************************/
+void ThreadPool::setNThreads(unsigned int nthreads)
+/*****************************************************************/
+{
+    stopWorkers();
+    m_nthreads = max(nthreads,1u);
+    startWorkers();
+}
+
+/*****************************************************************/
+void ThreadPool::startWorkers()
+/*****************************************************************/
+{
+    m_stop = false;
+    // The calling thread also executes tasks, so one thread less is needed
+    for(unsigned int t=1;t<m_nthreads;t++)
+    {
+        m_workers.push_back(thread(&ThreadPool::work, this));
+    }
+}
+
+/*****************************************************************/
+void ThreadPool::stopWorkers()
+/*****************************************************************/
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeUp.notify_all();
+    for(unsigned int t=0;t<m_workers.size();t++)
+    {
+        m_workers[t].join();
+    }
+    m_workers.clear();
+}
+
+/*****************************************************************/
+void ThreadPool::parallelFor(unsigned int ntasks, const std::function<void(unsigned int)>& task)
+/*****************************************************************/
+{
+    unique_lock<mutex> lock(m_mutex);
+    if(m_workers.size()==0 || ntasks<=1 || t_inPool || m_task)
+    {
+        lock.unlock();
+        for(unsigned int i=0;i<ntasks;i++)
+        {
+            task(i);
+        }
+        return;
+    }
+    m_task = &task;
+    m_ntasks = ntasks;
+    m_nextTask = 0;
+    m_runningTasks = 0;
+    m_exception = exception_ptr();
+    lock.unlock();
+    m_wakeUp.notify_all();
+    runTasks();
+    lock.lock();
+    while(m_nextTask<m_ntasks || m_runningTasks>0)
+    {
+        m_done.wait(lock);
+    }
+    m_task = NULL;
+    exception_ptr taskException = m_exception;
+    m_exception = exception_ptr();
+    lock.unlock();
+    if(taskException)
+    {
+        rethrow_exception(taskException);
+    }
+}
+
+/*****************************************************************/
+void ThreadPool::work()
+/*****************************************************************/
+{
+    while(true)
+    {
+        {
+            unique_lock<mutex> lock(m_mutex);
+            while(!m_stop && !(m_task && m_nextTask<m_ntasks))
+            {
+                m_wakeUp.wait(lock);
+            }
+            if(m_stop) return;
+        }
+        runTasks();
+    }
+}
+
+/*****************************************************************/
+void ThreadPool::runTasks()
+/*****************************************************************/
+{
+    t_inPool = true;
+    unique_lock<mutex> lock(m_mutex);
+    while(m_task && m_nextTask<m_ntasks)
+    {
+        unsigned int i = m_nextTask++;
+        const function<void(unsigned int)>* task = m_task;
+        m_runningTasks++;
+        lock.unlock();
+        try
+        {
+            (*task)(i);
+        }
+        catch(...)
+        {
+            lock.lock();
+            if(!m_exception) m_exception = current_exception();
+            // Skip the remaining tasks
+            m_nextTask = m_ntasks;
+            lock.unlock();
+        }
+        lock.lock();
+        m_runningTasks--;
+    }
+    if(m_nextTask>=m_ntasks && m_runningTasks==0)
+    {
+        m_done.notify_all();
+    }
+    lock.unlock();
+    t_inPool = false;
+}
+